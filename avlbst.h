@@ -6,6 +6,12 @@
 #include <cstdlib>
 #include <cstdint>
 #include <algorithm>
+#include <iterator>
+#include <stdexcept>
+#include <vector>
+#include <atomic>
+#include <future>
+#include <thread>
 #include "bst.h"
 
 struct KeyError { };
@@ -15,25 +21,27 @@ struct KeyError { };
 * other additional helper functions. You do NOT need to implement any functionality or
 * add additional data members or helper functions.
 */
-template <typename Key, typename Value>
-class AVLNode : public Node<Key, Value>
+template<typename Key, typename Value, typename Sizes = NoSubtreeSizes>
+class AVLNode : public Node<Key, Value, Sizes>
 {
 public:
     // Constructor/destructor.
-    AVLNode(const Key& key, const Value& value, AVLNode<Key, Value>* parent);
-    virtual ~AVLNode();
+    AVLNode(const Key& key, const Value& value, AVLNode<Key, Value, Sizes>* parent);
+    template<typename... Args>
+    explicit AVLNode(InPlaceItem tag, Args&&... args);
+    ~AVLNode();
 
     
     int8_t getBalance () const;
     void setBalance (int8_t balance);
     void updateBalance(int8_t diff);
 
-    // Getters for parent, left, and right. These need to be redefined since they
-    // return pointers to AVLNodes - not plain Nodes. See the Node class in bst.h
-    // for more information.
-    virtual AVLNode<Key, Value>* getParent() const override;
-    virtual AVLNode<Key, Value>* getLeft() const override;
-    virtual AVLNode<Key, Value>* getRight() const override;
+    // Getters for parent, left, and right. These hide the Node versions so that
+    // they return pointers to AVLNodes - not plain Nodes. See the Node class in
+    // bst.h for more information.
+    AVLNode<Key, Value, Sizes>* getParent() const;
+    AVLNode<Key, Value, Sizes>* getLeft() const;
+    AVLNode<Key, Value, Sizes>* getRight() const;
 
 protected:
     int8_t balance_;    
@@ -49,9 +57,20 @@ protected:
 * An explicit constructor to initialize the elements by calling the base class constructor and setting
 * the color to red since every new node will be red when it is first inserted.
 */
-template<class Key, class Value>
-AVLNode<Key, Value>::AVLNode(const Key& key, const Value& value, AVLNode<Key, Value> *parent) :
-    Node<Key, Value>(key, value, parent), balance_(0)
+template<class Key, class Value, class Sizes>
+AVLNode<Key, Value, Sizes>::AVLNode(const Key& key, const Value& value, AVLNode<Key, Value, Sizes> *parent) :
+    Node<Key, Value, Sizes>(key, value, parent), balance_(0)
+{
+
+}
+
+/**
+* Builds the pair in place; see the matching Node constructor.
+*/
+template<class Key, class Value, class Sizes>
+template<typename... Args>
+AVLNode<Key, Value, Sizes>::AVLNode(InPlaceItem tag, Args&&... args) :
+    Node<Key, Value, Sizes>(tag, std::forward<Args>(args)...), balance_(0)
 {
 
 }
@@ -59,8 +78,8 @@ AVLNode<Key, Value>::AVLNode(const Key& key, const Value& value, AVLNode<Key, Va
 /**
 * A destructor which does nothing.
 */
-template<class Key, class Value>
-AVLNode<Key, Value>::~AVLNode()
+template<class Key, class Value, class Sizes>
+AVLNode<Key, Value, Sizes>::~AVLNode()
 {
 
 }
@@ -68,8 +87,8 @@ AVLNode<Key, Value>::~AVLNode()
 /**
 * A getter for the balance of a AVLNode.
 */
-template<class Key, class Value>
-int8_t AVLNode<Key, Value>::getBalance() const
+template<class Key, class Value, class Sizes>
+int8_t AVLNode<Key, Value, Sizes>::getBalance() const
 {
     return balance_;
 }
@@ -77,8 +96,8 @@ int8_t AVLNode<Key, Value>::getBalance() const
 /**
 * A setter for the balance of a AVLNode.
 */
-template<class Key, class Value>
-void AVLNode<Key, Value>::setBalance(int8_t balance)
+template<class Key, class Value, class Sizes>
+void AVLNode<Key, Value, Sizes>::setBalance(int8_t balance)
 {
     balance_ = balance;
 }
@@ -86,38 +105,38 @@ void AVLNode<Key, Value>::setBalance(int8_t balance)
 /**
 * Adds height to the balance of a AVLNode.
 */
-template<class Key, class Value>
-void AVLNode<Key, Value>::updateBalance(int8_t diff)
+template<class Key, class Value, class Sizes>
+void AVLNode<Key, Value, Sizes>::updateBalance(int8_t diff)
 {
     balance_ += diff;
 }
 
 /**
-* An overridden function for getting the parent since a static_cast is necessary to make sure
+* Hides Node::getParent since a static_cast is necessary to make sure
 * that our node is a AVLNode.
 */
-template<class Key, class Value>
-AVLNode<Key, Value> *AVLNode<Key, Value>::getParent() const
+template<class Key, class Value, class Sizes>
+inline AVLNode<Key, Value, Sizes> *AVLNode<Key, Value, Sizes>::getParent() const
 {
-    return static_cast<AVLNode<Key, Value>*>(this->parent_);
+    return static_cast<AVLNode<Key, Value, Sizes>*>(this->parent_);
 }
 
 /**
-* Overridden for the same reasons as above.
+* Hidden for the same reasons as above.
 */
-template<class Key, class Value>
-AVLNode<Key, Value> *AVLNode<Key, Value>::getLeft() const
+template<class Key, class Value, class Sizes>
+inline AVLNode<Key, Value, Sizes> *AVLNode<Key, Value, Sizes>::getLeft() const
 {
-    return static_cast<AVLNode<Key, Value>*>(this->left_);
+    return static_cast<AVLNode<Key, Value, Sizes>*>(this->left_);
 }
 
 /**
-* Overridden for the same reasons as above.
+* Hidden for the same reasons as above.
 */
-template<class Key, class Value>
-AVLNode<Key, Value> *AVLNode<Key, Value>::getRight() const
+template<class Key, class Value, class Sizes>
+inline AVLNode<Key, Value, Sizes> *AVLNode<Key, Value, Sizes>::getRight() const
 {
-    return static_cast<AVLNode<Key, Value>*>(this->right_);
+    return static_cast<AVLNode<Key, Value, Sizes>*>(this->right_);
 }
 
 
@@ -128,522 +147,1153 @@ AVLNode<Key, Value> *AVLNode<Key, Value>::getRight() const
 */
 
 
-template <class Key, class Value>
-class AVLTree : public BinarySearchTree<Key, Value>
+template <class Key, class Value, class Compare = std::less<Key>, class Sizes = NoSubtreeSizes>
+class AVLTree : public BinarySearchTree<Key, Value, Compare, Sizes>
 {
 public:
-    virtual void insert (const std::pair<const Key, Value> &new_item); // TODO
-    virtual void remove(const Key& key);  // TODO
+    AVLTree();
+    explicit AVLTree(const Compare& comp);
+    template<typename InputIt>
+    AVLTree(InputIt first, InputIt last, const Compare& comp = Compare());
+    template<typename InputIt>
+    void assign(InputIt first, InputIt last);
+    virtual int height() const override;
+    std::size_t rotationCount() const;
+    void resetRotationCount();
+
+    // Join-based set operations; other is left untouched.
+    template<typename Merge>
+    void unite(const AVLTree<Key, Value, Compare, Sizes>& other, Merge merge);
+    void unite(const AVLTree<Key, Value, Compare, Sizes>& other);
+    template<typename Merge>
+    void intersect(const AVLTree<Key, Value, Compare, Sizes>& other, Merge merge);
+    void intersect(const AVLTree<Key, Value, Compare, Sizes>& other);
+    void subtract(const AVLTree<Key, Value, Compare, Sizes>& other);
+
+    // Moving key ranges between trees without copying nodes.
+    void split(const Key& key, AVLTree<Key, Value, Compare, Sizes>& right);
+    void concat(AVLTree<Key, Value, Compare, Sizes>& right);
 protected:
-    virtual void nodeSwap( AVLNode<Key,Value>* n1, AVLNode<Key,Value>* n2);
+    virtual void nodeSwap( AVLNode<Key, Value, Sizes>* n1, AVLNode<Key, Value, Sizes>* n2);
 
     // Add helper functions here
-    void rotateLeft(AVLNode<Key, Value>*& node);
-    void rotateRight(AVLNode<Key, Value>*& node);
-    void insert_Helper(AVLNode<Key, Value>* parent, AVLNode<Key, Value>* node);
-    void remove_Helper(AVLNode<Key, Value>* node, int height);
+    void replaceChild(AVLNode<Key, Value, Sizes>* parent, AVLNode<Key, Value, Sizes>* node, AVLNode<Key, Value, Sizes>* child);
+    void rotateLeft(AVLNode<Key, Value, Sizes>* node);
+    void rotateRight(AVLNode<Key, Value, Sizes>* node);
+    AVLNode<Key, Value, Sizes>* rebalance(AVLNode<Key, Value, Sizes>* node, int8_t heavy);
+    void insert_Helper(AVLNode<Key, Value, Sizes>* node);
+    void remove_Helper(AVLNode<Key, Value, Sizes>* node, int height);
+
+    virtual Node<Key, Value, Sizes>* createNode(const Key& key, const Value& value) override;
+    virtual Node<Key, Value, Sizes>* createNode(ItemBuilder<Key, Value>& builder) override;
+    virtual void insertFixup(Node<Key, Value, Sizes>* node) override;
+    virtual void removeNode(Node<Key, Value, Sizes>* node) override;
+
+    template<typename RandomIt>
+    void assignRange(RandomIt first, RandomIt last, std::random_access_iterator_tag);
+    template<typename InputIt>
+    void assignRange(InputIt first, InputIt last, std::input_iterator_tag);
+    template<typename ForwardIt>
+    bool isStrictlySorted(ForwardIt first, ForwardIt last) const;
+    template<typename RandomIt>
+    AVLNode<Key, Value, Sizes>* buildBalanced(RandomIt first, std::size_t n, AVLNode<Key, Value, Sizes>* parent);
+    static int balancedHeight(std::size_t n);
+
+    // A detached subtree and its height. The join-based operations carry
+    // heights along with the roots and derive a child's height from its
+    // parent's height and balance, so nodes never store one.
+    struct Subtree
+    {
+        AVLNode<Key, Value, Sizes>* root;
+        int height;
+    };
+    struct SplitResult
+    {
+        Subtree left;
+        AVLNode<Key, Value, Sizes>* match;
+        Subtree right;
+    };
+    // Preallocated pool blocks that parallel tasks can take nodes from.
+    struct SpareBlocks
+    {
+        std::vector<void*> blocks;
+        std::atomic<std::size_t> next;
+    };
+
+    static Subtree leftOf(const Subtree& tree);
+    static Subtree rightOf(const Subtree& tree);
+    static Subtree link(AVLNode<Key, Value, Sizes>* node, const Subtree& left, const Subtree& right);
+    static Subtree join(const Subtree& left, AVLNode<Key, Value, Sizes>* node, const Subtree& right);
+    static Subtree joinRight(const Subtree& left, AVLNode<Key, Value, Sizes>* node, const Subtree& right);
+    static Subtree joinLeft(const Subtree& left, AVLNode<Key, Value, Sizes>* node, const Subtree& right);
+    static Subtree concatSubtrees(const Subtree& left, const Subtree& right);
+    static Subtree splitLast(const Subtree& tree, AVLNode<Key, Value, Sizes>*& last);
+    SplitResult splitAt(const Subtree& tree, const Key& key) const;
+    Subtree wholeTree() const;
+    void adopt(const Subtree& tree);
+
+    template<typename Merge>
+    Subtree uniteRec(const Subtree& tree, const AVLNode<Key, Value, Sizes>* other,
+                     Merge& merge, SpareBlocks& spare, int forks);
+    template<typename Merge>
+    Subtree intersectRec(const Subtree& tree, const AVLNode<Key, Value, Sizes>* other,
+                         Merge& merge, std::vector<AVLNode<Key, Value, Sizes>*>& dropped, int forks);
+    Subtree subtractRec(const Subtree& tree, const AVLNode<Key, Value, Sizes>* other,
+                        std::vector<AVLNode<Key, Value, Sizes>*>& dropped, int forks);
+    static Subtree copySubtree(const AVLNode<Key, Value, Sizes>* source, SpareBlocks& spare);
+    void destroySubtrees(const std::vector<AVLNode<Key, Value, Sizes>*>& roots);
+    template<typename LeftTask, typename RightTask>
+    static void forkJoin(bool parallel, LeftTask left, RightTask right);
+    static int forkLevels();
+    static int heightOf(const AVLNode<Key, Value, Sizes>* node);
+
+    // Lowest subtree of other worth handing to another thread (a balanced
+    // one this high holds about 4096 nodes).
+    static const int PARALLEL_HEIGHT = 13;
+
+    // Height of the whole tree, kept up to date by the rebalancing code.
+    int height_;
+    std::size_t rotations_;
 };
 
+/**
+* Tells the base tree that its nodes are AVLNodes rather than plain Nodes.
+*/
+template<class Key, class Value, class Compare, class Sizes>
+AVLTree<Key, Value, Compare, Sizes>::AVLTree() :
+    BinarySearchTree<Key, Value, Compare, Sizes>(NodePolicy<AVLNode<Key, Value, Sizes> >(), Compare()),
+    height_(0),
+    rotations_(0)
+{
+
+}
+
+template<class Key, class Value, class Compare, class Sizes>
+AVLTree<Key, Value, Compare, Sizes>::AVLTree(const Compare& comp) :
+    BinarySearchTree<Key, Value, Compare, Sizes>(NodePolicy<AVLNode<Key, Value, Sizes> >(), comp),
+    height_(0),
+    rotations_(0)
+{
+
+}
+
+/**
+* Builds the tree from a range of key/value pairs in linear time when the
+* range is already sorted; see assign.
+*/
+template<class Key, class Value, class Compare, class Sizes>
+template<typename InputIt>
+AVLTree<Key, Value, Compare, Sizes>::AVLTree(InputIt first, InputIt last, const Compare& comp) :
+    BinarySearchTree<Key, Value, Compare, Sizes>(NodePolicy<AVLNode<Key, Value, Sizes> >(), comp),
+    height_(0),
+    rotations_(0)
+{
+    assign(first, last);
+}
+
+/**
+* Replaces the contents of the tree with the pairs in [first, last).
+*
+* A random access range whose keys are strictly increasing is turned
+* straight into a perfectly balanced tree in O(n): each subtree's middle
+* element becomes its root, so balances and parent links are known as the
+* nodes are created and no rotations are needed. Any other range is copied
+* and sorted first (O(n log n)); for duplicate keys the last value wins,
+* as it would with repeated inserts.
+*/
+template<class Key, class Value, class Compare, class Sizes>
+template<typename InputIt>
+void AVLTree<Key, Value, Compare, Sizes>::assign(InputIt first, InputIt last)
+{
+    this->clear();
+    assignRange(first, last, typename std::iterator_traits<InputIt>::iterator_category());
+}
+
+template<class Key, class Value, class Compare, class Sizes>
+template<typename RandomIt>
+void AVLTree<Key, Value, Compare, Sizes>::assignRange(RandomIt first, RandomIt last, std::random_access_iterator_tag)
+{
+    if (isStrictlySorted(first, last)) {
+        this->root_ = buildBalanced(first, last - first, nullptr);
+        this->resetLargest();
+        this->count_.store(last - first, std::memory_order_relaxed);
+        height_ = balancedHeight(last - first);
+    }
+    else {
+        assignRange(first, last, std::input_iterator_tag());
+    }
+}
+
+template<class Key, class Value, class Compare, class Sizes>
+template<typename InputIt>
+void AVLTree<Key, Value, Compare, Sizes>::assignRange(InputIt first, InputIt last, std::input_iterator_tag)
+{
+    std::vector<std::pair<Key, Value> > items(first, last);
+
+    if (!isStrictlySorted(items.begin(), items.end())) {
+        std::stable_sort(items.begin(), items.end(),
+            [this](const std::pair<Key, Value>& a, const std::pair<Key, Value>& b) {
+                return this->keyLess(a.first, b.first);
+            });
+
+        // Keep the last of each run of equal keys.
+        std::size_t kept = 0;
+        for (std::size_t i = 0; i < items.size(); ++i) {
+            if (i + 1 < items.size() && !this->keyLess(items[i].first, items[i + 1].first)) {
+                continue;
+            }
+            if (kept != i) {
+                items[kept] = std::move(items[i]);
+            }
+            ++kept;
+        }
+        items.resize(kept);
+    }
+
+    this->root_ = buildBalanced(std::make_move_iterator(items.begin()), items.size(), nullptr);
+    this->resetLargest();
+    this->count_.store(items.size(), std::memory_order_relaxed);
+    height_ = balancedHeight(items.size());
+}
+
+template<class Key, class Value, class Compare, class Sizes>
+template<typename ForwardIt>
+bool AVLTree<Key, Value, Compare, Sizes>::isStrictlySorted(ForwardIt first, ForwardIt last) const
+{
+    if (first == last) return true;
+
+    ForwardIt next = first;
+    for (++next; next != last; ++first, ++next) {
+        if (!this->keyLess((*first).first, (*next).first)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+* Builds the n sorted pairs starting at first into a subtree hanging off
+* parent and returns its root. The right half gets the extra element when
+* n is even, so every balance is 0 or +1. Nodes are created in key order,
+* which keeps neighbouring keys next to each other in the pool.
+*/
+template<class Key, class Value, class Compare, class Sizes>
+template<typename RandomIt>
+AVLNode<Key, Value, Sizes>* AVLTree<Key, Value, Compare, Sizes>::buildBalanced(RandomIt first, std::size_t n, AVLNode<Key, Value, Sizes>* parent)
+{
+    if (n == 0) return nullptr;
+
+    std::size_t leftCount = (n - 1) / 2;
+    std::size_t rightCount = n - 1 - leftCount;
+
+    AVLNode<Key, Value, Sizes>* left = buildBalanced(first, leftCount, nullptr);
+
+    RandomIt mid = first + leftCount;
+    AVLNode<Key, Value, Sizes>* node = static_cast<AVLNode<Key, Value, Sizes>*>(
+        this->createNode((*mid).first, (*mid).second));
+    node->setParent(parent);
+    node->setSize(n);
+    node->setLeft(left);
+    if (left) left->setParent(node);
+
+    AVLNode<Key, Value, Sizes>* right = buildBalanced(mid + 1, rightCount, node);
+    node->setRight(right);
+    node->setBalance(static_cast<int8_t>(balancedHeight(rightCount) - balancedHeight(leftCount)));
+
+    return node;
+}
+
+/**
+* Height of a subtree built by buildBalanced from n pairs.
+*/
+template<class Key, class Value, class Compare, class Sizes>
+int AVLTree<Key, Value, Compare, Sizes>::balancedHeight(std::size_t n)
+{
+    int height = 0;
+    while (n) {
+        ++height;
+        n >>= 1;
+    }
+    return height;
+}
+
+template<class Key, class Value, class Compare, class Sizes>
+Node<Key, Value, Sizes>* AVLTree<Key, Value, Compare, Sizes>::createNode(const Key& key, const Value& value)
+{
+    return this->template constructNode<AVLNode<Key, Value, Sizes> >(key, value);
+}
+
+template<class Key, class Value, class Compare, class Sizes>
+Node<Key, Value, Sizes>* AVLTree<Key, Value, Compare, Sizes>::createNode(ItemBuilder<Key, Value>& builder)
+{
+    return this->template constructNode<AVLNode<Key, Value, Sizes> >(builder);
+}
+
 /*
  * Recall: If key is already in the tree, you should 
  * overwrite the current value with the updated value.
+ *
+ * Insertion itself is shared with BinarySearchTree: one descent finds
+ * either the existing node or the attachment point, and every insert,
+ * emplace and try_emplace then calls this to rebalance after linking
+ * in a new leaf.
  */
-template<class Key, class Value>
-void AVLTree<Key, Value>::insert (const std::pair<const Key, Value> &new_item)
+template<class Key, class Value, class Compare, class Sizes>
+void AVLTree<Key, Value, Compare, Sizes>::insertFixup(Node<Key, Value, Sizes>* node)
+{
+    AVLNode<Key, Value, Sizes>* avlNode = static_cast<AVLNode<Key, Value, Sizes>*>(node);
+
+    if (avlNode->getParent()) {
+        this->insert_Helper(avlNode);
+    }
+    else {
+        height_ = 1;
+    }
+}
+
+/**
+* O(1). Insertion and removal already know when a height change reaches
+* the root, so they adjust height_ as they go; clear() only empties the
+* base tree, which is why an empty root is checked first.
+*/
+template<class Key, class Value, class Compare, class Sizes>
+int AVLTree<Key, Value, Compare, Sizes>::height() const
+{
+    if (this->root_ == nullptr) return 0;
+
+    return height_;
+}
+
+/**
+* Number of single rotations done since construction or the last reset;
+* a double rotation counts as two.
+*/
+template<class Key, class Value, class Compare, class Sizes>
+std::size_t AVLTree<Key, Value, Compare, Sizes>::rotationCount() const
+{
+    return rotations_;
+}
+
+template<class Key, class Value, class Compare, class Sizes>
+void AVLTree<Key, Value, Compare, Sizes>::resetRotationCount()
+{
+    rotations_ = 0;
+}
+
+/**
+* Unlinks node and walks back up fixing balances; see remove_Helper.
+*/
+template<class Key, class Value, class Compare, class Sizes>
+void AVLTree<Key, Value, Compare, Sizes>::removeNode(Node<Key, Value, Sizes>* node)
 {
-    if (this->root_) { //If AVL Tree is not empty
-        Node<Key, Value>* node = this->internalFind(new_item.first);
+    int height = 0;
+
+    if (node->getLeft() == nullptr && node->getRight() == nullptr) { //No child nodes
+        AVLNode<Key, Value, Sizes>* parent = (AVLNode<Key, Value, Sizes>*)(node->getParent());
 
-        if (node) { //Node already exists in the tree
-            node->setValue(new_item.second);
+        if (parent) {
+            if ((AVLNode<Key, Value, Sizes>*)(node) == parent->getLeft()) {
+                height = 1;
+            }
+            else if ((AVLNode<Key, Value, Sizes>*)(node) == parent->getRight()) {
+                height = -1;
+            }
+        }
+
+        if (this->root_ == node) {
+            this->root_ = nullptr;
+        }
+        else if (node->getParent()->getLeft() == node) {
+            node->getParent()->setLeft(nullptr);
+        }
+        else {
+            node->getParent()->setRight(nullptr);
         }
-        else { //Node needs to be inserted
-            AVLNode<Key, Value>* buff = (AVLNode<Key, Value>*) this->root_;
-
-            bool cycle = true;
-            while (cycle) {
-                if (buff->getKey() > new_item.first) {
-                    if (buff->getLeft() == nullptr) {
-                        cycle = false;
-
-                        AVLNode<Key, Value>* avlNode = new AVLNode<Key, Value>(new_item.first, new_item.second, buff);
-                        buff->setLeft(avlNode);
-                        avlNode->setBalance(0);
-                        
-                        if (buff->getBalance() != 0) {
-                            buff->setBalance(0);
-                        }
-                        else {
-                            buff->updateBalance(-1);
-                            this->insert_Helper(buff, avlNode);
-                        }
-                    }
-                    else {
-                        buff = buff->getLeft();
-                    }
-                }
-                else {
-                    if (buff->getRight() == nullptr) {
-                        cycle = false;
-
-                        AVLNode<Key, Value>* avlNode = new AVLNode<Key, Value>(new_item.first, new_item.second, buff);
-                        buff->setRight(avlNode);
-                        avlNode->setBalance(0);
-                        
-                        if (buff->getBalance() != 0) {
-                            buff->setBalance(0);
-                        }
-                        else {
-                            buff->updateBalance(1);
-                            this->insert_Helper(buff, avlNode);
-                        }
-                    }
-                    else {
-                        buff = buff->getRight();
-                    }
-                }
+
+        this->discardNode(node);
+        remove_Helper(parent, height);
+    }
+    else if(node->getLeft() && node->getRight() == nullptr) { //Only left child node
+        AVLNode<Key, Value, Sizes>* parent = (AVLNode<Key, Value, Sizes>*)(node->getParent());
+
+        if (parent) {
+            if ((AVLNode<Key, Value, Sizes>*)(node) == parent->getLeft()) {
+                height = 1;
             }
+            else if ((AVLNode<Key, Value, Sizes>*)(node) == parent->getRight()) {
+                height = -1;
+            }
+        }
+
+        if (this->root_ == node) {
+            this->root_ = node->getLeft();
+            node->getLeft()->setParent(nullptr);
         }
+        else if (node->getParent()->getLeft() == node) {
+            node->getParent()->setLeft(node->getLeft());
+            node->getLeft()->setParent(node->getParent());
+        }
+        else {
+            node->getParent()->setRight(node->getLeft());
+            node->getLeft()->setParent(node->getParent());
+        }
+
+        this->discardNode(node);
+        remove_Helper(parent, height);
     }
-    else { //AVL Tree is empty
-        AVLNode<Key, Value>* buff = new AVLNode<Key, Value>(new_item.first, new_item.second, nullptr);
-        
-        this->root_ = buff;
-
-        buff->setBalance(0);
-        buff->setLeft(nullptr);
-        buff->setRight(nullptr);
-    }
-}
-  template<class Key, class Value>
-  void AVLTree<Key, Value>:: remove(const Key& key)
-  {
-      Node<Key, Value>* node = this->internalFind(key);
-      int height = 0;
-
-      if (node) {
-          if (node->getLeft() == nullptr && node->getRight() == nullptr) { //No child nodes
-              AVLNode<Key, Value>* parent = (AVLNode<Key, Value>*)(node->getParent());
-
-              if (parent) {
-                  if ((AVLNode<Key, Value>*)(node) == parent->getLeft()) {
-                      height = 1;
-                  }
-                  else if ((AVLNode<Key, Value>*)(node) == parent->getRight()) {
-                      height = -1;
-                  }
-              }
-
-              if (this->root_ == node) {
-                  this->root_ = nullptr;
-              }
-              else if (node->getParent()->getLeft() == node) {
-                  node->getParent()->setLeft(nullptr);
-              }
-              else {
-                  node->getParent()->setRight(nullptr);
-              }
-
-              delete node;
-              remove_Helper(parent, height);
-          }
-          else if(node->getLeft() && node->getRight() == nullptr) { //Only left child node
-              AVLNode<Key, Value>* parent = (AVLNode<Key, Value>*)(node->getParent());
-
-              if (parent) {
-                  if ((AVLNode<Key, Value>*)(node) == parent->getLeft()) {
-                      height = 1;
-                  }
-                  else if ((AVLNode<Key, Value>*)(node) == parent->getRight()) {
-                      height = -1;
-                  }
-              }
-
-              if (this->root_ == node) {
-                  this->root_ = node->getLeft();
-                  node->getLeft()->setParent(nullptr);
-              }
-              else if (node->getParent()->getLeft() == node) {
-                  node->getParent()->setLeft(node->getLeft());
-                  node->getLeft()->setParent(node->getParent());
-              }
-              else {
-                  node->getParent()->setRight(node->getLeft());
-                  node->getLeft()->setParent(node->getParent());
-              }
-
-              delete node;
-              remove_Helper(parent, height);
-          }
-          else if(node->getLeft() == nullptr && node->getRight()) { //Only right child node
-              AVLNode<Key, Value>* parent = (AVLNode<Key, Value>*)(node->getParent());
-
-              if (parent) {
-                  if ((AVLNode<Key, Value>*)(node) == parent->getLeft()) {
-                      height = 1;
-                  }
-                  else if ((AVLNode<Key, Value>*)(node) == parent->getRight()) {
-                      height = -1;
-                  }
-              }
-
-              if (this->root_ == node) {
-                  this->root_ = node->getRight();
-                  node->getRight()->setParent(nullptr);
-              }
-              else if (node->getParent()->getLeft() == node) {
-                  node->getParent()->setLeft(node->getRight());
-                  node->getRight()->setParent(node->getParent());
-              }
-              else {
-                  node->getParent()->setRight(node->getRight());
-                  node->getRight()->setParent(node->getParent());
-              }
-
-              delete node;
-              remove_Helper(parent, height);
-          }
-          else if (node->getLeft() && node->getRight()) { 
-              AVLNode<Key, Value>* prev = (AVLNode<Key, Value>*)(this->predecessor(node));
-              
-              nodeSwap((AVLNode<Key, Value>*)(node), prev);
-
-              if (this->root_ == node) {
-                  this->root_ = prev;
-              }
-
-              AVLNode<Key, Value>* parent = (AVLNode<Key, Value>*)(node->getParent());
-
-              if (parent) {
-                  if ((AVLNode<Key, Value>*)(node) == parent->getLeft()) {
-                      height = 1;
-                  }
-                  else if ((AVLNode<Key, Value>*)(node) == parent->getRight()) {
-                      height = -1;
-                  }
-              }
-
-              if (node->getLeft()) {
-                  node->getLeft()->setParent(node->getParent());
-
-                  if (node->getParent()->getRight() == node) {
-                      node->getParent()->setRight(node->getLeft());
-                  }
-                  else {
-                      node->getParent()->setLeft(node->getLeft());
-                  }
-              }
-              else {
-                  if (node->getParent()->getRight() == node) {
-                      node->getParent()->setRight(nullptr);
-                  }
-                  else {
-                      node->getParent()->setLeft(nullptr);
-                  }
-              }
-              
-              delete node;
-              remove_Helper(parent, height);
-          }
-      }
-  }
-
-
-template<class Key, class Value>
-void AVLTree<Key, Value>::nodeSwap( AVLNode<Key,Value>* n1, AVLNode<Key,Value>* n2)
-{
-    BinarySearchTree<Key, Value>::nodeSwap(n1, n2);
+    else if(node->getLeft() == nullptr && node->getRight()) { //Only right child node
+        AVLNode<Key, Value, Sizes>* parent = (AVLNode<Key, Value, Sizes>*)(node->getParent());
+
+        if (parent) {
+            if ((AVLNode<Key, Value, Sizes>*)(node) == parent->getLeft()) {
+                height = 1;
+            }
+            else if ((AVLNode<Key, Value, Sizes>*)(node) == parent->getRight()) {
+                height = -1;
+            }
+        }
+
+        if (this->root_ == node) {
+            this->root_ = node->getRight();
+            node->getRight()->setParent(nullptr);
+        }
+        else if (node->getParent()->getLeft() == node) {
+            node->getParent()->setLeft(node->getRight());
+            node->getRight()->setParent(node->getParent());
+        }
+        else {
+            node->getParent()->setRight(node->getRight());
+            node->getRight()->setParent(node->getParent());
+        }
+
+        this->discardNode(node);
+        remove_Helper(parent, height);
+    }
+    else if (node->getLeft() && node->getRight()) {
+        AVLNode<Key, Value, Sizes>* prev = (AVLNode<Key, Value, Sizes>*)(this->predecessor(node));
+
+        nodeSwap((AVLNode<Key, Value, Sizes>*)(node), prev);
+
+        if (this->root_ == node) {
+            this->root_ = prev;
+        }
+
+        AVLNode<Key, Value, Sizes>* parent = (AVLNode<Key, Value, Sizes>*)(node->getParent());
+
+        if (parent) {
+            if ((AVLNode<Key, Value, Sizes>*)(node) == parent->getLeft()) {
+                height = 1;
+            }
+            else if ((AVLNode<Key, Value, Sizes>*)(node) == parent->getRight()) {
+                height = -1;
+            }
+        }
+
+        if (node->getLeft()) {
+            node->getLeft()->setParent(node->getParent());
+
+            if (node->getParent()->getRight() == node) {
+                node->getParent()->setRight(node->getLeft());
+            }
+            else {
+                node->getParent()->setLeft(node->getLeft());
+            }
+        }
+        else {
+            if (node->getParent()->getRight() == node) {
+                node->getParent()->setRight(nullptr);
+            }
+            else {
+                node->getParent()->setLeft(nullptr);
+            }
+        }
+
+        this->discardNode(node);
+        remove_Helper(parent, height);
+    }
+}
+
+
+template<class Key, class Value, class Compare, class Sizes>
+void AVLTree<Key, Value, Compare, Sizes>::nodeSwap( AVLNode<Key, Value, Sizes>* n1, AVLNode<Key, Value, Sizes>* n2)
+{
+    BinarySearchTree<Key, Value, Compare, Sizes>::nodeSwap(n1, n2);
     int8_t tempB = n1->getBalance();
     n1->setBalance(n2->getBalance());
     n2->setBalance(tempB);
 }
 
-template<class Key, class Value>
-void AVLTree<Key, Value>::rotateLeft(AVLNode<Key, Value>*& node) {
-    AVLNode<Key, Value>* child = node->getRight();
-    
-    if(node->getParent() == nullptr){
+/**
+* Puts child where node used to hang: under node's old parent, or at the
+* root.
+*/
+template<class Key, class Value, class Compare, class Sizes>
+void AVLTree<Key, Value, Compare, Sizes>::replaceChild(AVLNode<Key, Value, Sizes>* parent, AVLNode<Key, Value, Sizes>* node, AVLNode<Key, Value, Sizes>* child)
+{
+    child->setParent(parent);
+    if (parent == nullptr) {
         this->root_ = child;
-        child->setParent(nullptr);
-        node->setParent(child);
-        node->setRight(nullptr);
-        if(child->getLeft()){
-            child->getLeft()->setParent(node);
-            node->setRight(child->getLeft());
-        }
-        node->getParent()->setLeft(node);
-    }
-    else if(node == node->getParent()->getLeft()){
-        child->setParent(node->getParent());
-        node->getParent()->setLeft(child);
-        node->setParent(child);
-        if(child->getLeft()){
-            child->getLeft()->setParent(node);
-            node->setRight(child->getLeft());
+    }
+    else if (parent->getLeft() == node) {
+        parent->setLeft(child);
+    }
+    else {
+        parent->setRight(child);
+    }
+}
+
+/**
+* Lifts node's right child into its place. Balances are left to the
+* caller, which knows what they become.
+*/
+template<class Key, class Value, class Compare, class Sizes>
+void AVLTree<Key, Value, Compare, Sizes>::rotateLeft(AVLNode<Key, Value, Sizes>* node) {
+    AVLNode<Key, Value, Sizes>* parent = node->getParent();
+    AVLNode<Key, Value, Sizes>* child = node->getRight();
+    AVLNode<Key, Value, Sizes>* inner = child->getLeft();
+
+    node->setRight(inner);
+    if (inner) inner->setParent(node);
+    child->setLeft(node);
+    node->setParent(child);
+    replaceChild(parent, node, child);
+
+    // child now roots what used to be node's subtree.
+    node->updateSize();
+    child->updateSize();
+    ++rotations_;
+}
+
+template<class Key, class Value, class Compare, class Sizes>
+void AVLTree<Key, Value, Compare, Sizes>::rotateRight(AVLNode<Key, Value, Sizes>* node) {
+    AVLNode<Key, Value, Sizes>* parent = node->getParent();
+    AVLNode<Key, Value, Sizes>* child = node->getLeft();
+    AVLNode<Key, Value, Sizes>* inner = child->getRight();
+
+    node->setLeft(inner);
+    if (inner) inner->setParent(node);
+    child->setRight(node);
+    node->setParent(child);
+    replaceChild(parent, node, child);
+
+    node->updateSize();
+    child->updateSize();
+    ++rotations_;
+}
+
+/**
+* Fixes node, whose balance has reached 2 * heavy, by rotating its
+* heavy child (pivot) up, and returns the new root of the subtree. The
+* resulting balances are set here for every case a retrace can run into.
+*/
+template<class Key, class Value, class Compare, class Sizes>
+AVLNode<Key, Value, Sizes>* AVLTree<Key, Value, Compare, Sizes>::rebalance(AVLNode<Key, Value, Sizes>* node, int8_t heavy)
+{
+    AVLNode<Key, Value, Sizes>* pivot = heavy > 0 ? node->getRight() : node->getLeft();
+    int8_t pivotBalance = pivot->getBalance();
+
+    if (pivotBalance != -heavy) {
+        // Single rotation. A level pivot only happens after a removal and
+        // leaves the subtree height unchanged.
+        if (heavy > 0) rotateLeft(node);
+        else rotateRight(node);
+
+        if (pivotBalance == 0) {
+            node->setBalance(heavy);
+            pivot->setBalance(-heavy);
         }
-        else{
-            node->setRight(nullptr);
+        else {
+            node->setBalance(0);
+            pivot->setBalance(0);
         }
-        node->getParent()->setLeft(node);
-    }
-    else if(node == node->getParent()->getRight()){
-        child->setParent(node->getParent());
-        node->getParent()->setRight(child);
-        node->setParent(child);
-        if(child->getLeft()){
-            child->getLeft()->setParent(node);
-            node->setRight(child->getLeft());
+        return pivot;
+    }
+
+    // Double rotation: pivot's inner child ends up on top.
+    AVLNode<Key, Value, Sizes>* grandchild = heavy > 0 ? pivot->getLeft() : pivot->getRight();
+    int8_t grandBalance = grandchild->getBalance();
+
+    if (heavy > 0) {
+        rotateRight(pivot);
+        rotateLeft(node);
+    }
+    else {
+        rotateLeft(pivot);
+        rotateRight(node);
+    }
+
+    node->setBalance(grandBalance == heavy ? -heavy : 0);
+    pivot->setBalance(grandBalance == -heavy ? heavy : 0);
+    grandchild->setBalance(0);
+    return grandchild;
+}
+
+/**
+* Walks up from a newly linked leaf, updating balances until the height
+* of the subtree stops growing: either a balance returns to 0 or one
+* rotation restores the old height. Reaching the root means the whole
+* tree grew.
+*/
+template<class Key, class Value, class Compare, class Sizes>
+void AVLTree<Key, Value, Compare, Sizes>::insert_Helper(AVLNode<Key, Value, Sizes>* node) {
+    AVLNode<Key, Value, Sizes>* parent = node->getParent();
+
+    while (parent != nullptr) {
+        int8_t diff = parent->getLeft() == node ? -1 : 1;
+        int8_t balance = parent->getBalance() + diff;
+
+        if (balance == 0) {
+            parent->setBalance(0);
+            return;
         }
-        else{
-            node->setRight(nullptr);
+        if (balance != diff) {
+            rebalance(parent, diff);
+            return;
         }
-        node->getParent()->setLeft(node);
+
+        parent->setBalance(balance);
+        node = parent;
+        parent = parent->getParent();
     }
+
+    ++height_;
 }
 
-template<class Key, class Value>
-void AVLTree<Key, Value>::rotateRight(AVLNode<Key, Value>*& node) {
-    AVLNode<Key, Value>* child = node->getLeft();
+/**
+* Walks up from the parent of a removed node. height is +1 when node's
+* left subtree shrank and -1 when its right one did. Stops once a subtree
+* keeps its height; reaching past the root means the whole tree shrank.
+*/
+template<class Key, class Value, class Compare, class Sizes>
+void AVLTree<Key, Value, Compare, Sizes>::remove_Helper(AVLNode<Key, Value, Sizes>* node, int height) {
+    int8_t diff = static_cast<int8_t>(height);
+
+    while (node != nullptr) {
+        AVLNode<Key, Value, Sizes>* parent = node->getParent();
+        int8_t parentDiff = 0;
+        if (parent) {
+            parentDiff = parent->getLeft() == node ? 1 : -1;
+        }
 
-    if(node->getParent() == nullptr){
-        this->root_ = child;
-        child->setParent(nullptr);
-        node->setParent(child);
-        node->setLeft(nullptr);
-        if(child->getRight()){
-            AVLNode<Key, Value>* orphan = child->getRight();
-            orphan->setParent(node);
-            node->setLeft(orphan);
+        int8_t balance = node->getBalance() + diff;
+
+        if (balance == diff) {
+            // Was level: one side is shorter now, but the height holds.
+            node->setBalance(balance);
+            return;
         }
-        node->getParent()->setRight(node);
-    }
-    else if(node == node->getParent()->getLeft()){
-        AVLNode<Key, Value>* child = node->getLeft();
-        child->setParent(node->getParent());
-        node->getParent()->setLeft(child);
-        node->setParent(child);
-        if(child->getRight()){
-            AVLNode<Key, Value>* orphan = child->getRight();
-            orphan->setParent(node);
-            node->setLeft(orphan);
+        if (balance != 0) {
+            AVLNode<Key, Value, Sizes>* top = rebalance(node, diff);
+            if (top->getBalance() != 0) {
+                return;
+            }
         }
-        else{
-            node->setLeft(nullptr);
+        else {
+            node->setBalance(0);
         }
-        node->getParent()->setRight(node);
-    }
-    else if(node == node->getParent()->getRight()){
-        AVLNode<Key, Value>* child = node->getLeft();
-        child->setParent(node->getParent());
-        node->getParent()->setRight(child);
-        node->setParent(child);
-        if(child->getRight()){
-            AVLNode<Key, Value>* orphan = child->getRight();
-            orphan->setParent(node);
-            node->setLeft(orphan);
+
+        node = parent;
+        diff = parentDiff;
+    }
+
+    --height_;
+}
+
+/*
+  Join-based set operations.
+
+  Everything below is built on join(left, node, right), which links two
+  AVL subtrees whose keys lie on either side of node's key in time
+  proportional to the difference of their heights, and on splitAt, which
+  cuts a subtree around a key with O(log n) joins. Union, intersection and
+  difference split this tree by the root of other and recurse on the two
+  halves, for O(m log(n/m + 1)) work when other has m keys and this tree n.
+
+  The two recursive calls touch disjoint nodes, so the top few levels run
+  them on separate threads. Neither the pool nor the merge callback is
+  shared between them: new nodes come from blocks allocated before the
+  recursion starts, and dropped nodes are only destroyed once it is over.
+*/
+
+/**
+* Adds every key of other to this tree. For keys in both trees
+* merge(Value& mine, const Value& theirs) decides the value kept; it may
+* be called from several threads at once, on different keys, and must not
+* throw. The plain overload takes other's value, as insert would.
+*/
+template<class Key, class Value, class Compare, class Sizes>
+template<typename Merge>
+void AVLTree<Key, Value, Compare, Sizes>::unite(const AVLTree<Key, Value, Compare, Sizes>& other, Merge merge)
+{
+    if (&other == this || other.empty()) return;
+
+    SpareBlocks spare;
+    spare.next = 0;
+    spare.blocks.reserve(other.size());
+    try {
+        for (std::size_t i = 0; i < other.size(); ++i) {
+            spare.blocks.push_back(this->pool_.allocate());
         }
-        else{
-            node->setLeft(nullptr);
+    }
+    catch (...) {
+        for (std::size_t i = 0; i < spare.blocks.size(); ++i) {
+            this->pool_.deallocate(spare.blocks[i]);
         }
-        node->getParent()->setRight(node);
-    }
-}
-
-  template<class Key, class Value>
-  void AVLTree<Key, Value>::insert_Helper(AVLNode<Key, Value>* parent, AVLNode<Key, Value>* node) {
-      if (parent == nullptr || parent->getParent() == nullptr) return;
-
-      AVLNode<Key, Value>* grandpa = parent->getParent();
-
-      if(grandpa->getLeft() == parent) {
-          grandpa->updateBalance(-1);
-
-          if (!grandpa->getBalance()) {
-              return;
-          }
-          else if (grandpa->getBalance() == -1) {
-              insert_Helper(grandpa, parent);
-          }
-          else if (grandpa->getBalance() == -2) {
-              if (parent->getLeft() == node) {
-                  rotateRight(grandpa);
-                  grandpa->setBalance(0);
-                  parent->setBalance(0);
-              }
-              else {
-                  rotateLeft(parent);
-                  rotateRight(grandpa);
-
-                  if (!node->getBalance()) {
-                      grandpa->setBalance(0);
-                      parent->setBalance(0);
-                      node->setBalance(0);
-                  }
-                  if (node->getBalance() == -1) {
-                      grandpa->setBalance(1);
-                      parent->setBalance(0);
-                      node->setBalance(0);
-                  }
-                  if (node->getBalance() == 1) {
-                      grandpa->setBalance(0);
-                      parent->setBalance(-1);
-                      node->setBalance(0);
-                  }
-              }
-          }
-      }
-      else if (grandpa->getRight() == parent) {
-          grandpa->updateBalance(1);
-
-          if (!grandpa->getBalance()) {
-              return;
-          }
-          else if (grandpa->getBalance() == 1) {
-              insert_Helper(grandpa, parent);
-          }
-          else if (grandpa->getBalance() == 2) {
-              if (parent->getRight() == node) {
-                  rotateLeft(grandpa);
-                  grandpa->setBalance(0);
-                  parent->setBalance(0);
-              }
-              else {
-                  rotateRight(parent);
-                  rotateLeft(grandpa);
-
-                  if (!node->getBalance()) {
-                      grandpa->setBalance(0);
-                      parent->setBalance(0);
-                      node->setBalance(0);
-                  }
-                  if (node->getBalance() == -1) {
-                      grandpa->setBalance(0);
-                      parent->setBalance(1);
-                      node->setBalance(0);
-                  }
-                  if (node->getBalance() == 1) {
-                      grandpa->setBalance(-1);
-                      parent->setBalance(0);
-                      node->setBalance(0);
-                  }
-              }
-          }
-      }
-  }
-
-  template<class Key, class Value>
-  void AVLTree<Key, Value>::remove_Helper(AVLNode<Key, Value>* node, int height) {
-      if(node == nullptr){
-          return;
-      }
-
-      int width = 0;
-
-      AVLNode<Key, Value>* parent = node->getParent();
-
-      if(parent) {
-          width = parent->getLeft() == node ? 1 : -1;
-      }
-
-      if (height == 1) {
-          if (node->getBalance() + height == 2) {
-              AVLNode<Key, Value> *pivot = node->getRight();
-              if(pivot->getBalance() == 1) {
-                  rotateLeft(node);
-
-                  pivot->setBalance(0);
-                  node->setBalance(0);
-
-                  remove_Helper(parent, width);
-              }
-              else if(pivot->getBalance() == 0) {
-                  rotateLeft(node);
-
-                  pivot->setBalance(-1);
-                  node->setBalance(1);
-              }
-              else if(pivot->getBalance() == -1) {
-                  AVLNode<Key, Value> *grandpa = pivot->getLeft();
-
-                  rotateRight(pivot);
-                  rotateLeft(node);
-
-                  if (grandpa->getBalance() == -1) {
-                      pivot->setBalance(1);
-                      grandpa->setBalance(0);
-                      node->setBalance(0);
-                  }
-                  else if (grandpa->getBalance() == 0) {
-                      pivot->setBalance(0);
-                      grandpa->setBalance(0);
-                      node->setBalance(0);
-                  }
-                  else if (grandpa->getBalance() == 1) {
-                      pivot->setBalance(0);
-                      grandpa->setBalance(0);
-                      node->setBalance(-1);
-                  }
-
-                  remove_Helper(parent, width);
-              }
-          }
-          else if (node->getBalance() + height == 1) {
-              node->setBalance(1);
-          }
-          else if (node->getBalance() + height == 0) {
-              node->setBalance(0);
-              
-              remove_Helper(parent, width);
-          }
-      }
-      else if (height == -1) {
-          if (node->getBalance() + height == -2) {
-              AVLNode<Key, Value> *pivot = node->getLeft();
-              if (pivot->getBalance() == -1) {
-                  rotateRight(node);
-
-                  pivot->setBalance(0);
-                  node->setBalance(0);
-
-                  remove_Helper(parent, width);
-              }
-              else if (!pivot->getBalance()) {
-                  rotateRight(node);
-                  pivot->setBalance(1);
-                  node->setBalance(-1);
-              }
-              else if (pivot->getBalance() == 1) {
-                  AVLNode<Key, Value> *grandpa = pivot->getRight();
-                  rotateLeft(pivot);
-                  rotateRight(node);
-                  if (grandpa->getBalance() == 1) {
-                      pivot->setBalance(-1);
-                      grandpa->setBalance(0);
-                      node->setBalance(0);
-                  }
-                  else if (grandpa->getBalance() == 0) {
-                      pivot->setBalance(0);
-                      grandpa->setBalance(0);
-                      node->setBalance(0);
-                  }
-                  else if (grandpa->getBalance() == -1) {
-                      pivot->setBalance(0);
-                      grandpa->setBalance(0);
-                      node->setBalance(1);
-                  }
-
-                  remove_Helper(parent, width);
-              }
-          }
-          else if (node->getBalance() + height == -1) {
-              node->setBalance(-1);
-          }
-          else if (node->getBalance() + height == 0) {
-              node->setBalance(0);
-
-              remove_Helper(parent, width);
-          }
-      }
-  }
-
-#endif
\ No newline at end of file
+        throw;
+    }
+
+    adopt(uniteRec(wholeTree(), static_cast<const AVLNode<Key, Value, Sizes>*>(other.root_),
+                   merge, spare, forkLevels()));
+
+    for (std::size_t i = spare.next; i < spare.blocks.size(); ++i) {
+        this->pool_.deallocate(spare.blocks[i]);
+    }
+}
+
+template<class Key, class Value, class Compare, class Sizes>
+void AVLTree<Key, Value, Compare, Sizes>::unite(const AVLTree<Key, Value, Compare, Sizes>& other)
+{
+    unite(other, [](Value& mine, const Value& theirs) { mine = theirs; });
+}
+
+/**
+* Keeps only the keys that are also in other, calling merge on each of
+* them as unite does. The plain overload keeps this tree's values.
+*/
+template<class Key, class Value, class Compare, class Sizes>
+template<typename Merge>
+void AVLTree<Key, Value, Compare, Sizes>::intersect(const AVLTree<Key, Value, Compare, Sizes>& other, Merge merge)
+{
+    if (&other == this) return;
+
+    std::vector<AVLNode<Key, Value, Sizes>*> dropped;
+    adopt(intersectRec(wholeTree(), static_cast<const AVLNode<Key, Value, Sizes>*>(other.root_),
+                       merge, dropped, forkLevels()));
+    destroySubtrees(dropped);
+}
+
+template<class Key, class Value, class Compare, class Sizes>
+void AVLTree<Key, Value, Compare, Sizes>::intersect(const AVLTree<Key, Value, Compare, Sizes>& other)
+{
+    intersect(other, [](Value&, const Value&) { });
+}
+
+/**
+* Removes every key that is in other.
+*/
+template<class Key, class Value, class Compare, class Sizes>
+void AVLTree<Key, Value, Compare, Sizes>::subtract(const AVLTree<Key, Value, Compare, Sizes>& other)
+{
+    if (&other == this) {
+        this->clear();
+        return;
+    }
+
+    std::vector<AVLNode<Key, Value, Sizes>*> dropped;
+    adopt(subtractRec(wholeTree(), static_cast<const AVLNode<Key, Value, Sizes>*>(other.root_),
+                      dropped, forkLevels()));
+    destroySubtrees(dropped);
+}
+
+/**
+* Moves every key >= key into right, replacing whatever right held, and
+* keeps the smaller keys here. Takes O(log n): the nodes themselves do not
+* move, right just becomes a co-owner of this tree's pool slabs. Memory
+* freed by either tree is therefore only returned to the system once both
+* have been cleared or destroyed.
+*/
+template<class Key, class Value, class Compare, class Sizes>
+void AVLTree<Key, Value, Compare, Sizes>::split(const Key& key, AVLTree<Key, Value, Compare, Sizes>& right)
+{
+    if (&right == this) return;
+
+    right.clear();
+    SplitResult parts = splitAt(wholeTree(), key);
+    if (parts.match) {
+        Subtree empty = { nullptr, 0 };
+        parts.right = join(empty, parts.match, parts.right);
+    }
+    adopt(parts.left);
+    right.adopt(parts.right);
+    this->pool_.shareWith(right.pool_);
+}
+
+/**
+* Appends every pair of right, leaving right empty. All of right's keys
+* must be greater than this tree's; std::invalid_argument is thrown
+* otherwise. Like split, it takes O(log n) and shares pool slabs rather
+* than copying nodes.
+*/
+template<class Key, class Value, class Compare, class Sizes>
+void AVLTree<Key, Value, Compare, Sizes>::concat(AVLTree<Key, Value, Compare, Sizes>& right)
+{
+    if (right.empty()) return;
+    if (&right == this ||
+        (this->largest_ && !this->keyLess(this->largest_->getKey(), right.begin()->first))) {
+        throw std::invalid_argument("concat: key ranges overlap");
+    }
+
+    std::size_t count = this->count_.load(std::memory_order_relaxed);
+    std::size_t rightCount = right.count_.load(std::memory_order_relaxed);
+    adopt(concatSubtrees(wholeTree(), right.wholeTree()));
+    if (count != this->UNKNOWN_COUNT && rightCount != this->UNKNOWN_COUNT) {
+        this->count_.store(count + rightCount, std::memory_order_relaxed);
+    }
+    right.pool_.shareWith(this->pool_);
+
+    Subtree empty = { nullptr, 0 };
+    right.adopt(empty);
+    right.clear();
+}
+
+template<class Key, class Value, class Compare, class Sizes>
+typename AVLTree<Key, Value, Compare, Sizes>::Subtree AVLTree<Key, Value, Compare, Sizes>::leftOf(const Subtree& tree)
+{
+    Subtree child = { tree.root->getLeft(), tree.height - (tree.root->getBalance() > 0 ? 2 : 1) };
+    return child;
+}
+
+template<class Key, class Value, class Compare, class Sizes>
+typename AVLTree<Key, Value, Compare, Sizes>::Subtree AVLTree<Key, Value, Compare, Sizes>::rightOf(const Subtree& tree)
+{
+    Subtree child = { tree.root->getRight(), tree.height - (tree.root->getBalance() < 0 ? 2 : 1) };
+    return child;
+}
+
+/**
+* Makes left and right the children of node and fixes up its size and
+* balance. The heights must already be within one of each other.
+*/
+template<class Key, class Value, class Compare, class Sizes>
+typename AVLTree<Key, Value, Compare, Sizes>::Subtree
+AVLTree<Key, Value, Compare, Sizes>::link(AVLNode<Key, Value, Sizes>* node, const Subtree& left, const Subtree& right)
+{
+    node->setLeft(left.root);
+    node->setRight(right.root);
+    if (left.root) left.root->setParent(node);
+    if (right.root) right.root->setParent(node);
+    node->updateSize();
+    node->setBalance(static_cast<int8_t>(right.height - left.height));
+
+    Subtree joined = { node, 1 + std::max(left.height, right.height) };
+    return joined;
+}
+
+/**
+* Joins two subtrees around node, whose key must sit between theirs. The
+* result's height is at most one more than the taller input's.
+*/
+template<class Key, class Value, class Compare, class Sizes>
+typename AVLTree<Key, Value, Compare, Sizes>::Subtree
+AVLTree<Key, Value, Compare, Sizes>::join(const Subtree& left, AVLNode<Key, Value, Sizes>* node, const Subtree& right)
+{
+    if (left.height > right.height + 1) return joinRight(left, node, right);
+    if (right.height > left.height + 1) return joinLeft(left, node, right);
+    return link(node, left, right);
+}
+
+/**
+* Walks down the right spine of the taller left subtree until it reaches
+* a subtree short enough to pair with right, then repairs the balance on
+* the way back up with at most one single or double rotation.
+*/
+template<class Key, class Value, class Compare, class Sizes>
+typename AVLTree<Key, Value, Compare, Sizes>::Subtree
+AVLTree<Key, Value, Compare, Sizes>::joinRight(const Subtree& left, AVLNode<Key, Value, Sizes>* node, const Subtree& right)
+{
+    Subtree outer = leftOf(left);
+    Subtree inner = rightOf(left);
+
+    if (inner.height <= right.height + 1) {
+        if (1 + std::max(inner.height, right.height) <= outer.height + 1) {
+            return link(left.root, outer, link(node, inner, right));
+        }
+        // inner is the taller side of the new piece: rotate it to the top.
+        Subtree innerLeft = leftOf(inner);
+        Subtree innerRight = rightOf(inner);
+        Subtree lower = link(left.root, outer, innerLeft);
+        Subtree upper = link(node, innerRight, right);
+        return link(inner.root, lower, upper);
+    }
+
+    Subtree joined = joinRight(inner, node, right);
+    if (joined.height <= outer.height + 1) {
+        return link(left.root, outer, joined);
+    }
+    Subtree joinedLeft = leftOf(joined);
+    Subtree joinedRight = rightOf(joined);
+    return link(joined.root, link(left.root, outer, joinedLeft), joinedRight);
+}
+
+/**
+* Mirror image of joinRight for a taller right subtree.
+*/
+template<class Key, class Value, class Compare, class Sizes>
+typename AVLTree<Key, Value, Compare, Sizes>::Subtree
+AVLTree<Key, Value, Compare, Sizes>::joinLeft(const Subtree& left, AVLNode<Key, Value, Sizes>* node, const Subtree& right)
+{
+    Subtree inner = leftOf(right);
+    Subtree outer = rightOf(right);
+
+    if (inner.height <= left.height + 1) {
+        if (1 + std::max(left.height, inner.height) <= outer.height + 1) {
+            return link(right.root, link(node, left, inner), outer);
+        }
+        Subtree innerLeft = leftOf(inner);
+        Subtree innerRight = rightOf(inner);
+        Subtree lower = link(node, left, innerLeft);
+        Subtree upper = link(right.root, innerRight, outer);
+        return link(inner.root, lower, upper);
+    }
+
+    Subtree joined = joinLeft(left, node, inner);
+    if (joined.height <= outer.height + 1) {
+        return link(right.root, joined, outer);
+    }
+    Subtree joinedLeft = leftOf(joined);
+    Subtree joinedRight = rightOf(joined);
+    return link(joined.root, joinedLeft, link(right.root, joinedRight, outer));
+}
+
+/**
+* Joins two subtrees with no node in between by pulling the largest node
+* out of left to use as the middle.
+*/
+template<class Key, class Value, class Compare, class Sizes>
+typename AVLTree<Key, Value, Compare, Sizes>::Subtree
+AVLTree<Key, Value, Compare, Sizes>::concatSubtrees(const Subtree& left, const Subtree& right)
+{
+    if (left.root == nullptr) return right;
+    if (right.root == nullptr) return left;
+
+    AVLNode<Key, Value, Sizes>* last;
+    Subtree rest = splitLast(left, last);
+    return join(rest, last, right);
+}
+
+/**
+* Detaches the largest node of a non-empty subtree into last and returns
+* what is left.
+*/
+template<class Key, class Value, class Compare, class Sizes>
+typename AVLTree<Key, Value, Compare, Sizes>::Subtree
+AVLTree<Key, Value, Compare, Sizes>::splitLast(const Subtree& tree, AVLNode<Key, Value, Sizes>*& last)
+{
+    Subtree left = leftOf(tree);
+    if (tree.root->getRight() == nullptr) {
+        last = tree.root;
+        return left;
+    }
+    Subtree rest = splitLast(rightOf(tree), last);
+    return join(left, tree.root, rest);
+}
+
+/**
+* Cuts a subtree into the keys below key and the keys above it. The node
+* holding key itself, if any, comes back detached as match; its child
+* links are stale.
+*/
+template<class Key, class Value, class Compare, class Sizes>
+typename AVLTree<Key, Value, Compare, Sizes>::SplitResult
+AVLTree<Key, Value, Compare, Sizes>::splitAt(const Subtree& tree, const Key& key) const
+{
+    if (tree.root == nullptr) {
+        SplitResult empty = { tree, nullptr, tree };
+        return empty;
+    }
+
+    Subtree left = leftOf(tree);
+    Subtree right = rightOf(tree);
+    int order = this->keyCompare(key, tree.root->getKey());
+    if (order < 0) {
+        SplitResult parts = splitAt(left, key);
+        parts.right = join(parts.right, tree.root, right);
+        return parts;
+    }
+    if (order > 0) {
+        SplitResult parts = splitAt(right, key);
+        parts.left = join(left, tree.root, parts.left);
+        return parts;
+    }
+    SplitResult parts = { left, tree.root, right };
+    return parts;
+}
+
+template<class Key, class Value, class Compare, class Sizes>
+typename AVLTree<Key, Value, Compare, Sizes>::Subtree AVLTree<Key, Value, Compare, Sizes>::wholeTree() const
+{
+    Subtree tree = { static_cast<AVLNode<Key, Value, Sizes>*>(this->root_), height_ };
+    return tree;
+}
+
+/**
+* Installs tree as the whole tree.
+*/
+template<class Key, class Value, class Compare, class Sizes>
+void AVLTree<Key, Value, Compare, Sizes>::adopt(const Subtree& tree)
+{
+    this->setRoot(tree.root);
+    height_ = tree.height;
+}
+
+/**
+* Height of the subtree under node, in O(height): the balance says which
+* child is the taller one.
+*/
+template<class Key, class Value, class Compare, class Sizes>
+int AVLTree<Key, Value, Compare, Sizes>::heightOf(const AVLNode<Key, Value, Sizes>* node)
+{
+    int height = 0;
+    while (node != nullptr) {
+        ++height;
+        node = node->getBalance() < 0 ? node->getLeft() : node->getRight();
+    }
+    return height;
+}
+
+template<class Key, class Value, class Compare, class Sizes>
+template<typename Merge>
+typename AVLTree<Key, Value, Compare, Sizes>::Subtree
+AVLTree<Key, Value, Compare, Sizes>::uniteRec(const Subtree& tree, const AVLNode<Key, Value, Sizes>* other,
+                              Merge& merge, SpareBlocks& spare, int forks)
+{
+    if (other == nullptr) return tree;
+    if (tree.root == nullptr) return copySubtree(other, spare);
+
+    SplitResult parts = splitAt(tree, other->getKey());
+    bool parallel = forks > 0 && heightOf(other) >= PARALLEL_HEIGHT;
+    Subtree left, right;
+    forkJoin(parallel,
+        [&]() { left = uniteRec(parts.left, other->getLeft(), merge, spare, forks - 1); },
+        [&]() { right = uniteRec(parts.right, other->getRight(), merge, spare, forks - 1); });
+
+    AVLNode<Key, Value, Sizes>* node = parts.match;
+    if (node) {
+        merge(node->getValue(), other->getValue());
+    }
+    else {
+        node = new (spare.blocks[spare.next++]) AVLNode<Key, Value, Sizes>(InPlaceItem(), other->getItem());
+    }
+    return join(left, node, right);
+}
+
+template<class Key, class Value, class Compare, class Sizes>
+template<typename Merge>
+typename AVLTree<Key, Value, Compare, Sizes>::Subtree
+AVLTree<Key, Value, Compare, Sizes>::intersectRec(const Subtree& tree, const AVLNode<Key, Value, Sizes>* other,
+                                  Merge& merge, std::vector<AVLNode<Key, Value, Sizes>*>& dropped, int forks)
+{
+    if (tree.root == nullptr) return tree;
+    if (other == nullptr) {
+        dropped.push_back(tree.root);
+        Subtree empty = { nullptr, 0 };
+        return empty;
+    }
+
+    SplitResult parts = splitAt(tree, other->getKey());
+    bool parallel = forks > 0 && heightOf(other) >= PARALLEL_HEIGHT;
+    Subtree left, right;
+    std::vector<AVLNode<Key, Value, Sizes>*> leftDropped;
+    forkJoin(parallel,
+        [&]() { left = intersectRec(parts.left, other->getLeft(), merge, leftDropped, forks - 1); },
+        [&]() { right = intersectRec(parts.right, other->getRight(), merge, dropped, forks - 1); });
+    dropped.insert(dropped.end(), leftDropped.begin(), leftDropped.end());
+
+    if (parts.match == nullptr) return concatSubtrees(left, right);
+    merge(parts.match->getValue(), other->getValue());
+    return join(left, parts.match, right);
+}
+
+template<class Key, class Value, class Compare, class Sizes>
+typename AVLTree<Key, Value, Compare, Sizes>::Subtree
+AVLTree<Key, Value, Compare, Sizes>::subtractRec(const Subtree& tree, const AVLNode<Key, Value, Sizes>* other,
+                                 std::vector<AVLNode<Key, Value, Sizes>*>& dropped, int forks)
+{
+    if (tree.root == nullptr || other == nullptr) return tree;
+
+    SplitResult parts = splitAt(tree, other->getKey());
+    bool parallel = forks > 0 && heightOf(other) >= PARALLEL_HEIGHT;
+    Subtree left, right;
+    std::vector<AVLNode<Key, Value, Sizes>*> leftDropped;
+    forkJoin(parallel,
+        [&]() { left = subtractRec(parts.left, other->getLeft(), leftDropped, forks - 1); },
+        [&]() { right = subtractRec(parts.right, other->getRight(), dropped, forks - 1); });
+    dropped.insert(dropped.end(), leftDropped.begin(), leftDropped.end());
+
+    if (parts.match) {
+        parts.match->setLeft(nullptr);
+        parts.match->setRight(nullptr);
+        dropped.push_back(parts.match);
+    }
+    return concatSubtrees(left, right);
+}
+
+/**
+* Copies a subtree of another tree node for node, keeping its shape.
+*/
+template<class Key, class Value, class Compare, class Sizes>
+typename AVLTree<Key, Value, Compare, Sizes>::Subtree
+AVLTree<Key, Value, Compare, Sizes>::copySubtree(const AVLNode<Key, Value, Sizes>* source, SpareBlocks& spare)
+{
+    if (source == nullptr) {
+        Subtree empty = { nullptr, 0 };
+        return empty;
+    }
+
+    Subtree left = copySubtree(source->getLeft(), spare);
+    AVLNode<Key, Value, Sizes>* node =
+        new (spare.blocks[spare.next++]) AVLNode<Key, Value, Sizes>(InPlaceItem(), source->getItem());
+    Subtree right = copySubtree(source->getRight(), spare);
+    return link(node, left, right);
+}
+
+/**
+* Destroys the subtrees the set operations cut loose.
+*/
+template<class Key, class Value, class Compare, class Sizes>
+void AVLTree<Key, Value, Compare, Sizes>::destroySubtrees(const std::vector<AVLNode<Key, Value, Sizes>*>& roots)
+{
+    std::vector<AVLNode<Key, Value, Sizes>*> pending(roots);
+    while (!pending.empty()) {
+        AVLNode<Key, Value, Sizes>* node = pending.back();
+        pending.pop_back();
+        if (node->getLeft()) pending.push_back(node->getLeft());
+        if (node->getRight()) pending.push_back(node->getRight());
+        this->destroyNode(node);
+    }
+}
+
+/**
+* Runs left on a new thread and right on this one when parallel is set,
+* and both in turn otherwise.
+*/
+template<class Key, class Value, class Compare, class Sizes>
+template<typename LeftTask, typename RightTask>
+void AVLTree<Key, Value, Compare, Sizes>::forkJoin(bool parallel, LeftTask left, RightTask right)
+{
+    if (!parallel) {
+        left();
+        right();
+        return;
+    }
+    std::future<void> pending = std::async(std::launch::async, left);
+    right();
+    pending.get();
+}
+
+/**
+* How many levels of the recursion may fork: enough for one task per
+* hardware thread.
+*/
+template<class Key, class Value, class Compare, class Sizes>
+int AVLTree<Key, Value, Compare, Sizes>::forkLevels()
+{
+    unsigned threads = std::thread::hardware_concurrency();
+    int levels = 0;
+    while ((1u << levels) < threads) {
+        ++levels;
+    }
+    return levels;
+}
+
+#endif
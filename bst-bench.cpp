@@ -0,0 +1,386 @@
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "avlbst.h"
+
+using namespace std;
+
+// Insert, find, iterate, mix and remove timings for BinarySearchTree,
+// AVLTree and std::map over several key orders. Every structure, order
+// and size runs in a child process of its own so that the peak RSS it
+// reports belongs to that run alone.
+//
+//   bst-bench [--max-size N] [--json FILE]
+//
+// Sizes go up by 10x from 1K to --max-size (1M by default). Larger sizes
+// work the same way but need about 60 bytes per key for the trees.
+
+typedef uint64_t Key;
+typedef uint64_t Value;
+
+// Small sizes are repeated until the operations have taken this long.
+const double MIN_SECONDS = 0.25;
+// The plain BST degenerates into a list on sorted and zigzag keys, which
+// costs O(n^2); it is skipped for those above this size.
+const size_t DEGENERATE_LIMIT = 20000;
+// Skew of the Zipf distribution (as in YCSB).
+const double ZIPF_THETA = 0.99;
+
+const char* const STRUCTURES[] = { "bst", "avl", "std::map" };
+const char* const DISTRIBUTIONS[] = { "sequential", "random", "zipf", "adversarial" };
+const char* const OPERATIONS[] = { "insert", "find", "iterate", "mixed", "remove" };
+const int NUM_STRUCTURES = 3;
+const int NUM_DISTRIBUTIONS = 4;
+const int NUM_OPERATIONS = 5;
+
+// What a child process sends back for one operation.
+struct Result
+{
+    double nsPerOp;
+    long peakRssKb;
+};
+
+uint64_t splitmix64(uint64_t x)
+{
+    x += 0x9E3779B97F4A7C15ULL;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    return x ^ (x >> 31);
+}
+
+/**
+* Draws ranks in [0, n) where rank r has probability proportional to
+* 1 / (r + 1)^theta, using the method of Gray et al. ("Quickly generating
+* billion-record synthetic databases") that YCSB also uses.
+*/
+class Zipf
+{
+public:
+    Zipf(uint64_t n, double theta) : n_(n), theta_(theta)
+    {
+        zetan_ = 0;
+        for (uint64_t i = 1; i <= n; ++i) {
+            zetan_ += 1.0 / pow((double)i, theta);
+        }
+        double zeta2 = 1.0 + 1.0 / pow(2.0, theta);
+        alpha_ = 1.0 / (1.0 - theta);
+        eta_ = (1.0 - pow(2.0 / n, 1.0 - theta)) / (1.0 - zeta2 / zetan_);
+    }
+
+    template<typename Rng>
+    uint64_t operator()(Rng& rng)
+    {
+        double u = uniform_real_distribution<double>(0.0, 1.0)(rng);
+        double uz = u * zetan_;
+        if (uz < 1.0) return 0;
+        if (uz < 1.0 + pow(0.5, theta_)) return 1;
+        uint64_t rank = (uint64_t)(n_ * pow(eta_ * u - eta_ + 1.0, alpha_));
+        return rank < n_ ? rank : n_ - 1;
+    }
+
+private:
+    uint64_t n_;
+    double theta_;
+    double zetan_;
+    double alpha_;
+    double eta_;
+};
+
+/**
+* The n keys to insert, in insertion order. Zipf keys repeat, so those
+* inserts partly overwrite; hot ranks are scattered over the key space.
+*/
+vector<Key> insertKeys(int distribution, size_t n)
+{
+    vector<Key> keys(n);
+    if (distribution == 0) {
+        for (size_t i = 0; i < n; ++i) keys[i] = i;
+    }
+    else if (distribution == 1) {
+        for (size_t i = 0; i < n; ++i) keys[i] = splitmix64(i);
+    }
+    else if (distribution == 2) {
+        mt19937_64 rng(7);
+        Zipf zipf(n, ZIPF_THETA);
+        for (size_t i = 0; i < n; ++i) keys[i] = splitmix64(zipf(rng));
+    }
+    else {
+        // Zigzag between the ends of the range: a list for a plain BST and
+        // a rotation on almost every insert for a balanced one.
+        for (size_t i = 0; i < n; ++i) keys[i] = (i % 2 == 0) ? i / 2 : n - 1 - i / 2;
+    }
+    return keys;
+}
+
+/**
+* The n keys to look up: present keys in the distribution's own order,
+* except for Zipf, where popular keys are asked for far more often.
+*/
+vector<Key> queryKeys(int distribution, const vector<Key>& inserted)
+{
+    size_t n = inserted.size();
+    vector<Key> keys(n);
+    mt19937_64 rng(11);
+    if (distribution == 1) {
+        for (size_t i = 0; i < n; ++i) keys[i] = inserted[rng() % n];
+    }
+    else if (distribution == 2) {
+        Zipf zipf(n, ZIPF_THETA);
+        for (size_t i = 0; i < n; ++i) keys[i] = splitmix64(zipf(rng));
+    }
+    else {
+        keys = inserted;
+    }
+    return keys;
+}
+
+// The same small interface over both tree types and std::map.
+void put(BinarySearchTree<Key, Value>& tree, Key key, Value value)
+{
+    tree.insert(std::make_pair(key, value));
+}
+
+void put(map<Key, Value>& tree, Key key, Value value)
+{
+    tree[key] = value;
+}
+
+bool get(const BinarySearchTree<Key, Value>& tree, Key key, Value& value)
+{
+    BinarySearchTree<Key, Value>::const_iterator it = tree.find(key);
+    if (it == tree.end()) return false;
+    value = it->second;
+    return true;
+}
+
+bool get(const map<Key, Value>& tree, Key key, Value& value)
+{
+    map<Key, Value>::const_iterator it = tree.find(key);
+    if (it == tree.end()) return false;
+    value = it->second;
+    return true;
+}
+
+void erase(BinarySearchTree<Key, Value>& tree, Key key)
+{
+    tree.remove(key);
+}
+
+void erase(map<Key, Value>& tree, Key key)
+{
+    tree.erase(key);
+}
+
+double elapsedNs(chrono::steady_clock::time_point start)
+{
+    return chrono::duration<double, nano>(chrono::steady_clock::now() - start).count();
+}
+
+// Keeps the compiler from dropping lookups whose results are unused.
+volatile Value sink;
+
+/**
+* Runs every operation on a Tree of n keys, repeating the whole sequence
+* while it is too quick to time well, and fills in ns per operation.
+*/
+template<typename Tree>
+void measure(int distribution, size_t n, Result* results)
+{
+    vector<Key> keys = insertKeys(distribution, n);
+    vector<Key> queries = queryKeys(distribution, keys);
+    double total[NUM_OPERATIONS] = { 0, 0, 0, 0, 0 };
+    double spent = 0;
+    size_t reps = 0;
+    Value check = 0;
+
+    do {
+        Tree tree;
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        for (size_t i = 0; i < n; ++i) put(tree, keys[i], i);
+        total[0] += elapsedNs(start);
+
+        start = chrono::steady_clock::now();
+        for (size_t i = 0; i < n; ++i) {
+            Value value;
+            if (get(tree, queries[i], value)) check += value;
+        }
+        total[1] += elapsedNs(start);
+
+        start = chrono::steady_clock::now();
+        for (typename Tree::const_iterator it = tree.begin(); it != tree.end(); ++it) {
+            check += it->second;
+        }
+        total[2] += elapsedNs(start);
+
+        // Half lookups, a quarter inserts and a quarter removes, all over
+        // the query keys, so the size stays about the same.
+        mt19937 rng(reps);
+        start = chrono::steady_clock::now();
+        for (size_t i = 0; i < n; ++i) {
+            Key key = queries[rng() % n];
+            unsigned op = rng() % 4;
+            Value value;
+            if (op < 2) {
+                if (get(tree, key, value)) check += value;
+            }
+            else if (op == 2) {
+                put(tree, key, i);
+            }
+            else {
+                erase(tree, key);
+            }
+        }
+        total[3] += elapsedNs(start);
+
+        start = chrono::steady_clock::now();
+        for (size_t i = 0; i < n; ++i) erase(tree, keys[i]);
+        total[4] += elapsedNs(start);
+
+        spent = total[0] + total[1] + total[2] + total[3] + total[4];
+        ++reps;
+    } while (spent < MIN_SECONDS * 1e9);
+    sink = check;
+
+    for (int op = 0; op < NUM_OPERATIONS; ++op) {
+        results[op].nsPerOp = total[op] / (double)(reps * n);
+    }
+}
+
+/**
+* Runs one structure, distribution and size in a child process, which
+* reports back through a pipe. Returns false if the child failed (for
+* instance by running out of memory).
+*/
+bool runIsolated(int structure, int distribution, size_t n, Result* results)
+{
+    int fds[2];
+    if (pipe(fds) != 0) return false;
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        close(fds[0]);
+        close(fds[1]);
+        return false;
+    }
+    if (pid == 0) {
+        close(fds[0]);
+        if (structure == 0) measure<BinarySearchTree<Key, Value> >(distribution, n, results);
+        else if (structure == 1) measure<AVLTree<Key, Value> >(distribution, n, results);
+        else measure<map<Key, Value> >(distribution, n, results);
+
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        for (int op = 0; op < NUM_OPERATIONS; ++op) results[op].peakRssKb = usage.ru_maxrss;
+
+        const char* data = reinterpret_cast<const char*>(results);
+        size_t left = sizeof(Result) * NUM_OPERATIONS;
+        while (left > 0) {
+            ssize_t written = write(fds[1], data, left);
+            if (written <= 0) _exit(1);
+            data += written;
+            left -= written;
+        }
+        _exit(0);
+    }
+
+    close(fds[1]);
+    char* data = reinterpret_cast<char*>(results);
+    size_t got = 0;
+    while (got < sizeof(Result) * NUM_OPERATIONS) {
+        ssize_t r = read(fds[0], data + got, sizeof(Result) * NUM_OPERATIONS - got);
+        if (r <= 0) break;
+        got += r;
+    }
+    close(fds[0]);
+
+    int status = 0;
+    waitpid(pid, &status, 0);
+    return got == sizeof(Result) * NUM_OPERATIONS && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+int main(int argc, char *argv[])
+{
+    size_t maxSize = 1000000;
+    string jsonPath = "bst-bench.json";
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--max-size") == 0 && i + 1 < argc) {
+            maxSize = strtoull(argv[++i], nullptr, 10);
+        }
+        else if (strcmp(argv[i], "--json") == 0 && i + 1 < argc) {
+            jsonPath = argv[++i];
+        }
+        else {
+            cerr << "usage: " << argv[0] << " [--max-size N] [--json FILE]" << endl;
+            return 1;
+        }
+    }
+
+    ostringstream json;
+    bool firstRecord = true;
+    json << "[\n";
+
+    cout << setw(10) << "structure" << setw(13) << "keys" << setw(11) << "size"
+         << setw(9) << "op" << setw(12) << "ns/op" << setw(12) << "Mops/s"
+         << setw(14) << "peak RSS MB" << endl;
+
+    for (size_t n = 1000; n <= maxSize; n *= 10) {
+        for (int d = 0; d < NUM_DISTRIBUTIONS; ++d) {
+            for (int s = 0; s < NUM_STRUCTURES; ++s) {
+                if (s == 0 && (d == 0 || d == 3) && n > DEGENERATE_LIMIT) {
+                    cout << setw(10) << STRUCTURES[s] << setw(13) << DISTRIBUTIONS[d]
+                         << setw(11) << n << "   skipped (degenerate, O(n^2))" << endl;
+                    continue;
+                }
+
+                Result results[NUM_OPERATIONS];
+                if (!runIsolated(s, d, n, results)) {
+                    cout << setw(10) << STRUCTURES[s] << setw(13) << DISTRIBUTIONS[d]
+                         << setw(11) << n << "   failed" << endl;
+                    continue;
+                }
+
+                for (int op = 0; op < NUM_OPERATIONS; ++op) {
+                    double opsPerSec = 1e9 / results[op].nsPerOp;
+                    cout << setw(10) << STRUCTURES[s] << setw(13) << DISTRIBUTIONS[d]
+                         << setw(11) << n << setw(9) << OPERATIONS[op]
+                         << setw(12) << fixed << setprecision(1) << results[op].nsPerOp
+                         << setw(12) << setprecision(2) << opsPerSec / 1e6
+                         << setw(14) << setprecision(1) << results[op].peakRssKb / 1024.0 << endl;
+
+                    json << (firstRecord ? "" : ",\n")
+                         << "  {\"structure\": \"" << STRUCTURES[s]
+                         << "\", \"distribution\": \"" << DISTRIBUTIONS[d]
+                         << "\", \"size\": " << n
+                         << ", \"operation\": \"" << OPERATIONS[op]
+                         << "\", \"ns_per_op\": " << setprecision(2) << results[op].nsPerOp
+                         << ", \"ops_per_sec\": " << setprecision(0) << opsPerSec
+                         << ", \"peak_rss_kb\": " << results[op].peakRssKb << "}";
+                    firstRecord = false;
+                }
+            }
+        }
+    }
+    json << "\n]\n";
+
+    ofstream out(jsonPath.c_str());
+    out << json.str();
+    if (!out) {
+        cerr << "could not write " << jsonPath << endl;
+        return 1;
+    }
+    cout << "Results written to " << jsonPath << endl;
+    return 0;
+}
@@ -1,17 +1,420 @@
 #include <iostream>
+#include <cstdio>
 #include <map>
+#include <random>
+#include <stdexcept>
+#include <string>
 #include "bst.h"
 #include "avlbst.h"
+#include "compact_avl.h"
+#include "frozen_tree.h"
+#include "btree.h"
+#include "persistent_avl.h"
+#include "parallel_bst.h"
 
 using namespace std;
 
+bool failed = false;
+
+void check(bool ok, const char* what)
+{
+    if(!ok) {
+        cout << "FAILED: " << what << endl;
+        failed = true;
+    }
+}
+
+template<typename Tree>
+void fill(Tree& tree, int lo, int hi)
+{
+    for(int key = lo; key < hi; ++key) tree.insert(std::make_pair(key, key));
+}
+
+// Inserts and removes straight after an operation that moved whole
+// subtrees, before anything has asked for size(), must still leave the
+// right count.
+template<typename Tree>
+void checkCountAfter(Tree& tree, std::size_t expected, const char* what)
+{
+    tree.insert(std::make_pair(1000, 0));
+    tree.remove(1000);
+    tree.remove(tree.begin()->first);
+    check(tree.size() == expected - 1 && tree.isBalanced(), what);
+}
+
+template<typename Sizes>
+void testCountAfterRestructure()
+{
+    typedef AVLTree<int,int,std::less<int>,Sizes> Tree;
+    Tree other;
+    fill(other, 5, 15);
+
+    Tree united;
+    fill(united, 0, 10);
+    united.unite(other);
+    checkCountAfter(united, 15, "size after unite");
+
+    Tree common;
+    fill(common, 0, 10);
+    common.intersect(other);
+    checkCountAfter(common, 5, "size after intersect");
+
+    Tree rest;
+    fill(rest, 0, 10);
+    rest.subtract(other);
+    checkCountAfter(rest, 5, "size after subtract");
+
+    Tree left, right;
+    fill(left, 0, 10);
+    left.split(4, right);
+    checkCountAfter(left, 4, "size of the left part after split");
+    checkCountAfter(right, 6, "size of the right part after split");
+
+    left.concat(right);
+    checkCountAfter(left, 8, "size after concat");
+}
+
+// The checks below run each operation on a tree and on a std::map side by
+// side, then compare size, contents and balance.
+template<typename Tree, typename Map>
+bool sameAs(const Tree& tree, const Map& expected)
+{
+    if(tree.size() != expected.size() || !tree.isBalanced()) return false;
+    typename Map::const_iterator it = expected.begin();
+    for(typename Tree::const_iterator t = tree.begin(); t != tree.end(); ++t, ++it) {
+        if(t->first != it->first || t->second != it->second) return false;
+    }
+    return true;
+}
+
+template<typename Tree>
+void randomFill(Tree& tree, map<int,int>& expected, mt19937& rng, int count)
+{
+    for(int i = 0; i < count; ++i) {
+        int key = (int)(rng() % 300);
+        tree.insert(std::make_pair(key, i));
+        expected[key] = i;
+    }
+}
+
+// A few inserts and removes after an operation, so that one that left the
+// tree's bookkeeping wrong shows up.
+template<typename Tree>
+void checkAfterChanges(Tree& tree, map<int,int>& expected, mt19937& rng, const char* what)
+{
+    check(sameAs(tree, expected), what);
+    for(int i = 0; i < 20; ++i) {
+        int key = (int)(rng() % 320);
+        if(rng() % 2 == 0) {
+            tree.insert(std::make_pair(key, -i));
+            expected[key] = -i;
+        }
+        else {
+            tree.remove(key);
+            expected.erase(key);
+        }
+    }
+    check(sameAs(tree, expected), what);
+}
+
+template<typename Sizes>
+void testSetOperations()
+{
+    typedef AVLTree<int,int,std::less<int>,Sizes> Tree;
+    mt19937 rng(17);
+    for(int round = 0; round < 50; ++round) {
+        // Sizes from empty up, so that either side can be the larger one.
+        int mine = (int)(rng() % 200);
+        int theirs = (int)(rng() % 200);
+        Tree other;
+        map<int,int> otherKeys;
+        randomFill(other, otherKeys, rng, theirs);
+
+        Tree united;
+        map<int,int> unionKeys;
+        randomFill(united, unionKeys, rng, mine);
+        united.unite(other);
+        for(map<int,int>::iterator it = otherKeys.begin(); it != otherKeys.end(); ++it) {
+            unionKeys[it->first] = it->second;
+        }
+        checkAfterChanges(united, unionKeys, rng, "unite against std::map");
+
+        Tree summed;
+        map<int,int> sums;
+        randomFill(summed, sums, rng, mine);
+        summed.unite(other, [](int& a, const int& b) { a += b; });
+        for(map<int,int>::iterator it = otherKeys.begin(); it != otherKeys.end(); ++it) {
+            if(sums.count(it->first)) sums[it->first] += it->second;
+            else sums[it->first] = it->second;
+        }
+        checkAfterChanges(summed, sums, rng, "unite with a merge against std::map");
+
+        Tree common;
+        map<int,int> before, intersection;
+        randomFill(common, before, rng, mine);
+        common.intersect(other);
+        for(map<int,int>::iterator it = before.begin(); it != before.end(); ++it) {
+            if(otherKeys.count(it->first)) intersection.insert(*it);
+        }
+        checkAfterChanges(common, intersection, rng, "intersect against std::map");
+
+        Tree taken;
+        map<int,int> takenBefore, theirValues;
+        randomFill(taken, takenBefore, rng, mine);
+        taken.intersect(other, [](int& a, const int& b) { a = b; });
+        for(map<int,int>::iterator it = takenBefore.begin(); it != takenBefore.end(); ++it) {
+            if(otherKeys.count(it->first)) theirValues[it->first] = otherKeys[it->first];
+        }
+        checkAfterChanges(taken, theirValues, rng, "intersect with a merge against std::map");
+
+        Tree rest;
+        map<int,int> difference;
+        randomFill(rest, difference, rng, mine);
+        rest.subtract(other);
+        for(map<int,int>::iterator it = otherKeys.begin(); it != otherKeys.end(); ++it) {
+            difference.erase(it->first);
+        }
+        checkAfterChanges(rest, difference, rng, "subtract against std::map");
+
+        check(sameAs(other, otherKeys), "set operations left their argument alone");
+    }
+}
+
+template<typename Sizes>
+void testSplitConcat()
+{
+    typedef AVLTree<int,int,std::less<int>,Sizes> Tree;
+    mt19937 rng(23);
+    for(int round = 0; round < 100; ++round) {
+        Tree left;
+        map<int,int> all;
+        randomFill(left, all, rng, (int)(rng() % 200));
+        // Split points below, inside and above the keys, present or not.
+        int at = (int)(rng() % 340) - 20;
+
+        Tree right;
+        left.split(at, right);
+        map<int,int> below(all.begin(), all.lower_bound(at));
+        map<int,int> above(all.lower_bound(at), all.end());
+        check(sameAs(left, below), "left part of split against std::map");
+        check(sameAs(right, above), "right part of split against std::map");
+
+        // Changes that keep the two parts apart, so they still concatenate.
+        for(int i = 0; i < 10; ++i) {
+            int key = at - 1 - (int)(rng() % 30);
+            left.insert(std::make_pair(key, i));
+            below[key] = i;
+            key = at + (int)(rng() % 30);
+            right.insert(std::make_pair(key, i));
+            above[key] = i;
+            if(!below.empty() && rng() % 2 == 0) {
+                left.remove(below.begin()->first);
+                below.erase(below.begin());
+            }
+        }
+        check(sameAs(left, below), "left part changed after split");
+        check(sameAs(right, above), "right part changed after split");
+
+        left.concat(right);
+        below.insert(above.begin(), above.end());
+        check(right.size() == 0 && right.begin() == right.end(), "concat empties its argument");
+        checkAfterChanges(left, below, rng, "concat against std::map");
+    }
+
+    Tree low, high;
+    fill(low, 0, 10);
+    fill(high, 5, 15);
+    bool threw = false;
+    try {
+        low.concat(high);
+    }
+    catch (const std::invalid_argument&) {
+        threw = true;
+    }
+    check(threw && low.size() == 10 && high.size() == 10, "concat of overlapping ranges");
+}
+
+void testHintedInsert()
+{
+    mt19937 rng(29);
+    AVLTree<int,int> tree;
+    map<int,int> expected;
+    for(int i = 0; i < 5000; ++i) {
+        int key = (int)(rng() % 2000);
+        // Good hints, hints next to the spot and arbitrary ones.
+        AVLTree<int,int>::iterator hint;
+        switch(rng() % 5) {
+        case 0: hint = tree.end(); break;
+        case 1: hint = tree.begin(); break;
+        case 2: hint = tree.lower_bound(key); break;
+        case 3: hint = tree.upper_bound(key); break;
+        default: hint = tree.lower_bound((int)(rng() % 2000)); break;
+        }
+        AVLTree<int,int>::iterator at;
+        if(rng() % 2 == 0) {
+            // Overwrites, as insert does.
+            at = tree.insert(hint, std::make_pair(key, i));
+            expected[key] = i;
+        }
+        else {
+            // Keeps an existing value, as emplace does.
+            at = tree.emplace_hint(hint, key, i);
+            expected.insert(std::make_pair(key, i));
+        }
+        if(at == tree.end() || at->first != key || at->second != expected[key]) {
+            check(false, "hinted insert returns the key's node");
+        }
+        if(rng() % 8 == 0) {
+            int gone = (int)(rng() % 2000);
+            tree.remove(gone);
+            expected.erase(gone);
+        }
+    }
+    check(sameAs(tree, expected), "hinted insert against std::map");
+
+    // A sorted run hinted with end(), as std::inserter would give it.
+    AVLTree<int,int> appended;
+    map<int,int> sorted;
+    for(int i = 0; i < 1000; ++i) {
+        appended.insert(appended.end(), std::make_pair(2 * i, i));
+        sorted[2 * i] = i;
+    }
+    for(int i = 999; i >= 0; --i) {
+        appended.emplace_hint(appended.find(2 * i), 2 * i - 1, -i);
+        sorted.insert(std::make_pair(2 * i - 1, -i));
+    }
+    check(sameAs(appended, sorted), "sorted hinted inserts against std::map");
+}
+
+void testHeterogeneousLookup()
+{
+    const char* names[] = { "ash", "beech", "cedar", "elm", "fir", "larch", "oak", "pine", "yew" };
+    const char* probes[] = { "", "a", "ash", "asp", "cedar", "d", "elm", "oak", "oaks", "z" };
+    AVLTree<std::string,int> tree;
+    map<std::string,int> expected;
+    for(int i = 0; i < 9; ++i) {
+        tree.insert(std::make_pair(std::string(names[i]), i));
+        expected[names[i]] = i;
+    }
+
+    const AVLTree<std::string,int>& constTree = tree;
+    for(int i = 0; i < 10; ++i) {
+        const char* probe = probes[i];
+        map<std::string,int>::iterator found = expected.find(probe);
+        check((tree.find(probe) == tree.end()) == (found == expected.end()) &&
+              (constTree.find(probe) == constTree.end()) == (found == expected.end()),
+              "find by const char*");
+        if(found != expected.end()) {
+            check(tree.find(probe)->second == found->second && tree[probe] == found->second &&
+                  constTree[probe] == found->second, "value found by const char*");
+        }
+        else {
+            bool threw = false;
+            try {
+                tree[probe];
+            }
+            catch (const std::out_of_range&) {
+                threw = true;
+            }
+            check(threw, "operator[] by const char* on a missing key");
+        }
+
+        map<std::string,int>::iterator lower = expected.lower_bound(probe);
+        map<std::string,int>::iterator upper = expected.upper_bound(probe);
+        check(lower == expected.end() ? tree.lower_bound(probe) == tree.end()
+                                      : tree.lower_bound(probe)->first == lower->first,
+              "lower_bound by const char*");
+        check(upper == expected.end() ? constTree.upper_bound(probe) == constTree.end()
+                                      : constTree.upper_bound(probe)->first == upper->first,
+              "upper_bound by const char*");
+        std::pair<AVLTree<std::string,int>::iterator, AVLTree<std::string,int>::iterator> range =
+            tree.equal_range(probe);
+        check(range.first == tree.lower_bound(probe) && range.second == tree.upper_bound(probe),
+              "equal_range by const char*");
+    }
+
+    for(int i = 0; i < 10; i += 2) {
+        tree.remove(probes[i]);
+        expected.erase(probes[i]);
+    }
+    check(sameAs(tree, expected), "remove by const char* against std::map");
+    tree.insert(std::make_pair(std::string("asp"), 20));
+    expected["asp"] = 20;
+    tree.remove("pine");
+    expected.erase("pine");
+    check(sameAs(tree, expected), "changes after removes by const char*");
+}
+
+// A value that counts how often one is built, to see whether an insert
+// built a node it then threw away.
+struct Counted
+{
+    static int built;
+    int value;
+
+    explicit Counted(int v) : value(v) { ++built; }
+    Counted(const Counted& other) : value(other.value) { ++built; }
+    Counted(Counted&& other) : value(other.value) { ++built; }
+    Counted& operator=(const Counted& other) { value = other.value; return *this; }
+    Counted& operator=(Counted&& other) { value = other.value; return *this; }
+};
+
+int Counted::built = 0;
+
+ostream& operator<<(ostream& out, const Counted& counted)
+{
+    return out << counted.value;
+}
+
+void testInsertLooksUpFirst()
+{
+    AVLTree<int,Counted> tree;
+    for(int key = 0; key < 100; ++key) tree.insert(std::make_pair(key, Counted(key)));
+
+    // A present key only has its value assigned.
+    std::pair<int,Counted> update(50, Counted(-50));
+    std::pair<int,Counted> hinted(60, Counted(-60));
+    Counted::built = 0;
+    bool added = tree.insert(std::move(update)).second;
+    tree.insert(tree.find(60), std::move(hinted));
+    check(!added && Counted::built == 0 && tree.find(50)->second.value == -50 &&
+          tree.find(60)->second.value == -60, "insert of a present key builds no node");
+
+    // A new key is moved into its node once.
+    std::pair<int,Counted> fresh(100, Counted(100));
+    Counted::built = 0;
+    added = tree.insert(std::move(fresh)).second;
+    check(added && Counted::built == 1 && tree.size() == 101 && tree.isBalanced(),
+          "insert of a new key builds one node");
+
+    // Pairs whose key still has to be converted go the long way round.
+    AVLTree<std::string,int> words;
+    words.insert(std::make_pair("oak", 1));
+    check(!words.insert(std::make_pair("oak", 2)).second && words["oak"] == 2 &&
+          words.insert(words.end(), std::make_pair("yew", 3))->second == 3 && words.size() == 2,
+          "insert of pairs with a convertible key");
+}
 
 int main(int argc, char *argv[])
 {
+    testCountAfterRestructure<NoSubtreeSizes>();
+    testCountAfterRestructure<SubtreeSizes>();
+    testSetOperations<NoSubtreeSizes>();
+    testSetOperations<SubtreeSizes>();
+    testSplitConcat<NoSubtreeSizes>();
+    testSplitConcat<SubtreeSizes>();
+    testHintedInsert();
+    testHeterogeneousLookup();
+    testInsertLooksUpFirst();
+
     // Binary Search Tree tests
     BinarySearchTree<char,int> bt;
     bt.insert(std::make_pair('a',1));
     bt.insert(std::make_pair('b',2));
+    bt.emplace('c',3);
+    if(!bt.try_emplace('c',4).second) {
+        cout << "try_emplace left c at " << bt['c'] << endl;
+    }
     
     cout << "Binary Search Tree contents:" << endl;
     for(BinarySearchTree<char,int>::iterator it = bt.begin(); it != bt.end(); ++it) {
@@ -30,6 +433,11 @@ int main(int argc, char *argv[])
     AVLTree<char,int> at;
     at.insert(std::make_pair('a',1));
     at.insert(std::make_pair('b',2));
+    if(!at.insert(std::make_pair('a',3)).second) {
+        cout << "a was already present, value now " << at['a'] << endl;
+    }
+    at.insert(std::make_pair('c',4));
+    cout << "rotations so far: " << at.rotationCount() << endl;
 
     cout << "\nAVLTree contents:" << endl;
     for(AVLTree<char,int>::iterator it = at.begin(); it != at.end(); ++it) {
@@ -44,5 +452,126 @@ int main(int argc, char *argv[])
     cout << "Erasing b" << endl;
     at.remove('b');
 
-    return 0;
+    // Bulk load from an already sorted range
+    map<char,int> sorted;
+    sorted['x'] = 24;
+    sorted['y'] = 25;
+    sorted['z'] = 26;
+    AVLTree<char,int> loaded(sorted.begin(), sorted.end());
+
+    cout << "\nBulk loaded AVLTree contents:" << endl;
+    for(AVLTree<char,int>::iterator it = loaded.begin(); it != loaded.end(); ++it) {
+        cout << it->first << " " << it->second << endl;
+    }
+    cout << "size " << loaded.size() << endl;
+
+    // Order statistics need a tree whose nodes keep subtree sizes
+    AVLTree<char,int,std::less<char>,SubtreeSizes> ranked(sorted.begin(), sorted.end());
+    cout << "rank of y " << ranked.rank('y')
+         << ", select(2) " << ranked.select(2)->first
+         << ", keys in [x, z) " << ranked.count_range('x', 'z') << endl;
+    cout << "lower_bound(w) " << loaded.lower_bound('w')->first
+         << ", upper_bound(x) " << loaded.upper_bound('x')->first << endl;
+    cout << "height " << loaded.height() << ", balanced " << loaded.isBalanced() << endl;
+    cout << "Reversed:";
+    for(AVLTree<char,int>::reverse_iterator it = loaded.rbegin(); it != loaded.rend(); ++it) {
+        cout << " " << it->first;
+    }
+    cout << endl;
+
+    // Join-based set operations
+    AVLTree<char,int> merged;
+    merged.insert(std::make_pair('a',1));
+    merged.insert(std::make_pair('y',100));
+    merged.unite(loaded, [](int& mine, const int& theirs) { mine += theirs; });
+    cout << "Union:";
+    for(AVLTree<char,int>::iterator it = merged.begin(); it != merged.end(); ++it) {
+        cout << " " << it->first << "=" << it->second;
+    }
+    merged.subtract(loaded);
+    cout << ", minus bulk loaded keys: " << merged.size() << " left" << endl;
+
+    // Split off the keys from y up and put them back
+    AVLTree<char,int> upper;
+    loaded.split('y', upper);
+    cout << "Split at y: " << loaded.size() << " + " << upper.size() << " keys";
+    loaded.concat(upper);
+    cout << ", concatenated again: " << loaded.size() << " keys, balanced " << loaded.isBalanced() << endl;
+
+    // Multi-threaded scans
+    parallel_for_each(loaded, [](std::pair<const char,int>& kv) { kv.second *= 2; }, 2);
+    int total = parallel_reduce(loaded, 0,
+        [](int sum, const std::pair<const char,int>& kv) { return sum + kv.second; },
+        [](int a, int b) { return a + b; }, 2);
+    cout << "Parallel: doubled values sum to " << total << endl;
+
+    // String keys looked up by literal, without building a std::string
+    AVLTree<std::string,int> words;
+    words.insert(std::make_pair(std::string("pear"), 4));
+    words.insert(std::make_pair(std::string("fig"), 3));
+    words.insert(std::make_pair(std::string("kiwi"), 4));
+    words.remove("fig");
+    cout << "Words: pear -> " << words["pear"] << ", lower_bound(g) "
+         << words.lower_bound("g")->first << ", " << words.size() << " left" << endl;
+
+    // Custom ordering: largest key first
+    AVLTree<int,int,std::greater<int> > descending;
+    for(int i = 1; i <= 5; ++i) descending.insert(std::make_pair(i, i * i));
+    cout << "Descending:";
+    for(AVLTree<int,int,std::greater<int> >::iterator it = descending.begin(); it != descending.end(); ++it) {
+        cout << " " << it->first;
+    }
+    cout << ", lower_bound(3) " << descending.lower_bound(3)->first << endl;
+
+    // Appending sorted keys with end() as the hint skips the descent
+    AVLTree<int,int> appended;
+    for(int i = 0; i < 100; ++i) appended.insert(appended.end(), std::make_pair(i, i));
+    appended.emplace_hint(appended.find(50), 49, -1);
+    cout << "Hinted: " << appended.size() << " keys, height " << appended.height()
+         << ", 49 -> " << appended[49] << endl;
+
+    // Compact tree: index links, 8 bytes of overhead per node
+    CompactAVLTree<int,int> ct;
+    ct.reserve(3);
+    ct.insert(std::make_pair(2, 20));
+    ct.insert(std::make_pair(1, 10));
+    ct.insert(std::make_pair(3, 30));
+    ct.remove(1);
+    cout << "Compact:";
+    for(CompactAVLTree<int,int>::const_iterator it = ct.begin(); it != ct.end(); ++it) {
+        cout << " " << it->first << "=" << it->second;
+    }
+    cout << ", " << ct.memoryUsage() << " bytes" << endl;
+
+    // Read-only snapshot for lookups
+    FrozenTree<char,int> frozen(loaded);
+    cout << "Frozen lower_bound(w) " << frozen.lower_bound('w')->first
+         << ", find(q) " << (frozen.find('q') == frozen.end() ? "missing" : "found") << endl;
+
+    // Snapshot file, served straight from the mapping
+    frozen.save("bst-test.snapshot");
+    FrozenTree<char,int> mapped = FrozenTree<char,int>::load_mmap("bst-test.snapshot");
+    cout << "Mapped snapshot: " << mapped.size() << " keys, x -> " << mapped['x'] << endl;
+    std::remove("bst-test.snapshot");
+
+    // B+ tree with the same interface
+    BTree<char,int> bpt;
+    bpt.insert(std::make_pair('m',1));
+    bpt.insert(std::make_pair('k',2));
+    bpt.insert(std::make_pair('n',3));
+    bpt.remove('k');
+    cout << "BTree:";
+    for(BTree<char,int>::iterator it = bpt.begin(); it != bpt.end(); ++it) {
+        cout << " " << it->first << "=" << it->second;
+    }
+    cout << ", m -> " << bpt['m'] << endl;
+
+    // Persistent tree: snapshots are O(1) and never change
+    PersistentAVLTree<char,int> pt;
+    pt.insert(std::make_pair('p',1));
+    PersistentAVLTree<char,int> snap = pt.snapshot();
+    pt.insert(std::make_pair('q',2));
+    cout << "Persistent: live " << pt.size() << " keys, snapshot " << snap.size() << " keys" << endl;
+
+    return failed ? 1 : 0;
 }
@@ -6,20 +6,397 @@
 #include <cstdlib>
 #include <utility>
 #include <cmath>
+#include <new>
+#include <tuple>
+#include <type_traits>
+#include <iterator>
+#include <cstddef>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <string>
+#include "node_pool.h"
 
 /**
- * A templated class for a Node in a search tree.
- * The getters for parent/left/right are virtual so
- * that they can be overridden for future kinds of
- * search trees, such as Red Black trees, Splay trees,
- * and AVL trees.
+ * Tag selecting the Node constructors that build the stored pair in place
+ * from arbitrary arguments (used by emplace and try_emplace).
+ */
+struct InPlaceItem
+{
+};
+
+/**
+ * Builds a node's key/value pair in the storage handed to it. emplace
+ * wraps its arguments in one of these so that the virtual createNode can
+ * construct the pair straight into whatever node type the tree uses.
  */
 template <typename Key, typename Value>
-class Node
+class ItemBuilder
+{
+public:
+    virtual void build(std::pair<const Key, Value>* item) = 0;
+
+protected:
+    ~ItemBuilder() {}
+};
+
+/**
+ * An ItemBuilder that calls fn(item), where fn placement-news the pair.
+ */
+template <typename Key, typename Value, typename Function>
+class ItemBuilderFor : public ItemBuilder<Key, Value>
+{
+public:
+    explicit ItemBuilderFor(Function& fn) : fn_(fn) {}
+    virtual void build(std::pair<const Key, Value>* item) { fn_(item); }
+
+private:
+    Function& fn_;
+};
+
+class ParallelTraversal;
+
+/**
+ * True when a K and a Key can be compared with < both ways, so lookups
+ * can search for a K as is (say a const char* in a std::string-keyed
+ * tree) instead of building a temporary Key from it first.
+ */
+template<typename Key, typename K, typename = void>
+struct IsComparableKey : std::false_type
+{
+};
+
+template<typename Key, typename K>
+struct IsComparableKey<Key, K, decltype(void(std::declval<const Key&>() < std::declval<const K&>()),
+                                        void(std::declval<const K&>() < std::declval<const Key&>()))> :
+    std::true_type
+{
+};
+
+/**
+ * Three-way comparison with the meaning of <: negative when a < b,
+ * positive when b < a and zero otherwise. The generic version calls <
+ * twice when a is not less than b. Strings, pairs and tuples have
+ * overloads that look at each character or element once, so a search
+ * that needs to tell "less", "equal" and "greater" apart pays for a
+ * single comparison of such keys per node instead of two.
+ */
+template<typename A, typename B>
+int threeWayCompare(const A& a, const B& b);
+
+template<typename C, typename Traits, typename Alloc>
+int threeWayCompare(const std::basic_string<C, Traits, Alloc>& a,
+                    const std::basic_string<C, Traits, Alloc>& b);
+
+template<typename C, typename Traits, typename Alloc, typename B>
+typename std::enable_if<std::is_convertible<const B&, const C*>::value, int>::type
+threeWayCompare(const std::basic_string<C, Traits, Alloc>& a, const B& b);
+
+template<typename A, typename C, typename Traits, typename Alloc>
+typename std::enable_if<std::is_convertible<const A&, const C*>::value, int>::type
+threeWayCompare(const A& a, const std::basic_string<C, Traits, Alloc>& b);
+
+template<typename A1, typename A2, typename B1, typename B2>
+int threeWayCompare(const std::pair<A1, A2>& a, const std::pair<B1, B2>& b);
+
+template<typename... As, typename... Bs>
+int threeWayCompare(const std::tuple<As...>& a, const std::tuple<Bs...>& b);
+
+// Compares tuple elements I to N - 1 in order.
+template<std::size_t I, std::size_t N>
+struct TupleThreeWay
+{
+    template<typename A, typename B>
+    static int compare(const A& a, const B& b)
+    {
+        int result = threeWayCompare(std::get<I>(a), std::get<I>(b));
+        return result != 0 ? result : TupleThreeWay<I + 1, N>::compare(a, b);
+    }
+};
+
+template<std::size_t N>
+struct TupleThreeWay<N, N>
+{
+    template<typename A, typename B>
+    static int compare(const A&, const B&)
+    {
+        return 0;
+    }
+};
+
+template<typename A, typename B>
+int threeWayCompare(const A& a, const B& b)
+{
+    if (a < b) return -1;
+    return b < a ? 1 : 0;
+}
+
+template<typename C, typename Traits, typename Alloc>
+int threeWayCompare(const std::basic_string<C, Traits, Alloc>& a,
+                    const std::basic_string<C, Traits, Alloc>& b)
+{
+    return a.compare(b);
+}
+
+template<typename C, typename Traits, typename Alloc, typename B>
+typename std::enable_if<std::is_convertible<const B&, const C*>::value, int>::type
+threeWayCompare(const std::basic_string<C, Traits, Alloc>& a, const B& b)
+{
+    return a.compare(static_cast<const C*>(b));
+}
+
+template<typename A, typename C, typename Traits, typename Alloc>
+typename std::enable_if<std::is_convertible<const A&, const C*>::value, int>::type
+threeWayCompare(const A& a, const std::basic_string<C, Traits, Alloc>& b)
+{
+    int result = b.compare(static_cast<const C*>(a));
+    return result < 0 ? 1 : (result > 0 ? -1 : 0);
+}
+
+template<typename A1, typename A2, typename B1, typename B2>
+int threeWayCompare(const std::pair<A1, A2>& a, const std::pair<B1, B2>& b)
+{
+    int result = threeWayCompare(a.first, b.first);
+    return result != 0 ? result : threeWayCompare(a.second, b.second);
+}
+
+template<typename... As, typename... Bs>
+int threeWayCompare(const std::tuple<As...>& a, const std::tuple<Bs...>& b)
+{
+    static_assert(sizeof...(As) == sizeof...(Bs), "tuples of different sizes");
+    return TupleThreeWay<0, sizeof...(As)>::compare(a, b);
+}
+
+// True when Compare declares is_transparent, as the C++14 standard
+// comparators do, which promises that it can compare a Key with other
+// types directly.
+template<typename Compare, typename = void>
+struct IsTransparent : std::false_type
+{
+};
+
+template<typename Compare>
+struct IsTransparent<Compare, decltype(void(sizeof(typename Compare::is_transparent*)))> :
+    std::true_type
+{
+};
+
+// True when Compare has an int compare(a, b) const member that does a
+// three-way comparison in one go.
+template<typename Compare, typename A, typename B, typename = void>
+struct HasThreeWayCompare : std::false_type
+{
+};
+
+template<typename Compare, typename A, typename B>
+struct HasThreeWayCompare<Compare, A, B, decltype(void(
+    std::declval<const Compare&>().compare(std::declval<const A&>(), std::declval<const B&>())))> :
+    std::true_type
+{
+};
+
+/**
+ * How a tree orders its keys with a given Compare. less is a single call
+ * of the comparator. compare is three-way and uses the comparator's own
+ * compare(a, b) member if it has one; otherwise it calls the comparator
+ * a second time when the first call says "not less".
+ *
+ * The default std::less<Key> (and std::greater<Key>) compare with <
+ * directly, which gives them threeWayCompare and lets lookups take any
+ * type comparable with Key; other comparators get those lookups when
+ * they are transparent.
+ */
+template<typename Key, typename Compare>
+struct KeyOrder
+{
+    template<typename K>
+    struct Accepts : IsTransparent<Compare>
+    {
+    };
+
+    template<typename A, typename B>
+    static bool less(const Compare& comp, const A& a, const B& b)
+    {
+        return comp(a, b);
+    }
+
+    template<typename A, typename B>
+    static int compare(const Compare& comp, const A& a, const B& b)
+    {
+        return compare(comp, a, b, HasThreeWayCompare<Compare, A, B>());
+    }
+
+private:
+    template<typename A, typename B>
+    static int compare(const Compare& comp, const A& a, const B& b, std::true_type)
+    {
+        return comp.compare(a, b);
+    }
+
+    template<typename A, typename B>
+    static int compare(const Compare& comp, const A& a, const B& b, std::false_type)
+    {
+        if (comp(a, b)) return -1;
+        return comp(b, a) ? 1 : 0;
+    }
+};
+
+template<typename Key>
+struct KeyOrder<Key, std::less<Key> >
+{
+    template<typename K>
+    struct Accepts : IsComparableKey<Key, K>
+    {
+    };
+
+    template<typename A, typename B>
+    static bool less(const std::less<Key>&, const A& a, const B& b)
+    {
+        return a < b;
+    }
+
+    template<typename A, typename B>
+    static int compare(const std::less<Key>&, const A& a, const B& b)
+    {
+        return threeWayCompare(a, b);
+    }
+};
+
+template<typename Key>
+struct KeyOrder<Key, std::greater<Key> >
+{
+    template<typename K>
+    struct Accepts : IsComparableKey<Key, K>
+    {
+    };
+
+    template<typename A, typename B>
+    static bool less(const std::greater<Key>&, const A& a, const B& b)
+    {
+        return b < a;
+    }
+
+    template<typename A, typename B>
+    static int compare(const std::greater<Key>&, const A& a, const B& b)
+    {
+        return threeWayCompare(b, a);
+    }
+};
+
+// Enables the heterogeneous lookup overloads for a K the tree's ordering
+// accepts. Key itself keeps using the plain overloads.
+template<typename Key, typename Compare, typename K>
+using EnableIfLookupKey = typename std::enable_if<
+    !std::is_same<typename std::decay<K>::type, Key>::value &&
+    KeyOrder<Key, Compare>::template Accepts<K>::value>::type;
+
+// True when an insert is handed a std::pair (as the P of insert(P&&))
+// whose key already is a Key and whose value can be assigned to a Value,
+// so the key can be looked up before any node is built for it.
+template<typename Key, typename Value, typename P, typename = void>
+struct IsKeyedPair : std::false_type
+{
+};
+
+template<typename Key, typename Value, typename P>
+struct IsKeyedPair<Key, Value, P, typename std::enable_if<
+    std::is_same<typename std::remove_const<typename std::decay<P>::type::first_type>::type,
+                 Key>::value &&
+    std::is_same<std::pair<typename std::decay<P>::type::first_type,
+                           typename std::decay<P>::type::second_type>,
+                 typename std::decay<P>::type>::value &&
+    std::is_assignable<Value&, decltype((std::declval<P>().second))>::value>::type> :
+    std::true_type
+{
+};
+
+/**
+ * Node augmentation policies, given to a tree as its Sizes parameter and
+ * inherited by its nodes. With NoSubtreeSizes, the default, a node holds
+ * nothing extra and inserts and removes never walk back up to the root.
+ * SubtreeSizes keeps the number of nodes below every node, which rank,
+ * select and count_range need, at the cost of a word per node and an
+ * update of every ancestor on each insert and remove.
+ */
+class NoSubtreeSizes
+{
+public:
+    static const bool enabled = false;
+
+    void setSize(std::size_t size);
+    void updateSize(const NoSubtreeSizes* left, const NoSubtreeSizes* right);
+};
+
+class SubtreeSizes
+{
+public:
+    static const bool enabled = true;
+
+    SubtreeSizes();
+
+    // Number of nodes in the subtree rooted here (including this one).
+    std::size_t getSize() const;
+    void setSize(std::size_t size);
+    // Recomputes the size from the children's, which must be correct.
+    void updateSize(const SubtreeSizes* left, const SubtreeSizes* right);
+
+private:
+    std::size_t size_;
+};
+
+inline void NoSubtreeSizes::setSize(std::size_t)
+{
+
+}
+
+inline void NoSubtreeSizes::updateSize(const NoSubtreeSizes*, const NoSubtreeSizes*)
+{
+
+}
+
+inline SubtreeSizes::SubtreeSizes() :
+    size_(1)
+{
+
+}
+
+inline std::size_t SubtreeSizes::getSize() const
+{
+    return size_;
+}
+
+inline void SubtreeSizes::setSize(std::size_t size)
+{
+    size_ = size;
+}
+
+inline void SubtreeSizes::updateSize(const SubtreeSizes* left, const SubtreeSizes* right)
+{
+    size_ = 1 + (left ? left->size_ : 0) + (right ? right->size_ : 0);
+}
+
+/**
+ * A templated class for a Node in a search tree.
+ * Node has no virtual functions: the getters for
+ * parent/left/right are plain inline loads. Node types
+ * for other kinds of search trees (Red Black trees,
+ * Splay trees, AVL trees) derive from Node and hide
+ * the getters with versions returning their own type,
+ * which is a static_cast and costs nothing at runtime.
+ * The owning tree is told the concrete node type at
+ * compile time through a NodePolicy (see below).
+ * Sizes is one of the augmentation policies above.
+ */
+template <typename Key, typename Value, typename Sizes = NoSubtreeSizes>
+class Node : public Sizes
 {
 public:
-    Node(const Key& key, const Value& value, Node<Key, Value>* parent);
-    virtual ~Node();
+    Node(const Key& key, const Value& value, Node<Key, Value, Sizes>* parent);
+    template<typename... Args>
+    explicit Node(InPlaceItem, Args&&... args);
+    Node(InPlaceItem, ItemBuilder<Key, Value>& builder);
+    ~Node();
 
     const std::pair<const Key, Value>& getItem() const;
     std::pair<const Key, Value>& getItem();
@@ -27,20 +404,30 @@ public:
     const Value& getValue() const;
     Value& getValue();
 
-    virtual Node<Key, Value>* getParent() const;
-    virtual Node<Key, Value>* getLeft() const;
-    virtual Node<Key, Value>* getRight() const;
+    Node<Key, Value, Sizes>* getParent() const;
+    Node<Key, Value, Sizes>* getLeft() const;
+    Node<Key, Value, Sizes>* getRight() const;
 
-    void setParent(Node<Key, Value>* parent);
-    void setLeft(Node<Key, Value>* left);
-    void setRight(Node<Key, Value>* right);
+    void setParent(Node<Key, Value, Sizes>* parent);
+    void setLeft(Node<Key, Value, Sizes>* left);
+    void setRight(Node<Key, Value, Sizes>* right);
     void setValue(const Value &value);
+    void setValue(Value&& value);
+
+    // Subtree sizes; sizeOf needs Sizes to be SubtreeSizes.
+    static std::size_t sizeOf(const Node<Key, Value, Sizes>* node);
+    void updateSize();
 
 protected:
-    std::pair<const Key, Value> item_;
-    Node<Key, Value>* parent_;
-    Node<Key, Value>* left_;
-    Node<Key, Value>* right_;
+    // A variant member so that the ItemBuilder constructor can build the
+    // pair in its body; the other constructors initialize it as usual.
+    union
+    {
+        std::pair<const Key, Value> item_;
+    };
+    Node<Key, Value, Sizes>* parent_;
+    Node<Key, Value, Sizes>* left_;
+    Node<Key, Value, Sizes>* right_;
 };
 
 /*
@@ -52,8 +439,8 @@ protected:
 /**
 * Explicit constructor for a node.
 */
-template<typename Key, typename Value>
-Node<Key, Value>::Node(const Key& key, const Value& value, Node<Key, Value>* parent) :
+template<typename Key, typename Value, typename Sizes>
+Node<Key, Value, Sizes>::Node(const Key& key, const Value& value, Node<Key, Value, Sizes>* parent) :
     item_(key, value),
     parent_(parent),
     left_(NULL),
@@ -61,120 +448,224 @@ Node<Key, Value>::Node(const Key& key, const Value& value, Node<Key, Value>* par
 {
 
 }
-template<typename Key, typename Value>
-Node<Key, Value>::~Node()
+/**
+* Constructs the key/value pair directly from args. The node starts out
+* unlinked; the tree sets its parent when it is attached.
+*/
+template<typename Key, typename Value, typename Sizes>
+template<typename... Args>
+Node<Key, Value, Sizes>::Node(InPlaceItem, Args&&... args) :
+    item_(std::forward<Args>(args)...),
+    parent_(NULL),
+    left_(NULL),
+    right_(NULL)
+{
+
+}
+
+/**
+* Lets builder construct the pair in place (see BinarySearchTree::buildNode).
+*/
+template<typename Key, typename Value, typename Sizes>
+Node<Key, Value, Sizes>::Node(InPlaceItem, ItemBuilder<Key, Value>& builder) :
+    parent_(NULL),
+    left_(NULL),
+    right_(NULL)
 {
+    builder.build(&item_);
+}
 
+template<typename Key, typename Value, typename Sizes>
+Node<Key, Value, Sizes>::~Node()
+{
+    item_.~pair();
 }
 
-template<typename Key, typename Value>
-const std::pair<const Key, Value>& Node<Key, Value>::getItem() const
+template<typename Key, typename Value, typename Sizes>
+const std::pair<const Key, Value>& Node<Key, Value, Sizes>::getItem() const
 {
     return item_;
 }
 
-template<typename Key, typename Value>
-std::pair<const Key, Value>& Node<Key, Value>::getItem()
+template<typename Key, typename Value, typename Sizes>
+std::pair<const Key, Value>& Node<Key, Value, Sizes>::getItem()
 {
     return item_;
 }
 
-template<typename Key, typename Value>
-const Key& Node<Key, Value>::getKey() const
+template<typename Key, typename Value, typename Sizes>
+const Key& Node<Key, Value, Sizes>::getKey() const
 {
     return item_.first;
 }
 
-template<typename Key, typename Value>
-const Value& Node<Key, Value>::getValue() const
+template<typename Key, typename Value, typename Sizes>
+const Value& Node<Key, Value, Sizes>::getValue() const
 {
     return item_.second;
 }
 
-template<typename Key, typename Value>
-Value& Node<Key, Value>::getValue()
+template<typename Key, typename Value, typename Sizes>
+Value& Node<Key, Value, Sizes>::getValue()
 {
     return item_.second;
 }
 
-template<typename Key, typename Value>
-Node<Key, Value>* Node<Key, Value>::getParent() const
+template<typename Key, typename Value, typename Sizes>
+inline Node<Key, Value, Sizes>* Node<Key, Value, Sizes>::getParent() const
 {
     return parent_;
 }
 
 
-template<typename Key, typename Value>
-Node<Key, Value>* Node<Key, Value>::getLeft() const
+template<typename Key, typename Value, typename Sizes>
+inline Node<Key, Value, Sizes>* Node<Key, Value, Sizes>::getLeft() const
 {
     return left_;
 }
 
 
-template<typename Key, typename Value>
-Node<Key, Value>* Node<Key, Value>::getRight() const
+template<typename Key, typename Value, typename Sizes>
+inline Node<Key, Value, Sizes>* Node<Key, Value, Sizes>::getRight() const
 {
     return right_;
 }
 
 
-template<typename Key, typename Value>
-void Node<Key, Value>::setParent(Node<Key, Value>* parent)
+template<typename Key, typename Value, typename Sizes>
+void Node<Key, Value, Sizes>::setParent(Node<Key, Value, Sizes>* parent)
 {
     parent_ = parent;
 }
 
 
-template<typename Key, typename Value>
-void Node<Key, Value>::setLeft(Node<Key, Value>* left)
+template<typename Key, typename Value, typename Sizes>
+void Node<Key, Value, Sizes>::setLeft(Node<Key, Value, Sizes>* left)
 {
     left_ = left;
 }
 
 
-template<typename Key, typename Value>
-void Node<Key, Value>::setRight(Node<Key, Value>* right)
+template<typename Key, typename Value, typename Sizes>
+void Node<Key, Value, Sizes>::setRight(Node<Key, Value, Sizes>* right)
 {
     right_ = right;
 }
 
 
-template<typename Key, typename Value>
-void Node<Key, Value>::setValue(const Value& value)
+template<typename Key, typename Value, typename Sizes>
+void Node<Key, Value, Sizes>::setValue(const Value& value)
 {
     item_.second = value;
 }
 
+
+template<typename Key, typename Value, typename Sizes>
+void Node<Key, Value, Sizes>::setValue(Value&& value)
+{
+    item_.second = std::move(value);
+}
+
+
+/**
+* Subtree size that treats a null child as an empty subtree.
+*/
+template<typename Key, typename Value, typename Sizes>
+inline std::size_t Node<Key, Value, Sizes>::sizeOf(const Node<Key, Value, Sizes>* node)
+{
+    return node ? node->getSize() : 0;
+}
+
+
+/**
+* Recomputes this node's size from its children's (which must be correct);
+* does nothing without SubtreeSizes.
+*/
+template<typename Key, typename Value, typename Sizes>
+inline void Node<Key, Value, Sizes>::updateSize()
+{
+    Sizes::updateSize(left_, right_);
+}
+
 /*
   ---------------------------------------
   End implementations for the Node class.
   ---------------------------------------
 */
 
+/**
+ * Compile-time description of the node type a tree stores. A derived
+ * tree passes NodePolicy<ItsNode>() to the protected BinarySearchTree
+ * constructor so the base can size its pool and run the right destructor
+ * on its nodes without any virtual dispatch on Node itself.
+ */
+template <typename NodeType>
+struct NodePolicy
+{
+};
+
 
-template <typename Key, typename Value>
+/**
+ * Keys are ordered by Compare, a strict weak ordering as for std::map.
+ * Sizes chooses whether nodes keep subtree sizes (see SubtreeSizes); the
+ * order statistics below are only available when they do.
+ */
+template <typename Key, typename Value, typename Compare = std::less<Key>,
+          typename Sizes = NoSubtreeSizes>
 class BinarySearchTree
 {
 public:
+    class iterator;
+    typedef Compare key_compare;
+
     BinarySearchTree(); 
+    explicit BinarySearchTree(const Compare& comp);
     virtual ~BinarySearchTree(); 
-    virtual void insert(const std::pair<const Key, Value>& keyValuePair); //TODO
+    virtual std::pair<iterator, bool> insert(const std::pair<const Key, Value>& keyValuePair);
+    template<typename P, typename = typename std::enable_if<
+        std::is_constructible<std::pair<const Key, Value>, P&&>::value>::type>
+    std::pair<iterator, bool> insert(P&& keyValuePair);
+    template<typename... Args>
+    std::pair<iterator, bool> emplace(Args&&... args);
+    template<typename... Args>
+    std::pair<iterator, bool> try_emplace(const Key& key, Args&&... args);
+    template<typename... Args>
+    std::pair<iterator, bool> try_emplace(Key&& key, Args&&... args);
     virtual void remove(const Key& key); 
+    template<typename K, typename = EnableIfLookupKey<Key, Compare, K> >
+    void remove(const K& key);
     void clear(); 
-    void clear_Helper(Node<Key, Value>* node);
-    bool isBalanced(); 
-    bool isBalanced_Helper(Node<Key, Value>* node);
-    int isBalanced_Height(Node<Key, Value>* node);
+    void clear_Helper(Node<Key, Value, Sizes>* node);
+    bool isBalanced() const;
+    virtual int height() const;
     void print() const;
     bool empty() const;
+    std::size_t size() const;
+    Compare key_comp() const;
 
-    template<typename PPKey, typename PPValue>
-    friend void prettyPrintBST(BinarySearchTree<PPKey, PPValue> & tree);
+    template<typename PPKey, typename PPValue, typename PPCompare, typename PPSizes>
+    friend void prettyPrintBST(BinarySearchTree<PPKey, PPValue, PPCompare, PPSizes> & tree);
+    friend class ParallelTraversal;
+protected:
+    template<typename NodeType>
+    BinarySearchTree(NodePolicy<NodeType> policy, const Compare& comp);
 public:
-  
-    class iterator  // TODO
+    class const_iterator;
+
+    /**
+     * Bidirectional iterator over the pairs in key order. It remembers the
+     * tree it came from so that --end() can step straight to the largest
+     * node, which the tree keeps track of.
+     */
+    class iterator
     {
     public:
+        typedef std::bidirectional_iterator_tag iterator_category;
+        typedef std::pair<const Key, Value> value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef std::pair<const Key, Value>* pointer;
+        typedef std::pair<const Key, Value>& reference;
+
         iterator();
 
         std::pair<const Key,Value>& operator*() const;
@@ -184,34 +675,206 @@ public:
         bool operator!=(const iterator& rhs) const;
 
         iterator& operator++();
+        iterator operator++(int);
+        iterator& operator--();
+        iterator operator--(int);
+
+    protected:
+        friend class BinarySearchTree<Key, Value, Compare, Sizes>;
+        friend class const_iterator;
+        iterator(Node<Key, Value, Sizes>* ptr, const BinarySearchTree<Key, Value, Compare, Sizes>* tree);
+        Node<Key, Value, Sizes> *current_;
+        const BinarySearchTree<Key, Value, Compare, Sizes>* tree_;
+    };
+
+    /**
+     * Same as iterator, but only gives const access to the pairs. An
+     * iterator converts to a const_iterator and the two compare equal
+     * when they point at the same node.
+     */
+    class const_iterator
+    {
+    public:
+        typedef std::bidirectional_iterator_tag iterator_category;
+        typedef std::pair<const Key, Value> value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef const std::pair<const Key, Value>* pointer;
+        typedef const std::pair<const Key, Value>& reference;
+
+        const_iterator();
+        const_iterator(const iterator& it);
+
+        const std::pair<const Key,Value>& operator*() const;
+        const std::pair<const Key,Value>* operator->() const;
+
+        friend bool operator==(const const_iterator& lhs, const const_iterator& rhs)
+        {
+            return lhs.current_ == rhs.current_;
+        }
+        friend bool operator!=(const const_iterator& lhs, const const_iterator& rhs)
+        {
+            return lhs.current_ != rhs.current_;
+        }
+
+        const_iterator& operator++();
+        const_iterator operator++(int);
+        const_iterator& operator--();
+        const_iterator operator--(int);
 
     protected:
-        friend class BinarySearchTree<Key, Value>;
-        iterator(Node<Key,Value>* ptr);
-        Node<Key, Value> *current_;
+        friend class BinarySearchTree<Key, Value, Compare, Sizes>;
+        const_iterator(Node<Key, Value, Sizes>* ptr, const BinarySearchTree<Key, Value, Compare, Sizes>* tree);
+        Node<Key, Value, Sizes> *current_;
+        const BinarySearchTree<Key, Value, Compare, Sizes>* tree_;
     };
 
+    typedef std::reverse_iterator<iterator> reverse_iterator;
+    typedef std::reverse_iterator<const_iterator> const_reverse_iterator;
+
 public:
-    iterator begin() const;
-    iterator end() const;
-    iterator find(const Key& key) const;
+    // Inserts that try the spot just before hint first; see findHintedPos.
+    iterator insert(const_iterator hint, const std::pair<const Key, Value>& keyValuePair);
+    template<typename P, typename = typename std::enable_if<
+        std::is_constructible<std::pair<const Key, Value>, P&&>::value>::type>
+    iterator insert(const_iterator hint, P&& keyValuePair);
+    template<typename... Args>
+    iterator emplace_hint(const_iterator hint, Args&&... args);
+
+    iterator begin();
+    const_iterator begin() const;
+    const_iterator cbegin() const;
+    iterator end();
+    const_iterator end() const;
+    const_iterator cend() const;
+    reverse_iterator rbegin();
+    const_reverse_iterator rbegin() const;
+    const_reverse_iterator crbegin() const;
+    reverse_iterator rend();
+    const_reverse_iterator rend() const;
+    const_reverse_iterator crend() const;
+
+    iterator find(const Key& key);
+    const_iterator find(const Key& key) const;
+    iterator lower_bound(const Key& key);
+    const_iterator lower_bound(const Key& key) const;
+    iterator upper_bound(const Key& key);
+    const_iterator upper_bound(const Key& key) const;
+    std::pair<iterator, iterator> equal_range(const Key& key);
+    std::pair<const_iterator, const_iterator> equal_range(const Key& key) const;
+
+    // The same lookups for any type comparable with Key; see IsComparableKey.
+    template<typename K, typename = EnableIfLookupKey<Key, Compare, K> >
+    iterator find(const K& key);
+    template<typename K, typename = EnableIfLookupKey<Key, Compare, K> >
+    const_iterator find(const K& key) const;
+    template<typename K, typename = EnableIfLookupKey<Key, Compare, K> >
+    iterator lower_bound(const K& key);
+    template<typename K, typename = EnableIfLookupKey<Key, Compare, K> >
+    const_iterator lower_bound(const K& key) const;
+    template<typename K, typename = EnableIfLookupKey<Key, Compare, K> >
+    iterator upper_bound(const K& key);
+    template<typename K, typename = EnableIfLookupKey<Key, Compare, K> >
+    const_iterator upper_bound(const K& key) const;
+    template<typename K, typename = EnableIfLookupKey<Key, Compare, K> >
+    std::pair<iterator, iterator> equal_range(const K& key);
+    template<typename K, typename = EnableIfLookupKey<Key, Compare, K> >
+    std::pair<const_iterator, const_iterator> equal_range(const K& key) const;
+    template<typename Function>
+    void range_scan(const Key& lo, const Key& hi, Function fn) const;
     Value& operator[](const Key& key);
     Value const & operator[](const Key& key) const;
+    template<typename K, typename = EnableIfLookupKey<Key, Compare, K> >
+    Value& operator[](const K& key);
+    template<typename K, typename = EnableIfLookupKey<Key, Compare, K> >
+    Value const & operator[](const K& key) const;
+
+    // Order statistics, all O(height) using the subtree sizes kept in
+    // every node, so they only compile when Sizes is SubtreeSizes. select
+    // is 0-based and returns end() when k >= size().
+    std::size_t rank(const Key& key) const;
+    iterator select(std::size_t k);
+    const_iterator select(std::size_t k) const;
+    std::size_t count_range(const Key& lo, const Key& hi) const;
 
 protected:
-    Node<Key, Value>* internalFind(const Key& k) const; // TODO
-    Node<Key, Value> *getSmallestNode() const;  // TODO
-    static Node<Key, Value>* predecessor(Node<Key, Value>* current); // TODO
-    static Node<Key, Value>* successor(Node<Key, Value>* current);
-    
-    virtual void printRoot (Node<Key, Value> *r) const;
-    virtual void nodeSwap( Node<Key,Value>* n1, Node<Key,Value>* n2) ;
-
+    template<typename K>
+    Node<Key, Value, Sizes>* internalFind(const K& key) const;
+    template<typename K>
+    Node<Key, Value, Sizes>* internalLowerBound(const K& key) const;
+    template<typename K>
+    Node<Key, Value, Sizes>* internalUpperBound(const K& key) const;
+    template<typename K>
+    std::pair<Node<Key, Value, Sizes>*, Node<Key, Value, Sizes>*> internalEqualRange(const K& key) const;
+    template<typename A, typename B>
+    bool keyLess(const A& a, const B& b) const;
+    template<typename A, typename B>
+    int keyCompare(const A& a, const B& b) const;
+    Node<Key, Value, Sizes>* findInsertPos(const Key& key, Node<Key, Value, Sizes>*& parent, bool& isLeft) const;
+    Node<Key, Value, Sizes>* findHintedPos(Node<Key, Value, Sizes>* next, const Key& key,
+                                    Node<Key, Value, Sizes>*& parent, bool& isLeft,
+                                    bool& beforeNext) const;
+    void linkNode(Node<Key, Value, Sizes>* node, Node<Key, Value, Sizes>* parent, bool isLeft);
+    static void updateSizes(Node<Key, Value, Sizes>* node);
+    void discardNode(Node<Key, Value, Sizes>* node);
+    int measureHeight(bool checkBalance) const;
+    void resetLargest();
+    void setRoot(Node<Key, Value, Sizes>* root);
+    static std::size_t countNodes(Node<Key, Value, Sizes>* root, SubtreeSizes);
+    static std::size_t countNodes(Node<Key, Value, Sizes>* root, NoSubtreeSizes);
+    Node<Key, Value, Sizes> *getSmallestNode() const;  // TODO
+    Node<Key, Value, Sizes> *getLargestNode() const;
+    Node<Key, Value, Sizes>* internalSelect(std::size_t k) const;
+    static Node<Key, Value, Sizes>* predecessor(Node<Key, Value, Sizes>* current); // TODO
+    static Node<Key, Value, Sizes>* successor(Node<Key, Value, Sizes>* current);
     
+    virtual void printRoot (Node<Key, Value, Sizes> *r) const;
+    virtual void nodeSwap( Node<Key, Value, Sizes>* n1, Node<Key, Value, Sizes>* n2) ;
+
+    // Node storage. The pool block size and the destructor used for nodes
+    // are fixed by the NodePolicy given to the constructor. Derived trees
+    // override createNode to build their own node type (constructNode does
+    // the pool work) and insertFixup to rebalance after a new node is linked.
+    virtual Node<Key, Value, Sizes>* createNode(const Key& key, const Value& value);
+    virtual Node<Key, Value, Sizes>* createNode(ItemBuilder<Key, Value>& builder);
+    virtual void insertFixup(Node<Key, Value, Sizes>* node);
+    virtual void removeNode(Node<Key, Value, Sizes>* node);
+    template<typename NodeType, typename... Args>
+    NodeType* constructNode(Args&&... args);
+    void destroyNode(Node<Key, Value, Sizes>* node);
+
+    std::pair<iterator, bool> insertNode(const Key& key, const Value& value, bool assign,
+                                         const const_iterator* hint = nullptr);
+    template<typename... Args>
+    std::pair<iterator, bool> emplaceNode(bool assign, const const_iterator* hint,
+                                          Args&&... args);
+    template<typename P>
+    std::pair<iterator, bool> insertPair(const const_iterator* hint, P&& keyValuePair, std::true_type);
+    template<typename P>
+    std::pair<iterator, bool> insertPair(const const_iterator* hint, P&& keyValuePair, std::false_type);
+    template<typename... Args>
+    Node<Key, Value, Sizes>* buildNode(Args&&... args);
+
+    template<typename NodeType>
+    static void destroyAs(Node<Key, Value, Sizes>* node);
 
 
 protected:
-    Node<Key, Value>* root_;
+    Node<Key, Value, Sizes>* root_;
+    Node<Key, Value, Sizes>* largest_;
+    NodePool pool_;
+    void (*destroyFn_)(Node<Key, Value, Sizes>*);
+    Compare comp_;
+    // Number of keys, or UNKNOWN_COUNT until size() next counts them.
+    // Atomic only so that concurrent size() calls on a const tree can
+    // publish the count they work out; every access is relaxed, so insert
+    // and remove pay for no locked instruction.
+    mutable std::atomic<std::size_t> count_;
+    static const std::size_t UNKNOWN_COUNT = static_cast<std::size_t>(-1);
+    // The node the last hinted insert linked and the hint it went in
+    // front of (see findHintedPos). Any other insert or remove clears
+    // hintPrev_.
+    Node<Key, Value, Sizes>* hintNext_;
+    Node<Key, Value, Sizes>* hintPrev_;
     
 };
 
@@ -220,41 +883,43 @@ protected:
 Begin implementations for the BinarySearchTree::iterator class.
 ---------------------------------------------------------------
 */
-template<class Key, class Value>
-BinarySearchTree<Key, Value>::iterator::iterator(Node<Key,Value> *ptr)
+template<class Key, class Value, class Compare, class Sizes>
+BinarySearchTree<Key, Value, Compare, Sizes>::iterator::iterator(Node<Key, Value, Sizes> *ptr, const BinarySearchTree<Key, Value, Compare, Sizes>* tree)
 {
     this->current_ = ptr;
+    this->tree_ = tree;
 }
 
 
-template<class Key, class Value>
-BinarySearchTree<Key, Value>::iterator::iterator() 
+template<class Key, class Value, class Compare, class Sizes>
+BinarySearchTree<Key, Value, Compare, Sizes>::iterator::iterator() 
 {
     this->current_ = nullptr;
+    this->tree_ = nullptr;
 
 }
 
 
-template<class Key, class Value>
+template<class Key, class Value, class Compare, class Sizes>
 std::pair<const Key,Value> &
-BinarySearchTree<Key, Value>::iterator::operator*() const
+BinarySearchTree<Key, Value, Compare, Sizes>::iterator::operator*() const
 {
     return current_->getItem();
 }
 
 
-template<class Key, class Value>
+template<class Key, class Value, class Compare, class Sizes>
 std::pair<const Key,Value> *
-BinarySearchTree<Key, Value>::iterator::operator->() const
+BinarySearchTree<Key, Value, Compare, Sizes>::iterator::operator->() const
 {
     return &(current_->getItem());
 }
 
 
-template<class Key, class Value>
+template<class Key, class Value, class Compare, class Sizes>
 bool
-BinarySearchTree<Key, Value>::iterator::operator==(
-    const BinarySearchTree<Key, Value>::iterator& rhs) const
+BinarySearchTree<Key, Value, Compare, Sizes>::iterator::operator==(
+    const BinarySearchTree<Key, Value, Compare, Sizes>::iterator& rhs) const
 {
     if (this->current_ == rhs.current_) {
         return true;
@@ -263,10 +928,10 @@ BinarySearchTree<Key, Value>::iterator::operator==(
 }
 
 
-template<class Key, class Value>
+template<class Key, class Value, class Compare, class Sizes>
 bool
-BinarySearchTree<Key, Value>::iterator::operator!=(
-    const BinarySearchTree<Key, Value>::iterator& rhs) const
+BinarySearchTree<Key, Value, Compare, Sizes>::iterator::operator!=(
+    const BinarySearchTree<Key, Value, Compare, Sizes>::iterator& rhs) const
 {
     if (this->current_ == rhs.current_) {
         return false;
@@ -276,148 +941,899 @@ BinarySearchTree<Key, Value>::iterator::operator!=(
 
 
 
-template<class Key, class Value>
-typename BinarySearchTree<Key, Value>::iterator&
-BinarySearchTree<Key, Value>::iterator::operator++()
+template<class Key, class Value, class Compare, class Sizes>
+typename BinarySearchTree<Key, Value, Compare, Sizes>::iterator&
+BinarySearchTree<Key, Value, Compare, Sizes>::iterator::operator++()
 {
-    this->current_ = BinarySearchTree<Key, Value>::successor(current_);
+    this->current_ = BinarySearchTree<Key, Value, Compare, Sizes>::successor(current_);
     
     return *this;
 }
 
-
-/*
--------------------------------------------------------------
-End implementations for the BinarySearchTree::iterator class.
--------------------------------------------------------------
+
+template<class Key, class Value, class Compare, class Sizes>
+typename BinarySearchTree<Key, Value, Compare, Sizes>::iterator
+BinarySearchTree<Key, Value, Compare, Sizes>::iterator::operator++(int)
+{
+    iterator old = *this;
+    ++(*this);
+    return old;
+}
+
+
+/**
+* Stepping back from end() lands on the largest node in O(1).
+*/
+template<class Key, class Value, class Compare, class Sizes>
+typename BinarySearchTree<Key, Value, Compare, Sizes>::iterator&
+BinarySearchTree<Key, Value, Compare, Sizes>::iterator::operator--()
+{
+    if (this->current_ == nullptr) {
+        this->current_ = tree_->getLargestNode();
+    }
+    else {
+        this->current_ = BinarySearchTree<Key, Value, Compare, Sizes>::predecessor(current_);
+    }
+
+    return *this;
+}
+
+
+template<class Key, class Value, class Compare, class Sizes>
+typename BinarySearchTree<Key, Value, Compare, Sizes>::iterator
+BinarySearchTree<Key, Value, Compare, Sizes>::iterator::operator--(int)
+{
+    iterator old = *this;
+    --(*this);
+    return old;
+}
+
+
+/*
+-------------------------------------------------------------
+End implementations for the BinarySearchTree::iterator class.
+-------------------------------------------------------------
+*/
+
+/*
+--------------------------------------------------------------------
+Begin implementations for the BinarySearchTree::const_iterator class.
+--------------------------------------------------------------------
+*/
+template<class Key, class Value, class Compare, class Sizes>
+BinarySearchTree<Key, Value, Compare, Sizes>::const_iterator::const_iterator(Node<Key, Value, Sizes> *ptr, const BinarySearchTree<Key, Value, Compare, Sizes>* tree)
+{
+    this->current_ = ptr;
+    this->tree_ = tree;
+}
+
+
+template<class Key, class Value, class Compare, class Sizes>
+BinarySearchTree<Key, Value, Compare, Sizes>::const_iterator::const_iterator()
+{
+    this->current_ = nullptr;
+    this->tree_ = nullptr;
+}
+
+
+template<class Key, class Value, class Compare, class Sizes>
+BinarySearchTree<Key, Value, Compare, Sizes>::const_iterator::const_iterator(const iterator& it)
+{
+    this->current_ = it.current_;
+    this->tree_ = it.tree_;
+}
+
+
+template<class Key, class Value, class Compare, class Sizes>
+const std::pair<const Key,Value> &
+BinarySearchTree<Key, Value, Compare, Sizes>::const_iterator::operator*() const
+{
+    return current_->getItem();
+}
+
+
+template<class Key, class Value, class Compare, class Sizes>
+const std::pair<const Key,Value> *
+BinarySearchTree<Key, Value, Compare, Sizes>::const_iterator::operator->() const
+{
+    return &(current_->getItem());
+}
+
+
+template<class Key, class Value, class Compare, class Sizes>
+typename BinarySearchTree<Key, Value, Compare, Sizes>::const_iterator&
+BinarySearchTree<Key, Value, Compare, Sizes>::const_iterator::operator++()
+{
+    this->current_ = BinarySearchTree<Key, Value, Compare, Sizes>::successor(current_);
+    return *this;
+}
+
+
+template<class Key, class Value, class Compare, class Sizes>
+typename BinarySearchTree<Key, Value, Compare, Sizes>::const_iterator
+BinarySearchTree<Key, Value, Compare, Sizes>::const_iterator::operator++(int)
+{
+    const_iterator old = *this;
+    ++(*this);
+    return old;
+}
+
+
+template<class Key, class Value, class Compare, class Sizes>
+typename BinarySearchTree<Key, Value, Compare, Sizes>::const_iterator&
+BinarySearchTree<Key, Value, Compare, Sizes>::const_iterator::operator--()
+{
+    if (this->current_ == nullptr) {
+        this->current_ = tree_->getLargestNode();
+    }
+    else {
+        this->current_ = BinarySearchTree<Key, Value, Compare, Sizes>::predecessor(current_);
+    }
+    return *this;
+}
+
+
+template<class Key, class Value, class Compare, class Sizes>
+typename BinarySearchTree<Key, Value, Compare, Sizes>::const_iterator
+BinarySearchTree<Key, Value, Compare, Sizes>::const_iterator::operator--(int)
+{
+    const_iterator old = *this;
+    --(*this);
+    return old;
+}
+
+/*
+------------------------------------------------------------------
+End implementations for the BinarySearchTree::const_iterator class.
+------------------------------------------------------------------
+*/
+
+/*
+-----------------------------------------------------
+Begin implementations for the BinarySearchTree class.
+-----------------------------------------------------
+*/
+template<class Key, class Value, class Compare, class Sizes>
+BinarySearchTree<Key, Value, Compare, Sizes>::BinarySearchTree() :
+    root_(nullptr),
+    largest_(nullptr),
+    pool_(sizeof(Node<Key, Value, Sizes>)),
+    destroyFn_(&BinarySearchTree<Key, Value, Compare, Sizes>::template destroyAs<Node<Key, Value, Sizes> >),
+    comp_(),
+    count_(0),
+    hintNext_(nullptr),
+    hintPrev_(nullptr)
+{
+
+}
+
+template<class Key, class Value, class Compare, class Sizes>
+BinarySearchTree<Key, Value, Compare, Sizes>::BinarySearchTree(const Compare& comp) :
+    root_(nullptr),
+    largest_(nullptr),
+    pool_(sizeof(Node<Key, Value, Sizes>)),
+    destroyFn_(&BinarySearchTree<Key, Value, Compare, Sizes>::template destroyAs<Node<Key, Value, Sizes> >),
+    comp_(comp),
+    count_(0),
+    hintNext_(nullptr),
+    hintPrev_(nullptr)
+{
+
+}
+
+/**
+* Used by derived trees that store their own node type.
+*/
+template<class Key, class Value, class Compare, class Sizes>
+template<typename NodeType>
+BinarySearchTree<Key, Value, Compare, Sizes>::BinarySearchTree(NodePolicy<NodeType>, const Compare& comp) :
+    root_(nullptr),
+    largest_(nullptr),
+    pool_(sizeof(NodeType)),
+    destroyFn_(&BinarySearchTree<Key, Value, Compare, Sizes>::template destroyAs<NodeType>),
+    comp_(comp),
+    count_(0),
+    hintNext_(nullptr),
+    hintPrev_(nullptr)
+{
+
+}
+
+template<typename Key, typename Value, typename Compare, typename Sizes>
+BinarySearchTree<Key, Value, Compare, Sizes>::~BinarySearchTree()
+{
+    this->clear();
+}
+template<class Key, class Value, class Compare, class Sizes>
+bool BinarySearchTree<Key, Value, Compare, Sizes>::empty() const
+{
+    return this->root_ == nullptr;
+}
+
+/**
+* O(1) from the count kept by insert and remove. After an operation that
+* moves whole subtrees (the AVL split and set operations) the count is
+* only known with SubtreeSizes; otherwise insert and remove leave it
+* unknown and the first size() call counts the nodes once.
+*/
+template<class Key, class Value, class Compare, class Sizes>
+std::size_t BinarySearchTree<Key, Value, Compare, Sizes>::size() const
+{
+    std::size_t count = count_.load(std::memory_order_relaxed);
+    if (count == UNKNOWN_COUNT) {
+        count = countNodes(this->root_, Sizes());
+        count_.store(count, std::memory_order_relaxed);
+    }
+    return count;
+}
+
+/**
+* Installs root as the whole tree. The count is taken from the root's
+* subtree size when nodes keep one, and left for size() to work out
+* otherwise.
+*/
+template<class Key, class Value, class Compare, class Sizes>
+void BinarySearchTree<Key, Value, Compare, Sizes>::setRoot(Node<Key, Value, Sizes>* root)
+{
+    this->root_ = root;
+    if (root) root->setParent(nullptr);
+    count_.store(Sizes::enabled ? countNodes(root, Sizes()) : UNKNOWN_COUNT,
+                 std::memory_order_relaxed);
+    hintPrev_ = nullptr;
+    this->resetLargest();
+}
+
+template<class Key, class Value, class Compare, class Sizes>
+std::size_t BinarySearchTree<Key, Value, Compare, Sizes>::countNodes(Node<Key, Value, Sizes>* root, SubtreeSizes)
+{
+    return Node<Key, Value, Sizes>::sizeOf(root);
+}
+
+template<class Key, class Value, class Compare, class Sizes>
+std::size_t BinarySearchTree<Key, Value, Compare, Sizes>::countNodes(Node<Key, Value, Sizes>* root, NoSubtreeSizes)
+{
+    Node<Key, Value, Sizes>* node = root;
+    while (node != nullptr && node->getLeft() != nullptr) {
+        node = node->getLeft();
+    }
+
+    std::size_t count = 0;
+    for (; node != nullptr; node = successor(node)) {
+        ++count;
+    }
+    return count;
+}
+
+template<class Key, class Value, class Compare, class Sizes>
+Compare BinarySearchTree<Key, Value, Compare, Sizes>::key_comp() const
+{
+    return comp_;
+}
+
+/**
+* The tree's ordering of a and b; see KeyOrder.
+*/
+template<class Key, class Value, class Compare, class Sizes>
+template<typename A, typename B>
+inline bool BinarySearchTree<Key, Value, Compare, Sizes>::keyLess(const A& a, const B& b) const
+{
+    return KeyOrder<Key, Compare>::less(comp_, a, b);
+}
+
+template<class Key, class Value, class Compare, class Sizes>
+template<typename A, typename B>
+inline int BinarySearchTree<Key, Value, Compare, Sizes>::keyCompare(const A& a, const B& b) const
+{
+    return KeyOrder<Key, Compare>::compare(comp_, a, b);
+}
+
+template<typename Key, typename Value, typename Compare, typename Sizes>
+void BinarySearchTree<Key, Value, Compare, Sizes>::print() const
+{
+    printRoot(root_);
+    std::cout << "\n";
+}
+
+template<class Key, class Value, class Compare, class Sizes>
+typename BinarySearchTree<Key, Value, Compare, Sizes>::iterator
+BinarySearchTree<Key, Value, Compare, Sizes>::begin()
+{
+    BinarySearchTree<Key, Value, Compare, Sizes>::iterator begin(getSmallestNode(), this);
+    return begin;
+}
+
+template<class Key, class Value, class Compare, class Sizes>
+typename BinarySearchTree<Key, Value, Compare, Sizes>::const_iterator
+BinarySearchTree<Key, Value, Compare, Sizes>::begin() const
+{
+    return const_iterator(getSmallestNode(), this);
+}
+
+template<class Key, class Value, class Compare, class Sizes>
+typename BinarySearchTree<Key, Value, Compare, Sizes>::const_iterator
+BinarySearchTree<Key, Value, Compare, Sizes>::cbegin() const
+{
+    return begin();
+}
+
+
+template<class Key, class Value, class Compare, class Sizes>
+typename BinarySearchTree<Key, Value, Compare, Sizes>::iterator
+BinarySearchTree<Key, Value, Compare, Sizes>::end()
+{
+    BinarySearchTree<Key, Value, Compare, Sizes>::iterator end(NULL, this);
+    return end;
+}
+
+template<class Key, class Value, class Compare, class Sizes>
+typename BinarySearchTree<Key, Value, Compare, Sizes>::const_iterator
+BinarySearchTree<Key, Value, Compare, Sizes>::end() const
+{
+    return const_iterator(NULL, this);
+}
+
+template<class Key, class Value, class Compare, class Sizes>
+typename BinarySearchTree<Key, Value, Compare, Sizes>::const_iterator
+BinarySearchTree<Key, Value, Compare, Sizes>::cend() const
+{
+    return end();
+}
+
+
+template<class Key, class Value, class Compare, class Sizes>
+typename BinarySearchTree<Key, Value, Compare, Sizes>::reverse_iterator
+BinarySearchTree<Key, Value, Compare, Sizes>::rbegin()
+{
+    return reverse_iterator(end());
+}
+
+template<class Key, class Value, class Compare, class Sizes>
+typename BinarySearchTree<Key, Value, Compare, Sizes>::const_reverse_iterator
+BinarySearchTree<Key, Value, Compare, Sizes>::rbegin() const
+{
+    return const_reverse_iterator(end());
+}
+
+template<class Key, class Value, class Compare, class Sizes>
+typename BinarySearchTree<Key, Value, Compare, Sizes>::const_reverse_iterator
+BinarySearchTree<Key, Value, Compare, Sizes>::crbegin() const
+{
+    return rbegin();
+}
+
+template<class Key, class Value, class Compare, class Sizes>
+typename BinarySearchTree<Key, Value, Compare, Sizes>::reverse_iterator
+BinarySearchTree<Key, Value, Compare, Sizes>::rend()
+{
+    return reverse_iterator(begin());
+}
+
+template<class Key, class Value, class Compare, class Sizes>
+typename BinarySearchTree<Key, Value, Compare, Sizes>::const_reverse_iterator
+BinarySearchTree<Key, Value, Compare, Sizes>::rend() const
+{
+    return const_reverse_iterator(begin());
+}
+
+template<class Key, class Value, class Compare, class Sizes>
+typename BinarySearchTree<Key, Value, Compare, Sizes>::const_reverse_iterator
+BinarySearchTree<Key, Value, Compare, Sizes>::crend() const
+{
+    return rend();
+}
+
+
+template<class Key, class Value, class Compare, class Sizes>
+typename BinarySearchTree<Key, Value, Compare, Sizes>::iterator
+BinarySearchTree<Key, Value, Compare, Sizes>::find(const Key & k)
+{
+    Node<Key, Value, Sizes> *curr = internalFind(k);
+    BinarySearchTree<Key, Value, Compare, Sizes>::iterator it(curr, this);
+    return it;
+}
+
+template<class Key, class Value, class Compare, class Sizes>
+typename BinarySearchTree<Key, Value, Compare, Sizes>::const_iterator
+BinarySearchTree<Key, Value, Compare, Sizes>::find(const Key & k) const
+{
+    return const_iterator(internalFind(k), this);
+}
+
+
+/**
+* Returns an iterator to the first key not less than key, or end().
+*/
+template<class Key, class Value, class Compare, class Sizes>
+typename BinarySearchTree<Key, Value, Compare, Sizes>::iterator
+BinarySearchTree<Key, Value, Compare, Sizes>::lower_bound(const Key& key)
+{
+    return iterator(internalLowerBound(key), this);
+}
+
+template<class Key, class Value, class Compare, class Sizes>
+typename BinarySearchTree<Key, Value, Compare, Sizes>::const_iterator
+BinarySearchTree<Key, Value, Compare, Sizes>::lower_bound(const Key& key) const
+{
+    return const_iterator(internalLowerBound(key), this);
+}
+
+/**
+* Returns an iterator to the first key greater than key, or end().
+*/
+template<class Key, class Value, class Compare, class Sizes>
+typename BinarySearchTree<Key, Value, Compare, Sizes>::iterator
+BinarySearchTree<Key, Value, Compare, Sizes>::upper_bound(const Key& key)
+{
+    return iterator(internalUpperBound(key), this);
+}
+
+template<class Key, class Value, class Compare, class Sizes>
+typename BinarySearchTree<Key, Value, Compare, Sizes>::const_iterator
+BinarySearchTree<Key, Value, Compare, Sizes>::upper_bound(const Key& key) const
+{
+    return const_iterator(internalUpperBound(key), this);
+}
+
+/**
+* Keys are unique, so the range holds at most one element.
+*/
+template<class Key, class Value, class Compare, class Sizes>
+std::pair<typename BinarySearchTree<Key, Value, Compare, Sizes>::iterator, typename BinarySearchTree<Key, Value, Compare, Sizes>::iterator>
+BinarySearchTree<Key, Value, Compare, Sizes>::equal_range(const Key& key)
+{
+    std::pair<Node<Key, Value, Sizes>*, Node<Key, Value, Sizes>*> range = internalEqualRange(key);
+    return std::make_pair(iterator(range.first, this), iterator(range.second, this));
+}
+
+template<class Key, class Value, class Compare, class Sizes>
+std::pair<typename BinarySearchTree<Key, Value, Compare, Sizes>::const_iterator, typename BinarySearchTree<Key, Value, Compare, Sizes>::const_iterator>
+BinarySearchTree<Key, Value, Compare, Sizes>::equal_range(const Key& key) const
+{
+    std::pair<Node<Key, Value, Sizes>*, Node<Key, Value, Sizes>*> range = internalEqualRange(key);
+    return std::make_pair(const_iterator(range.first, this), const_iterator(range.second, this));
+}
+
+/**
+* Calls fn on every key/value pair with lo <= key < hi, in order. One
+* descent finds the first pair and the scan stops at the first key not
+* below hi, so the cost is O(height + number of pairs visited).
+*/
+template<class Key, class Value, class Compare, class Sizes>
+template<typename Function>
+void BinarySearchTree<Key, Value, Compare, Sizes>::range_scan(const Key& lo, const Key& hi, Function fn) const
+{
+    Node<Key, Value, Sizes>* node = internalLowerBound(lo);
+
+    while (node != nullptr && keyLess(node->getKey(), hi)) {
+        fn(node->getItem());
+        node = successor(node);
+    }
+}
+
+
+template<class Key, class Value, class Compare, class Sizes>
+Value& BinarySearchTree<Key, Value, Compare, Sizes>::operator[](const Key& key)
+{
+    Node<Key, Value, Sizes> *curr = internalFind(key);
+    if(curr == NULL) throw std::out_of_range("Invalid key");
+    return curr->getValue();
+}
+template<class Key, class Value, class Compare, class Sizes>
+Value const & BinarySearchTree<Key, Value, Compare, Sizes>::operator[](const Key& key) const
+{
+    Node<Key, Value, Sizes> *curr = internalFind(key);
+    if(curr == NULL) throw std::out_of_range("Invalid key");
+    return curr->getValue();
+}
+
+/**
+* The heterogeneous overloads below search for key without converting it
+* to a Key, comparing it with the stored keys directly.
+*/
+template<class Key, class Value, class Compare, class Sizes>
+template<typename K, typename>
+typename BinarySearchTree<Key, Value, Compare, Sizes>::iterator
+BinarySearchTree<Key, Value, Compare, Sizes>::find(const K& key)
+{
+    return iterator(internalFind(key), this);
+}
+
+template<class Key, class Value, class Compare, class Sizes>
+template<typename K, typename>
+typename BinarySearchTree<Key, Value, Compare, Sizes>::const_iterator
+BinarySearchTree<Key, Value, Compare, Sizes>::find(const K& key) const
+{
+    return const_iterator(internalFind(key), this);
+}
+
+template<class Key, class Value, class Compare, class Sizes>
+template<typename K, typename>
+typename BinarySearchTree<Key, Value, Compare, Sizes>::iterator
+BinarySearchTree<Key, Value, Compare, Sizes>::lower_bound(const K& key)
+{
+    return iterator(internalLowerBound(key), this);
+}
+
+template<class Key, class Value, class Compare, class Sizes>
+template<typename K, typename>
+typename BinarySearchTree<Key, Value, Compare, Sizes>::const_iterator
+BinarySearchTree<Key, Value, Compare, Sizes>::lower_bound(const K& key) const
+{
+    return const_iterator(internalLowerBound(key), this);
+}
+
+template<class Key, class Value, class Compare, class Sizes>
+template<typename K, typename>
+typename BinarySearchTree<Key, Value, Compare, Sizes>::iterator
+BinarySearchTree<Key, Value, Compare, Sizes>::upper_bound(const K& key)
+{
+    return iterator(internalUpperBound(key), this);
+}
+
+template<class Key, class Value, class Compare, class Sizes>
+template<typename K, typename>
+typename BinarySearchTree<Key, Value, Compare, Sizes>::const_iterator
+BinarySearchTree<Key, Value, Compare, Sizes>::upper_bound(const K& key) const
+{
+    return const_iterator(internalUpperBound(key), this);
+}
+
+template<class Key, class Value, class Compare, class Sizes>
+template<typename K, typename>
+std::pair<typename BinarySearchTree<Key, Value, Compare, Sizes>::iterator, typename BinarySearchTree<Key, Value, Compare, Sizes>::iterator>
+BinarySearchTree<Key, Value, Compare, Sizes>::equal_range(const K& key)
+{
+    std::pair<Node<Key, Value, Sizes>*, Node<Key, Value, Sizes>*> range = internalEqualRange(key);
+    return std::make_pair(iterator(range.first, this), iterator(range.second, this));
+}
+
+template<class Key, class Value, class Compare, class Sizes>
+template<typename K, typename>
+std::pair<typename BinarySearchTree<Key, Value, Compare, Sizes>::const_iterator, typename BinarySearchTree<Key, Value, Compare, Sizes>::const_iterator>
+BinarySearchTree<Key, Value, Compare, Sizes>::equal_range(const K& key) const
+{
+    std::pair<Node<Key, Value, Sizes>*, Node<Key, Value, Sizes>*> range = internalEqualRange(key);
+    return std::make_pair(const_iterator(range.first, this), const_iterator(range.second, this));
+}
+
+template<class Key, class Value, class Compare, class Sizes>
+template<typename K, typename>
+Value& BinarySearchTree<Key, Value, Compare, Sizes>::operator[](const K& key)
+{
+    Node<Key, Value, Sizes> *curr = internalFind(key);
+    if(curr == NULL) throw std::out_of_range("Invalid key");
+    return curr->getValue();
+}
+
+template<class Key, class Value, class Compare, class Sizes>
+template<typename K, typename>
+Value const & BinarySearchTree<Key, Value, Compare, Sizes>::operator[](const K& key) const
+{
+    Node<Key, Value, Sizes> *curr = internalFind(key);
+    if(curr == NULL) throw std::out_of_range("Invalid key");
+    return curr->getValue();
+}
+
+/**
+* Returns the number of keys in the tree that are less than key.
+*/
+template<class Key, class Value, class Compare, class Sizes>
+std::size_t BinarySearchTree<Key, Value, Compare, Sizes>::rank(const Key& key) const
+{
+    static_assert(Sizes::enabled, "rank and count_range need a tree with SubtreeSizes");
+    std::size_t result = 0;
+    Node<Key, Value, Sizes>* node = this->root_;
+
+    while (node != nullptr) {
+        if (keyLess(node->getKey(), key)) {
+            result += Node<Key, Value, Sizes>::sizeOf(node->getLeft()) + 1;
+            node = node->getRight();
+        }
+        else {
+            node = node->getLeft();
+        }
+    }
+
+    return result;
+}
+
+/**
+* Returns an iterator to the k-th smallest key (counting from 0).
+*/
+template<class Key, class Value, class Compare, class Sizes>
+typename BinarySearchTree<Key, Value, Compare, Sizes>::iterator
+BinarySearchTree<Key, Value, Compare, Sizes>::select(std::size_t k)
+{
+    return iterator(internalSelect(k), this);
+}
+
+template<class Key, class Value, class Compare, class Sizes>
+typename BinarySearchTree<Key, Value, Compare, Sizes>::const_iterator
+BinarySearchTree<Key, Value, Compare, Sizes>::select(std::size_t k) const
+{
+    return const_iterator(internalSelect(k), this);
+}
+
+/**
+* Returns the number of keys in [lo, hi).
+*/
+template<class Key, class Value, class Compare, class Sizes>
+std::size_t BinarySearchTree<Key, Value, Compare, Sizes>::count_range(const Key& lo, const Key& hi) const
+{
+    if (!keyLess(lo, hi)) return 0;
+    return rank(hi) - rank(lo);
+}
+
+
+/**
+* Inserts the pair, or overwrites the value if the key is already present.
+* Returns an iterator to the key's node and whether a new node was created.
+*/
+template<class Key, class Value, class Compare, class Sizes>
+std::pair<typename BinarySearchTree<Key, Value, Compare, Sizes>::iterator, bool>
+BinarySearchTree<Key, Value, Compare, Sizes>::insert(const std::pair<const Key, Value> &keyValuePair) {
+    return insertNode(keyValuePair.first, keyValuePair.second, true);
+}
+
+/**
+* Same as above for anything a std::pair<const Key, Value> can be built
+* from. The node's pair is built straight from keyValuePair, so an rvalue
+* pair has its key and value moved into the node once. A pair whose key
+* is already a Key is looked up first, as try_emplace does, so inserting
+* a key that is present builds no node and only assigns the value.
+*/
+template<class Key, class Value, class Compare, class Sizes>
+template<typename P, typename>
+std::pair<typename BinarySearchTree<Key, Value, Compare, Sizes>::iterator, bool>
+BinarySearchTree<Key, Value, Compare, Sizes>::insert(P&& keyValuePair) {
+    return insertPair(nullptr, std::forward<P>(keyValuePair), IsKeyedPair<Key, Value, P>());
+}
+
+/**
+* Builds the pair from args and inserts it. Unlike insert, an existing
+* key keeps its value (as with std::map::emplace).
 */
+template<class Key, class Value, class Compare, class Sizes>
+template<typename... Args>
+std::pair<typename BinarySearchTree<Key, Value, Compare, Sizes>::iterator, bool>
+BinarySearchTree<Key, Value, Compare, Sizes>::emplace(Args&&... args) {
+    return emplaceNode(false, nullptr, std::forward<Args>(args)...);
+}
 
-/*
------------------------------------------------------
-Begin implementations for the BinarySearchTree class.
------------------------------------------------------
+/**
+* Constructs the value from args only if key is not already present. The
+* key is searched for first, so nothing is built when it is; otherwise
+* the pair is built piecewise inside the new node.
 */
-template<class Key, class Value>
-BinarySearchTree<Key, Value>::BinarySearchTree() : root_(nullptr)
-{
+template<class Key, class Value, class Compare, class Sizes>
+template<typename... Args>
+std::pair<typename BinarySearchTree<Key, Value, Compare, Sizes>::iterator, bool>
+BinarySearchTree<Key, Value, Compare, Sizes>::try_emplace(const Key& key, Args&&... args) {
+    Node<Key, Value, Sizes>* parent;
+    bool isLeft;
+    Node<Key, Value, Sizes>* node = findInsertPos(key, parent, isLeft);
+    if (node) {
+        return std::make_pair(iterator(node, this), false);
+    }
 
+    node = buildNode(std::piecewise_construct, std::forward_as_tuple(key),
+                     std::forward_as_tuple(std::forward<Args>(args)...));
+    linkNode(node, parent, isLeft);
+    insertFixup(node);
+    return std::make_pair(iterator(node, this), true);
 }
 
-template<typename Key, typename Value>
-BinarySearchTree<Key, Value>::~BinarySearchTree()
-{
-    this->clear();
+template<class Key, class Value, class Compare, class Sizes>
+template<typename... Args>
+std::pair<typename BinarySearchTree<Key, Value, Compare, Sizes>::iterator, bool>
+BinarySearchTree<Key, Value, Compare, Sizes>::try_emplace(Key&& key, Args&&... args) {
+    Node<Key, Value, Sizes>* parent;
+    bool isLeft;
+    Node<Key, Value, Sizes>* node = findInsertPos(key, parent, isLeft);
+    if (node) {
+        return std::make_pair(iterator(node, this), false);
+    }
+
+    node = buildNode(std::piecewise_construct, std::forward_as_tuple(std::move(key)),
+                     std::forward_as_tuple(std::forward<Args>(args)...));
+    linkNode(node, parent, isLeft);
+    insertFixup(node);
+    return std::make_pair(iterator(node, this), true);
 }
-template<class Key, class Value>
-bool BinarySearchTree<Key, Value>::empty() const
-{
-    return this->root_ == nullptr;
+
+/**
+* Hinted insert: like insert, but if the key belongs just before hint it
+* is linked there without descending from the root. Returns an iterator
+* to the key's node.
+*/
+template<class Key, class Value, class Compare, class Sizes>
+typename BinarySearchTree<Key, Value, Compare, Sizes>::iterator
+BinarySearchTree<Key, Value, Compare, Sizes>::insert(const_iterator hint, const std::pair<const Key, Value>& keyValuePair) {
+    return insertNode(keyValuePair.first, keyValuePair.second, true, &hint).first;
 }
 
-template<typename Key, typename Value>
-void BinarySearchTree<Key, Value>::print() const
-{
-    printRoot(root_);
-    std::cout << "\n";
+template<class Key, class Value, class Compare, class Sizes>
+template<typename P, typename>
+typename BinarySearchTree<Key, Value, Compare, Sizes>::iterator
+BinarySearchTree<Key, Value, Compare, Sizes>::insert(const_iterator hint, P&& keyValuePair) {
+    return insertPair(&hint, std::forward<P>(keyValuePair), IsKeyedPair<Key, Value, P>()).first;
 }
 
-template<class Key, class Value>
-typename BinarySearchTree<Key, Value>::iterator
-BinarySearchTree<Key, Value>::begin() const
-{
-    BinarySearchTree<Key, Value>::iterator begin(getSmallestNode());
-    return begin;
+/**
+* emplace with a hint; an existing key keeps its value.
+*/
+template<class Key, class Value, class Compare, class Sizes>
+template<typename... Args>
+typename BinarySearchTree<Key, Value, Compare, Sizes>::iterator
+BinarySearchTree<Key, Value, Compare, Sizes>::emplace_hint(const_iterator hint, Args&&... args) {
+    return emplaceNode(false, &hint, std::forward<Args>(args)...).first;
 }
 
+/**
+* Shared by the insert overloads taking a const pair: one descent (or a
+* check of hint, when one is given), then either an update in place (when
+* assign is set) or a new node built by createNode.
+*/
+template<class Key, class Value, class Compare, class Sizes>
+std::pair<typename BinarySearchTree<Key, Value, Compare, Sizes>::iterator, bool>
+BinarySearchTree<Key, Value, Compare, Sizes>::insertNode(const Key& key, const Value& value, bool assign,
+                                                  const const_iterator* hint) {
+    Node<Key, Value, Sizes>* parent;
+    bool isLeft;
+    bool beforeHint = false;
+    Node<Key, Value, Sizes>* node = hint ? findHintedPos(hint->current_, key, parent, isLeft, beforeHint)
+                                  : findInsertPos(key, parent, isLeft);
+
+    if (node) {
+        if (assign) {
+            node->setValue(value);
+        }
+        return std::make_pair(iterator(node, this), false);
+    }
 
-template<class Key, class Value>
-typename BinarySearchTree<Key, Value>::iterator
-BinarySearchTree<Key, Value>::end() const
-{
-    BinarySearchTree<Key, Value>::iterator end(NULL);
-    return end;
+    node = createNode(key, value);
+    linkNode(node, parent, isLeft);
+    if (beforeHint) {
+        hintNext_ = hint->current_;
+        hintPrev_ = node;
+    }
+    insertFixup(node);
+    return std::make_pair(iterator(node, this), true);
 }
 
+/**
+* Shared by emplace and the insert overloads taking anything a pair can be
+* built from but whose key is not a Key yet: the node is built from args
+* first, since the key is only known once the pair exists, then looked up
+* by that key. A duplicate
+* either hands its value over (when assign is set) or is just dropped.
+*/
+template<class Key, class Value, class Compare, class Sizes>
+template<typename... Args>
+std::pair<typename BinarySearchTree<Key, Value, Compare, Sizes>::iterator, bool>
+BinarySearchTree<Key, Value, Compare, Sizes>::emplaceNode(bool assign, const const_iterator* hint,
+                                                   Args&&... args) {
+    Node<Key, Value, Sizes>* node = buildNode(std::forward<Args>(args)...);
+    Node<Key, Value, Sizes>* parent;
+    bool isLeft;
+    bool beforeHint = false;
+    Node<Key, Value, Sizes>* existing;
+    try {
+        existing = hint ? findHintedPos(hint->current_, node->getKey(), parent, isLeft, beforeHint)
+                        : findInsertPos(node->getKey(), parent, isLeft);
+        if (existing && assign) {
+            existing->setValue(std::move(node->getValue()));
+        }
+    }
+    catch (...) {
+        destroyNode(node);
+        throw;
+    }
+
+    if (existing) {
+        destroyNode(node);
+        return std::make_pair(iterator(existing, this), false);
+    }
 
-template<class Key, class Value>
-typename BinarySearchTree<Key, Value>::iterator
-BinarySearchTree<Key, Value>::find(const Key & k) const
-{
-    Node<Key, Value> *curr = internalFind(k);
-    BinarySearchTree<Key, Value>::iterator it(curr);
-    return it;
+    linkNode(node, parent, isLeft);
+    if (beforeHint) {
+        hintNext_ = hint->current_;
+        hintPrev_ = node;
+    }
+    insertFixup(node);
+    return std::make_pair(iterator(node, this), true);
 }
 
+/**
+* insert(P&&) for a pair whose key can be looked up as it is: the value is
+* assigned to an existing key's node, and a node is only built, straight
+* from keyValuePair, once the key is known to be new.
+*/
+template<class Key, class Value, class Compare, class Sizes>
+template<typename P>
+std::pair<typename BinarySearchTree<Key, Value, Compare, Sizes>::iterator, bool>
+BinarySearchTree<Key, Value, Compare, Sizes>::insertPair(const const_iterator* hint, P&& keyValuePair,
+                                                  std::true_type) {
+    Node<Key, Value, Sizes>* parent;
+    bool isLeft;
+    bool beforeHint = false;
+    const Key& key = keyValuePair.first;
+    Node<Key, Value, Sizes>* node = hint ? findHintedPos(hint->current_, key, parent, isLeft, beforeHint)
+                                  : findInsertPos(key, parent, isLeft);
+    if (node) {
+        node->getValue() = std::forward<P>(keyValuePair).second;
+        return std::make_pair(iterator(node, this), false);
+    }
 
-template<class Key, class Value>
-Value& BinarySearchTree<Key, Value>::operator[](const Key& key)
-{
-    Node<Key, Value> *curr = internalFind(key);
-    if(curr == NULL) throw std::out_of_range("Invalid key");
-    return curr->getValue();
+    node = buildNode(std::forward<P>(keyValuePair));
+    linkNode(node, parent, isLeft);
+    if (beforeHint) {
+        hintNext_ = hint->current_;
+        hintPrev_ = node;
+    }
+    insertFixup(node);
+    return std::make_pair(iterator(node, this), true);
 }
-template<class Key, class Value>
-Value const & BinarySearchTree<Key, Value>::operator[](const Key& key) const
-{
-    Node<Key, Value> *curr = internalFind(key);
-    if(curr == NULL) throw std::out_of_range("Invalid key");
-    return curr->getValue();
+
+/**
+* insert(P&&) for anything else a pair can be built from: the key is only
+* known once the node's pair has been built (see emplaceNode).
+*/
+template<class Key, class Value, class Compare, class Sizes>
+template<typename P>
+std::pair<typename BinarySearchTree<Key, Value, Compare, Sizes>::iterator, bool>
+BinarySearchTree<Key, Value, Compare, Sizes>::insertPair(const const_iterator* hint, P&& keyValuePair,
+                                                  std::false_type) {
+    return emplaceNode(true, hint, std::forward<P>(keyValuePair));
+}
+
+/**
+* Builds an unlinked node of the tree's node type whose pair is
+* constructed from args, with no temporary pair in between.
+*/
+template<class Key, class Value, class Compare, class Sizes>
+template<typename... Args>
+Node<Key, Value, Sizes>* BinarySearchTree<Key, Value, Compare, Sizes>::buildNode(Args&&... args) {
+    auto construct = [&](std::pair<const Key, Value>* item) {
+        new (item) std::pair<const Key, Value>(std::forward<Args>(args)...);
+    };
+    ItemBuilderFor<Key, Value, decltype(construct)> builder(construct);
+    return createNode(builder);
 }
 
 
-template<class Key, class Value>
-void BinarySearchTree<Key, Value>::insert(const std::pair<const Key, Value> &keyValuePair) {
-    if (this->empty()) { 
-        this->root_ = new Node<Key, Value>(keyValuePair.first, keyValuePair.second, nullptr);
-    }
-    else {
-        Node<Key, Value>* node = this->root_;
-        Node<Key, Value>* parent;
+template<typename Key, typename Value, typename Compare, typename Sizes>
+void BinarySearchTree<Key, Value, Compare, Sizes>::remove(const Key & key) {
+    Node<Key, Value, Sizes>* node = internalFind(key);
 
-        while (node) { 
-            parent = node;
-            if (node->getKey() > keyValuePair.first) {
-                node = node->getLeft();
-            }
-            else if (node->getKey() < keyValuePair.first) {
-                node = node->getRight();
-            }
-            else {
-                node->setValue(keyValuePair.second);
-                return;
-            }
-        }
-        if (parent->getKey() > keyValuePair.first) { //Right child
-            parent->setLeft(new Node<Key, Value>(keyValuePair.first, keyValuePair.second, parent));
-            parent->getLeft()->setParent(parent);
-            parent->getLeft()->setLeft(nullptr);
-            parent->getLeft()->setRight(nullptr);
-        }
-        else {
-            parent->setRight(new Node<Key, Value>(keyValuePair.first, keyValuePair.second, parent));
-            parent->getRight()->setParent(parent);
-            parent->getRight()->setLeft(nullptr);
-            parent->getRight()->setRight(nullptr);
-        }
+    if (node) {
+        removeNode(node);
     }
 }
 
+template<typename Key, typename Value, typename Compare, typename Sizes>
+template<typename K, typename>
+void BinarySearchTree<Key, Value, Compare, Sizes>::remove(const K& key) {
+    Node<Key, Value, Sizes>* node = internalFind(key);
 
-template<typename Key, typename Value>
-void BinarySearchTree<Key, Value>::remove(const Key & key) {
-    Node<Key, Value>* node = internalFind(key);
-
-    if (!node) {
-        return;
+    if (node) {
+        removeNode(node);
     }
+}
 
+/**
+* Unlinks and destroys a node of this tree. Derived trees override this
+* to rebalance afterwards.
+*/
+template<typename Key, typename Value, typename Compare, typename Sizes>
+void BinarySearchTree<Key, Value, Compare, Sizes>::removeNode(Node<Key, Value, Sizes>* node) {
     if (node->getLeft() != nullptr && node->getRight() != nullptr ) { //If node has two children
         nodeSwap(node, predecessor(node));
     }
 
     if (node->getLeft() != nullptr && node->getRight() == nullptr ) { //Only Left child
         if (node->getParent()) {
-            Node<Key, Value>* parent = node->getParent();
+            Node<Key, Value, Sizes>* parent = node->getParent();
             if (node->getParent()->getLeft() != node) {
                 node->getParent()->setRight(node->getLeft());
                 parent->getRight()->setParent(parent);
@@ -430,13 +1846,13 @@ void BinarySearchTree<Key, Value>::remove(const Key & key) {
             node->getLeft()->setParent(NULL);
         }
 
-        delete node;
+        discardNode(node);
         return;
     }
 
     if ( node->getLeft() == nullptr && node->getRight()) { //Only right child
         if (node->getParent()) {
-            Node<Key, Value>* parent = node->getParent();
+            Node<Key, Value, Sizes>* parent = node->getParent();
             if (node->getParent()->getLeft() == node) {
                 node->getParent()->setLeft(node->getRight());
                 parent->getLeft()->setParent(parent);
@@ -449,7 +1865,7 @@ void BinarySearchTree<Key, Value>::remove(const Key & key) {
             node->getRight()->setParent(nullptr);
         }
 
-        delete node;
+        discardNode(node);
         return;
     }
 
@@ -464,14 +1880,14 @@ void BinarySearchTree<Key, Value>::remove(const Key & key) {
             root_ = nullptr;
         }
 
-        delete node;
+        discardNode(node);
         return;
     }
 }
 
-template<class Key, class Value>
-Node<Key, Value>*
-BinarySearchTree<Key, Value>::predecessor(Node<Key, Value>* current)
+template<class Key, class Value, class Compare, class Sizes>
+Node<Key, Value, Sizes>*
+BinarySearchTree<Key, Value, Compare, Sizes>::predecessor(Node<Key, Value, Sizes>* current)
 {
     if (current->getLeft()) {
         current = current->getLeft();
@@ -498,9 +1914,9 @@ BinarySearchTree<Key, Value>::predecessor(Node<Key, Value>* current)
     }
 }
 
-template<class Key, class Value>
-Node<Key, Value>*
-BinarySearchTree<Key, Value>::successor(Node<Key, Value>* current)
+template<class Key, class Value, class Compare, class Sizes>
+Node<Key, Value, Sizes>*
+BinarySearchTree<Key, Value, Compare, Sizes>::successor(Node<Key, Value, Sizes>* current)
 {
     if (current->getRight()) {
         current = current->getRight();
@@ -512,7 +1928,7 @@ BinarySearchTree<Key, Value>::successor(Node<Key, Value>* current)
         return current;
     }
     else {
-        Node<Key, Value>* buff = current->getParent();
+        Node<Key, Value, Sizes>* buff = current->getParent();
 
         while (buff && current == buff->getRight()) {
             current = buff;
@@ -523,50 +1939,137 @@ BinarySearchTree<Key, Value>::successor(Node<Key, Value>* current)
     }
 }
 
-template<typename Key, typename Value>
-void BinarySearchTree<Key, Value>::clear()
+/**
+* Runs every node's destructor and then hands all of the pool's slabs
+* back at once instead of freeing the nodes one at a time. When neither
+* the key nor the value needs destroying, the walk is skipped altogether
+* and clearing costs one free per slab.
+*/
+template<typename Key, typename Value, typename Compare, typename Sizes>
+void BinarySearchTree<Key, Value, Compare, Sizes>::clear()
 {
-    this->clear_Helper(this->root_);
+    if (!std::is_trivially_destructible<std::pair<const Key, Value> >::value) {
+        this->clear_Helper(this->root_);
+    }
     this->root_ = nullptr;
+    this->largest_ = nullptr;
+    count_.store(0, std::memory_order_relaxed);
+    hintPrev_ = nullptr;
+    pool_.release();
+}
+
+/**
+* Destroys the nodes of a subtree without returning their storage;
+* clear() releases the pool afterwards.
+*
+* Iterative, so even a degenerate tree of height n cannot overflow the
+* stack. Each leaf is unhooked from its parent before it is destroyed,
+* which turns the parent into a leaf in turn; following the parent links
+* back up needs no auxiliary stack.
+*/
+template<typename Key, typename Value, typename Compare, typename Sizes>
+void BinarySearchTree<Key, Value, Compare, Sizes>::clear_Helper(Node<Key, Value, Sizes>* node) {
+    Node<Key, Value, Sizes>* top = node ? node->getParent() : nullptr;
+
+    while (node != top) {
+        if (node->getLeft()) {
+            node = node->getLeft();
+        }
+        else if (node->getRight()) {
+            node = node->getRight();
+        }
+        else {
+            Node<Key, Value, Sizes>* parent = node->getParent();
+            if (parent != top) {
+                if (parent->getLeft() == node) {
+                    parent->setLeft(nullptr);
+                }
+                else {
+                    parent->setRight(nullptr);
+                }
+            }
+            destroyFn_(node);
+            node = parent;
+        }
+    }
 }
 
-template<typename Key, typename Value>
-void BinarySearchTree<Key, Value>::clear_Helper(Node<Key, Value>* node) {
-    if (node){
-        clear_Helper(node->getRight());
-        clear_Helper(node->getLeft());
-        delete node;
-        node = nullptr;
+template<typename Key, typename Value, typename Compare, typename Sizes>
+Node<Key, Value, Sizes>* BinarySearchTree<Key, Value, Compare, Sizes>::internalSelect(std::size_t k) const
+{
+    static_assert(Sizes::enabled, "select needs a tree with SubtreeSizes");
+    Node<Key, Value, Sizes>* node = this->root_;
+
+    while (node != nullptr) {
+        std::size_t leftSize = Node<Key, Value, Sizes>::sizeOf(node->getLeft());
+        if (k < leftSize) {
+            node = node->getLeft();
+        }
+        else if (k == leftSize) {
+            break;
+        }
+        else {
+            k -= leftSize + 1;
+            node = node->getRight();
+        }
+    }
+
+    return node;
+}
+
+/**
+* O(1): the tree keeps track of its largest node as it changes.
+*/
+template<typename Key, typename Value, typename Compare, typename Sizes>
+Node<Key, Value, Sizes>*
+BinarySearchTree<Key, Value, Compare, Sizes>::getLargestNode() const
+{
+    return this->largest_;
+}
+
+/**
+* Recomputes the largest node after the tree was built or reshaped by
+* something other than a single insert or remove.
+*/
+template<typename Key, typename Value, typename Compare, typename Sizes>
+void BinarySearchTree<Key, Value, Compare, Sizes>::resetLargest()
+{
+    Node<Key, Value, Sizes>* node = this->root_;
+    while (node != nullptr && node->getRight() != nullptr) {
+        node = node->getRight();
     }
+    this->largest_ = node;
 }
 
-template<typename Key, typename Value>
-Node<Key, Value>*
-BinarySearchTree<Key, Value>::getSmallestNode() const
+template<typename Key, typename Value, typename Compare, typename Sizes>
+Node<Key, Value, Sizes>*
+BinarySearchTree<Key, Value, Compare, Sizes>::getSmallestNode() const
 {
     if (this->empty()) return nullptr;
 
-    Node<Key, Value>* temp = this->root_;
+    Node<Key, Value, Sizes>* temp = this->root_;
     while (temp->getLeft() != nullptr) {
         temp = temp->getLeft();
     }
 
     return temp;
 }
-template<typename Key, typename Value>
-Node<Key, Value>* BinarySearchTree<Key, Value>::internalFind(const Key& key) const
+template<typename Key, typename Value, typename Compare, typename Sizes>
+template<typename K>
+Node<Key, Value, Sizes>* BinarySearchTree<Key, Value, Compare, Sizes>::internalFind(const K& key) const
 {
     if (this->empty()) {
         return nullptr;
     }
 
-    Node<Key, Value>* node = this->root_;
+    Node<Key, Value, Sizes>* node = this->root_;
 
     while (node != nullptr) {
-        if (node->getKey() > key) {
+        int order = keyCompare(key, node->getKey());
+        if (order < 0) {
             node = node->getLeft();
         }
-        else if (node->getKey() < key) {
+        else if (order > 0) {
             node = node->getRight();
         }
         else {
@@ -578,58 +2081,321 @@ Node<Key, Value>* BinarySearchTree<Key, Value>::internalFind(const Key& key) con
 }
 
 
-template<typename Key, typename Value>
-bool BinarySearchTree<Key, Value>::isBalanced()
+/**
+* Both bounds use one comparison per level and remember the last node
+* where the descent went left, which is the answer once a leaf is reached.
+*/
+template<typename Key, typename Value, typename Compare, typename Sizes>
+template<typename K>
+Node<Key, Value, Sizes>* BinarySearchTree<Key, Value, Compare, Sizes>::internalLowerBound(const K& key) const
 {
-    if (this->empty()) return true;
+    Node<Key, Value, Sizes>* node = this->root_;
+    Node<Key, Value, Sizes>* result = nullptr;
+
+    while (node != nullptr) {
+        if (keyLess(node->getKey(), key)) {
+            node = node->getRight();
+        }
+        else {
+            result = node;
+            node = node->getLeft();
+        }
+    }
 
-    return this->isBalanced_Helper(root_);
+    return result;
 }
 
-template<typename Key, typename Value> 
-bool BinarySearchTree<Key, Value>::isBalanced_Helper(Node<Key, Value>* node) {
-    if (!node) {
-        return true;
+template<typename Key, typename Value, typename Compare, typename Sizes>
+template<typename K>
+Node<Key, Value, Sizes>* BinarySearchTree<Key, Value, Compare, Sizes>::internalUpperBound(const K& key) const
+{
+    Node<Key, Value, Sizes>* node = this->root_;
+    Node<Key, Value, Sizes>* result = nullptr;
+
+    while (node != nullptr) {
+        if (keyLess(key, node->getKey())) {
+            result = node;
+            node = node->getLeft();
+        }
+        else {
+            node = node->getRight();
+        }
     }
 
-    int leftHeight = isBalanced_Height(node->left_);
-    int rightHeight = isBalanced_Height(node->right_);
+    return result;
+}
 
-    if (std::abs(leftHeight - rightHeight) <= 1 && isBalanced_Helper(node->left_) && isBalanced_Helper(node->right_)) {
-        return true;
+/**
+* The lower bound and the node after it when the lower bound equals key,
+* otherwise the lower bound twice.
+*/
+template<typename Key, typename Value, typename Compare, typename Sizes>
+template<typename K>
+std::pair<Node<Key, Value, Sizes>*, Node<Key, Value, Sizes>*>
+BinarySearchTree<Key, Value, Compare, Sizes>::internalEqualRange(const K& key) const
+{
+    Node<Key, Value, Sizes>* lower = internalLowerBound(key);
+    Node<Key, Value, Sizes>* upper = lower;
+    if (lower != nullptr && !keyLess(key, lower->getKey())) {
+        upper = successor(lower);
+    }
+    return std::make_pair(lower, upper);
+}
+
+/**
+* Walks once from the root to the leaf where key belongs, doing a single
+* key comparison per level. The last node we went right at is the only
+* one that can equal key, so it is checked once at the bottom. Returns
+* that node if it matches; otherwise returns nullptr and sets parent and
+* isLeft to the spot a new node for key should be linked in at.
+*/
+template<typename Key, typename Value, typename Compare, typename Sizes>
+Node<Key, Value, Sizes>* BinarySearchTree<Key, Value, Compare, Sizes>::findInsertPos(const Key& key, Node<Key, Value, Sizes>*& parent, bool& isLeft) const
+{
+    Node<Key, Value, Sizes>* node = this->root_;
+    Node<Key, Value, Sizes>* candidate = nullptr;
+    parent = nullptr;
+    isLeft = false;
+
+    while (node != nullptr) {
+        parent = node;
+        isLeft = keyLess(key, node->getKey());
+        if (isLeft) {
+            node = node->getLeft();
+        }
+        else {
+            candidate = node;
+            node = node->getRight();
+        }
     }
 
-    return false;
+    if (candidate != nullptr && !keyLess(candidate->getKey(), key)) {
+        return candidate;
+    }
+    return nullptr;
 }
 
-template<typename Key, typename Value>
-int BinarySearchTree<Key, Value>::isBalanced_Height(Node<Key, Value>* node) {
-    if (!node) return 0;
-    
-    return 1 + std::max(isBalanced_Height(node->getLeft()), isBalanced_Height(node->getRight()));
+/**
+* findInsertPos for a key expected to go just before next (nullptr meaning
+* after the largest key). When it does, that is, when it falls between
+* next's predecessor and next, it is linked as next's left child if next
+* has none and otherwise as the predecessor's right child, which is then
+* free. Checking that takes one comparison for a key that is new and in
+* the right place, so each key of a sorted run hinted with end() is
+* appended without a descent. The predecessor is O(1) for end() (the
+* largest node) and for the hint the previous hinted insert went in front
+* of (the node it linked), which covers a hint that is handed back
+* unchanged, as std::inserter does; other hints walk to it. Equal
+* neighbours are returned as matches; any other key falls back to the
+* normal search. beforeNext is set when the key goes just before next.
+*/
+template<typename Key, typename Value, typename Compare, typename Sizes>
+Node<Key, Value, Sizes>* BinarySearchTree<Key, Value, Compare, Sizes>::findHintedPos(Node<Key, Value, Sizes>* next, const Key& key,
+                                                                       Node<Key, Value, Sizes>*& parent, bool& isLeft,
+                                                                       bool& beforeNext) const
+{
+    beforeNext = false;
+    if (this->root_ == nullptr) {
+        return findInsertPos(key, parent, isLeft);
+    }
+
+    Node<Key, Value, Sizes>* prev;
+    if (next == nullptr) {
+        prev = this->largest_;
+    }
+    else if (next == hintNext_ && hintPrev_ != nullptr) {
+        prev = hintPrev_;
+    }
+    else {
+        prev = predecessor(next);
+    }
+    if (prev != nullptr && !keyLess(prev->getKey(), key)) {
+        if (!keyLess(key, prev->getKey())) return prev;
+        return findInsertPos(key, parent, isLeft);
+    }
+    if (next != nullptr && !keyLess(key, next->getKey())) {
+        if (!keyLess(next->getKey(), key)) return next;
+        return findInsertPos(key, parent, isLeft);
+    }
+
+    if (next != nullptr && next->getLeft() == nullptr) {
+        parent = next;
+        isLeft = true;
+    }
+    else {
+        parent = prev;
+        isLeft = false;
+    }
+    beforeNext = true;
+    return nullptr;
+}
+
+/**
+* Hooks a freshly created node in under parent (or as the root).
+*/
+template<typename Key, typename Value, typename Compare, typename Sizes>
+void BinarySearchTree<Key, Value, Compare, Sizes>::linkNode(Node<Key, Value, Sizes>* node, Node<Key, Value, Sizes>* parent, bool isLeft)
+{
+    node->setParent(parent);
+    if (parent == nullptr) {
+        this->root_ = node;
+        this->largest_ = node;
+    }
+    else if (isLeft) {
+        parent->setLeft(node);
+    }
+    else {
+        parent->setRight(node);
+        if (parent == this->largest_) {
+            this->largest_ = node;
+        }
+    }
+    updateSizes(parent);
+    std::size_t count = count_.load(std::memory_order_relaxed);
+    if (count != UNKNOWN_COUNT) count_.store(count + 1, std::memory_order_relaxed);
+    hintPrev_ = nullptr;
+}
+
+/**
+* Recomputes the subtree size of node and every one of its ancestors,
+* after a node has been linked in below it or unlinked from below it.
+* Without SubtreeSizes there is nothing to walk.
+*/
+template<typename Key, typename Value, typename Compare, typename Sizes>
+void BinarySearchTree<Key, Value, Compare, Sizes>::updateSizes(Node<Key, Value, Sizes>* node)
+{
+    if (!Sizes::enabled) return;
+    while (node != nullptr) {
+        node->updateSize();
+        node = node->getParent();
+    }
+}
+
+/**
+* Bookkeeping shared by the remove paths once node has been unlinked from
+* the tree (its own links are still intact): fixes the ancestors' subtree
+* sizes and the largest node, then frees it. A removed largest node has
+* no right child, so its predecessor is either the maximum of its left
+* subtree or its parent.
+*/
+template<typename Key, typename Value, typename Compare, typename Sizes>
+void BinarySearchTree<Key, Value, Compare, Sizes>::discardNode(Node<Key, Value, Sizes>* node)
+{
+    updateSizes(node->getParent());
+    std::size_t count = count_.load(std::memory_order_relaxed);
+    if (count != UNKNOWN_COUNT) count_.store(count - 1, std::memory_order_relaxed);
+    hintPrev_ = nullptr;
+
+    if (node == this->largest_) {
+        Node<Key, Value, Sizes>* replacement = node->getLeft();
+        if (replacement == nullptr) {
+            replacement = node->getParent();
+        }
+        else {
+            while (replacement->getRight() != nullptr) {
+                replacement = replacement->getRight();
+            }
+        }
+        this->largest_ = replacement;
+    }
+
+    destroyNode(node);
+}
+
+/**
+* O(n), in a single pass that uses no recursion.
+*/
+template<typename Key, typename Value, typename Compare, typename Sizes>
+bool BinarySearchTree<Key, Value, Compare, Sizes>::isBalanced() const
+{
+    return this->measureHeight(true) >= 0;
+}
+
+/**
+* Number of nodes on the longest root-to-leaf path (0 for an empty tree).
+* Plain trees keep no height information, so this walks the whole tree.
+*/
+template<typename Key, typename Value, typename Compare, typename Sizes>
+int BinarySearchTree<Key, Value, Compare, Sizes>::height() const
+{
+    return this->measureHeight(false);
 }
 
+/**
+* Computes the height with an iterative post-order walk that follows the
+* parent links, so it runs in O(n) without recursion. Finished subtree
+* heights wait on a small stack (at most one per level) until their
+* parent is visited. With checkBalance set, returns -1 as soon as a node
+* whose subtree heights differ by more than one is found.
+*/
+template<typename Key, typename Value, typename Compare, typename Sizes>
+int BinarySearchTree<Key, Value, Compare, Sizes>::measureHeight(bool checkBalance) const
+{
+    std::vector<int> heights;
+    Node<Key, Value, Sizes>* node = this->root_;
+    Node<Key, Value, Sizes>* prev = nullptr;
+
+    while (node != nullptr) {
+        Node<Key, Value, Sizes>* left = node->getLeft();
+        Node<Key, Value, Sizes>* right = node->getRight();
+
+        if (prev == node->getParent() && left != nullptr) {
+            prev = node;
+            node = left;
+            continue;
+        }
+        if (right != nullptr && prev != right) {
+            prev = node;
+            node = right;
+            continue;
+        }
+
+        // Both subtrees are done: the right height is on top if present.
+        int rightHeight = 0;
+        int leftHeight = 0;
+        if (right != nullptr) {
+            rightHeight = heights.back();
+            heights.pop_back();
+        }
+        if (left != nullptr) {
+            leftHeight = heights.back();
+            heights.pop_back();
+        }
+        if (checkBalance && std::abs(leftHeight - rightHeight) > 1) {
+            return -1;
+        }
+        heights.push_back(1 + std::max(leftHeight, rightHeight));
+
+        prev = node;
+        node = node->getParent();
+    }
+
+    return heights.empty() ? 0 : heights.back();
+}
 
 
-template<typename Key, typename Value>
-void BinarySearchTree<Key, Value>::nodeSwap( Node<Key,Value>* n1, Node<Key,Value>* n2)
+template<typename Key, typename Value, typename Compare, typename Sizes>
+void BinarySearchTree<Key, Value, Compare, Sizes>::nodeSwap( Node<Key, Value, Sizes>* n1, Node<Key, Value, Sizes>* n2)
 {
     if((n1 == n2) || (n1 == NULL) || (n2 == NULL) ) {
         return;
     }
-    Node<Key, Value>* n1p = n1->getParent();
-    Node<Key, Value>* n1r = n1->getRight();
-    Node<Key, Value>* n1lt = n1->getLeft();
+    Node<Key, Value, Sizes>* n1p = n1->getParent();
+    Node<Key, Value, Sizes>* n1r = n1->getRight();
+    Node<Key, Value, Sizes>* n1lt = n1->getLeft();
     bool n1isLeft = false;
     if(n1p != NULL && (n1 == n1p->getLeft())) n1isLeft = true;
-    Node<Key, Value>* n2p = n2->getParent();
-    Node<Key, Value>* n2r = n2->getRight();
-    Node<Key, Value>* n2lt = n2->getLeft();
+    Node<Key, Value, Sizes>* n2p = n2->getParent();
+    Node<Key, Value, Sizes>* n2r = n2->getRight();
+    Node<Key, Value, Sizes>* n2lt = n2->getLeft();
     bool n2isLeft = false;
     if(n2p != NULL && (n2 == n2p->getLeft())) n2isLeft = true;
 
 
-    Node<Key, Value>* temp;
+    // Subtree sizes belong to the positions, which the nodes trade.
+    std::swap(static_cast<Sizes&>(*n1), static_cast<Sizes&>(*n2));
+
+    Node<Key, Value, Sizes>* temp;
     temp = n1->getParent();
     n1->setParent(n2->getParent());
     n2->setParent(temp);
@@ -697,6 +2463,63 @@ void BinarySearchTree<Key, Value>::nodeSwap( Node<Key,Value>* n1, Node<Key,Value
 
 
 
+template<typename Key, typename Value, typename Compare, typename Sizes>
+Node<Key, Value, Sizes>* BinarySearchTree<Key, Value, Compare, Sizes>::createNode(const Key& key, const Value& value)
+{
+    return constructNode<Node<Key, Value, Sizes> >(key, value);
+}
+
+template<typename Key, typename Value, typename Compare, typename Sizes>
+Node<Key, Value, Sizes>* BinarySearchTree<Key, Value, Compare, Sizes>::createNode(ItemBuilder<Key, Value>& builder)
+{
+    return constructNode<Node<Key, Value, Sizes> >(builder);
+}
+
+/**
+* A plain BST has nothing to fix up after an insert.
+*/
+template<typename Key, typename Value, typename Compare, typename Sizes>
+void BinarySearchTree<Key, Value, Compare, Sizes>::insertFixup(Node<Key, Value, Sizes>*)
+{
+
+}
+
+/**
+* Builds an unlinked NodeType in the pool, constructing its pair in place
+* from args.
+*/
+template<typename Key, typename Value, typename Compare, typename Sizes>
+template<typename NodeType, typename... Args>
+NodeType* BinarySearchTree<Key, Value, Compare, Sizes>::constructNode(Args&&... args)
+{
+    void* block = pool_.allocate();
+    try {
+        return new (block) NodeType(InPlaceItem(), std::forward<Args>(args)...);
+    }
+    catch (...) {
+        pool_.deallocate(block);
+        throw;
+    }
+}
+
+/**
+* Destroys a single node and puts its block on the pool's free list.
+*/
+template<typename Key, typename Value, typename Compare, typename Sizes>
+void BinarySearchTree<Key, Value, Compare, Sizes>::destroyNode(Node<Key, Value, Sizes>* node)
+{
+    destroyFn_(node);
+    pool_.deallocate(node);
+}
+
+template<typename Key, typename Value, typename Compare, typename Sizes>
+template<typename NodeType>
+void BinarySearchTree<Key, Value, Compare, Sizes>::destroyAs(Node<Key, Value, Sizes>* node)
+{
+    static_cast<NodeType*>(node)->~NodeType();
+}
+
+
 #include "print_bst.h"
 
 
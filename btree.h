@@ -0,0 +1,1157 @@
+#ifndef BTREE_H
+#define BTREE_H
+
+#include <cstddef>
+#include <functional>
+#include <iterator>
+#include <new>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include <algorithm>
+#include "node_pool.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/**
+ * In-node search helpers for BTree. Each returns how many of the n keys,
+ * sorted by comp, come before key (btreeCountLess) or do not come after
+ * it (btreeCountLessEqual), which is the slot to look at next.
+ *
+ * Arithmetic keys are counted with a linear, branch-free scan that the
+ * compiler can vectorise; nodes are small enough that touching every key
+ * beats a mispredicted binary search. Other keys use a binary search.
+ */
+template<typename Key, typename Compare>
+int btreeCountLess(const Key* keys, int n, const Key& key, const Compare& comp, std::true_type)
+{
+    int count = 0;
+    for (int i = 0; i < n; ++i) {
+        count += comp(keys[i], key);
+    }
+    return count;
+}
+
+template<typename Key, typename Compare>
+int btreeCountLess(const Key* keys, int n, const Key& key, const Compare& comp, std::false_type)
+{
+    return static_cast<int>(std::lower_bound(keys, keys + n, key, comp) - keys);
+}
+
+template<typename Key, typename Compare>
+int btreeCountLessEqual(const Key* keys, int n, const Key& key, const Compare& comp, std::true_type)
+{
+    int count = 0;
+    for (int i = 0; i < n; ++i) {
+        count += !comp(key, keys[i]);
+    }
+    return count;
+}
+
+template<typename Key, typename Compare>
+int btreeCountLessEqual(const Key* keys, int n, const Key& key, const Compare& comp, std::false_type)
+{
+    return static_cast<int>(std::upper_bound(keys, keys + n, key, comp) - keys);
+}
+
+#if defined(__SSE2__)
+/**
+* 32-bit integer keys in the default order are compared four at a time
+* with SSE2.
+*/
+inline int btreeCountGreaterSSE2(const int* keys, int n, int key)
+{
+    const __m128i needle = _mm_set1_epi32(key);
+    int count = 0;
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(keys + i));
+        int mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(block, needle)));
+        count += __builtin_popcount(mask);
+    }
+    for (; i < n; ++i) {
+        count += keys[i] > key;
+    }
+    return count;
+}
+
+inline int btreeCountLess(const int* keys, int n, const int& key, const std::less<int>&, std::true_type)
+{
+    const __m128i needle = _mm_set1_epi32(key);
+    int count = 0;
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(keys + i));
+        int mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmplt_epi32(block, needle)));
+        count += __builtin_popcount(mask);
+    }
+    for (; i < n; ++i) {
+        count += keys[i] < key;
+    }
+    return count;
+}
+
+inline int btreeCountLessEqual(const int* keys, int n, const int& key, const std::less<int>&, std::true_type)
+{
+    return n - btreeCountGreaterSSE2(keys, n, key);
+}
+#endif
+
+
+/**
+ * What BTree iterators return from operator->. It holds the pair of
+ * references the iterator dereferences to, so it->first and it->second
+ * work as they do for the other trees.
+ */
+template<typename Reference>
+class BTreeArrow
+{
+public:
+    explicit BTreeArrow(const Reference& ref) : ref_(ref) {}
+    const Reference* operator->() const { return &ref_; }
+
+private:
+    Reference ref_;
+};
+
+
+/**
+ * A B+ tree with the same interface as BinarySearchTree (insert, remove,
+ * find, operator[], bounds and bidirectional iterators), for workloads
+ * where the binary tree's one-cache-miss-per-level lookups dominate.
+ *
+ * Inner nodes hold up to INNER_KEYS separator keys and one more child
+ * pointer; the keys of a node sit together in a few cache lines and are
+ * searched with btreeCountLess/btreeCountLessEqual. All pairs live in the
+ * leaves, which are linked both ways so that iteration and range scans
+ * just walk along the leaf level. Leaves and inner nodes each come from
+ * their own NodePool.
+ *
+ * A leaf keeps its keys in one array and its values in another beside
+ * it, so searches only read keys and each key is stored once. There is no
+ * std::pair in the tree to point at: like std::flat_map's, the iterators
+ * dereference to a pair of references (std::pair<const Key&, Value&>),
+ * which is built on the fly. Key and Value need not be default
+ * constructible; slots are constructed only while they hold an element.
+ *
+ * Like std::map iterators, iterators stay valid across lookups but not
+ * across an insert or remove, which may move pairs between leaves.
+ */
+template <class Key, class Value, class Compare = std::less<Key> >
+class BTree
+{
+protected:
+    typedef std::pair<const Key, Value> Item;
+
+    // About four cache lines of keys per node, kept even so that splits
+    // and merges come out evenly.
+    static const int NODE_KEY_BYTES = 256;
+    static const int RAW_KEYS = NODE_KEY_BYTES / static_cast<int>(sizeof(Key));
+    static const int INNER_KEYS = RAW_KEYS < 4 ? 4 : (RAW_KEYS > 64 ? 64 : RAW_KEYS & ~1);
+    static const int LEAF_ITEMS = INNER_KEYS;
+    static const int MIN_INNER_KEYS = INNER_KEYS / 2;
+    static const int MIN_LEAF_ITEMS = LEAF_ITEMS / 2;
+    static const int MAX_DEPTH = 48;
+
+    // Only the first count_ keys and values of a node are constructed.
+    struct Leaf
+    {
+        Leaf() : count_(0), prev_(nullptr), next_(nullptr) {}
+
+        Key* keys() { return reinterpret_cast<Key*>(keys_); }
+        const Key* keys() const { return reinterpret_cast<const Key*>(keys_); }
+        Value* values() { return reinterpret_cast<Value*>(values_); }
+        const Value* values() const { return reinterpret_cast<const Value*>(values_); }
+
+        int count_;
+        Leaf* prev_;
+        Leaf* next_;
+        alignas(Key) unsigned char keys_[LEAF_ITEMS * sizeof(Key)];
+        alignas(Value) unsigned char values_[LEAF_ITEMS * sizeof(Value)];
+    };
+
+    // One key and child more than a node may keep, so that insertChild
+    // can add a separator first and split the overfull node after.
+    struct Inner
+    {
+        Inner() : count_(0) {}
+
+        Key* keys() { return reinterpret_cast<Key*>(keys_); }
+        const Key* keys() const { return reinterpret_cast<const Key*>(keys_); }
+
+        int count_;
+        alignas(Key) unsigned char keys_[(INNER_KEYS + 1) * sizeof(Key)];
+        void* children_[INNER_KEYS + 2];
+    };
+
+public:
+    class const_iterator;
+
+    class iterator
+    {
+    public:
+        typedef std::bidirectional_iterator_tag iterator_category;
+        typedef std::pair<const Key, Value> value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef std::pair<const Key&, Value&> reference;
+        typedef BTreeArrow<reference> pointer;
+
+        iterator();
+
+        reference operator*() const;
+        pointer operator->() const;
+
+        bool operator==(const iterator& rhs) const;
+        bool operator!=(const iterator& rhs) const;
+
+        iterator& operator++();
+        iterator operator++(int);
+        iterator& operator--();
+        iterator operator--(int);
+
+    protected:
+        friend class BTree<Key, Value, Compare>;
+        friend class const_iterator;
+        iterator(Leaf* leaf, int index, const BTree<Key, Value, Compare>* tree);
+
+        Leaf* leaf_;
+        int index_;
+        const BTree<Key, Value, Compare>* tree_;
+    };
+
+    class const_iterator
+    {
+    public:
+        typedef std::bidirectional_iterator_tag iterator_category;
+        typedef std::pair<const Key, Value> value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef std::pair<const Key&, const Value&> reference;
+        typedef BTreeArrow<reference> pointer;
+
+        const_iterator();
+        const_iterator(const iterator& it);
+
+        reference operator*() const;
+        pointer operator->() const;
+
+        friend bool operator==(const const_iterator& lhs, const const_iterator& rhs)
+        {
+            return lhs.leaf_ == rhs.leaf_ && lhs.index_ == rhs.index_;
+        }
+        friend bool operator!=(const const_iterator& lhs, const const_iterator& rhs)
+        {
+            return !(lhs == rhs);
+        }
+
+        const_iterator& operator++();
+        const_iterator operator++(int);
+        const_iterator& operator--();
+        const_iterator operator--(int);
+
+    protected:
+        friend class BTree<Key, Value, Compare>;
+        const_iterator(Leaf* leaf, int index, const BTree<Key, Value, Compare>* tree);
+
+        Leaf* leaf_;
+        int index_;
+        const BTree<Key, Value, Compare>* tree_;
+    };
+
+    typedef Compare key_compare;
+
+    BTree();
+    explicit BTree(const Compare& comp);
+    ~BTree();
+
+    std::pair<iterator, bool> insert(const std::pair<const Key, Value>& keyValuePair);
+    void remove(const Key& key);
+    void clear();
+    bool empty() const;
+    std::size_t size() const;
+
+    iterator begin();
+    const_iterator begin() const;
+    iterator end();
+    const_iterator end() const;
+    iterator find(const Key& key);
+    const_iterator find(const Key& key) const;
+    iterator lower_bound(const Key& key);
+    const_iterator lower_bound(const Key& key) const;
+    iterator upper_bound(const Key& key);
+    const_iterator upper_bound(const Key& key) const;
+    Value& operator[](const Key& key);
+    Value const & operator[](const Key& key) const;
+    Compare key_comp() const;
+
+protected:
+    BTree(const BTree&) = delete;
+    BTree& operator=(const BTree&) = delete;
+
+    bool keyLess(const Key& a, const Key& b) const;
+    int countLess(const Key* keys, int n, const Key& key) const;
+    int countLessEqual(const Key* keys, int n, const Key& key) const;
+
+    Leaf* descend(const Key& key, Inner** path, int* slots) const;
+    Leaf* firstLeaf() const;
+    Leaf* lastLeaf() const;
+    Leaf* internalLowerBound(const Key& key, int& index) const;
+    Leaf* internalUpperBound(const Key& key, int& index) const;
+
+    static void moveKey(Key* from, Key* to);
+    static void moveItem(Leaf* from, int i, Leaf* to, int j);
+    static void insertItem(Leaf* leaf, int i, const Item& item);
+    static void eraseItem(Leaf* leaf, int i);
+    static void removeChild(Inner* node, int keyIndex);
+
+    Leaf* splitLeaf(Leaf* leaf);
+    void insertChild(Inner** path, int* slots, const Key& separator, void* child);
+    void fixLeafUnderflow(Leaf* leaf, Inner** path, int* slots);
+    void fixInnerUnderflow(Inner** path, int* slots, int depth);
+    void destroySubtree(void* node, int depth);
+
+    void* root_;
+    int depth_;
+    std::size_t size_;
+    NodePool leafPool_;
+    NodePool innerPool_;
+    Compare comp_;
+};
+
+/*
+  -----------------------------------------------------
+  Begin implementations for the BTree::iterator class.
+  -----------------------------------------------------
+*/
+
+template<class Key, class Value, class Compare>
+BTree<Key, Value, Compare>::iterator::iterator() :
+    leaf_(nullptr),
+    index_(0),
+    tree_(nullptr)
+{
+
+}
+
+template<class Key, class Value, class Compare>
+BTree<Key, Value, Compare>::iterator::iterator(Leaf* leaf, int index, const BTree<Key, Value, Compare>* tree) :
+    leaf_(leaf),
+    index_(index),
+    tree_(tree)
+{
+
+}
+
+template<class Key, class Value, class Compare>
+typename BTree<Key, Value, Compare>::iterator::reference
+BTree<Key, Value, Compare>::iterator::operator*() const
+{
+    return reference(leaf_->keys()[index_], leaf_->values()[index_]);
+}
+
+template<class Key, class Value, class Compare>
+typename BTree<Key, Value, Compare>::iterator::pointer
+BTree<Key, Value, Compare>::iterator::operator->() const
+{
+    return pointer(**this);
+}
+
+template<class Key, class Value, class Compare>
+bool BTree<Key, Value, Compare>::iterator::operator==(const iterator& rhs) const
+{
+    return leaf_ == rhs.leaf_ && index_ == rhs.index_;
+}
+
+template<class Key, class Value, class Compare>
+bool BTree<Key, Value, Compare>::iterator::operator!=(const iterator& rhs) const
+{
+    return !(*this == rhs);
+}
+
+template<class Key, class Value, class Compare>
+typename BTree<Key, Value, Compare>::iterator& BTree<Key, Value, Compare>::iterator::operator++()
+{
+    if (++index_ == leaf_->count_) {
+        leaf_ = leaf_->next_;
+        index_ = 0;
+    }
+    return *this;
+}
+
+template<class Key, class Value, class Compare>
+typename BTree<Key, Value, Compare>::iterator BTree<Key, Value, Compare>::iterator::operator++(int)
+{
+    iterator old = *this;
+    ++(*this);
+    return old;
+}
+
+template<class Key, class Value, class Compare>
+typename BTree<Key, Value, Compare>::iterator& BTree<Key, Value, Compare>::iterator::operator--()
+{
+    if (leaf_ == nullptr) {
+        leaf_ = tree_->lastLeaf();
+        index_ = leaf_->count_ - 1;
+    }
+    else if (index_ > 0) {
+        --index_;
+    }
+    else {
+        leaf_ = leaf_->prev_;
+        index_ = leaf_->count_ - 1;
+    }
+    return *this;
+}
+
+template<class Key, class Value, class Compare>
+typename BTree<Key, Value, Compare>::iterator BTree<Key, Value, Compare>::iterator::operator--(int)
+{
+    iterator old = *this;
+    --(*this);
+    return old;
+}
+
+/*
+  ---------------------------------------------------
+  End implementations for the BTree::iterator class.
+  ---------------------------------------------------
+*/
+
+/*
+  -----------------------------------------------------------
+  Begin implementations for the BTree::const_iterator class.
+  -----------------------------------------------------------
+*/
+
+template<class Key, class Value, class Compare>
+BTree<Key, Value, Compare>::const_iterator::const_iterator() :
+    leaf_(nullptr),
+    index_(0),
+    tree_(nullptr)
+{
+
+}
+
+template<class Key, class Value, class Compare>
+BTree<Key, Value, Compare>::const_iterator::const_iterator(const iterator& it) :
+    leaf_(it.leaf_),
+    index_(it.index_),
+    tree_(it.tree_)
+{
+
+}
+
+template<class Key, class Value, class Compare>
+BTree<Key, Value, Compare>::const_iterator::const_iterator(Leaf* leaf, int index, const BTree<Key, Value, Compare>* tree) :
+    leaf_(leaf),
+    index_(index),
+    tree_(tree)
+{
+
+}
+
+template<class Key, class Value, class Compare>
+typename BTree<Key, Value, Compare>::const_iterator::reference
+BTree<Key, Value, Compare>::const_iterator::operator*() const
+{
+    return reference(leaf_->keys()[index_], leaf_->values()[index_]);
+}
+
+template<class Key, class Value, class Compare>
+typename BTree<Key, Value, Compare>::const_iterator::pointer
+BTree<Key, Value, Compare>::const_iterator::operator->() const
+{
+    return pointer(**this);
+}
+
+template<class Key, class Value, class Compare>
+typename BTree<Key, Value, Compare>::const_iterator& BTree<Key, Value, Compare>::const_iterator::operator++()
+{
+    if (++index_ == leaf_->count_) {
+        leaf_ = leaf_->next_;
+        index_ = 0;
+    }
+    return *this;
+}
+
+template<class Key, class Value, class Compare>
+typename BTree<Key, Value, Compare>::const_iterator BTree<Key, Value, Compare>::const_iterator::operator++(int)
+{
+    const_iterator old = *this;
+    ++(*this);
+    return old;
+}
+
+template<class Key, class Value, class Compare>
+typename BTree<Key, Value, Compare>::const_iterator& BTree<Key, Value, Compare>::const_iterator::operator--()
+{
+    if (leaf_ == nullptr) {
+        leaf_ = tree_->lastLeaf();
+        index_ = leaf_->count_ - 1;
+    }
+    else if (index_ > 0) {
+        --index_;
+    }
+    else {
+        leaf_ = leaf_->prev_;
+        index_ = leaf_->count_ - 1;
+    }
+    return *this;
+}
+
+template<class Key, class Value, class Compare>
+typename BTree<Key, Value, Compare>::const_iterator BTree<Key, Value, Compare>::const_iterator::operator--(int)
+{
+    const_iterator old = *this;
+    --(*this);
+    return old;
+}
+
+/*
+  ---------------------------------------------------------
+  End implementations for the BTree::const_iterator class.
+  ---------------------------------------------------------
+*/
+
+/*
+  ------------------------------------------
+  Begin implementations for the BTree class.
+  ------------------------------------------
+*/
+
+template<class Key, class Value, class Compare>
+BTree<Key, Value, Compare>::BTree() :
+    root_(nullptr),
+    depth_(0),
+    size_(0),
+    leafPool_(sizeof(Leaf)),
+    innerPool_(sizeof(Inner)),
+    comp_()
+{
+
+}
+
+template<class Key, class Value, class Compare>
+BTree<Key, Value, Compare>::BTree(const Compare& comp) :
+    root_(nullptr),
+    depth_(0),
+    size_(0),
+    leafPool_(sizeof(Leaf)),
+    innerPool_(sizeof(Inner)),
+    comp_(comp)
+{
+
+}
+
+template<class Key, class Value, class Compare>
+BTree<Key, Value, Compare>::~BTree()
+{
+    clear();
+}
+
+template<class Key, class Value, class Compare>
+inline bool BTree<Key, Value, Compare>::keyLess(const Key& a, const Key& b) const
+{
+    return comp_(a, b);
+}
+
+template<class Key, class Value, class Compare>
+int BTree<Key, Value, Compare>::countLess(const Key* keys, int n, const Key& key) const
+{
+    return btreeCountLess(keys, n, key, comp_, typename std::is_arithmetic<Key>::type());
+}
+
+template<class Key, class Value, class Compare>
+int BTree<Key, Value, Compare>::countLessEqual(const Key* keys, int n, const Key& key) const
+{
+    return btreeCountLessEqual(keys, n, key, comp_, typename std::is_arithmetic<Key>::type());
+}
+
+/**
+* Walks from the root to the leaf whose range holds key. If path is given,
+* it receives the inner nodes passed through and slots the child index
+* taken in each. Separator i is the smallest key in child i + 1, so keys
+* equal to it go right.
+*/
+template<class Key, class Value, class Compare>
+typename BTree<Key, Value, Compare>::Leaf* BTree<Key, Value, Compare>::descend(const Key& key, Inner** path, int* slots) const
+{
+    void* node = root_;
+    for (int d = 0; d < depth_; ++d) {
+        Inner* inner = static_cast<Inner*>(node);
+        int slot = countLessEqual(inner->keys(), inner->count_, key);
+        if (path) {
+            path[d] = inner;
+            slots[d] = slot;
+        }
+        node = inner->children_[slot];
+    }
+    return static_cast<Leaf*>(node);
+}
+
+template<class Key, class Value, class Compare>
+typename BTree<Key, Value, Compare>::Leaf* BTree<Key, Value, Compare>::firstLeaf() const
+{
+    void* node = root_;
+    for (int d = 0; d < depth_; ++d) {
+        node = static_cast<Inner*>(node)->children_[0];
+    }
+    return static_cast<Leaf*>(node);
+}
+
+template<class Key, class Value, class Compare>
+typename BTree<Key, Value, Compare>::Leaf* BTree<Key, Value, Compare>::lastLeaf() const
+{
+    void* node = root_;
+    for (int d = 0; d < depth_; ++d) {
+        Inner* inner = static_cast<Inner*>(node);
+        node = inner->children_[inner->count_];
+    }
+    return static_cast<Leaf*>(node);
+}
+
+/**
+* Position of the first key not less than key, or a null leaf for end().
+*/
+template<class Key, class Value, class Compare>
+typename BTree<Key, Value, Compare>::Leaf* BTree<Key, Value, Compare>::internalLowerBound(const Key& key, int& index) const
+{
+    index = 0;
+    if (root_ == nullptr) return nullptr;
+
+    Leaf* leaf = descend(key, nullptr, nullptr);
+    index = countLess(leaf->keys(), leaf->count_, key);
+    if (index == leaf->count_) {
+        leaf = leaf->next_;
+        index = 0;
+    }
+    return leaf;
+}
+
+template<class Key, class Value, class Compare>
+typename BTree<Key, Value, Compare>::Leaf* BTree<Key, Value, Compare>::internalUpperBound(const Key& key, int& index) const
+{
+    index = 0;
+    if (root_ == nullptr) return nullptr;
+
+    Leaf* leaf = descend(key, nullptr, nullptr);
+    index = countLessEqual(leaf->keys(), leaf->count_, key);
+    if (index == leaf->count_) {
+        leaf = leaf->next_;
+        index = 0;
+    }
+    return leaf;
+}
+
+/**
+* Moves the key at from into the unconstructed slot at to, leaving from
+* unconstructed.
+*/
+template<class Key, class Value, class Compare>
+inline void BTree<Key, Value, Compare>::moveKey(Key* from, Key* to)
+{
+    new (to) Key(std::move(*from));
+    from->~Key();
+}
+
+/**
+* Moves the pair in slot i of from into the empty slot j of to.
+*/
+template<class Key, class Value, class Compare>
+void BTree<Key, Value, Compare>::moveItem(Leaf* from, int i, Leaf* to, int j)
+{
+    moveKey(from->keys() + i, to->keys() + j);
+    new (to->values() + j) Value(std::move(from->values()[i]));
+    from->values()[i].~Value();
+}
+
+template<class Key, class Value, class Compare>
+void BTree<Key, Value, Compare>::insertItem(Leaf* leaf, int i, const Item& item)
+{
+    for (int j = leaf->count_; j > i; --j) {
+        moveItem(leaf, j - 1, leaf, j);
+    }
+    new (leaf->keys() + i) Key(item.first);
+    try {
+        new (leaf->values() + i) Value(item.second);
+    }
+    catch (...) {
+        leaf->keys()[i].~Key();
+        for (int j = i; j < leaf->count_; ++j) {
+            moveItem(leaf, j + 1, leaf, j);
+        }
+        throw;
+    }
+    ++leaf->count_;
+}
+
+template<class Key, class Value, class Compare>
+void BTree<Key, Value, Compare>::eraseItem(Leaf* leaf, int i)
+{
+    leaf->keys()[i].~Key();
+    leaf->values()[i].~Value();
+    for (int j = i + 1; j < leaf->count_; ++j) {
+        moveItem(leaf, j, leaf, j - 1);
+    }
+    --leaf->count_;
+}
+
+/**
+* Drops separator keyIndex and the child to its right.
+*/
+template<class Key, class Value, class Compare>
+void BTree<Key, Value, Compare>::removeChild(Inner* node, int keyIndex)
+{
+    node->keys()[keyIndex].~Key();
+    for (int j = keyIndex + 1; j < node->count_; ++j) {
+        moveKey(node->keys() + j, node->keys() + j - 1);
+        node->children_[j] = node->children_[j + 1];
+    }
+    --node->count_;
+}
+
+/**
+* Inserts the pair, or overwrites the value if the key is already present
+* (like BinarySearchTree::insert). A full leaf is split in half and the
+* new separator is pushed up, splitting inner nodes as needed; the tree
+* only grows taller when the root splits.
+*/
+template<class Key, class Value, class Compare>
+std::pair<typename BTree<Key, Value, Compare>::iterator, bool>
+BTree<Key, Value, Compare>::insert(const std::pair<const Key, Value>& keyValuePair)
+{
+    const Key& key = keyValuePair.first;
+    if (root_ == nullptr) {
+        root_ = new (leafPool_.allocate()) Leaf();
+        depth_ = 0;
+    }
+
+    Inner* path[MAX_DEPTH];
+    int slots[MAX_DEPTH];
+    Leaf* leaf = descend(key, path, slots);
+
+    int i = countLess(leaf->keys(), leaf->count_, key);
+    if (i < leaf->count_ && !keyLess(key, leaf->keys()[i])) {
+        leaf->values()[i] = keyValuePair.second;
+        return std::make_pair(iterator(leaf, i, this), false);
+    }
+
+    if (leaf->count_ < LEAF_ITEMS) {
+        insertItem(leaf, i, keyValuePair);
+        ++size_;
+        return std::make_pair(iterator(leaf, i, this), true);
+    }
+
+    Leaf* right = splitLeaf(leaf);
+    Leaf* target = leaf;
+    if (i > leaf->count_) {
+        target = right;
+        i -= leaf->count_;
+    }
+    insertItem(target, i, keyValuePair);
+    ++size_;
+    insertChild(path, slots, right->keys()[0], right);
+
+    return std::make_pair(iterator(target, i, this), true);
+}
+
+/**
+* Moves the upper half of a full leaf into a new leaf linked in after it.
+*/
+template<class Key, class Value, class Compare>
+typename BTree<Key, Value, Compare>::Leaf* BTree<Key, Value, Compare>::splitLeaf(Leaf* leaf)
+{
+    Leaf* right = new (leafPool_.allocate()) Leaf();
+    int keep = leaf->count_ / 2;
+
+    for (int j = keep; j < leaf->count_; ++j) {
+        moveItem(leaf, j, right, j - keep);
+    }
+    right->count_ = leaf->count_ - keep;
+    leaf->count_ = keep;
+
+    right->next_ = leaf->next_;
+    right->prev_ = leaf;
+    if (leaf->next_) leaf->next_->prev_ = right;
+    leaf->next_ = right;
+
+    return right;
+}
+
+/**
+* Adds separator and the child to its right above the leaf level of path.
+* A node that overflows splits around its middle key, which moves up
+* another level in turn.
+*/
+template<class Key, class Value, class Compare>
+void BTree<Key, Value, Compare>::insertChild(Inner** path, int* slots, const Key& separator, void* child)
+{
+    Key sepKey(separator);
+    void* newChild = child;
+
+    for (int d = depth_ - 1; d >= 0; --d) {
+        Inner* node = path[d];
+        Key* keys = node->keys();
+        int pos = slots[d];
+
+        for (int j = node->count_; j > pos; --j) {
+            moveKey(keys + j - 1, keys + j);
+            node->children_[j + 1] = node->children_[j];
+        }
+        new (keys + pos) Key(std::move(sepKey));
+        node->children_[pos + 1] = newChild;
+        if (++node->count_ <= INNER_KEYS) return;
+
+        const int total = node->count_;
+        const int mid = total / 2;
+        Inner* right = new (innerPool_.allocate()) Inner();
+
+        for (int j = mid + 1; j < total; ++j) {
+            moveKey(keys + j, right->keys() + j - mid - 1);
+        }
+        for (int j = mid + 1; j <= total; ++j) {
+            right->children_[j - mid - 1] = node->children_[j];
+        }
+        right->count_ = total - mid - 1;
+
+        sepKey = std::move(keys[mid]);
+        keys[mid].~Key();
+        node->count_ = mid;
+        newChild = right;
+    }
+
+    Inner* root = new (innerPool_.allocate()) Inner();
+    new (root->keys()) Key(std::move(sepKey));
+    root->children_[0] = root_;
+    root->children_[1] = newChild;
+    root->count_ = 1;
+    root_ = root;
+    ++depth_;
+}
+
+/**
+* Does nothing if the key is not in the tree. Separators are left alone
+* when a leaf's smallest key goes away; they still route correctly.
+*/
+template<class Key, class Value, class Compare>
+void BTree<Key, Value, Compare>::remove(const Key& key)
+{
+    if (root_ == nullptr) return;
+
+    Inner* path[MAX_DEPTH];
+    int slots[MAX_DEPTH];
+    Leaf* leaf = descend(key, path, slots);
+
+    int i = countLess(leaf->keys(), leaf->count_, key);
+    if (i == leaf->count_ || keyLess(key, leaf->keys()[i])) return;
+
+    eraseItem(leaf, i);
+    --size_;
+
+    if (depth_ == 0) {
+        if (leaf->count_ == 0) {
+            leaf->~Leaf();
+            leafPool_.deallocate(leaf);
+            root_ = nullptr;
+        }
+        return;
+    }
+
+    if (leaf->count_ < MIN_LEAF_ITEMS) {
+        fixLeafUnderflow(leaf, path, slots);
+    }
+}
+
+/**
+* Refills a leaf that dropped below half full by borrowing a pair from a
+* sibling that can spare one, or else merges it with a sibling and removes
+* a separator from the parent.
+*/
+template<class Key, class Value, class Compare>
+void BTree<Key, Value, Compare>::fixLeafUnderflow(Leaf* leaf, Inner** path, int* slots)
+{
+    Inner* parent = path[depth_ - 1];
+    int slot = slots[depth_ - 1];
+    Leaf* left = slot > 0 ? static_cast<Leaf*>(parent->children_[slot - 1]) : nullptr;
+    Leaf* right = slot < parent->count_ ? static_cast<Leaf*>(parent->children_[slot + 1]) : nullptr;
+
+    if (left && left->count_ > MIN_LEAF_ITEMS) {
+        for (int j = leaf->count_; j > 0; --j) {
+            moveItem(leaf, j - 1, leaf, j);
+        }
+        moveItem(left, left->count_ - 1, leaf, 0);
+        --left->count_;
+        ++leaf->count_;
+        parent->keys()[slot - 1] = leaf->keys()[0];
+        return;
+    }
+    if (right && right->count_ > MIN_LEAF_ITEMS) {
+        moveItem(right, 0, leaf, leaf->count_);
+        ++leaf->count_;
+        for (int j = 1; j < right->count_; ++j) {
+            moveItem(right, j, right, j - 1);
+        }
+        --right->count_;
+        parent->keys()[slot] = right->keys()[0];
+        return;
+    }
+
+    // Merge the right one of the pair into the left one.
+    int keyIndex = slot;
+    if (left) {
+        right = leaf;
+        leaf = left;
+        keyIndex = slot - 1;
+    }
+    for (int j = 0; j < right->count_; ++j) {
+        moveItem(right, j, leaf, leaf->count_ + j);
+    }
+    leaf->count_ += right->count_;
+    leaf->next_ = right->next_;
+    if (right->next_) right->next_->prev_ = leaf;
+    right->~Leaf();
+    leafPool_.deallocate(right);
+
+    removeChild(parent, keyIndex);
+    fixInnerUnderflow(path, slots, depth_ - 1);
+}
+
+/**
+* Same as fixLeafUnderflow one level up, repeated towards the root. Keys
+* rotate through the parent's separator when borrowing. An empty root is
+* replaced by its only child, which is how the tree gets shorter.
+*/
+template<class Key, class Value, class Compare>
+void BTree<Key, Value, Compare>::fixInnerUnderflow(Inner** path, int* slots, int depth)
+{
+    for (int d = depth; d >= 0; --d) {
+        Inner* node = path[d];
+
+        if (d == 0) {
+            if (node->count_ == 0) {
+                root_ = node->children_[0];
+                --depth_;
+                node->~Inner();
+                innerPool_.deallocate(node);
+            }
+            return;
+        }
+        if (node->count_ >= MIN_INNER_KEYS) return;
+
+        Inner* parent = path[d - 1];
+        int slot = slots[d - 1];
+        Inner* left = slot > 0 ? static_cast<Inner*>(parent->children_[slot - 1]) : nullptr;
+        Inner* right = slot < parent->count_ ? static_cast<Inner*>(parent->children_[slot + 1]) : nullptr;
+
+        if (left && left->count_ > MIN_INNER_KEYS) {
+            for (int j = node->count_; j > 0; --j) {
+                moveKey(node->keys() + j - 1, node->keys() + j);
+            }
+            for (int j = node->count_ + 1; j > 0; --j) {
+                node->children_[j] = node->children_[j - 1];
+            }
+            new (node->keys()) Key(std::move(parent->keys()[slot - 1]));
+            node->children_[0] = left->children_[left->count_];
+            parent->keys()[slot - 1] = std::move(left->keys()[left->count_ - 1]);
+            left->keys()[left->count_ - 1].~Key();
+            --left->count_;
+            ++node->count_;
+            return;
+        }
+        if (right && right->count_ > MIN_INNER_KEYS) {
+            new (node->keys() + node->count_) Key(std::move(parent->keys()[slot]));
+            node->children_[node->count_ + 1] = right->children_[0];
+            ++node->count_;
+            parent->keys()[slot] = std::move(right->keys()[0]);
+            right->keys()[0].~Key();
+            for (int j = 1; j < right->count_; ++j) {
+                moveKey(right->keys() + j, right->keys() + j - 1);
+            }
+            for (int j = 1; j <= right->count_; ++j) {
+                right->children_[j - 1] = right->children_[j];
+            }
+            --right->count_;
+            return;
+        }
+
+        int keyIndex = slot;
+        if (left) {
+            right = node;
+            node = left;
+            keyIndex = slot - 1;
+        }
+        new (node->keys() + node->count_) Key(std::move(parent->keys()[keyIndex]));
+        for (int j = 0; j < right->count_; ++j) {
+            moveKey(right->keys() + j, node->keys() + node->count_ + 1 + j);
+        }
+        for (int j = 0; j <= right->count_; ++j) {
+            node->children_[node->count_ + 1 + j] = right->children_[j];
+        }
+        node->count_ += 1 + right->count_;
+        right->~Inner();
+        innerPool_.deallocate(right);
+
+        removeChild(parent, keyIndex);
+    }
+}
+
+/**
+* Destroys every node and gives the pools' slabs back. With trivially
+* destructible keys and values there is nothing to run, so only the slabs
+* are freed.
+*/
+template<class Key, class Value, class Compare>
+void BTree<Key, Value, Compare>::clear()
+{
+    if (root_ != nullptr && !(std::is_trivially_destructible<Key>::value &&
+                              std::is_trivially_destructible<Value>::value)) {
+        destroySubtree(root_, depth_);
+    }
+    root_ = nullptr;
+    depth_ = 0;
+    size_ = 0;
+    leafPool_.release();
+    innerPool_.release();
+}
+
+/**
+* Recursion only goes as deep as the tree, a handful of levels.
+*/
+template<class Key, class Value, class Compare>
+void BTree<Key, Value, Compare>::destroySubtree(void* node, int depth)
+{
+    if (depth == 0) {
+        Leaf* leaf = static_cast<Leaf*>(node);
+        for (int i = 0; i < leaf->count_; ++i) {
+            leaf->keys()[i].~Key();
+            leaf->values()[i].~Value();
+        }
+        leaf->~Leaf();
+        return;
+    }
+
+    Inner* inner = static_cast<Inner*>(node);
+    for (int i = 0; i <= inner->count_; ++i) {
+        destroySubtree(inner->children_[i], depth - 1);
+    }
+    for (int i = 0; i < inner->count_; ++i) {
+        inner->keys()[i].~Key();
+    }
+    inner->~Inner();
+}
+
+template<class Key, class Value, class Compare>
+bool BTree<Key, Value, Compare>::empty() const
+{
+    return size_ == 0;
+}
+
+template<class Key, class Value, class Compare>
+std::size_t BTree<Key, Value, Compare>::size() const
+{
+    return size_;
+}
+
+template<class Key, class Value, class Compare>
+typename BTree<Key, Value, Compare>::iterator BTree<Key, Value, Compare>::begin()
+{
+    return iterator(root_ ? firstLeaf() : nullptr, 0, this);
+}
+
+template<class Key, class Value, class Compare>
+typename BTree<Key, Value, Compare>::const_iterator BTree<Key, Value, Compare>::begin() const
+{
+    return const_iterator(root_ ? firstLeaf() : nullptr, 0, this);
+}
+
+template<class Key, class Value, class Compare>
+typename BTree<Key, Value, Compare>::iterator BTree<Key, Value, Compare>::end()
+{
+    return iterator(nullptr, 0, this);
+}
+
+template<class Key, class Value, class Compare>
+typename BTree<Key, Value, Compare>::const_iterator BTree<Key, Value, Compare>::end() const
+{
+    return const_iterator(nullptr, 0, this);
+}
+
+template<class Key, class Value, class Compare>
+typename BTree<Key, Value, Compare>::iterator BTree<Key, Value, Compare>::find(const Key& key)
+{
+    int index;
+    Leaf* leaf = internalLowerBound(key, index);
+    if (leaf == nullptr || keyLess(key, leaf->keys()[index])) {
+        return end();
+    }
+    return iterator(leaf, index, this);
+}
+
+template<class Key, class Value, class Compare>
+typename BTree<Key, Value, Compare>::const_iterator BTree<Key, Value, Compare>::find(const Key& key) const
+{
+    return const_cast<BTree<Key, Value, Compare>*>(this)->find(key);
+}
+
+template<class Key, class Value, class Compare>
+typename BTree<Key, Value, Compare>::iterator BTree<Key, Value, Compare>::lower_bound(const Key& key)
+{
+    int index;
+    Leaf* leaf = internalLowerBound(key, index);
+    return iterator(leaf, index, this);
+}
+
+template<class Key, class Value, class Compare>
+typename BTree<Key, Value, Compare>::const_iterator BTree<Key, Value, Compare>::lower_bound(const Key& key) const
+{
+    int index;
+    Leaf* leaf = internalLowerBound(key, index);
+    return const_iterator(leaf, index, this);
+}
+
+template<class Key, class Value, class Compare>
+typename BTree<Key, Value, Compare>::iterator BTree<Key, Value, Compare>::upper_bound(const Key& key)
+{
+    int index;
+    Leaf* leaf = internalUpperBound(key, index);
+    return iterator(leaf, index, this);
+}
+
+template<class Key, class Value, class Compare>
+typename BTree<Key, Value, Compare>::const_iterator BTree<Key, Value, Compare>::upper_bound(const Key& key) const
+{
+    int index;
+    Leaf* leaf = internalUpperBound(key, index);
+    return const_iterator(leaf, index, this);
+}
+
+template<class Key, class Value, class Compare>
+Value& BTree<Key, Value, Compare>::operator[](const Key& key)
+{
+    iterator it = find(key);
+    if(it == end()) throw std::out_of_range("Invalid key");
+    return it->second;
+}
+
+template<class Key, class Value, class Compare>
+Value const & BTree<Key, Value, Compare>::operator[](const Key& key) const
+{
+    const_iterator it = find(key);
+    if(it == end()) throw std::out_of_range("Invalid key");
+    return it->second;
+}
+
+template<class Key, class Value, class Compare>
+Compare BTree<Key, Value, Compare>::key_comp() const
+{
+    return comp_;
+}
+
+/*
+  ----------------------------------------
+  End implementations for the BTree class.
+  ----------------------------------------
+*/
+
+#endif
@@ -0,0 +1,683 @@
+#ifndef COMPACT_AVL_H
+#define COMPACT_AVL_H
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+/**
+ * A node of CompactAVLTree. Children are 32-bit indices into the tree's
+ * node vector rather than pointers, and the balance factor lives in the
+ * top two bits of the left link, so a node costs 8 bytes on top of its
+ * key/value pair (no vptr, no parent link, no size field).
+ */
+template<typename Key, typename Value>
+class CompactAVLNode
+{
+public:
+    typedef std::uint32_t Index;
+
+    // 30 bits are left for the index; the all-ones value means "no child".
+    static const Index NIL = 0x3FFFFFFFu;
+
+    CompactAVLNode(const Key& key, const Value& value);
+
+    Index getChild(int dir) const;
+    void setChild(int dir, Index child);
+    int getBalance() const;
+    void setBalance(int balance);
+
+    std::pair<Key, Value> item_;
+
+private:
+    static const Index INDEX_MASK = 0x3FFFFFFFu;
+    static const int BALANCE_SHIFT = 30;
+
+    Index links_[2];
+};
+
+/*
+  ------------------------------------------------------
+  Begin implementations for the CompactAVLNode class.
+  ------------------------------------------------------
+*/
+
+/**
+* A new node is a leaf with balance 0.
+*/
+template<typename Key, typename Value>
+CompactAVLNode<Key, Value>::CompactAVLNode(const Key& key, const Value& value) :
+    item_(key, value)
+{
+    links_[0] = NIL | (1u << BALANCE_SHIFT);
+    links_[1] = NIL;
+}
+
+/**
+* dir is 0 for the left child and 1 for the right one.
+*/
+template<typename Key, typename Value>
+inline std::uint32_t CompactAVLNode<Key, Value>::getChild(int dir) const
+{
+    return links_[dir] & INDEX_MASK;
+}
+
+template<typename Key, typename Value>
+inline void CompactAVLNode<Key, Value>::setChild(int dir, Index child)
+{
+    links_[dir] = (links_[dir] & ~INDEX_MASK) | child;
+}
+
+/**
+* The balance (-1, 0 or 1) is stored offset by one in the spare bits.
+*/
+template<typename Key, typename Value>
+inline int CompactAVLNode<Key, Value>::getBalance() const
+{
+    return static_cast<int>(links_[0] >> BALANCE_SHIFT) - 1;
+}
+
+template<typename Key, typename Value>
+inline void CompactAVLNode<Key, Value>::setBalance(int balance)
+{
+    links_[0] = (links_[0] & INDEX_MASK) | (static_cast<Index>(balance + 1) << BALANCE_SHIFT);
+}
+
+/*
+  ----------------------------------------------------
+  End implementations for the CompactAVLNode class.
+  ----------------------------------------------------
+*/
+
+
+/**
+ * An AVL tree for large maps of small keys and values. All nodes sit in
+ * one contiguous vector and refer to each other by index, which keeps the
+ * per-node overhead to 8 bytes (an AVLNode carries 40 or more) and lets
+ * the whole tree be reserved up front.
+ *
+ * Without parent links, insert and remove remember the path they took on
+ * a small fixed-size stack and retrace along it. Removing a node moves the
+ * last node of the vector into the hole, so the vector never has gaps.
+ * That also means pointers, references and iterators into the tree are
+ * invalidated by any insert or remove.
+ *
+ * Up to 2^30 - 1 nodes are supported; an AVL tree of that size is well
+ * under MAX_HEIGHT levels deep.
+ */
+template<typename Key, typename Value, typename Compare = std::less<Key> >
+class CompactAVLTree
+{
+public:
+    typedef CompactAVLNode<Key, Value> NodeType;
+    typedef typename NodeType::Index Index;
+
+    static const int MAX_HEIGHT = 64;
+
+    /**
+     * Forward iterator over the pairs in key order. It carries the
+     * ancestors it still has to visit, so it needs no parent links.
+     */
+    class const_iterator
+    {
+    public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef std::pair<Key, Value> value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef const std::pair<Key, Value>* pointer;
+        typedef const std::pair<Key, Value>& reference;
+
+        const_iterator();
+
+        const std::pair<Key, Value>& operator*() const;
+        const std::pair<Key, Value>* operator->() const;
+
+        bool operator==(const const_iterator& rhs) const;
+        bool operator!=(const const_iterator& rhs) const;
+
+        const_iterator& operator++();
+        const_iterator operator++(int);
+
+    protected:
+        friend class CompactAVLTree<Key, Value, Compare>;
+        explicit const_iterator(const CompactAVLTree<Key, Value, Compare>* tree);
+        void pushLeftSpine(Index node);
+
+        const CompactAVLTree<Key, Value, Compare>* tree_;
+        Index stack_[MAX_HEIGHT];
+        int depth_;
+    };
+
+    typedef Compare key_compare;
+
+    CompactAVLTree();
+    explicit CompactAVLTree(const Compare& comp);
+
+    bool insert(const std::pair<Key, Value>& keyValuePair);
+    void remove(const Key& key);
+    void clear();
+    void reserve(std::size_t n);
+
+    const_iterator begin() const;
+    const_iterator end() const;
+    const_iterator find(const Key& key) const;
+    Value& operator[](const Key& key);
+    Value const & operator[](const Key& key) const;
+
+    bool empty() const;
+    std::size_t size() const;
+    int height() const;
+    std::size_t memoryUsage() const;
+    Compare key_comp() const;
+
+protected:
+    bool keyLess(const Key& a, const Key& b) const;
+    Index findIndex(const Key& key) const;
+    Index rotate(Index node, int dir);
+    Index rebalance(Index node, int dir);
+    void relink(const Index* path, const int* dirs, int depth, Index child);
+    void eraseSlot(Index slot);
+
+    std::vector<NodeType> nodes_;
+    Index root_;
+    int height_;
+    Compare comp_;
+};
+
+/*
+  ------------------------------------------------------------------
+  Begin implementations for the CompactAVLTree::const_iterator class.
+  ------------------------------------------------------------------
+*/
+
+template<typename Key, typename Value, typename Compare>
+CompactAVLTree<Key, Value, Compare>::const_iterator::const_iterator() :
+    tree_(nullptr),
+    depth_(0)
+{
+
+}
+
+template<typename Key, typename Value, typename Compare>
+CompactAVLTree<Key, Value, Compare>::const_iterator::const_iterator(const CompactAVLTree<Key, Value, Compare>* tree) :
+    tree_(tree),
+    depth_(0)
+{
+
+}
+
+template<typename Key, typename Value, typename Compare>
+void CompactAVLTree<Key, Value, Compare>::const_iterator::pushLeftSpine(Index node)
+{
+    while (node != NodeType::NIL) {
+        stack_[depth_++] = node;
+        node = tree_->nodes_[node].getChild(0);
+    }
+}
+
+template<typename Key, typename Value, typename Compare>
+const std::pair<Key, Value>&
+CompactAVLTree<Key, Value, Compare>::const_iterator::operator*() const
+{
+    return tree_->nodes_[stack_[depth_ - 1]].item_;
+}
+
+template<typename Key, typename Value, typename Compare>
+const std::pair<Key, Value>*
+CompactAVLTree<Key, Value, Compare>::const_iterator::operator->() const
+{
+    return &(tree_->nodes_[stack_[depth_ - 1]].item_);
+}
+
+/**
+* Iterators at the same position have the same current node; end() is the
+* only one with an empty stack.
+*/
+template<typename Key, typename Value, typename Compare>
+bool CompactAVLTree<Key, Value, Compare>::const_iterator::operator==(const const_iterator& rhs) const
+{
+    if (depth_ == 0 || rhs.depth_ == 0) {
+        return depth_ == rhs.depth_;
+    }
+    return stack_[depth_ - 1] == rhs.stack_[rhs.depth_ - 1];
+}
+
+template<typename Key, typename Value, typename Compare>
+bool CompactAVLTree<Key, Value, Compare>::const_iterator::operator!=(const const_iterator& rhs) const
+{
+    return !(*this == rhs);
+}
+
+template<typename Key, typename Value, typename Compare>
+typename CompactAVLTree<Key, Value, Compare>::const_iterator&
+CompactAVLTree<Key, Value, Compare>::const_iterator::operator++()
+{
+    Index current = stack_[--depth_];
+    pushLeftSpine(tree_->nodes_[current].getChild(1));
+    return *this;
+}
+
+template<typename Key, typename Value, typename Compare>
+typename CompactAVLTree<Key, Value, Compare>::const_iterator
+CompactAVLTree<Key, Value, Compare>::const_iterator::operator++(int)
+{
+    const_iterator old = *this;
+    ++(*this);
+    return old;
+}
+
+/*
+  ----------------------------------------------------------------
+  End implementations for the CompactAVLTree::const_iterator class.
+  ----------------------------------------------------------------
+*/
+
+/*
+  ------------------------------------------------------
+  Begin implementations for the CompactAVLTree class.
+  ------------------------------------------------------
+*/
+
+template<typename Key, typename Value, typename Compare>
+CompactAVLTree<Key, Value, Compare>::CompactAVLTree() :
+    root_(NodeType::NIL),
+    height_(0),
+    comp_()
+{
+
+}
+
+template<typename Key, typename Value, typename Compare>
+CompactAVLTree<Key, Value, Compare>::CompactAVLTree(const Compare& comp) :
+    root_(NodeType::NIL),
+    height_(0),
+    comp_(comp)
+{
+
+}
+
+/**
+* Inserts the pair, or overwrites the value if the key is already present
+* (like BinarySearchTree::insert). Returns true if a node was added.
+*/
+template<typename Key, typename Value, typename Compare>
+bool CompactAVLTree<Key, Value, Compare>::insert(const std::pair<Key, Value>& keyValuePair)
+{
+    const Key& key = keyValuePair.first;
+    Index path[MAX_HEIGHT];
+    int dirs[MAX_HEIGHT];
+    int depth = 0;
+
+    // One comparison per level; the last node we went right from is the
+    // only one that can hold an equal key.
+    Index candidate = NodeType::NIL;
+    Index current = root_;
+    while (current != NodeType::NIL) {
+        int dir = 1;
+        if (keyLess(key, nodes_[current].item_.first)) {
+            dir = 0;
+        }
+        else {
+            candidate = current;
+        }
+        path[depth] = current;
+        dirs[depth] = dir;
+        ++depth;
+        current = nodes_[current].getChild(dir);
+    }
+
+    if (candidate != NodeType::NIL && !keyLess(nodes_[candidate].item_.first, key)) {
+        nodes_[candidate].item_.second = keyValuePair.second;
+        return false;
+    }
+
+    if (nodes_.size() >= NodeType::NIL) {
+        throw std::length_error("CompactAVLTree is full");
+    }
+    Index node = static_cast<Index>(nodes_.size());
+    nodes_.push_back(NodeType(keyValuePair.first, keyValuePair.second));
+    relink(path, dirs, depth, node);
+
+    // Retrace until a subtree stops growing.
+    for (int i = depth - 1; i >= 0; --i) {
+        NodeType& parent = nodes_[path[i]];
+        int diff = dirs[i] ? 1 : -1;
+        int balance = parent.getBalance() + diff;
+
+        if (balance == 0) {
+            parent.setBalance(0);
+            return true;
+        }
+        if (balance != diff) {
+            relink(path, dirs, i, rebalance(path[i], dirs[i]));
+            return true;
+        }
+        parent.setBalance(balance);
+    }
+
+    ++height_;
+    return true;
+}
+
+/**
+* Does nothing if the key is not in the tree.
+*/
+template<typename Key, typename Value, typename Compare>
+void CompactAVLTree<Key, Value, Compare>::remove(const Key& key)
+{
+    Index path[MAX_HEIGHT];
+    int dirs[MAX_HEIGHT];
+    int depth = 0;
+
+    Index current = root_;
+    while (current != NodeType::NIL) {
+        const Key& nodeKey = nodes_[current].item_.first;
+        int dir;
+        if (keyLess(key, nodeKey)) dir = 0;
+        else if (keyLess(nodeKey, key)) dir = 1;
+        else break;
+        path[depth] = current;
+        dirs[depth] = dir;
+        ++depth;
+        current = nodes_[current].getChild(dir);
+    }
+    if (current == NodeType::NIL) return;
+
+    // A node with two children trades places with its predecessor, which
+    // has no right child, and that node is unlinked instead.
+    Index victim = current;
+    if (nodes_[current].getChild(0) != NodeType::NIL && nodes_[current].getChild(1) != NodeType::NIL) {
+        path[depth] = current;
+        dirs[depth] = 0;
+        ++depth;
+        victim = nodes_[current].getChild(0);
+        while (nodes_[victim].getChild(1) != NodeType::NIL) {
+            path[depth] = victim;
+            dirs[depth] = 1;
+            ++depth;
+            victim = nodes_[victim].getChild(1);
+        }
+        std::swap(nodes_[current].item_, nodes_[victim].item_);
+    }
+
+    Index child = nodes_[victim].getChild(0);
+    if (child == NodeType::NIL) {
+        child = nodes_[victim].getChild(1);
+    }
+    relink(path, dirs, depth, child);
+
+    // Retrace until a subtree keeps its height.
+    bool shrank = true;
+    for (int i = depth - 1; i >= 0; --i) {
+        NodeType& node = nodes_[path[i]];
+        int diff = dirs[i] ? -1 : 1;
+        int balance = node.getBalance() + diff;
+
+        if (balance == diff) {
+            node.setBalance(balance);
+            shrank = false;
+            break;
+        }
+        if (balance != 0) {
+            Index top = rebalance(path[i], diff > 0 ? 1 : 0);
+            relink(path, dirs, i, top);
+            if (nodes_[top].getBalance() != 0) {
+                shrank = false;
+                break;
+            }
+        }
+        else {
+            node.setBalance(0);
+        }
+    }
+    if (shrank) {
+        --height_;
+    }
+
+    eraseSlot(victim);
+}
+
+/**
+* Frees the storage of every node.
+*/
+template<typename Key, typename Value, typename Compare>
+void CompactAVLTree<Key, Value, Compare>::clear()
+{
+    std::vector<NodeType>().swap(nodes_);
+    root_ = NodeType::NIL;
+    height_ = 0;
+}
+
+/**
+* Reserves room for n nodes so that filling the tree does not reallocate.
+*/
+template<typename Key, typename Value, typename Compare>
+void CompactAVLTree<Key, Value, Compare>::reserve(std::size_t n)
+{
+    nodes_.reserve(n);
+}
+
+template<typename Key, typename Value, typename Compare>
+typename CompactAVLTree<Key, Value, Compare>::const_iterator
+CompactAVLTree<Key, Value, Compare>::begin() const
+{
+    const_iterator it(this);
+    it.pushLeftSpine(root_);
+    return it;
+}
+
+template<typename Key, typename Value, typename Compare>
+typename CompactAVLTree<Key, Value, Compare>::const_iterator
+CompactAVLTree<Key, Value, Compare>::end() const
+{
+    return const_iterator(this);
+}
+
+/**
+* The ancestors we went left from are exactly the nodes the iterator
+* still has to visit, so they are collected on the way down.
+*/
+template<typename Key, typename Value, typename Compare>
+typename CompactAVLTree<Key, Value, Compare>::const_iterator
+CompactAVLTree<Key, Value, Compare>::find(const Key& key) const
+{
+    const_iterator it(this);
+    Index current = root_;
+    while (current != NodeType::NIL) {
+        const Key& nodeKey = nodes_[current].item_.first;
+        if (keyLess(key, nodeKey)) {
+            it.stack_[it.depth_++] = current;
+            current = nodes_[current].getChild(0);
+        }
+        else if (keyLess(nodeKey, key)) {
+            current = nodes_[current].getChild(1);
+        }
+        else {
+            it.stack_[it.depth_++] = current;
+            return it;
+        }
+    }
+    return end();
+}
+
+template<typename Key, typename Value, typename Compare>
+Value& CompactAVLTree<Key, Value, Compare>::operator[](const Key& key)
+{
+    Index node = findIndex(key);
+    if(node == NodeType::NIL) throw std::out_of_range("Invalid key");
+    return nodes_[node].item_.second;
+}
+
+template<typename Key, typename Value, typename Compare>
+Value const & CompactAVLTree<Key, Value, Compare>::operator[](const Key& key) const
+{
+    Index node = findIndex(key);
+    if(node == NodeType::NIL) throw std::out_of_range("Invalid key");
+    return nodes_[node].item_.second;
+}
+
+template<typename Key, typename Value, typename Compare>
+bool CompactAVLTree<Key, Value, Compare>::empty() const
+{
+    return root_ == NodeType::NIL;
+}
+
+template<typename Key, typename Value, typename Compare>
+std::size_t CompactAVLTree<Key, Value, Compare>::size() const
+{
+    return nodes_.size();
+}
+
+/**
+* O(1), kept up to date by insert and remove.
+*/
+template<typename Key, typename Value, typename Compare>
+int CompactAVLTree<Key, Value, Compare>::height() const
+{
+    return height_;
+}
+
+/**
+* Bytes held by the node vector, including reserved but unused capacity.
+*/
+template<typename Key, typename Value, typename Compare>
+std::size_t CompactAVLTree<Key, Value, Compare>::memoryUsage() const
+{
+    return nodes_.capacity() * sizeof(NodeType);
+}
+
+template<typename Key, typename Value, typename Compare>
+Compare CompactAVLTree<Key, Value, Compare>::key_comp() const
+{
+    return comp_;
+}
+
+template<typename Key, typename Value, typename Compare>
+inline bool CompactAVLTree<Key, Value, Compare>::keyLess(const Key& a, const Key& b) const
+{
+    return comp_(a, b);
+}
+
+template<typename Key, typename Value, typename Compare>
+typename CompactAVLTree<Key, Value, Compare>::Index
+CompactAVLTree<Key, Value, Compare>::findIndex(const Key& key) const
+{
+    Index current = root_;
+    while (current != NodeType::NIL) {
+        const Key& nodeKey = nodes_[current].item_.first;
+        if (keyLess(key, nodeKey)) current = nodes_[current].getChild(0);
+        else if (keyLess(nodeKey, key)) current = nodes_[current].getChild(1);
+        else break;
+    }
+    return current;
+}
+
+/**
+* Lifts node's child on side dir into its place and returns it. The
+* caller hooks the result back into the tree.
+*/
+template<typename Key, typename Value, typename Compare>
+typename CompactAVLTree<Key, Value, Compare>::Index
+CompactAVLTree<Key, Value, Compare>::rotate(Index node, int dir)
+{
+    Index child = nodes_[node].getChild(dir);
+    nodes_[node].setChild(dir, nodes_[child].getChild(1 - dir));
+    nodes_[child].setChild(1 - dir, node);
+    return child;
+}
+
+/**
+* Same cases as AVLTree::rebalance: node leans two levels towards dir.
+* Returns the new root of the subtree.
+*/
+template<typename Key, typename Value, typename Compare>
+typename CompactAVLTree<Key, Value, Compare>::Index
+CompactAVLTree<Key, Value, Compare>::rebalance(Index node, int dir)
+{
+    int heavy = dir ? 1 : -1;
+    Index pivot = nodes_[node].getChild(dir);
+    int pivotBalance = nodes_[pivot].getBalance();
+
+    if (pivotBalance != -heavy) {
+        rotate(node, dir);
+        if (pivotBalance == 0) {
+            nodes_[node].setBalance(heavy);
+            nodes_[pivot].setBalance(-heavy);
+        }
+        else {
+            nodes_[node].setBalance(0);
+            nodes_[pivot].setBalance(0);
+        }
+        return pivot;
+    }
+
+    Index grandchild = nodes_[pivot].getChild(1 - dir);
+    int grandBalance = nodes_[grandchild].getBalance();
+
+    nodes_[node].setChild(dir, rotate(pivot, 1 - dir));
+    rotate(node, dir);
+
+    nodes_[node].setBalance(grandBalance == heavy ? -heavy : 0);
+    nodes_[pivot].setBalance(grandBalance == -heavy ? heavy : 0);
+    nodes_[grandchild].setBalance(0);
+    return grandchild;
+}
+
+/**
+* Hangs child where path[depth] would go: under path[depth - 1] on side
+* dirs[depth - 1], or at the root when depth is 0.
+*/
+template<typename Key, typename Value, typename Compare>
+void CompactAVLTree<Key, Value, Compare>::relink(const Index* path, const int* dirs, int depth, Index child)
+{
+    if (depth == 0) {
+        root_ = child;
+    }
+    else {
+        nodes_[path[depth - 1]].setChild(dirs[depth - 1], child);
+    }
+}
+
+/**
+* Releases the storage of an unlinked node by moving the last node of the
+* vector into its slot and pointing that node's parent at the new index.
+*/
+template<typename Key, typename Value, typename Compare>
+void CompactAVLTree<Key, Value, Compare>::eraseSlot(Index slot)
+{
+    Index last = static_cast<Index>(nodes_.size() - 1);
+
+    if (slot != last) {
+        const Key& key = nodes_[last].item_.first;
+        if (root_ == last) {
+            root_ = slot;
+        }
+        else {
+            Index parent = root_;
+            for (;;) {
+                int dir = keyLess(key, nodes_[parent].item_.first) ? 0 : 1;
+                Index child = nodes_[parent].getChild(dir);
+                if (child == last) {
+                    nodes_[parent].setChild(dir, slot);
+                    break;
+                }
+                parent = child;
+            }
+        }
+        nodes_[slot] = std::move(nodes_[last]);
+    }
+
+    nodes_.pop_back();
+}
+
+/*
+  ----------------------------------------------------
+  End implementations for the CompactAVLTree class.
+  ----------------------------------------------------
+*/
+
+#endif
@@ -0,0 +1,455 @@
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <cmath>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <set>
+#include <thread>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+#include "concurrent_avl.h"
+
+using namespace std;
+
+// Every thread runs mixed operations on the same few keys, so writers race
+// on every key. Each operation is stamped from one global clock when it is
+// called and when it returns, and afterwards each key's history is checked
+// against a sequential map: some order of the operations that respects
+// those stamps must give every result that was returned. Linearizability
+// is local, so checking every key on its own covers the whole map. Each
+// write stores a value no other write uses, so a read names the write it
+// saw.
+const int THREADS = 4;
+const int SHARED_KEYS = 64;
+const int OPS_PER_THREAD = 40000;
+const int SCAN_WIDTH = 8;
+const long ABSENT = -1;
+
+// A wider key space for the structural stress afterwards.
+const int STRESS_KEYS = 20000;
+const int STRESS_OPS_PER_THREAD = 100000;
+
+enum OpType { INSERT, TRY_INSERT, REMOVE, FIND };
+
+struct Op
+{
+    OpType type;
+    long arg;       // the value INSERT and TRY_INSERT write
+    long result;    // FIND: the value seen or ABSENT; others: what the call returned
+    long call;
+    long ret;
+};
+
+typedef vector<vector<Op> > History;   // indexed by key
+
+atomic<bool> failed(false);
+atomic<long> ticks(0);
+
+void fail(const char* msg)
+{
+    cout << "FAILED: " << msg << endl;
+    failed = true;
+}
+
+// Exposes the nodes so that the shape can be checked once every thread
+// has finished.
+class CheckedConcurrentAVLTree : public ConcurrentAVLTree<int,long>
+{
+public:
+    // Keys in order, parent links matching child links, no unlinked node
+    // still reachable, and size() equal to the number of keys. With strict,
+    // also exact heights, every node within AVL balance and no routing node
+    // with fewer than two children: balance is relaxed, so racing writers
+    // can leave a little of that unrepaired, but a tree only one thread
+    // has written must be a proper AVL tree.
+    bool valid(bool strict) const
+    {
+        const Node* root = holder_.child(RIGHT);
+        if(root != nullptr && root->parent_.load() != &holder_) return false;
+        size_t count = 0;
+        int height;
+        return validNode(root, nullptr, nullptr, strict, count, height) && count == size();
+    }
+
+    int depth() const
+    {
+        return depthOf(holder_.child(RIGHT));
+    }
+
+private:
+    bool validNode(const Node* node, const int* lo, const int* hi, bool strict,
+                   size_t& count, int& height) const
+    {
+        height = 0;
+        if(node == nullptr) return true;
+        const int& key = node->key();
+        if((lo != nullptr && key <= *lo) || (hi != nullptr && key >= *hi)) return false;
+        Version version = node->version_.load();
+        if(isUnlinked(version) || isChanging(version)) return false;
+
+        const Node* left = node->child(LEFT);
+        const Node* right = node->child(RIGHT);
+        if(left != nullptr && left->parent_.load() != node) return false;
+        if(right != nullptr && right->parent_.load() != node) return false;
+        if(node->value_.load() != nullptr) ++count;
+        else if(strict && (left == nullptr || right == nullptr)) return false;
+
+        int hLeft, hRight;
+        if(!validNode(left, lo, &key, strict, count, hLeft) ||
+           !validNode(right, &key, hi, strict, count, hRight)) {
+            return false;
+        }
+        height = 1 + max(hLeft, hRight);
+        return !strict || (node->height_.load() == height && abs(hLeft - hRight) <= 1);
+    }
+
+    int depthOf(const Node* node) const
+    {
+        if(node == nullptr) return 0;
+        return 1 + max(depthOf(node->child(LEFT)), depthOf(node->child(RIGHT)));
+    }
+};
+
+void worker(ConcurrentAVLTree<int,long>& tree, int id, History& history)
+{
+    mt19937 rng(id);
+    for(int i = 0; i < OPS_PER_THREAD && !failed; ++i) {
+        int key = (int)(rng() % SHARED_KEYS);
+        unsigned choice = rng() % 100;
+        Op op;
+        op.arg = (long)id * OPS_PER_THREAD + i;
+
+        if(choice < 3) {
+            // A scan is recorded as a read of every key in its range.
+            vector<long> seen(SCAN_WIDTH, ABSENT);
+            int prev = INT_MIN;
+            op.type = FIND;
+            op.call = ticks++;
+            tree.range_scan(key, key + SCAN_WIDTH, [&](const pair<const int,long>& kv) {
+                if(kv.first <= prev || kv.first < key || kv.first >= key + SCAN_WIDTH) {
+                    fail("scan out of order or out of range");
+                }
+                else {
+                    seen[kv.first - key] = kv.second;
+                }
+                prev = kv.first;
+            });
+            op.ret = ticks++;
+            for(int k = key; k < key + SCAN_WIDTH && k < SHARED_KEYS; ++k) {
+                op.result = seen[k - key];
+                history[k].push_back(op);
+            }
+            continue;
+        }
+
+        op.call = ticks++;
+        if(choice < 35) {
+            op.type = INSERT;
+            op.result = tree.insert(make_pair(key, op.arg));
+        }
+        else if(choice < 50) {
+            op.type = TRY_INSERT;
+            op.result = tree.try_insert(make_pair(key, op.arg));
+        }
+        else if(choice < 80) {
+            op.type = REMOVE;
+            op.result = tree.remove(key);
+        }
+        else {
+            long value;
+            op.type = FIND;
+            op.result = tree.find(key, value) ? value : ABSENT;
+        }
+        op.ret = ticks++;
+        history[key].push_back(op);
+    }
+}
+
+// One step of a sequential map restricted to a single key: false if op
+// could not have returned its result in state, otherwise state moves on.
+bool apply(const Op& op, long& state)
+{
+    switch(op.type) {
+    case INSERT:
+        if(op.result != (state == ABSENT)) return false;
+        state = op.arg;
+        return true;
+    case TRY_INSERT:
+        if(op.result != (state == ABSENT)) return false;
+        if(state == ABSENT) state = op.arg;
+        return true;
+    case REMOVE:
+        if(op.result != (state != ABSENT)) return false;
+        state = ABSENT;
+        return true;
+    default:
+        return op.result == state;
+    }
+}
+
+// Which ops of a segment have been linearized, one bit each, and the
+// state they left the key in.
+struct Config
+{
+    vector<unsigned long long> done;
+    long state;
+
+    bool isDone(size_t i) const { return (done[i / 64] >> (i % 64)) & 1; }
+    void flip(size_t i) { done[i / 64] ^= 1ULL << (i % 64); }
+    bool operator==(const Config& other) const { return state == other.state && done == other.done; }
+};
+
+struct ConfigHash
+{
+    size_t operator()(const Config& config) const
+    {
+        size_t h = hash<long>()(config.state);
+        for(size_t i = 0; i < config.done.size(); ++i) {
+            h = h * 1000003 ^ hash<unsigned long long>()(config.done[i]);
+        }
+        return h;
+    }
+};
+
+// Depth-first over the orders of ops (sorted by call) that respect real
+// time: the next one linearized must have been called before every op
+// still pending returned. Adds every state a complete order can end in to
+// finals.
+void search(const vector<Op>& ops, Config& config, size_t left,
+            unordered_set<Config, ConfigHash>& seen, set<long>& finals)
+{
+    if(!seen.insert(config).second) return;
+    if(left == 0) {
+        finals.insert(config.state);
+        return;
+    }
+
+    size_t first = 0;
+    while(config.done[first / 64] == ~0ULL) first += 64;
+    while(config.isDone(first)) ++first;
+    // An op called after some pending op returned cannot go next, and
+    // neither can any op called after it.
+    long firstReturn = LONG_MAX;
+    size_t end = first;
+    for(; end < ops.size() && ops[end].call < firstReturn; ++end) {
+        if(!config.isDone(end)) firstReturn = min(firstReturn, ops[end].ret);
+    }
+    for(size_t i = first; i < end; ++i) {
+        long state = config.state;
+        if(ops[i].call < firstReturn && !config.isDone(i) && apply(ops[i], config.state)) {
+            config.flip(i);
+            search(ops, config, left - 1, seen, finals);
+            config.flip(i);
+        }
+        config.state = state;
+    }
+}
+
+// Checks one key's history and returns the values it may have ended with
+// (empty if no valid order exists). The history is cut wherever no
+// operation is in flight, and only the states possible at each cut are
+// carried across it.
+set<long> linearize(vector<Op> ops)
+{
+    sort(ops.begin(), ops.end(), [](const Op& a, const Op& b) { return a.call < b.call; });
+    set<long> states;
+    states.insert(ABSENT);
+    size_t begin = 0;
+    while(begin < ops.size() && !states.empty()) {
+        size_t end = begin + 1;
+        long lastReturn = ops[begin].ret;
+        while(end < ops.size() && ops[end].call < lastReturn) {
+            lastReturn = max(lastReturn, ops[end].ret);
+            ++end;
+        }
+
+        vector<Op> segment(ops.begin() + begin, ops.begin() + end);
+        unordered_set<Config, ConfigHash> seen;
+        set<long> finals;
+        for(set<long>::const_iterator it = states.begin(); it != states.end(); ++it) {
+            Config config;
+            config.done.assign(segment.size() / 64 + 1, 0);
+            config.state = *it;
+            search(segment, config, segment.size(), seen, finals);
+        }
+        states.swap(finals);
+        begin = end;
+    }
+    return states;
+}
+
+size_t testLinearizable()
+{
+    ConcurrentAVLTree<int,long> tree;
+    vector<History> histories(THREADS, History(SHARED_KEYS));
+    vector<thread> threads;
+    for(int t = 0; t < THREADS; ++t) {
+        threads.push_back(thread(worker, std::ref(tree), t, std::ref(histories[t])));
+    }
+    for(size_t i = 0; i < threads.size(); ++i) {
+        threads[i].join();
+    }
+
+    size_t checked = 0;
+    size_t expectedSize = 0;
+    for(int key = 0; key < SHARED_KEYS && !failed; ++key) {
+        vector<Op> ops;
+        for(int t = 0; t < THREADS; ++t) {
+            ops.insert(ops.end(), histories[t][key].begin(), histories[t][key].end());
+        }
+        checked += ops.size();
+        set<long> finals = linearize(ops);
+        if(finals.empty()) {
+            cout << "key " << key << ": ";
+            fail("history is not linearizable");
+            break;
+        }
+
+        // The tree must have ended in a state some valid order ends in.
+        long value;
+        long final = tree.find(key, value) ? value : ABSENT;
+        if(finals.count(final) == 0) fail("final value not reachable by any valid order");
+        if(final != ABSENT) ++expectedSize;
+    }
+    if(tree.size() != expectedSize) fail("final size");
+    return checked;
+}
+
+// One thread's inserts and removes must keep the tree strictly balanced,
+// including through removes that leave routing nodes behind.
+void testSequentialBalance()
+{
+    CheckedConcurrentAVLTree tree;
+    mt19937 rng(7);
+    for(int i = 0; i < STRESS_OPS_PER_THREAD && !failed; ++i) {
+        int key = (int)(rng() % 2000);
+        if(rng() % 2) tree.insert(make_pair(key, (long)key));
+        else tree.remove(key);
+        if(i % 1000 == 0 && !tree.valid(true)) fail("sequential tree not balanced");
+    }
+    if(!tree.valid(true)) fail("sequential tree not balanced");
+}
+
+// Many keys, so that concurrent inserts and removes keep rotating and
+// unlinking all over the tree; once the threads stop, the tree must be
+// in order with nothing unlinked left in it, and no deeper than balance
+// that is only slightly relaxed allows.
+void testStructure()
+{
+    CheckedConcurrentAVLTree tree;
+    vector<thread> threads;
+    for(int t = 0; t < THREADS; ++t) {
+        threads.push_back(thread([&tree, t]() {
+            mt19937 rng(100 + t);
+            // Ascending runs force rotations along one spine.
+            for(int key = t; key < STRESS_KEYS; key += THREADS) {
+                tree.insert(make_pair(key, (long)key));
+            }
+            for(int i = 0; i < STRESS_OPS_PER_THREAD && !failed; ++i) {
+                int key = (int)(rng() % STRESS_KEYS);
+                unsigned choice = rng() % 100;
+                if(choice < 45) {
+                    tree.insert(make_pair(key, (long)key));
+                }
+                else if(choice < 90) {
+                    tree.remove(key);
+                }
+                else if(choice < 99) {
+                    long value;
+                    if(tree.find(key, value) && value != key) fail("value belongs to another key");
+                }
+                else {
+                    int prev = INT_MIN;
+                    tree.range_scan(key, key + 100, [&](const pair<const int,long>& kv) {
+                        if(kv.first <= prev || kv.first != kv.second) fail("scan out of order");
+                        prev = kv.first;
+                    });
+                }
+            }
+        }));
+    }
+    for(size_t i = 0; i < threads.size(); ++i) {
+        threads[i].join();
+    }
+
+    if(!tree.valid(false)) fail("tree not valid after stress");
+    // An AVL tree of n keys is under 1.45 log2(n + 2) deep.
+    if(tree.depth() > 1.5 * log2(tree.size() + 2.0) + 2) fail("tree too deep after stress");
+    size_t count = 0;
+    tree.for_each([&](const pair<const int,long>& kv) {
+        long value;
+        if(!tree.find(kv.first, value) || value != kv.second) fail("for_each and find disagree");
+        ++count;
+    });
+    if(count != tree.size()) fail("for_each count");
+
+    tree.clear();
+    if(!tree.empty() || !tree.valid(true) || tree.contains(0)) fail("clear");
+    tree.insert(make_pair(7, 7L));
+    if(!tree.valid(true) || tree.size() != 1) fail("insert after clear");
+}
+
+// Two clear() calls, and a scan, share the gate: each node must be
+// retired by only one of them. A node retired twice is deleted twice,
+// which -fsanitize=address reports.
+void testConcurrentClear()
+{
+    CheckedConcurrentAVLTree tree;
+    for(int round = 0; round < 500 && !failed; ++round) {
+        for(int key = 0; key < 200; ++key) {
+            tree.insert(make_pair(key, (long)key));
+        }
+        atomic<int> ready(0);
+        vector<thread> threads;
+        for(int t = 0; t < 3; ++t) {
+            threads.push_back(thread([&tree, &ready, t]() {
+                ++ready;
+                while(ready < 3) this_thread::yield();
+                if(t < 2) {
+                    tree.clear();
+                }
+                else {
+                    tree.for_each([](const pair<const int,long>& kv) {
+                        if(kv.first != kv.second) fail("scan during clear");
+                    });
+                }
+            }));
+        }
+        for(size_t i = 0; i < threads.size(); ++i) {
+            threads[i].join();
+        }
+        if(!tree.empty() || !tree.valid(true) || tree.contains(0)) fail("concurrent clear");
+    }
+}
+
+void testCustomOrder()
+{
+    ConcurrentAVLTree<int,long,std::greater<int> > tree;
+    for(int key = 0; key < 100; ++key) {
+        tree.insert(make_pair(key, (long)key));
+    }
+    int expected = 99;
+    tree.for_each([&](const pair<const int,long>& kv) {
+        if(kv.first != expected--) fail("custom order");
+    });
+    int seen = 0;
+    tree.range_scan(60, 50, [&](const pair<const int,long>&) { ++seen; });
+    if(seen != 10 || expected != -1) fail("custom order range");
+}
+
+int main(int argc, char *argv[])
+{
+    size_t checked = testLinearizable();
+    if(!failed) testSequentialBalance();
+    if(!failed) testStructure();
+    if(!failed) testConcurrentClear();
+    if(!failed) testCustomOrder();
+
+    if(failed) return 1;
+    cout << "concurrent stress test passed: " << checked << " operations linearized" << endl;
+    return 0;
+}
@@ -0,0 +1,1281 @@
+#ifndef CONCURRENT_AVL_H
+#define CONCURRENT_AVL_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "bst.h"
+
+/**
+ * A test-and-set lock for the nodes of ConcurrentAVLTree. It is held only
+ * for the few link updates of one insert, unlink or rotation, so waiters
+ * spin on a plain load and yield rather than sleep.
+ */
+class SpinLock
+{
+public:
+    SpinLock();
+
+    void lock();
+    bool try_lock();
+    void unlock();
+
+private:
+    SpinLock(const SpinLock&) = delete;
+    SpinLock& operator=(const SpinLock&) = delete;
+
+    std::atomic<bool> locked_;
+};
+
+/*
+  ----------------------------------------------
+  Begin implementations for the SpinLock class.
+  ----------------------------------------------
+*/
+
+inline SpinLock::SpinLock() :
+    locked_(false)
+{
+
+}
+
+inline void SpinLock::lock()
+{
+    while (locked_.exchange(true, std::memory_order_acquire)) {
+        while (locked_.load(std::memory_order_relaxed)) {
+            std::this_thread::yield();
+        }
+    }
+}
+
+inline bool SpinLock::try_lock()
+{
+    return !locked_.load(std::memory_order_relaxed) &&
+           !locked_.exchange(true, std::memory_order_acquire);
+}
+
+inline void SpinLock::unlock()
+{
+    locked_.store(false, std::memory_order_release);
+}
+
+/*
+  --------------------------------------------
+  End implementations for the SpinLock class.
+  --------------------------------------------
+*/
+
+
+/**
+ * A lock shared by two groups of threads that exclude each other: any
+ * number of holders of one phase can be inside together, but never
+ * alongside holders of the other phase. The phase, the holder count and
+ * a "waiting" bit live in one atomic word.
+ *
+ * A thread that finds the other phase inside sets the waiting bit, which
+ * stops that phase admitting anyone new; once its holders drain, the
+ * first thread to arrive takes the lock for its own phase. Neither phase
+ * can therefore keep the other out by streaming short holds. Waiters
+ * yield rather than sleep.
+ */
+class PhaseLock
+{
+public:
+    PhaseLock();
+
+    void lock(unsigned phase);
+    void unlock();
+
+private:
+    PhaseLock(const PhaseLock&) = delete;
+    PhaseLock& operator=(const PhaseLock&) = delete;
+
+    static const unsigned WAITING = 1u << 31;
+    static const unsigned PHASE = 1u << 30;
+    static const unsigned HOLDERS = PHASE - 1;
+
+    std::atomic<unsigned> state_;
+};
+
+/*
+  -----------------------------------------------
+  Begin implementations for the PhaseLock class.
+  -----------------------------------------------
+*/
+
+inline PhaseLock::PhaseLock() :
+    state_(0)
+{
+
+}
+
+/**
+* Enters as a holder of phase 0 or 1.
+*/
+inline void PhaseLock::lock(unsigned phase)
+{
+    const unsigned mine = phase ? PHASE : 0;
+    unsigned expected = state_.load(std::memory_order_relaxed);
+    for (;;) {
+        unsigned desired;
+        bool enter = true;
+        if ((expected & HOLDERS) == 0) {
+            desired = mine | 1;
+        }
+        else if (expected & WAITING) {
+            std::this_thread::yield();
+            expected = state_.load(std::memory_order_relaxed);
+            continue;
+        }
+        else if ((expected & PHASE) == mine) {
+            desired = expected + 1;
+        }
+        else {
+            desired = expected | WAITING;
+            enter = false;
+        }
+        if (state_.compare_exchange_weak(expected, desired,
+                                         std::memory_order_acquire,
+                                         std::memory_order_relaxed) && enter) {
+            return;
+        }
+    }
+}
+
+inline void PhaseLock::unlock()
+{
+    state_.fetch_sub(1, std::memory_order_release);
+}
+
+/*
+  ---------------------------------------------
+  End implementations for the PhaseLock class.
+  ---------------------------------------------
+*/
+
+
+/**
+ * Deferred freeing for structures whose readers take no locks. Every
+ * operation runs between enter() and leave(); a writer that unlinks
+ * something passes it to retire() instead of deleting it, and collect()
+ * deletes what has been retired once no operation that could still be
+ * holding a pointer to it is running.
+ *
+ * Running operations are counted per epoch parity on per-thread stripes,
+ * so entering costs two uncontended atomic adds. collect() takes what has
+ * been retired so far, advances the epoch and waits for the operations
+ * counted under the old parity to leave; anything that entered after
+ * that started when the retired objects were already unreachable.
+ * Collections run one at a time, which is why a single parity flip is
+ * enough. collect() must not be called from inside an operation.
+ */
+class EpochReclaimer
+{
+public:
+    typedef void (*Deleter)(void*);
+
+    EpochReclaimer();
+    ~EpochReclaimer();
+
+    unsigned enter();
+    void leave(unsigned parity);
+    void retire(void* object, Deleter deleter);
+    bool collectDue();
+    void collect();
+
+    // Scoped enter() and leave().
+    class Section
+    {
+    public:
+        explicit Section(EpochReclaimer& reclaimer) : reclaimer_(reclaimer), parity_(reclaimer.enter()) {}
+        ~Section() { reclaimer_.leave(parity_); }
+    private:
+        EpochReclaimer& reclaimer_;
+        unsigned parity_;
+    };
+
+private:
+    EpochReclaimer(const EpochReclaimer&) = delete;
+    EpochReclaimer& operator=(const EpochReclaimer&) = delete;
+
+    static const unsigned STRIPES = 32;
+    static const std::size_t COLLECT_EVERY = 256;
+
+    struct Retired
+    {
+        void* object;
+        Deleter deleter;
+    };
+
+    // Threads share stripes modulo STRIPES; each stripe has its own
+    // cache line so that entering does not bounce one between cores.
+    struct alignas(64) Stripe
+    {
+        Stripe() { active_[0].store(0); active_[1].store(0); }
+
+        std::atomic<long> active_[2];
+        SpinLock lock_;
+        std::vector<Retired> retired_;
+    };
+
+    static unsigned threadStripe();
+    static void deleteAll(std::vector<Retired>& batch);
+
+    Stripe stripes_[STRIPES];
+    std::atomic<unsigned> epoch_;
+    SpinLock collecting_;
+};
+
+/*
+  ----------------------------------------------------
+  Begin implementations for the EpochReclaimer class.
+  ----------------------------------------------------
+*/
+
+inline EpochReclaimer::EpochReclaimer() :
+    epoch_(0)
+{
+
+}
+
+inline EpochReclaimer::~EpochReclaimer()
+{
+    for (unsigned i = 0; i < STRIPES; ++i) {
+        deleteAll(stripes_[i].retired_);
+    }
+}
+
+inline unsigned EpochReclaimer::threadStripe()
+{
+    static std::atomic<unsigned> next(0);
+    static thread_local unsigned stripe = next.fetch_add(1, std::memory_order_relaxed) % STRIPES;
+    return stripe;
+}
+
+inline void EpochReclaimer::deleteAll(std::vector<Retired>& batch)
+{
+    for (std::size_t i = 0; i < batch.size(); ++i) {
+        batch[i].deleter(batch[i].object);
+    }
+    batch.clear();
+}
+
+/**
+* Returns the parity to pass to leave(). The epoch is read again once the
+* operation is counted, so it is never counted under a parity that a
+* collect() has already finished waiting for.
+*/
+inline unsigned EpochReclaimer::enter()
+{
+    Stripe& stripe = stripes_[threadStripe()];
+    for (;;) {
+        unsigned epoch = epoch_.load();
+        stripe.active_[epoch & 1].fetch_add(1);
+        if (epoch_.load() == epoch) {
+            return epoch & 1;
+        }
+        stripe.active_[epoch & 1].fetch_sub(1);
+    }
+}
+
+inline void EpochReclaimer::leave(unsigned parity)
+{
+    stripes_[threadStripe()].active_[parity].fetch_sub(1, std::memory_order_release);
+}
+
+inline void EpochReclaimer::retire(void* object, Deleter deleter)
+{
+    Stripe& stripe = stripes_[threadStripe()];
+    Retired retired = { object, deleter };
+    std::lock_guard<SpinLock> guard(stripe.lock_);
+    stripe.retired_.push_back(retired);
+}
+
+/**
+* True once the calling thread has retired enough to be worth a collect().
+*/
+inline bool EpochReclaimer::collectDue()
+{
+    Stripe& stripe = stripes_[threadStripe()];
+    std::lock_guard<SpinLock> guard(stripe.lock_);
+    return stripe.retired_.size() >= COLLECT_EVERY;
+}
+
+/**
+* Deletes everything retired before the call. Returns at once if another
+* thread is already collecting; what it misses goes in the next batch.
+*/
+inline void EpochReclaimer::collect()
+{
+    if (!collecting_.try_lock()) return;
+
+    std::vector<Retired> batch;
+    for (unsigned i = 0; i < STRIPES; ++i) {
+        std::lock_guard<SpinLock> guard(stripes_[i].lock_);
+        batch.insert(batch.end(), stripes_[i].retired_.begin(), stripes_[i].retired_.end());
+        stripes_[i].retired_.clear();
+    }
+
+    unsigned old = epoch_.fetch_add(1) & 1;
+    for (unsigned i = 0; i < STRIPES; ++i) {
+        while (stripes_[i].active_[old].load(std::memory_order_acquire) != 0) {
+            std::this_thread::yield();
+        }
+    }
+    collecting_.unlock();
+
+    deleteAll(batch);
+}
+
+/*
+  --------------------------------------------------
+  End implementations for the EpochReclaimer class.
+  --------------------------------------------------
+*/
+
+
+/**
+ * An AVL tree that many threads can use at once, after Bronson, Casper,
+ * Chafi and Olukotun, "A Practical Concurrent Binary Search Tree" (PPoPP
+ * 2010).
+ *
+ * Lookups take no locks. Each node carries a version number that writers
+ * change whenever a rotation or unlink could move keys out of its
+ * subtree; a reader notes a node's version before stepping to a child and
+ * checks it again afterwards, and backs up to retry from that node if it
+ * changed. Writers lock only the nodes they relink, always parent before
+ * child. Balance is relaxed: a writer repairs heights and rotates on its
+ * way back up after its change is visible, so other threads may briefly
+ * see the tree out of balance, but never out of order. Removing a key
+ * with two children leaves a routing node without a value that is
+ * unlinked once it has at most one child.
+ *
+ * Values live in immutable boxes that writers replace, so a reader copies
+ * a value that no one is writing. Nodes and boxes that are unlinked go to
+ * an EpochReclaimer and are deleted once no operation can still see them.
+ *
+ * for_each and range_scan walk the tree in order without validation, so
+ * they exclude writers through a PhaseLock: scans run in parallel with
+ * each other and with lookups, and writers run in parallel with each
+ * other, but a scan sees one consistent state. Callbacks get a
+ * std::pair<const Key&, const Value&> and must not modify the tree.
+ */
+template <class Key, class Value, class Compare = std::less<Key> >
+class ConcurrentAVLTree
+{
+public:
+    typedef Compare key_compare;
+
+    ConcurrentAVLTree();
+    explicit ConcurrentAVLTree(const Compare& comp);
+    ~ConcurrentAVLTree();
+
+    bool insert(const std::pair<const Key, Value>& keyValuePair);
+    bool try_insert(const std::pair<const Key, Value>& keyValuePair);
+    bool remove(const Key& key);
+    void clear();
+
+    bool find(const Key& key, Value& value) const;
+    bool contains(const Key& key) const;
+    std::size_t size() const;
+    bool empty() const;
+    Compare key_comp() const;
+
+    template<typename Function>
+    void for_each(Function fn) const;
+    template<typename Function>
+    void range_scan(const Key& lo, const Key& hi, Function fn) const;
+
+protected:
+    typedef std::int64_t Version;
+
+    // Version bits. A node that is being rotated down is SHRINKING and
+    // one being rotated up is GROWING; each finished change bumps the
+    // matching count. Readers below a growing node need not retry, since
+    // it keeps every key it had. An unlinked node's version is UNLINKED
+    // for good.
+    static const Version UNLINKED = 1;
+    static const Version GROWING = 2;
+    static const Version SHRINKING = 4;
+    static const Version GROW_COUNT = Version(1) << 3;
+    static const Version GROW_COUNT_MASK = Version(0xff) << 3;
+    static const Version SHRINK_COUNT = Version(1) << 11;
+
+    // What nodeCondition() asks for when it is not a new height.
+    static const int UNLINK_REQUIRED = -1;
+    static const int REBALANCE_REQUIRED = -2;
+    static const int NOTHING_REQUIRED = -3;
+
+    // LEFT and RIGHT index a node's children.
+    static const int LEFT = 0;
+    static const int RIGHT = 1;
+
+    enum UpdateMode { ASSIGN, IF_ABSENT, REMOVE };
+
+    // How an update attempt ended: RETRY from the parent, or done and the
+    // key was ABSENT or PRESENT beforehand.
+    enum Outcome { RETRY, ABSENT, PRESENT };
+
+    struct ValueBox
+    {
+        explicit ValueBox(const Value& value) : value_(value) {}
+
+        const Value value_;
+    };
+
+    struct Node
+    {
+        Node();
+        Node(const Key& key, ValueBox* value, Node* parent);
+
+        const Key& key() const { return *reinterpret_cast<const Key*>(key_); }
+        Node* child(int dir) const { return children_[dir].load(); }
+        void setChild(int dir, Node* child) { children_[dir].store(child); }
+
+        // Raw storage so that holder_ needs no Key.
+        alignas(Key) unsigned char key_[sizeof(Key)];
+        std::atomic<ValueBox*> value_;
+        std::atomic<Node*> parent_;
+        std::atomic<Node*> children_[2];
+        std::atomic<int> height_;
+        std::atomic<Version> version_;
+        SpinLock lock_;
+    };
+
+    class PhaseGuard
+    {
+    public:
+        PhaseGuard(PhaseLock& lock, unsigned phase) : lock_(lock) { lock_.lock(phase); }
+        ~PhaseGuard() { lock_.unlock(); }
+    private:
+        PhaseLock& lock_;
+    };
+
+    // PhaseLock phases for scanGate_.
+    static const unsigned WRITERS = 0;
+    static const unsigned SCANS = 1;
+
+    static bool isShrinkingOrUnlinked(Version version) { return (version & (SHRINKING | UNLINKED)) != 0; }
+    static bool isChanging(Version version) { return (version & (SHRINKING | GROWING)) != 0; }
+    static bool isUnlinked(Version version) { return version == UNLINKED; }
+    static bool hasShrunkOrUnlinked(Version original, Version current)
+    {
+        return ((original ^ current) & ~(GROWING | GROW_COUNT_MASK)) != 0;
+    }
+    static Version beginGrow(Version version) { return version | GROWING; }
+    static Version endGrow(Version version) { return version + GROW_COUNT; }
+    static Version beginShrink(Version version) { return version | SHRINKING; }
+    static Version endShrink(Version version) { return version + SHRINK_COUNT; }
+    static void waitUntilNotChanging(const Node* node, Version version);
+    static int heightOf(const Node* node) { return node == nullptr ? 0 : node->height_.load(); }
+
+    static void deleteNode(void* node);
+    static void deleteBox(void* box);
+    static void deleteSubtree(Node* root);
+
+    int compare(const Key& a, const Key& b) const;
+    bool keyLess(const Key& a, const Key& b) const;
+    Node* newNode(const Key& key, const Value& value, Node* parent);
+    void retire(Node* node);
+    void retire(ValueBox* box);
+
+    Outcome write(const Key& key, const Value* value, UpdateMode mode);
+    ValueBox* get(const Key& key) const;
+    bool attemptGet(const Key& key, Node* node, int dir, Version version, ValueBox*& box) const;
+    Outcome update(const Key& key, const Value* value, UpdateMode mode);
+    Outcome attemptUpdate(const Key& key, const Value* value, UpdateMode mode,
+                          Node* parent, Node* node, Version version);
+    Outcome attemptNodeUpdate(const Value* value, UpdateMode mode, Node* parent, Node* node);
+    bool attemptUnlink(Node* parent, Node* node);
+
+    int nodeCondition(const Node* node) const;
+    Node* fixHeight(Node* node);
+    void fixHeightAndRebalance(Node* node);
+    Node* rebalance(Node* parent, Node* node);
+    Node* rebalanceFrom(Node* parent, Node* node, Node* child, int hOther, int dir);
+    Node* rotate(Node* parent, Node* node, Node* child, int hOther,
+                 int hOuter, Node* inner, int hInner, int dir);
+    Node* rotateTwice(Node* parent, Node* node, Node* child, int hOther,
+                      int hOuter, Node* inner, int hInnerOuter, int dir);
+
+    template<typename Function>
+    void visit(const Key* lo, const Key* hi, Function& fn) const;
+
+    // Keyless sentinel above the root, which is its right child, so that
+    // replacing the root locks and relinks like any other child.
+    Node holder_;
+    Compare comp_;
+    std::atomic<long> count_;
+    mutable PhaseLock scanGate_;
+    mutable EpochReclaimer reclaimer_;
+};
+
+/*
+  -------------------------------------------------------
+  Begin implementations for the ConcurrentAVLTree class.
+  -------------------------------------------------------
+*/
+
+template<class Key, class Value, class Compare>
+ConcurrentAVLTree<Key, Value, Compare>::Node::Node() :
+    value_(nullptr), parent_(nullptr), height_(0), version_(0)
+{
+    children_[LEFT].store(nullptr);
+    children_[RIGHT].store(nullptr);
+}
+
+template<class Key, class Value, class Compare>
+ConcurrentAVLTree<Key, Value, Compare>::Node::Node(const Key& key, ValueBox* value, Node* parent) :
+    value_(value), parent_(parent), height_(1), version_(0)
+{
+    children_[LEFT].store(nullptr);
+    children_[RIGHT].store(nullptr);
+    new (key_) Key(key);
+}
+
+template<class Key, class Value, class Compare>
+ConcurrentAVLTree<Key, Value, Compare>::ConcurrentAVLTree() :
+    comp_(), count_(0)
+{
+
+}
+
+template<class Key, class Value, class Compare>
+ConcurrentAVLTree<Key, Value, Compare>::ConcurrentAVLTree(const Compare& comp) :
+    comp_(comp), count_(0)
+{
+
+}
+
+/**
+* No other thread may be using the tree.
+*/
+template<class Key, class Value, class Compare>
+ConcurrentAVLTree<Key, Value, Compare>::~ConcurrentAVLTree()
+{
+    deleteSubtree(holder_.child(RIGHT));
+}
+
+template<class Key, class Value, class Compare>
+void ConcurrentAVLTree<Key, Value, Compare>::deleteNode(void* node)
+{
+    Node* doomed = static_cast<Node*>(node);
+    doomed->key().~Key();
+    delete doomed;
+}
+
+template<class Key, class Value, class Compare>
+void ConcurrentAVLTree<Key, Value, Compare>::deleteBox(void* box)
+{
+    delete static_cast<ValueBox*>(box);
+}
+
+template<class Key, class Value, class Compare>
+void ConcurrentAVLTree<Key, Value, Compare>::deleteSubtree(Node* root)
+{
+    std::vector<Node*> stack;
+    if (root != nullptr) stack.push_back(root);
+    while (!stack.empty()) {
+        Node* node = stack.back();
+        stack.pop_back();
+        if (node->child(LEFT) != nullptr) stack.push_back(node->child(LEFT));
+        if (node->child(RIGHT) != nullptr) stack.push_back(node->child(RIGHT));
+        delete node->value_.load();
+        deleteNode(node);
+    }
+}
+
+template<class Key, class Value, class Compare>
+void ConcurrentAVLTree<Key, Value, Compare>::waitUntilNotChanging(const Node* node, Version version)
+{
+    if (!isChanging(version)) return;
+    for (int spins = 0; spins < 100; ++spins) {
+        if (node->version_.load() != version) return;
+    }
+    while (node->version_.load() == version) {
+        std::this_thread::yield();
+    }
+}
+
+template<class Key, class Value, class Compare>
+int ConcurrentAVLTree<Key, Value, Compare>::compare(const Key& a, const Key& b) const
+{
+    return KeyOrder<Key, Compare>::compare(comp_, a, b);
+}
+
+template<class Key, class Value, class Compare>
+bool ConcurrentAVLTree<Key, Value, Compare>::keyLess(const Key& a, const Key& b) const
+{
+    return KeyOrder<Key, Compare>::less(comp_, a, b);
+}
+
+template<class Key, class Value, class Compare>
+typename ConcurrentAVLTree<Key, Value, Compare>::Node*
+ConcurrentAVLTree<Key, Value, Compare>::newNode(const Key& key, const Value& value, Node* parent)
+{
+    ValueBox* box = new ValueBox(value);
+    try {
+        return new Node(key, box, parent);
+    }
+    catch (...) {
+        delete box;
+        throw;
+    }
+}
+
+template<class Key, class Value, class Compare>
+void ConcurrentAVLTree<Key, Value, Compare>::retire(Node* node)
+{
+    reclaimer_.retire(node, &deleteNode);
+}
+
+template<class Key, class Value, class Compare>
+void ConcurrentAVLTree<Key, Value, Compare>::retire(ValueBox* box)
+{
+    reclaimer_.retire(box, &deleteBox);
+}
+
+/**
+* Inserts the pair or overwrites the value of an existing key, like
+* AVLTree::insert. Returns true if the key was not there before.
+*/
+template<class Key, class Value, class Compare>
+bool ConcurrentAVLTree<Key, Value, Compare>::insert(const std::pair<const Key, Value>& keyValuePair)
+{
+    return write(keyValuePair.first, &keyValuePair.second, ASSIGN) == ABSENT;
+}
+
+/**
+* Inserts the pair only if the key is absent; an existing value is kept.
+*/
+template<class Key, class Value, class Compare>
+bool ConcurrentAVLTree<Key, Value, Compare>::try_insert(const std::pair<const Key, Value>& keyValuePair)
+{
+    return write(keyValuePair.first, &keyValuePair.second, IF_ABSENT) == ABSENT;
+}
+
+/**
+* Returns true if the key was there to remove.
+*/
+template<class Key, class Value, class Compare>
+bool ConcurrentAVLTree<Key, Value, Compare>::remove(const Key& key)
+{
+    return write(key, nullptr, REMOVE) == PRESENT;
+}
+
+/**
+* Removes everything. Like a scan, it waits for running writers.
+*/
+template<class Key, class Value, class Compare>
+void ConcurrentAVLTree<Key, Value, Compare>::clear()
+{
+    {
+        PhaseGuard gate(scanGate_, SCANS);
+        // Scans share the gate, and so may another clear(); only the one
+        // that detaches the root retires its nodes.
+        Node* root = holder_.children_[RIGHT].exchange(nullptr);
+        count_.store(0);
+        std::vector<Node*> stack;
+        if (root != nullptr) stack.push_back(root);
+
+        // Lookups and other scans may still be walking the old nodes.
+        while (!stack.empty()) {
+            Node* node = stack.back();
+            stack.pop_back();
+            if (node->child(LEFT) != nullptr) stack.push_back(node->child(LEFT));
+            if (node->child(RIGHT) != nullptr) stack.push_back(node->child(RIGHT));
+            ValueBox* box = node->value_.load();
+            if (box != nullptr) retire(box);
+            retire(node);
+        }
+    }
+    reclaimer_.collect();
+}
+
+/**
+* Copies the value for key into value and returns true, or returns false
+* if the key is absent.
+*/
+template<class Key, class Value, class Compare>
+bool ConcurrentAVLTree<Key, Value, Compare>::find(const Key& key, Value& value) const
+{
+    EpochReclaimer::Section section(reclaimer_);
+    const ValueBox* box = get(key);
+    if (box == nullptr) return false;
+    value = box->value_;
+    return true;
+}
+
+template<class Key, class Value, class Compare>
+bool ConcurrentAVLTree<Key, Value, Compare>::contains(const Key& key) const
+{
+    EpochReclaimer::Section section(reclaimer_);
+    return get(key) != nullptr;
+}
+
+/**
+* The number of keys. Writers count after their change is visible, so
+* while they run this may briefly be off by the number in flight.
+*/
+template<class Key, class Value, class Compare>
+std::size_t ConcurrentAVLTree<Key, Value, Compare>::size() const
+{
+    long count = count_.load();
+    return count < 0 ? 0 : static_cast<std::size_t>(count);
+}
+
+template<class Key, class Value, class Compare>
+bool ConcurrentAVLTree<Key, Value, Compare>::empty() const
+{
+    return size() == 0;
+}
+
+template<class Key, class Value, class Compare>
+Compare ConcurrentAVLTree<Key, Value, Compare>::key_comp() const
+{
+    return comp_;
+}
+
+/**
+* Calls fn on every pair in key order, as one consistent snapshot.
+*/
+template<class Key, class Value, class Compare>
+template<typename Function>
+void ConcurrentAVLTree<Key, Value, Compare>::for_each(Function fn) const
+{
+    PhaseGuard gate(scanGate_, SCANS);
+    EpochReclaimer::Section section(reclaimer_);
+    visit(nullptr, nullptr, fn);
+}
+
+/**
+* Calls fn on every pair with lo <= key < hi, in key order.
+*/
+template<class Key, class Value, class Compare>
+template<typename Function>
+void ConcurrentAVLTree<Key, Value, Compare>::range_scan(const Key& lo, const Key& hi, Function fn) const
+{
+    PhaseGuard gate(scanGate_, SCANS);
+    EpochReclaimer::Section section(reclaimer_);
+    visit(&lo, &hi, fn);
+}
+
+/**
+* In-order walk from the first key not below *lo up to *hi, either of
+* which may be null for no bound. Only called with writers shut out.
+*/
+template<class Key, class Value, class Compare>
+template<typename Function>
+void ConcurrentAVLTree<Key, Value, Compare>::visit(const Key* lo, const Key* hi, Function& fn) const
+{
+    std::vector<const Node*> stack;
+    const Node* node = holder_.child(RIGHT);
+    for (;;) {
+        while (node != nullptr) {
+            if (lo != nullptr && keyLess(node->key(), *lo)) {
+                node = node->child(RIGHT);
+            }
+            else {
+                stack.push_back(node);
+                node = node->child(LEFT);
+            }
+        }
+        if (stack.empty()) return;
+        node = stack.back();
+        stack.pop_back();
+        if (hi != nullptr && !keyLess(node->key(), *hi)) return;
+        const ValueBox* box = node->value_.load();
+        if (box != nullptr) {
+            fn(std::pair<const Key&, const Value&>(node->key(), box->value_));
+        }
+        node = node->child(RIGHT);
+    }
+}
+
+/**
+* Runs one update with the scan gate and an epoch section held, keeps
+* count_, and collects retired nodes once it is outside both.
+*/
+template<class Key, class Value, class Compare>
+typename ConcurrentAVLTree<Key, Value, Compare>::Outcome
+ConcurrentAVLTree<Key, Value, Compare>::write(const Key& key, const Value* value, UpdateMode mode)
+{
+    Outcome outcome;
+    {
+        PhaseGuard gate(scanGate_, WRITERS);
+        EpochReclaimer::Section section(reclaimer_);
+        outcome = update(key, value, mode);
+        if (outcome == ABSENT && mode != REMOVE) ++count_;
+        if (outcome == PRESENT && mode == REMOVE) --count_;
+    }
+    if (reclaimer_.collectDue()) {
+        reclaimer_.collect();
+    }
+    return outcome;
+}
+
+/**
+* Returns the box holding key's value, or null if the key is absent.
+*/
+template<class Key, class Value, class Compare>
+typename ConcurrentAVLTree<Key, Value, Compare>::ValueBox*
+ConcurrentAVLTree<Key, Value, Compare>::get(const Key& key) const
+{
+    for (;;) {
+        Node* root = holder_.child(RIGHT);
+        if (root == nullptr) return nullptr;
+        int cmp = compare(key, root->key());
+        if (cmp == 0) return root->value_.load();
+        Version version = root->version_.load();
+        if (isShrinkingOrUnlinked(version)) {
+            waitUntilNotChanging(root, version);
+        }
+        else if (root == holder_.child(RIGHT)) {
+            ValueBox* box;
+            if (attemptGet(key, root, cmp < 0 ? LEFT : RIGHT, version, box)) return box;
+        }
+    }
+}
+
+/**
+* Searches below node, which had the given version when the caller read
+* the link to it, in direction dir. Returns false if node has changed
+* since, so the caller must retry from its own node.
+*/
+template<class Key, class Value, class Compare>
+bool ConcurrentAVLTree<Key, Value, Compare>::attemptGet(const Key& key, Node* node, int dir,
+                                                        Version version, ValueBox*& box) const
+{
+    for (;;) {
+        Node* child = node->child(dir);
+        if (hasShrunkOrUnlinked(version, node->version_.load())) return false;
+        if (child == nullptr) {
+            box = nullptr;
+            return true;
+        }
+        int cmp = compare(key, child->key());
+        if (cmp == 0) {
+            box = child->value_.load();
+            return true;
+        }
+        Version childVersion = child->version_.load();
+        if (isShrinkingOrUnlinked(childVersion)) {
+            waitUntilNotChanging(child, childVersion);
+            if (hasShrunkOrUnlinked(version, node->version_.load())) return false;
+        }
+        else if (child != node->child(dir)) {
+            if (hasShrunkOrUnlinked(version, node->version_.load())) return false;
+        }
+        else {
+            if (hasShrunkOrUnlinked(version, node->version_.load())) return false;
+            if (attemptGet(key, child, cmp < 0 ? LEFT : RIGHT, childVersion, box)) return true;
+        }
+    }
+}
+
+template<class Key, class Value, class Compare>
+typename ConcurrentAVLTree<Key, Value, Compare>::Outcome
+ConcurrentAVLTree<Key, Value, Compare>::update(const Key& key, const Value* value, UpdateMode mode)
+{
+    for (;;) {
+        Node* root = holder_.child(RIGHT);
+        if (root == nullptr) {
+            if (mode == REMOVE) return ABSENT;
+            std::lock_guard<SpinLock> guard(holder_.lock_);
+            if (holder_.child(RIGHT) == nullptr) {
+                holder_.setChild(RIGHT, newNode(key, *value, &holder_));
+                return ABSENT;
+            }
+        }
+        else {
+            Version version = root->version_.load();
+            if (isShrinkingOrUnlinked(version)) {
+                waitUntilNotChanging(root, version);
+            }
+            else if (root == holder_.child(RIGHT)) {
+                Outcome outcome = attemptUpdate(key, value, mode, &holder_, root, version);
+                if (outcome != RETRY) return outcome;
+            }
+        }
+    }
+}
+
+/**
+* The update counterpart of attemptGet: finds key below node, validating
+* node's version at every step, and inserts a leaf when it falls off the
+* tree.
+*/
+template<class Key, class Value, class Compare>
+typename ConcurrentAVLTree<Key, Value, Compare>::Outcome
+ConcurrentAVLTree<Key, Value, Compare>::attemptUpdate(const Key& key, const Value* value, UpdateMode mode,
+                                                      Node* parent, Node* node, Version version)
+{
+    int cmp = compare(key, node->key());
+    if (cmp == 0) return attemptNodeUpdate(value, mode, parent, node);
+    int dir = cmp < 0 ? LEFT : RIGHT;
+
+    for (;;) {
+        Node* child = node->child(dir);
+        if (hasShrunkOrUnlinked(version, node->version_.load())) return RETRY;
+
+        if (child == nullptr) {
+            if (mode == REMOVE) return ABSENT;
+            Node* damaged;
+            {
+                std::lock_guard<SpinLock> guard(node->lock_);
+                if (hasShrunkOrUnlinked(version, node->version_.load())) return RETRY;
+                if (node->child(dir) != nullptr) continue;
+                node->setChild(dir, newNode(key, *value, node));
+                damaged = fixHeight(node);
+            }
+            fixHeightAndRebalance(damaged);
+            return ABSENT;
+        }
+
+        Version childVersion = child->version_.load();
+        if (isShrinkingOrUnlinked(childVersion)) {
+            waitUntilNotChanging(child, childVersion);
+        }
+        else if (child == node->child(dir)) {
+            if (hasShrunkOrUnlinked(version, node->version_.load())) return RETRY;
+            Outcome outcome = attemptUpdate(key, value, mode, node, child, childVersion);
+            if (outcome != RETRY) return outcome;
+        }
+    }
+}
+
+/**
+* Updates node, whose key is the one being written. Removing a node with
+* a missing child unlinks it under its parent's lock; otherwise only the
+* node is locked and its value box is swapped.
+*/
+template<class Key, class Value, class Compare>
+typename ConcurrentAVLTree<Key, Value, Compare>::Outcome
+ConcurrentAVLTree<Key, Value, Compare>::attemptNodeUpdate(const Value* value, UpdateMode mode,
+                                                          Node* parent, Node* node)
+{
+    if (mode == REMOVE && node->value_.load() == nullptr) return ABSENT;
+
+    if (mode == REMOVE && (node->child(LEFT) == nullptr || node->child(RIGHT) == nullptr)) {
+        Node* damaged;
+        ValueBox* old;
+        {
+            std::lock_guard<SpinLock> parentGuard(parent->lock_);
+            if (isUnlinked(parent->version_.load()) || node->parent_.load() != parent) return RETRY;
+            {
+                std::lock_guard<SpinLock> nodeGuard(node->lock_);
+                old = node->value_.load();
+                if (old == nullptr) return ABSENT;
+                if (!attemptUnlink(parent, node)) return RETRY;
+            }
+            retire(old);
+            damaged = fixHeight(parent);
+        }
+        fixHeightAndRebalance(damaged);
+        return PRESENT;
+    }
+
+    std::lock_guard<SpinLock> guard(node->lock_);
+    if (isUnlinked(node->version_.load())) return RETRY;
+    ValueBox* old = node->value_.load();
+    if (mode == IF_ABSENT && old != nullptr) return PRESENT;
+    if (mode == REMOVE) {
+        if (old == nullptr) return ABSENT;
+        // A child went away since the check above; this is now an unlink.
+        if (node->child(LEFT) == nullptr || node->child(RIGHT) == nullptr) return RETRY;
+        node->value_.store(nullptr);
+    }
+    else {
+        node->value_.store(new ValueBox(*value));
+    }
+    if (old == nullptr) return ABSENT;
+    retire(old);
+    return PRESENT;
+}
+
+/**
+* Splices out node, which has at most one child, with parent and node
+* locked. Returns false if node is not parent's child or has two.
+*/
+template<class Key, class Value, class Compare>
+bool ConcurrentAVLTree<Key, Value, Compare>::attemptUnlink(Node* parent, Node* node)
+{
+    Node* parentLeft = parent->child(LEFT);
+    if (parentLeft != node && parent->child(RIGHT) != node) return false;
+    Node* left = node->child(LEFT);
+    Node* right = node->child(RIGHT);
+    if (left != nullptr && right != nullptr) return false;
+
+    Node* splice = left != nullptr ? left : right;
+    parent->setChild(parentLeft == node ? LEFT : RIGHT, splice);
+    if (splice != nullptr) splice->parent_.store(parent);
+    node->version_.store(UNLINKED);
+    node->value_.store(nullptr);
+    retire(node);
+    return true;
+}
+
+/**
+* Returns the height node should have, or what must happen to it first.
+* Reads without locks, so the answer is only a hint.
+*/
+template<class Key, class Value, class Compare>
+int ConcurrentAVLTree<Key, Value, Compare>::nodeCondition(const Node* node) const
+{
+    Node* left = node->child(LEFT);
+    Node* right = node->child(RIGHT);
+    if ((left == nullptr || right == nullptr) && node->value_.load() == nullptr) {
+        return UNLINK_REQUIRED;
+    }
+
+    int height = node->height_.load();
+    int hLeft = heightOf(left);
+    int hRight = heightOf(right);
+    int balance = hLeft - hRight;
+    if (balance < -1 || balance > 1) return REBALANCE_REQUIRED;
+    int repaired = 1 + (hLeft > hRight ? hLeft : hRight);
+    return height != repaired ? repaired : NOTHING_REQUIRED;
+}
+
+/**
+* With node locked, fixes its height if that is all it needs. Returns the
+* next node to repair: node itself if it needs more, its parent if its
+* height changed, or null.
+*/
+template<class Key, class Value, class Compare>
+typename ConcurrentAVLTree<Key, Value, Compare>::Node*
+ConcurrentAVLTree<Key, Value, Compare>::fixHeight(Node* node)
+{
+    int condition = nodeCondition(node);
+    switch (condition) {
+    case REBALANCE_REQUIRED:
+    case UNLINK_REQUIRED:
+        return node;
+    case NOTHING_REQUIRED:
+        return nullptr;
+    default:
+        node->height_.store(condition);
+        return node->parent_.load();
+    }
+}
+
+/**
+* Repairs heights, balance and routing nodes from node up towards the
+* root, until a node needs nothing. Once a rotation or unlink has been
+* done on the way, the walk goes on to the root instead: a rotation hands
+* back the lowest node it damaged, and once that is repaired, an ancestor
+* whose subtree the rotation shortened may not be next in the chain.
+*/
+template<class Key, class Value, class Compare>
+void ConcurrentAVLTree<Key, Value, Compare>::fixHeightAndRebalance(Node* node)
+{
+    bool restructured = false;
+    while (node != nullptr && node->parent_.load() != nullptr) {
+        int condition = nodeCondition(node);
+        if (isUnlinked(node->version_.load())) return;
+        if (condition == NOTHING_REQUIRED) {
+            if (!restructured) return;
+            node = node->parent_.load();
+            continue;
+        }
+
+        Node* next;
+        Node* above;
+        if (condition != UNLINK_REQUIRED && condition != REBALANCE_REQUIRED) {
+            std::lock_guard<SpinLock> guard(node->lock_);
+            next = fixHeight(node);
+            above = node->parent_.load();
+        }
+        else {
+            Node* parent = node->parent_.load();
+            std::lock_guard<SpinLock> parentGuard(parent->lock_);
+            if (isUnlinked(parent->version_.load()) || node->parent_.load() != parent) continue;
+            std::lock_guard<SpinLock> nodeGuard(node->lock_);
+            next = rebalance(parent, node);
+            above = parent;
+            restructured = true;
+        }
+        node = next != nullptr || !restructured ? next : above;
+    }
+}
+
+/**
+* With parent and node locked, unlinks node if it is a routing node with
+* at most one child, rotates if it is out of balance, or fixes its
+* height. Returns the next node to repair.
+*/
+template<class Key, class Value, class Compare>
+typename ConcurrentAVLTree<Key, Value, Compare>::Node*
+ConcurrentAVLTree<Key, Value, Compare>::rebalance(Node* parent, Node* node)
+{
+    Node* left = node->child(LEFT);
+    Node* right = node->child(RIGHT);
+    if ((left == nullptr || right == nullptr) && node->value_.load() == nullptr) {
+        return attemptUnlink(parent, node) ? fixHeight(parent) : node;
+    }
+
+    int height = node->height_.load();
+    int hLeft = heightOf(left);
+    int hRight = heightOf(right);
+    int repaired = 1 + (hLeft > hRight ? hLeft : hRight);
+    int balance = hLeft - hRight;
+    if (balance > 1) return rebalanceFrom(parent, node, left, hRight, LEFT);
+    if (balance < -1) return rebalanceFrom(parent, node, right, hLeft, RIGHT);
+    if (repaired != height) {
+        node->height_.store(repaired);
+        return fixHeight(parent);
+    }
+    return nullptr;
+}
+
+/**
+* node is too tall on side dir, where child is, and hOther is the height
+* on the other side. Locks child and, for a double rotation, its inner
+* child, and rotates node down towards the other side.
+*/
+template<class Key, class Value, class Compare>
+typename ConcurrentAVLTree<Key, Value, Compare>::Node*
+ConcurrentAVLTree<Key, Value, Compare>::rebalanceFrom(Node* parent, Node* node, Node* child,
+                                                      int hOther, int dir)
+{
+    std::lock_guard<SpinLock> childGuard(child->lock_);
+    int hChild = child->height_.load();
+    if (hChild - hOther <= 1) return node;
+
+    Node* inner = child->child(1 - dir);
+    int hOuter = heightOf(child->child(dir));
+    int hInner = heightOf(inner);
+    if (hOuter >= hInner) {
+        return rotate(parent, node, child, hOther, hOuter, inner, hInner, dir);
+    }
+
+    {
+        std::lock_guard<SpinLock> innerGuard(inner->lock_);
+        hInner = inner->height_.load();
+        if (hOuter >= hInner) {
+            return rotate(parent, node, child, hOther, hOuter, inner, hInner, dir);
+        }
+        int hInnerOuter = heightOf(inner->child(dir));
+        int balance = hOuter - hInnerOuter;
+        if (balance >= -1 && balance <= 1) {
+            return rotateTwice(parent, node, child, hOther, hOuter, inner, hInnerOuter, dir);
+        }
+    }
+    // child is out of balance itself, so a double rotation would leave it
+    // so; rotate the other way beneath node first.
+    return rebalanceFrom(node, child, inner, hOuter, 1 - dir);
+}
+
+/**
+* Single rotation lifting child, node's child on side dir, above node.
+* parent, node and child are locked by the caller.
+*/
+template<class Key, class Value, class Compare>
+typename ConcurrentAVLTree<Key, Value, Compare>::Node*
+ConcurrentAVLTree<Key, Value, Compare>::rotate(Node* parent, Node* node, Node* child, int hOther,
+                                               int hOuter, Node* inner, int hInner, int dir)
+{
+    Version nodeVersion = node->version_.load();
+    Version childVersion = child->version_.load();
+    int parentDir = parent->child(LEFT) == node ? LEFT : RIGHT;
+
+    node->version_.store(beginShrink(nodeVersion));
+    child->version_.store(beginGrow(childVersion));
+
+    node->setChild(dir, inner);
+    child->setChild(1 - dir, node);
+    parent->setChild(parentDir, child);
+
+    child->parent_.store(parent);
+    node->parent_.store(child);
+    if (inner != nullptr) inner->parent_.store(node);
+
+    int hNode = 1 + (hInner > hOther ? hInner : hOther);
+    node->height_.store(hNode);
+    child->height_.store(1 + (hOuter > hNode ? hOuter : hNode));
+
+    child->version_.store(endGrow(childVersion));
+    node->version_.store(endShrink(nodeVersion));
+
+    // Pass on whichever node the rotation left needing work.
+    int balance = hInner - hOther;
+    if (balance < -1 || balance > 1) return node;
+    if ((inner == nullptr || hOther == 0) && node->value_.load() == nullptr) return node;
+    balance = hOuter - hNode;
+    if (balance < -1 || balance > 1) return child;
+    if (hOuter == 0 && child->value_.load() == nullptr) return child;
+    return fixHeight(parent);
+}
+
+/**
+* Double rotation lifting inner, child's child on the side away from dir,
+* above both child and node. parent, node, child and inner are locked.
+*/
+template<class Key, class Value, class Compare>
+typename ConcurrentAVLTree<Key, Value, Compare>::Node*
+ConcurrentAVLTree<Key, Value, Compare>::rotateTwice(Node* parent, Node* node, Node* child, int hOther,
+                                                    int hOuter, Node* inner, int hInnerOuter, int dir)
+{
+    Version nodeVersion = node->version_.load();
+    Version childVersion = child->version_.load();
+    Version innerVersion = inner->version_.load();
+    int parentDir = parent->child(LEFT) == node ? LEFT : RIGHT;
+    Node* innerOuter = inner->child(dir);
+    Node* innerInner = inner->child(1 - dir);
+    int hInnerInner = heightOf(innerInner);
+
+    node->version_.store(beginShrink(nodeVersion));
+    child->version_.store(beginShrink(childVersion));
+    inner->version_.store(beginGrow(innerVersion));
+
+    node->setChild(dir, innerInner);
+    child->setChild(1 - dir, innerOuter);
+    inner->setChild(dir, child);
+    inner->setChild(1 - dir, node);
+    parent->setChild(parentDir, inner);
+
+    inner->parent_.store(parent);
+    child->parent_.store(inner);
+    node->parent_.store(inner);
+    if (innerInner != nullptr) innerInner->parent_.store(node);
+    if (innerOuter != nullptr) innerOuter->parent_.store(child);
+
+    int hNode = 1 + (hInnerInner > hOther ? hInnerInner : hOther);
+    node->height_.store(hNode);
+    int hChild = 1 + (hOuter > hInnerOuter ? hOuter : hInnerOuter);
+    child->height_.store(hChild);
+    inner->height_.store(1 + (hChild > hNode ? hChild : hNode));
+
+    node->version_.store(endShrink(nodeVersion));
+    child->version_.store(endShrink(childVersion));
+    inner->version_.store(endGrow(innerVersion));
+
+    // A routing child left with one subtree is not on the path the caller
+    // goes on to repair, so splice it out now while inner is locked.
+    if ((hOuter == 0 || hInnerOuter == 0) && child->value_.load() == nullptr) {
+        attemptUnlink(inner, child);
+        --hChild;
+        inner->height_.store(1 + (hChild > hNode ? hChild : hNode));
+    }
+
+    int balance = hInnerInner - hOther;
+    if (balance < -1 || balance > 1) return node;
+    if ((innerInner == nullptr || hOther == 0) && node->value_.load() == nullptr) return node;
+    balance = hChild - hNode;
+    if (balance < -1 || balance > 1) return inner;
+    return fixHeight(parent);
+}
+
+/*
+  -----------------------------------------------------
+  End implementations for the ConcurrentAVLTree class.
+  -----------------------------------------------------
+*/
+
+#endif
@@ -0,0 +1,683 @@
+#include <algorithm>
+#include <atomic>
+#include <iostream>
+#include <map>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <csignal>
+#include <cstring>
+#include <sys/resource.h>
+#include "mutation_log.h"
+#include "compact_avl.h"
+#include "persistent_avl.h"
+#include "btree.h"
+
+using namespace std;
+
+// Checks of the containers built on top of the search trees, each against
+// a std::map holding what the container should contain.
+
+bool failed = false;
+
+void fail(const char* test, const char* msg)
+{
+    cout << "FAILED: " << test << ": " << msg << endl;
+    failed = true;
+}
+
+template<typename Tree, typename Compare>
+bool sameContents(const Tree& tree, const map<int,long,Compare>& expected)
+{
+    if(tree.size() != expected.size()) return false;
+    typename map<int,long,Compare>::const_iterator it = expected.begin();
+    for(typename Tree::const_iterator t = tree.begin(); t != tree.end(); ++t, ++it) {
+        if(t->first != it->first || t->second != it->second) return false;
+    }
+    return true;
+}
+
+// Reopening a LoggedAVLTree must bring back every committed mutation,
+// whether it is in the snapshot, the log or split between the two.
+void testLoggedTree()
+{
+    const char* test = "LoggedAVLTree";
+    string snapshot = "containers-test.snapshot";
+    string log = "containers-test.log";
+    std::remove(snapshot.c_str());
+    std::remove(log.c_str());
+
+    mt19937 rng(21);
+    map<int,long> expected;
+    for(int round = 0; round < 4; ++round) {
+        {
+            LoggedAVLTree<int,long> tree(snapshot, log, 16);
+            if(!sameContents(tree.tree(), expected)) fail(test, "contents after reopening");
+
+            // Enough records that replay has to read the log in pieces.
+            for(int i = 0; i < 20000; ++i) {
+                int key = (int)(rng() % 5000);
+                if(rng() % 4 == 0) {
+                    tree.remove(key);
+                    expected.erase(key);
+                }
+                else {
+                    tree.insert(std::make_pair(key, (long)i));
+                    expected[key] = i;
+                }
+            }
+            if(round % 2 == 0) tree.checkpoint();
+            for(int i = 0; i < 100; ++i) {
+                int key = (int)(rng() % 5000);
+                tree.insert(std::make_pair(key, -1L));
+                expected[key] = -1;
+            }
+            tree.commit();
+        }
+        LoggedAVLTree<int,long> reopened(snapshot, log, 16);
+        if(!sameContents(reopened.tree(), expected)) fail(test, "contents after a checkpoint");
+    }
+
+    // A torn record at the end is dropped and the rest still replays.
+    FILE* file = fopen(log.c_str(), "ab");
+    fwrite("torn", 1, 4, file);
+    fclose(file);
+    {
+        LoggedAVLTree<int,long> reopened(snapshot, log, 16);
+        if(!sameContents(reopened.tree(), expected)) fail(test, "contents after a torn record");
+        reopened.insert(std::make_pair(-5, 5L));
+        expected[-5] = 5;
+    }
+    LoggedAVLTree<int,long> reopened(snapshot, log, 16);
+    if(!sameContents(reopened.tree(), expected)) fail(test, "records after a torn one");
+
+    std::remove(snapshot.c_str());
+    std::remove(log.c_str());
+}
+
+// A commit that fails part-way leaves its records pending and part of
+// them in the file. Retrying it has to write over those torn bytes, or
+// replay stops at them and loses the records committed after.
+void testTornCommit()
+{
+    const char* test = "MutationLog torn commit";
+    string path = "containers-test.log";
+    std::remove(path.c_str());
+
+    map<int,long> expected;
+    {
+        MutationLog<int,long> log(path, 1000);
+        for(int i = 0; i < 10; ++i) {
+            log.logInsert(i, i);
+            expected[i] = i;
+        }
+        log.commit();
+
+        struct stat info;
+        ::stat(path.c_str(), &info);
+        for(int i = 10; i < 110; ++i) {
+            log.logInsert(i, i);
+            expected[i] = i;
+        }
+
+        // Let the file grow by less than the pending records need, and
+        // not by a whole number of them, so the write stops inside one.
+        struct rlimit saved;
+        ::getrlimit(RLIMIT_FSIZE, &saved);
+        struct rlimit limit = saved;
+        limit.rlim_cur = static_cast<rlim_t>(info.st_size) + 1001;
+        void (*handler)(int) = std::signal(SIGXFSZ, SIG_IGN);
+        ::setrlimit(RLIMIT_FSIZE, &limit);
+        bool threw = false;
+        try {
+            log.commit();
+        }
+        catch (const std::runtime_error&) {
+            threw = true;
+        }
+        ::setrlimit(RLIMIT_FSIZE, &saved);
+        std::signal(SIGXFSZ, handler);
+        if(!threw) fail(test, "commit past the file size limit did not throw");
+        if(log.pending() != 100) fail(test, "records dropped by a failed commit");
+
+        log.commit();
+        log.logRemove(3);
+        expected.erase(3);
+    }
+
+    MutationLog<int,long> log(path, 1000);
+    map<int,long> replayed;
+    log.replay([&](bool insert, int key, long value) {
+        if(insert) replayed[key] = value;
+        else replayed.erase(key);
+    });
+    if(replayed != expected) fail(test, "records after a retried commit");
+
+    std::remove(path.c_str());
+}
+
+// Every container has to keep and search its keys in the order of the
+// comparator it was given, not in operator< order.
+void testCustomOrder()
+{
+    const char* test = "custom order";
+    typedef greater<int> Order;
+    string snapshot = "containers-test-order.snapshot";
+    string log = "containers-test-order.log";
+    std::remove(snapshot.c_str());
+    std::remove(log.c_str());
+
+    mt19937 rng(23);
+    map<int,long,Order> expected;
+    CompactAVLTree<int,long,Order> compact;
+    PersistentAVLTree<int,long,Order> persistent;
+    {
+        LoggedAVLTree<int,long,Order> logged(snapshot, log);
+        for(int i = 0; i < 3000; ++i) {
+            int key = (int)(rng() % 1000);
+            if(rng() % 3 == 0) {
+                expected.erase(key);
+                compact.remove(key);
+                persistent.remove(key);
+                logged.remove(key);
+            }
+            else {
+                expected[key] = i;
+                compact.insert(std::make_pair(key, (long)i));
+                persistent.insert(std::make_pair(key, (long)i));
+                logged.insert(std::make_pair(key, (long)i));
+            }
+            if(i == 1500) logged.checkpoint();
+        }
+        logged.commit();
+        if(!sameContents(compact, expected)) fail(test, "CompactAVLTree contents");
+        if(!sameContents(persistent, expected)) fail(test, "PersistentAVLTree contents");
+        if(!sameContents(logged.tree(), expected)) fail(test, "LoggedAVLTree contents");
+        logged.checkpoint();
+    }
+    LoggedAVLTree<int,long,Order> reopened(snapshot, log);
+    if(!sameContents(reopened.tree(), expected)) fail(test, "LoggedAVLTree contents after reopening");
+
+    FrozenTree<int,long,Order> frozen(reopened.tree());
+    FrozenTree<int,long,Order> mapped = FrozenTree<int,long,Order>::load_mmap(snapshot);
+    FrozenTree<int,long,Order> ranged(expected.rbegin(), expected.rend());
+    if(!sameContents(frozen, expected)) fail(test, "FrozenTree contents");
+    if(!sameContents(mapped, expected)) fail(test, "mapped FrozenTree contents");
+    if(!sameContents(ranged, expected)) fail(test, "FrozenTree built from a range");
+    for(int key = -1; key <= 1000; ++key) {
+        bool present = expected.count(key) != 0;
+        if((compact.find(key) != compact.end()) != present) fail(test, "CompactAVLTree::find");
+        if((persistent.find(key) != persistent.end()) != present) fail(test, "PersistentAVLTree::find");
+        if((mapped.find(key) != mapped.end()) != present) fail(test, "FrozenTree::find");
+        map<int,long,Order>::const_iterator lower = expected.lower_bound(key);
+        FrozenTree<int,long,Order>::const_iterator frozenLower = frozen.lower_bound(key);
+        if((lower == expected.end()) != (frozenLower == frozen.end()) ||
+           (lower != expected.end() && lower->first != frozenLower->first)) {
+            fail(test, "FrozenTree::lower_bound");
+        }
+    }
+
+    std::remove(snapshot.c_str());
+    std::remove(log.c_str());
+}
+
+// A 64-byte key leaves room for only four keys per BTree node, so a few
+// thousand keys already make a tree five or six levels deep. It has no
+// default constructor, which BTree must not need.
+struct WideKey
+{
+    explicit WideKey(int v) : value(v) { memset(padding, 0, sizeof(padding)); }
+    int value;
+    char padding[60];
+};
+
+struct WideKeyOrder
+{
+    bool operator()(const WideKey& a, const WideKey& b) const { return a.value > b.value; }
+};
+
+// Exposes a BTree's nodes so the test can check its shape.
+template<typename Key, typename Value, typename Compare>
+class CheckedBTree : public BTree<Key, Value, Compare>
+{
+public:
+    typedef BTree<Key, Value, Compare> Base;
+    typedef typename Base::Leaf Leaf;
+    typedef typename Base::Inner Inner;
+
+    int depth() const { return this->depth_; }
+
+    // Every node but the root at least half full, keys in order and within
+    // the range their parent's separators give them, and the leaves linked
+    // in order.
+    bool valid() const
+    {
+        if(this->root_ == nullptr) return this->depth_ == 0 && this->size_ == 0;
+        const Leaf* prev = nullptr;
+        std::size_t count = 0;
+        if(!validNode(this->root_, this->depth_, nullptr, nullptr, true, prev, count)) return false;
+        return prev->next_ == nullptr && count == this->size_;
+    }
+
+private:
+    bool inRange(const Key& key, const Key* lo, const Key* hi) const
+    {
+        return (lo == nullptr || !this->keyLess(key, *lo)) && (hi == nullptr || this->keyLess(key, *hi));
+    }
+
+    bool validNode(const void* node, int depth, const Key* lo, const Key* hi, bool isRoot,
+                   const Leaf*& prev, std::size_t& count) const
+    {
+        if(depth == 0) {
+            const Leaf* leaf = static_cast<const Leaf*>(node);
+            if(leaf->count_ < (isRoot ? 1 : Base::MIN_LEAF_ITEMS) || leaf->count_ > Base::LEAF_ITEMS) return false;
+            for(int i = 0; i < leaf->count_; ++i) {
+                if(!inRange(leaf->keys()[i], lo, hi)) return false;
+                if(i > 0 && !this->keyLess(leaf->keys()[i - 1], leaf->keys()[i])) return false;
+            }
+            if(leaf->prev_ != prev || (prev != nullptr && prev->next_ != leaf)) return false;
+            prev = leaf;
+            count += leaf->count_;
+            return true;
+        }
+
+        const Inner* inner = static_cast<const Inner*>(node);
+        if(inner->count_ < (isRoot ? 1 : Base::MIN_INNER_KEYS) || inner->count_ > Base::INNER_KEYS) return false;
+        for(int i = 0; i < inner->count_; ++i) {
+            if(!inRange(inner->keys()[i], lo, hi)) return false;
+            if(i > 0 && !this->keyLess(inner->keys()[i - 1], inner->keys()[i])) return false;
+        }
+        for(int i = 0; i <= inner->count_; ++i) {
+            const Key* childLo = i == 0 ? lo : &inner->keys()[i - 1];
+            const Key* childHi = i == inner->count_ ? hi : &inner->keys()[i];
+            if(!validNode(inner->children_[i], depth - 1, childLo, childHi, false, prev, count)) return false;
+        }
+        return true;
+    }
+};
+
+template<typename Tree>
+bool sameWideContents(const Tree& tree, const map<int,long,greater<int> >& expected)
+{
+    if(tree.size() != expected.size()) return false;
+    map<int,long,greater<int> >::const_iterator it = expected.begin();
+    for(typename Tree::const_iterator t = tree.begin(); t != tree.end(); ++t, ++it) {
+        if(t->first.value != it->first || t->second != it->second) return false;
+    }
+    return true;
+}
+
+// Grows a BTree several levels deep, churns it so that leaves and inner
+// nodes at every level split, borrow and merge, then drains it until the
+// root has collapsed back down to nothing.
+void testBTree()
+{
+    const char* test = "BTree";
+    typedef CheckedBTree<WideKey, long, WideKeyOrder> Tree;
+    mt19937 rng(14);
+    Tree tree;
+    map<int,long,greater<int> > expected;
+    const int range = 4000;
+
+    int maxDepth = 0;
+    for(int i = 0; i < 6000; ++i) {
+        int key = (int)(rng() % range);
+        bool added = tree.insert(std::make_pair(WideKey(key), (long)i)).second;
+        if(added != (expected.count(key) == 0)) fail(test, "insert reported the wrong result");
+        expected[key] = i;
+        maxDepth = max(maxDepth, tree.depth());
+        if(i % 97 == 0 && !tree.valid()) fail(test, "invalid tree while growing");
+    }
+    if(maxDepth < 4) fail(test, "the tree never grew past four levels");
+    if(!tree.valid() || !sameWideContents(tree, expected)) fail(test, "contents after growing");
+
+    for(int i = 0; i < 40000; ++i) {
+        int key = (int)(rng() % range);
+        if(rng() % 2 == 0) {
+            tree.remove(WideKey(key));
+            expected.erase(key);
+        }
+        else {
+            tree.insert(std::make_pair(WideKey(key), (long)i));
+            expected[key] = i;
+        }
+        if(i % 101 == 0 && !tree.valid()) fail(test, "invalid tree while churning");
+    }
+    if(!tree.valid() || !sameWideContents(tree, expected)) fail(test, "contents after churning");
+
+    for(int key = -1; key <= range; ++key) {
+        map<int,long,greater<int> >::const_iterator lower = expected.lower_bound(key);
+        map<int,long,greater<int> >::const_iterator upper = expected.upper_bound(key);
+        Tree::const_iterator treeLower = tree.lower_bound(WideKey(key));
+        Tree::const_iterator treeUpper = tree.upper_bound(WideKey(key));
+        if((lower == expected.end()) != (treeLower == tree.end()) ||
+           (lower != expected.end() && lower->first != treeLower->first.value)) {
+            fail(test, "lower_bound");
+        }
+        if((upper == expected.end()) != (treeUpper == tree.end()) ||
+           (upper != expected.end() && upper->first != treeUpper->first.value)) {
+            fail(test, "upper_bound");
+        }
+        if((tree.find(WideKey(key)) != tree.end()) != (expected.count(key) != 0)) fail(test, "find");
+    }
+    Tree::iterator last = tree.end();
+    --last;
+    if(last->first.value != expected.rbegin()->first) fail(test, "stepping back from end()");
+    last->second = -1;
+    if(tree[WideKey(expected.rbegin()->first)] != -1) fail(test, "writing through an iterator");
+    expected.rbegin()->second = -1;
+
+    vector<int> keys;
+    for(map<int,long,greater<int> >::const_iterator it = expected.begin(); it != expected.end(); ++it) {
+        keys.push_back(it->first);
+    }
+    shuffle(keys.begin(), keys.end(), rng);
+    int depth = tree.depth();
+    for(size_t i = 0; i < keys.size(); ++i) {
+        tree.remove(WideKey(keys[i]));
+        expected.erase(keys[i]);
+        if(tree.depth() > depth) fail(test, "the tree grew while draining");
+        depth = tree.depth();
+        if(i % 53 == 0 && (!tree.valid() || !sameWideContents(tree, expected))) {
+            fail(test, "invalid tree while draining");
+        }
+    }
+    if(!tree.empty() || tree.depth() != 0 || tree.begin() != tree.end()) fail(test, "tree not empty after draining");
+}
+
+// Exposes a CompactAVLTree's node vector so the test can check its shape.
+template<typename Key, typename Value, typename Compare>
+class CheckedCompactAVLTree : public CompactAVLTree<Key, Value, Compare>
+{
+public:
+    typedef CompactAVLTree<Key, Value, Compare> Base;
+    typedef typename Base::NodeType NodeType;
+    typedef typename Base::Index Index;
+
+    Index rootSlot() const { return this->root_; }
+
+    // Keys in order, every stored balance equal to the real difference of
+    // its subtrees' heights, height() exact, and every slot of the vector
+    // reachable from the root exactly once.
+    bool valid() const
+    {
+        std::vector<char> seen(this->nodes_.size(), 0);
+        int height;
+        if(!validNode(this->root_, nullptr, nullptr, seen, height)) return false;
+        return height == this->height_ && std::count(seen.begin(), seen.end(), 1) == (long)seen.size();
+    }
+
+private:
+    bool validNode(Index node, const Key* lo, const Key* hi, std::vector<char>& seen, int& height) const
+    {
+        height = 0;
+        if(node == NodeType::NIL) return true;
+        if(node >= this->nodes_.size() || seen[node]) return false;
+        seen[node] = 1;
+
+        const Key& key = this->nodes_[node].item_.first;
+        if((lo != nullptr && !this->keyLess(*lo, key)) || (hi != nullptr && !this->keyLess(key, *hi))) return false;
+        int left, right;
+        if(!validNode(this->nodes_[node].getChild(0), lo, &key, seen, left)) return false;
+        if(!validNode(this->nodes_[node].getChild(1), &key, hi, seen, right)) return false;
+        if(this->nodes_[node].getBalance() != right - left) return false;
+        height = 1 + max(left, right);
+        return true;
+    }
+};
+
+// Small trees whose next remove takes one particular path: each rotation
+// case on the way back up, and the move of the last node of the vector
+// into the hole, including when that last node is the root.
+void testCompactTreeCases()
+{
+    const char* test = "CompactAVLTree cases";
+    struct Case
+    {
+        const char* name;
+        int inserts[8];
+        int removed;
+        bool lastIsRoot;
+    };
+    const Case cases[] = {
+        { "single rotation on insert", { 1, 2, 3 }, 0, false },
+        { "double rotation on insert", { 3, 1, 2 }, 0, true },
+        { "moving the root into the hole", { 1, 3, 2 }, 1, true },
+        { "rotation at a balanced pivot", { 2, 1, 4, 3, 5 }, 1, false },
+        { "single rotation on remove", { 2, 1, 4, 5 }, 1, false },
+        { "double rotation on remove", { 2, 1, 4, 3 }, 1, false },
+        { "removing a node with two children", { 4, 2, 6, 1, 3, 5, 7 }, 4, false },
+    };
+
+    for(size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); ++c) {
+        CheckedCompactAVLTree<int, long, less<int> > tree;
+        map<int,long> expected;
+        for(int i = 0; i < 8 && cases[c].inserts[i] != 0; ++i) {
+            tree.insert(std::make_pair(cases[c].inserts[i], (long)i));
+            expected[cases[c].inserts[i]] = i;
+        }
+        if(cases[c].lastIsRoot != (tree.rootSlot() == tree.size() - 1)) fail(test, cases[c].name);
+        if(cases[c].removed != 0) {
+            tree.remove(cases[c].removed);
+            expected.erase(cases[c].removed);
+        }
+        if(!tree.valid() || !sameContents(tree, expected)) fail(test, cases[c].name);
+    }
+}
+
+// A few thousand keys of inserts and removes, so that every rotation
+// case and the slot relocation in eraseSlot run many times, then a drain
+// in random order.
+void testCompactTree()
+{
+    const char* test = "CompactAVLTree";
+    typedef CheckedCompactAVLTree<int, long, less<int> > Tree;
+    mt19937 rng(12);
+    Tree tree;
+    map<int,long> expected;
+    const int range = 8000;
+
+    // Sorted inserts only ever rotate; the tree still has to stay within
+    // the AVL height bound.
+    for(int key = 0; key < 4095; ++key) {
+        tree.insert(std::make_pair(key, (long)key));
+        expected[key] = key;
+    }
+    if(!tree.valid() || tree.height() != 12) fail(test, "height after sorted inserts");
+
+    for(int i = 0; i < 60000; ++i) {
+        int key = (int)(rng() % range);
+        if(rng() % 2 == 0) {
+            tree.remove(key);
+            expected.erase(key);
+        }
+        else {
+            bool added = tree.insert(std::make_pair(key, (long)i));
+            if(added != (expected.count(key) == 0)) fail(test, "insert reported the wrong result");
+            expected[key] = i;
+        }
+        if(i % 97 == 0 && !tree.valid()) fail(test, "invalid tree while churning");
+    }
+    if(!tree.valid() || !sameContents(tree, expected)) fail(test, "contents after churning");
+
+    for(int key = -1; key <= range; ++key) {
+        Tree::const_iterator it = tree.find(key);
+        map<int,long>::const_iterator e = expected.find(key);
+        if((it == tree.end()) != (e == expected.end())) {
+            fail(test, "find");
+            continue;
+        }
+        if(it == tree.end()) continue;
+        ++it;
+        ++e;
+        if((it == tree.end()) != (e == expected.end()) || (it != tree.end() && it->first != e->first)) {
+            fail(test, "stepping on from find()");
+        }
+    }
+
+    vector<int> keys;
+    for(map<int,long>::const_iterator it = expected.begin(); it != expected.end(); ++it) {
+        keys.push_back(it->first);
+    }
+    shuffle(keys.begin(), keys.end(), rng);
+    for(size_t i = 0; i < keys.size(); ++i) {
+        tree.remove(keys[i]);
+        expected.erase(keys[i]);
+        if(i % 31 == 0 && (!tree.valid() || !sameContents(tree, expected))) {
+            fail(test, "invalid tree while draining");
+        }
+    }
+    if(!tree.empty() || tree.height() != 0 || tree.begin() != tree.end()) fail(test, "tree not empty after draining");
+}
+
+// Exposes the nodes of a PersistentAVLTree, or of a snapshot of one, so
+// the test can check its shape.
+template<typename Key, typename Value, typename Compare>
+class CheckedPersistentAVLTree : public PersistentAVLTree<Key, Value, Compare>
+{
+public:
+    typedef PersistentAVLTree<Key, Value, Compare> Base;
+    typedef typename Base::NodeType NodeType;
+
+    explicit CheckedPersistentAVLTree(const Base& tree) : Base(tree) {}
+
+    // Keys in order, stored heights exact and every node balanced.
+    bool valid() const
+    {
+        std::size_t count = 0;
+        return validNode(this->root_.get(), nullptr, nullptr, count) && count == this->size_;
+    }
+
+private:
+    bool validNode(const NodeType* node, const Key* lo, const Key* hi, std::size_t& count) const
+    {
+        if(node == nullptr) return true;
+        const Key& key = node->item_.first;
+        if((lo != nullptr && !this->keyLess(*lo, key)) || (hi != nullptr && !this->keyLess(key, *hi))) return false;
+        int left = NodeType::heightOf(node->left_);
+        int right = NodeType::heightOf(node->right_);
+        if(node->height_ != 1 + max(left, right) || abs(right - left) > 1) return false;
+        ++count;
+        return validNode(node->left_.get(), lo, &key, count) && validNode(node->right_.get(), &key, hi, count);
+    }
+};
+
+template<typename Tree>
+bool validPersistentTree(const Tree& tree)
+{
+    return CheckedPersistentAVLTree<int, long, less<int> >(tree).valid();
+}
+
+// Snapshots of a PersistentAVLTree must keep exactly the contents they
+// had when they were taken, whatever happens to the tree afterwards, to
+// other snapshots, or to copies of themselves.
+void testPersistentTree()
+{
+    const char* test = "PersistentAVLTree";
+    typedef PersistentAVLTree<int, long> Tree;
+    mt19937 rng(16);
+    const int range = 3000;
+    Tree tree;
+    map<int,long> expected;
+    vector<Tree> snapshots;
+    vector<map<int,long> > snapshotContents;
+
+    for(int i = 0; i < 50000; ++i) {
+        int key = (int)(rng() % range);
+        if(rng() % 3 == 0) {
+            tree.remove(key);
+            expected.erase(key);
+        }
+        else {
+            tree.insert(std::make_pair(key, (long)i));
+            expected[key] = i;
+        }
+        if(i % 5000 == 4999) {
+            snapshots.push_back(tree.snapshot());
+            snapshotContents.push_back(expected);
+        }
+    }
+
+    // One thread keeps reading a snapshot while the tree it came from
+    // takes more writes.
+    const Tree shared = snapshots[0];
+    atomic<bool> done(false);
+    atomic<bool> readerFailed(false);
+    thread reader([&]() {
+        do {
+            if(!sameContents(shared, snapshotContents[0]) || shared.find(-1) != shared.end()) {
+                readerFailed = true;
+            }
+        } while(!done);
+    });
+    for(int i = 0; i < 50000; ++i) {
+        int key = (int)(rng() % range);
+        if(rng() % 2 == 0) {
+            tree.remove(key);
+            expected.erase(key);
+        }
+        else {
+            tree.insert(std::make_pair(key, (long)-i));
+            expected[key] = -i;
+        }
+    }
+    done = true;
+    reader.join();
+    if(readerFailed) fail(test, "a snapshot changed while another thread wrote the tree");
+
+    if(!validPersistentTree(tree) || !sameContents(tree, expected)) fail(test, "contents of the tree");
+    for(size_t s = 0; s < snapshots.size(); ++s) {
+        if(!validPersistentTree(snapshots[s]) || !sameContents(snapshots[s], snapshotContents[s])) {
+            fail(test, "a snapshot changed after later inserts and removes");
+        }
+        for(int key = -1; key <= range; ++key) {
+            Tree::const_iterator it = snapshots[s].find(key);
+            map<int,long>::const_iterator e = snapshotContents[s].find(key);
+            if((it == snapshots[s].end()) != (e == snapshotContents[s].end()) ||
+               (e != snapshotContents[s].end() && (it->second != e->second || snapshots[s][key] != e->second))) {
+                fail(test, "find in an old snapshot");
+                break;
+            }
+        }
+    }
+
+    // Writing to a copy of a snapshot leaves the snapshot, its neighbours
+    // and the tree alone.
+    Tree branch = snapshots[3];
+    map<int,long> branchContents = snapshotContents[3];
+    for(int i = 0; i < 5000; ++i) {
+        int key = (int)(rng() % range);
+        if(rng() % 2 == 0) {
+            branch.remove(key);
+            branchContents.erase(key);
+        }
+        else {
+            branch.insert(std::make_pair(key, (long)i));
+            branchContents[key] = i;
+        }
+    }
+    if(!validPersistentTree(branch) || !sameContents(branch, branchContents)) fail(test, "contents of a branch");
+    tree.clear();
+    for(size_t s = 0; s < snapshots.size(); ++s) {
+        if(!sameContents(snapshots[s], snapshotContents[s])) fail(test, "a snapshot changed after a branch or a clear");
+    }
+    if(!tree.empty() || tree.begin() != tree.end()) fail(test, "tree not empty after clear");
+}
+
+int main(int argc, char *argv[])
+{
+    testLoggedTree();
+    testTornCommit();
+    testCustomOrder();
+    testBTree();
+    testCompactTreeCases();
+    testCompactTree();
+    testPersistentTree();
+
+    if(failed) return 1;
+    cout << "container tests passed" << endl;
+    return 0;
+}
@@ -0,0 +1,814 @@
+#ifndef FROZEN_TREE_H
+#define FROZEN_TREE_H
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iterator>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "bst.h"
+
+/**
+ * Header of the snapshot files written by FrozenTree::save. It is followed
+ * by the key array and then the pair array, each starting on a 64-byte
+ * boundary, exactly as FrozenTree lays them out in memory. The checksum
+ * covers both arrays; the type sizes and byte order marker make a file
+ * written for other key or value types, or on another kind of machine,
+ * fail to load instead of being misread.
+ */
+struct SnapshotHeader
+{
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t byteOrder;
+    std::uint32_t keySize;
+    std::uint32_t valueSize;
+    std::uint32_t itemSize;
+    std::uint32_t itemAlign;
+    std::uint64_t count;
+    std::uint64_t keysOffset;
+    std::uint64_t itemsOffset;
+    std::uint64_t fileSize;
+    std::uint64_t checksum;
+};
+
+static const char SNAPSHOT_MAGIC[8] = { 'F', 'R', 'Z', 'T', 'R', 'E', 'E', '\0' };
+static const std::uint32_t SNAPSHOT_VERSION = 1;
+static const std::uint32_t SNAPSHOT_BYTE_ORDER = 0x01020304;
+static const std::size_t SNAPSHOT_ALIGN = 64;
+
+/**
+ * A fast 64-bit checksum for catching torn or corrupted files. It mixes
+ * eight bytes per step, so checking a snapshot costs little more than
+ * reading it. Passing the previous result as seed continues a checksum:
+ * as long as every buffer but the last is a multiple of eight bytes long,
+ * the result is the same as for one call over all of them. Not meant to
+ * resist deliberate tampering.
+ */
+inline std::uint64_t snapshotChecksum(const void* data, std::size_t bytes,
+                                      std::uint64_t seed = 0x9E3779B97F4A7C15ull)
+{
+    const std::uint64_t MULTIPLIER = 0x9FB21C651E98DF25ull;
+    const unsigned char* p = static_cast<const unsigned char*>(data);
+    std::uint64_t hash = seed;
+
+    for (; bytes >= 8; p += 8, bytes -= 8) {
+        std::uint64_t word;
+        std::memcpy(&word, p, 8);
+        hash = (hash ^ word) * MULTIPLIER;
+        hash ^= hash >> 28;
+    }
+    if (bytes > 0) {
+        std::uint64_t tail = static_cast<std::uint64_t>(bytes) << 56;
+        std::memcpy(&tail, p, bytes);
+        hash = (hash ^ tail) * MULTIPLIER;
+        hash ^= hash >> 28;
+    }
+    return hash;
+}
+
+/**
+ * A read-only snapshot of a map, laid out for fast lookups.
+ *
+ * The keys are stored in Eytzinger (breadth-first) order in one flat
+ * array: the children of position k are 2k and 2k + 1, counting from 1.
+ * A search is then a loop with no data-dependent branches that walks down
+ * that implicit tree, and the top levels, which every search touches,
+ * share a few cache lines. Each step also prefetches the cache line that
+ * holds the node's descendants several levels down, so the memory
+ * latency of those deeper levels overlaps with the comparisons.
+ *
+ * Key/value pairs are kept in a second array in the same order, so
+ * searches only ever read keys. Iteration still goes in key order.
+ *
+ * Build it from a BinarySearchTree (or AVLTree) once the tree has stopped
+ * changing, or from any range of pairs. It searches with the tree's own
+ * comparator, or with the one given alongside the range.
+ *
+ * For trivially copyable keys and values, save() writes those two arrays
+ * to a file and load_mmap() maps such a file back in and searches it in
+ * place: loading allocates nothing per pair and costs little more than
+ * paging the file in. The file does not record the comparator, so it must
+ * be loaded with one that orders keys the way the saving tree's did.
+ * Copies of a FrozenTree share their storage.
+ */
+template<typename Key, typename Value, typename Compare = std::less<Key> >
+class FrozenTree
+{
+public:
+    /**
+     * Bidirectional iterator in key order. It walks the implicit tree by
+     * index arithmetic, so it needs no links.
+     */
+    class const_iterator
+    {
+    public:
+        typedef std::bidirectional_iterator_tag iterator_category;
+        typedef std::pair<const Key, Value> value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef const std::pair<const Key, Value>* pointer;
+        typedef const std::pair<const Key, Value>& reference;
+
+        const_iterator();
+
+        const std::pair<const Key, Value>& operator*() const;
+        const std::pair<const Key, Value>* operator->() const;
+
+        bool operator==(const const_iterator& rhs) const;
+        bool operator!=(const const_iterator& rhs) const;
+
+        const_iterator& operator++();
+        const_iterator operator++(int);
+        const_iterator& operator--();
+        const_iterator operator--(int);
+
+    protected:
+        friend class FrozenTree<Key, Value, Compare>;
+        const_iterator(std::size_t pos, const FrozenTree<Key, Value, Compare>* tree);
+
+        // 1-based position in the layout; 0 is end().
+        std::size_t pos_;
+        const FrozenTree<Key, Value, Compare>* tree_;
+    };
+
+    typedef Compare key_compare;
+
+    FrozenTree();
+    template<typename Sizes>
+    explicit FrozenTree(const BinarySearchTree<Key, Value, Compare, Sizes>& tree);
+    template<typename InputIt>
+    FrozenTree(InputIt first, InputIt last, const Compare& comp = Compare());
+
+    const_iterator begin() const;
+    const_iterator end() const;
+    const_iterator find(const Key& key) const;
+    const_iterator lower_bound(const Key& key) const;
+    const_iterator upper_bound(const Key& key) const;
+    Value const & operator[](const Key& key) const;
+
+    bool empty() const;
+    std::size_t size() const;
+    Compare key_comp() const;
+
+    void save(const std::string& path) const;
+    static FrozenTree<Key, Value, Compare> load_mmap(const std::string& path, bool verify = true,
+                                                     const Compare& comp = Compare());
+
+protected:
+    bool keyLess(const Key& a, const Key& b) const;
+    template<typename InputIt>
+    void build(InputIt first, InputIt last);
+    std::size_t lowerBoundPos(const Key& key) const;
+    std::size_t upperBoundPos(const Key& key) const;
+    static std::size_t firstPos(std::size_t pos, std::size_t n);
+    static std::size_t lastPos(std::size_t pos, std::size_t n);
+    static std::size_t settle(std::size_t pos);
+    void prefetch(std::size_t pos) const;
+
+    static SnapshotHeader expectedHeader();
+    template<typename T>
+    static void writeArray(int fd, const T* data, std::size_t n, std::uint64_t& checksum);
+    static void writeBytes(int fd, const void* data, std::size_t bytes);
+    static void syncDirectory(const std::string& path);
+    static std::size_t alignUp(std::size_t offset);
+
+    // The vectors behind a FrozenTree built in memory.
+    struct Arrays
+    {
+        std::vector<Key> keys;
+        std::vector<std::pair<const Key, Value> > items;
+    };
+
+    // How many keys share a cache line; prefetching position k * STRIDE
+    // fetches the descendants of k that many levels down.
+    static const std::size_t STRIDE = sizeof(Key) >= 64 ? 1 : 64 / sizeof(Key);
+
+    // Keeps what keys_ and items_ point into alive: an Arrays object or a
+    // read-only mapping of a snapshot file.
+    std::shared_ptr<const void> storage_;
+    const Key* keys_;
+    const std::pair<const Key, Value>* items_;
+    std::size_t size_;
+    Compare comp_;
+};
+
+/*
+  --------------------------------------------------------------
+  Begin implementations for the FrozenTree::const_iterator class.
+  --------------------------------------------------------------
+*/
+
+template<typename Key, typename Value, typename Compare>
+FrozenTree<Key, Value, Compare>::const_iterator::const_iterator() :
+    pos_(0),
+    tree_(nullptr)
+{
+
+}
+
+template<typename Key, typename Value, typename Compare>
+FrozenTree<Key, Value, Compare>::const_iterator::const_iterator(std::size_t pos, const FrozenTree<Key, Value, Compare>* tree) :
+    pos_(pos),
+    tree_(tree)
+{
+
+}
+
+template<typename Key, typename Value, typename Compare>
+const std::pair<const Key, Value>&
+FrozenTree<Key, Value, Compare>::const_iterator::operator*() const
+{
+    return tree_->items_[pos_ - 1];
+}
+
+template<typename Key, typename Value, typename Compare>
+const std::pair<const Key, Value>*
+FrozenTree<Key, Value, Compare>::const_iterator::operator->() const
+{
+    return &(tree_->items_[pos_ - 1]);
+}
+
+template<typename Key, typename Value, typename Compare>
+bool FrozenTree<Key, Value, Compare>::const_iterator::operator==(const const_iterator& rhs) const
+{
+    return pos_ == rhs.pos_;
+}
+
+template<typename Key, typename Value, typename Compare>
+bool FrozenTree<Key, Value, Compare>::const_iterator::operator!=(const const_iterator& rhs) const
+{
+    return pos_ != rhs.pos_;
+}
+
+/**
+* The successor is the leftmost position under the right child if there
+* is one, otherwise the first ancestor we are in the left subtree of.
+*/
+template<typename Key, typename Value, typename Compare>
+typename FrozenTree<Key, Value, Compare>::const_iterator&
+FrozenTree<Key, Value, Compare>::const_iterator::operator++()
+{
+    std::size_t right = 2 * pos_ + 1;
+    if (right <= tree_->size()) {
+        pos_ = firstPos(right, tree_->size());
+    }
+    else {
+        pos_ = settle(pos_);
+    }
+    return *this;
+}
+
+template<typename Key, typename Value, typename Compare>
+typename FrozenTree<Key, Value, Compare>::const_iterator
+FrozenTree<Key, Value, Compare>::const_iterator::operator++(int)
+{
+    const_iterator old = *this;
+    ++(*this);
+    return old;
+}
+
+/**
+* Mirror image of ++; stepping back from end() lands on the largest key.
+*/
+template<typename Key, typename Value, typename Compare>
+typename FrozenTree<Key, Value, Compare>::const_iterator&
+FrozenTree<Key, Value, Compare>::const_iterator::operator--()
+{
+    if (pos_ == 0) {
+        pos_ = lastPos(1, tree_->size());
+    }
+    else if (2 * pos_ <= tree_->size()) {
+        pos_ = lastPos(2 * pos_, tree_->size());
+    }
+    else {
+        // Climb while we are a left child, then once more.
+        while (pos_ != 0 && (pos_ & 1) == 0) {
+            pos_ >>= 1;
+        }
+        pos_ >>= 1;
+    }
+    return *this;
+}
+
+template<typename Key, typename Value, typename Compare>
+typename FrozenTree<Key, Value, Compare>::const_iterator
+FrozenTree<Key, Value, Compare>::const_iterator::operator--(int)
+{
+    const_iterator old = *this;
+    --(*this);
+    return old;
+}
+
+/*
+  ------------------------------------------------------------
+  End implementations for the FrozenTree::const_iterator class.
+  ------------------------------------------------------------
+*/
+
+/*
+  ----------------------------------------------
+  Begin implementations for the FrozenTree class.
+  ----------------------------------------------
+*/
+
+template<typename Key, typename Value, typename Compare>
+FrozenTree<Key, Value, Compare>::FrozenTree() :
+    keys_(nullptr),
+    items_(nullptr),
+    size_(0),
+    comp_()
+{
+
+}
+
+/**
+* Snapshots the current contents of tree, which is already in key order.
+*/
+template<typename Key, typename Value, typename Compare>
+template<typename Sizes>
+FrozenTree<Key, Value, Compare>::FrozenTree(const BinarySearchTree<Key, Value, Compare, Sizes>& tree) :
+    keys_(nullptr),
+    items_(nullptr),
+    size_(0),
+    comp_(tree.key_comp())
+{
+    build(tree.begin(), tree.end());
+}
+
+/**
+* Builds from any range of pairs. The range is sorted first unless its
+* keys are already strictly increasing; for duplicate keys the last value
+* wins, as it would with repeated inserts.
+*/
+template<typename Key, typename Value, typename Compare>
+template<typename InputIt>
+FrozenTree<Key, Value, Compare>::FrozenTree(InputIt first, InputIt last, const Compare& comp) :
+    keys_(nullptr),
+    items_(nullptr),
+    size_(0),
+    comp_(comp)
+{
+    std::vector<std::pair<Key, Value> > sorted(first, last);
+
+    std::stable_sort(sorted.begin(), sorted.end(),
+        [this](const std::pair<Key, Value>& a, const std::pair<Key, Value>& b) {
+            return keyLess(a.first, b.first);
+        });
+
+    // Keep the last of each run of equal keys.
+    std::size_t kept = 0;
+    for (std::size_t i = 0; i < sorted.size(); ++i) {
+        if (i + 1 < sorted.size() && !keyLess(sorted[i].first, sorted[i + 1].first)) {
+            continue;
+        }
+        if (kept != i) {
+            sorted[kept] = std::move(sorted[i]);
+        }
+        ++kept;
+    }
+    sorted.resize(kept);
+
+    build(sorted.begin(), sorted.end());
+}
+
+/**
+* Lays out a sorted, duplicate-free range. An in-order walk of the
+* implicit tree visits the positions in key order, so the k-th position
+* it reaches gets the k-th pair.
+*/
+template<typename Key, typename Value, typename Compare>
+template<typename InputIt>
+void FrozenTree<Key, Value, Compare>::build(InputIt first, InputIt last)
+{
+    std::vector<std::pair<Key, Value> > sorted(first, last);
+    std::size_t n = sorted.size();
+
+    std::vector<std::size_t> rankAt(n + 1);
+    std::size_t rank = 0;
+    for (std::size_t pos = n ? firstPos(1, n) : 0; pos != 0; ) {
+        rankAt[pos] = rank++;
+        std::size_t right = 2 * pos + 1;
+        pos = right <= n ? firstPos(right, n) : settle(pos);
+    }
+
+    std::shared_ptr<Arrays> arrays = std::make_shared<Arrays>();
+    arrays->keys.reserve(n);
+    arrays->items.reserve(n);
+    for (std::size_t pos = 1; pos <= n; ++pos) {
+        const std::pair<Key, Value>& item = sorted[rankAt[pos]];
+        arrays->keys.push_back(item.first);
+        arrays->items.push_back(item);
+    }
+
+    keys_ = arrays->keys.data();
+    items_ = arrays->items.data();
+    size_ = n;
+    storage_ = arrays;
+}
+
+template<typename Key, typename Value, typename Compare>
+typename FrozenTree<Key, Value, Compare>::const_iterator
+FrozenTree<Key, Value, Compare>::begin() const
+{
+    return const_iterator(empty() ? 0 : firstPos(1, size()), this);
+}
+
+template<typename Key, typename Value, typename Compare>
+typename FrozenTree<Key, Value, Compare>::const_iterator
+FrozenTree<Key, Value, Compare>::end() const
+{
+    return const_iterator(0, this);
+}
+
+template<typename Key, typename Value, typename Compare>
+typename FrozenTree<Key, Value, Compare>::const_iterator
+FrozenTree<Key, Value, Compare>::find(const Key& key) const
+{
+    std::size_t pos = lowerBoundPos(key);
+    if (pos != 0 && keyLess(key, keys_[pos - 1])) {
+        pos = 0;
+    }
+    return const_iterator(pos, this);
+}
+
+template<typename Key, typename Value, typename Compare>
+typename FrozenTree<Key, Value, Compare>::const_iterator
+FrozenTree<Key, Value, Compare>::lower_bound(const Key& key) const
+{
+    return const_iterator(lowerBoundPos(key), this);
+}
+
+template<typename Key, typename Value, typename Compare>
+typename FrozenTree<Key, Value, Compare>::const_iterator
+FrozenTree<Key, Value, Compare>::upper_bound(const Key& key) const
+{
+    return const_iterator(upperBoundPos(key), this);
+}
+
+template<typename Key, typename Value, typename Compare>
+Value const & FrozenTree<Key, Value, Compare>::operator[](const Key& key) const
+{
+    const_iterator it = find(key);
+    if(it == end()) throw std::out_of_range("Invalid key");
+    return it->second;
+}
+
+template<typename Key, typename Value, typename Compare>
+bool FrozenTree<Key, Value, Compare>::empty() const
+{
+    return size_ == 0;
+}
+
+template<typename Key, typename Value, typename Compare>
+std::size_t FrozenTree<Key, Value, Compare>::size() const
+{
+    return size_;
+}
+
+template<typename Key, typename Value, typename Compare>
+Compare FrozenTree<Key, Value, Compare>::key_comp() const
+{
+    return comp_;
+}
+
+template<typename Key, typename Value, typename Compare>
+inline bool FrozenTree<Key, Value, Compare>::keyLess(const Key& a, const Key& b) const
+{
+    return KeyOrder<Key, Compare>::less(comp_, a, b);
+}
+
+/**
+* Walks all the way down the implicit tree, going right whenever the key
+* at pos is less than key. The comparison result is folded into the next
+* index rather than branched on, so every search runs the same number of
+* iterations and the loop never mispredicts. The answer is the last
+* position we went left from, recovered by settle().
+*/
+template<typename Key, typename Value, typename Compare>
+std::size_t FrozenTree<Key, Value, Compare>::lowerBoundPos(const Key& key) const
+{
+    const std::size_t n = size_;
+    const Key* keys = keys_;
+    std::size_t pos = 1;
+
+    while (pos <= n) {
+        prefetch(pos * STRIDE);
+        pos = 2 * pos + static_cast<std::size_t>(keyLess(keys[pos - 1], key));
+    }
+
+    return settle(pos);
+}
+
+/**
+* Same walk as lowerBoundPos, going right while the key at pos is not
+* greater than key.
+*/
+template<typename Key, typename Value, typename Compare>
+std::size_t FrozenTree<Key, Value, Compare>::upperBoundPos(const Key& key) const
+{
+    const std::size_t n = size_;
+    const Key* keys = keys_;
+    std::size_t pos = 1;
+
+    while (pos <= n) {
+        prefetch(pos * STRIDE);
+        pos = 2 * pos + static_cast<std::size_t>(!keyLess(key, keys[pos - 1]));
+    }
+
+    return settle(pos);
+}
+
+/**
+* Leftmost position in the subtree rooted at pos, in a layout of n keys.
+*/
+template<typename Key, typename Value, typename Compare>
+std::size_t FrozenTree<Key, Value, Compare>::firstPos(std::size_t pos, std::size_t n)
+{
+    while (2 * pos <= n) {
+        pos = 2 * pos;
+    }
+    return pos;
+}
+
+/**
+* Rightmost position in the subtree rooted at pos, in a layout of n keys.
+*/
+template<typename Key, typename Value, typename Compare>
+std::size_t FrozenTree<Key, Value, Compare>::lastPos(std::size_t pos, std::size_t n)
+{
+    while (2 * pos + 1 <= n) {
+        pos = 2 * pos + 1;
+    }
+    return pos;
+}
+
+/**
+* Undoes the trailing right turns of a path: drops the low one bits and
+* then one more level, giving the nearest ancestor whose left subtree
+* pos is in (0 if there is none).
+*/
+template<typename Key, typename Value, typename Compare>
+std::size_t FrozenTree<Key, Value, Compare>::settle(std::size_t pos)
+{
+#if defined(__GNUC__)
+    return pos >> __builtin_ffsll(static_cast<long long>(~pos));
+#else
+    while (pos & 1) {
+        pos >>= 1;
+    }
+    return pos >> 1;
+#endif
+}
+
+template<typename Key, typename Value, typename Compare>
+inline void FrozenTree<Key, Value, Compare>::prefetch(std::size_t pos) const
+{
+#if defined(__GNUC__)
+    if (pos <= size_) {
+        __builtin_prefetch(keys_ + (pos - 1));
+    }
+#else
+    (void)pos;
+#endif
+}
+
+/**
+* Writes the tree to a snapshot file that load_mmap can serve from
+* directly. The file is written under a temporary name, synced and then
+* renamed over path, so a crash leaves either the old snapshot or the new
+* one. The directory is synced after the rename, so once save returns the
+* new snapshot is the one a crash leaves behind. Throws
+* std::runtime_error if any step fails.
+*/
+template<typename Key, typename Value, typename Compare>
+void FrozenTree<Key, Value, Compare>::save(const std::string& path) const
+{
+    static_assert(std::is_trivially_copyable<Key>::value &&
+                  std::is_trivially_copyable<Value>::value,
+                  "snapshots need trivially copyable keys and values");
+
+    SnapshotHeader header = expectedHeader();
+    header.count = size_;
+    header.keysOffset = alignUp(sizeof(SnapshotHeader));
+    header.itemsOffset = alignUp(header.keysOffset + size_ * sizeof(Key));
+    header.fileSize = header.itemsOffset + size_ * sizeof(std::pair<const Key, Value>);
+    header.checksum = snapshotChecksum(nullptr, 0);
+
+    std::string temp = path + ".tmp";
+    int fd = ::open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        throw std::runtime_error("cannot create " + temp + ": " + std::strerror(errno));
+    }
+
+    try {
+        std::vector<char> zeros(SNAPSHOT_ALIGN, 0);
+        writeBytes(fd, &header, sizeof(header));
+        writeBytes(fd, zeros.data(), header.keysOffset - sizeof(header));
+        writeArray(fd, keys_, size_, header.checksum);
+        writeBytes(fd, zeros.data(), header.itemsOffset - (header.keysOffset + size_ * sizeof(Key)));
+        writeArray(fd, items_, size_, header.checksum);
+
+        // Now that the checksum is known, fill in the real header.
+        if (::lseek(fd, 0, SEEK_SET) != 0) {
+            throw std::runtime_error("cannot seek in " + temp + ": " + std::strerror(errno));
+        }
+        writeBytes(fd, &header, sizeof(header));
+        if (::fsync(fd) != 0) {
+            throw std::runtime_error("cannot sync " + temp + ": " + std::strerror(errno));
+        }
+    }
+    catch (...) {
+        ::close(fd);
+        std::remove(temp.c_str());
+        throw;
+    }
+
+    if (::close(fd) != 0 || std::rename(temp.c_str(), path.c_str()) != 0) {
+        std::string reason = std::strerror(errno);
+        std::remove(temp.c_str());
+        throw std::runtime_error("cannot write " + path + ": " + reason);
+    }
+    syncDirectory(path);
+}
+
+/**
+* Maps a file written by save and returns a tree that searches it in
+* place. The header is checked against Key and Value, and unless verify is
+* false the checksum is too, which reads the whole file once. Throws
+* std::runtime_error if the file cannot be mapped or does not match.
+*/
+template<typename Key, typename Value, typename Compare>
+FrozenTree<Key, Value, Compare> FrozenTree<Key, Value, Compare>::load_mmap(const std::string& path, bool verify,
+                                                                          const Compare& comp)
+{
+    static_assert(std::is_trivially_copyable<Key>::value &&
+                  std::is_trivially_copyable<Value>::value,
+                  "snapshots need trivially copyable keys and values");
+
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error("cannot open " + path + ": " + std::strerror(errno));
+    }
+    struct stat info;
+    if (::fstat(fd, &info) != 0 || static_cast<std::size_t>(info.st_size) < sizeof(SnapshotHeader)) {
+        ::close(fd);
+        throw std::runtime_error(path + " is not a snapshot");
+    }
+
+    std::size_t length = static_cast<std::size_t>(info.st_size);
+    void* base = ::mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (base == MAP_FAILED) {
+        throw std::runtime_error("cannot map " + path + ": " + std::strerror(errno));
+    }
+    std::shared_ptr<const void> mapping(base, [length](const void* addr) {
+        ::munmap(const_cast<void*>(addr), length);
+    });
+
+    const char* bytes = static_cast<const char*>(base);
+    SnapshotHeader header;
+    std::memcpy(&header, bytes, sizeof(header));
+    SnapshotHeader expected = expectedHeader();
+
+    const std::uint64_t itemSize = sizeof(std::pair<const Key, Value>);
+    if (std::memcmp(header.magic, expected.magic, sizeof(header.magic)) != 0 ||
+        header.version != expected.version) {
+        throw std::runtime_error(path + " is not a snapshot of a supported version");
+    }
+    if (header.byteOrder != expected.byteOrder || header.keySize != expected.keySize ||
+        header.valueSize != expected.valueSize || header.itemSize != expected.itemSize ||
+        header.itemAlign != expected.itemAlign) {
+        throw std::runtime_error(path + " was written for other key or value types");
+    }
+    if (header.fileSize != length ||
+        header.keysOffset % SNAPSHOT_ALIGN != 0 || header.itemsOffset % SNAPSHOT_ALIGN != 0 ||
+        header.keysOffset < sizeof(SnapshotHeader) ||
+        header.count > (length - header.keysOffset) / sizeof(Key) ||
+        header.itemsOffset < header.keysOffset + header.count * sizeof(Key) ||
+        header.itemsOffset > length ||
+        header.count > (length - header.itemsOffset) / itemSize) {
+        throw std::runtime_error(path + " is truncated or corrupt");
+    }
+
+    if (verify) {
+        // One checksum runs over the keys and then the pairs, as save wrote them.
+        std::uint64_t checksum = snapshotChecksum(bytes + header.keysOffset, header.count * sizeof(Key));
+        checksum = snapshotChecksum(bytes + header.itemsOffset, header.count * itemSize, checksum);
+        if (checksum != header.checksum) {
+            throw std::runtime_error(path + " failed its checksum");
+        }
+    }
+
+    FrozenTree<Key, Value, Compare> tree;
+    tree.comp_ = comp;
+    tree.keys_ = reinterpret_cast<const Key*>(bytes + header.keysOffset);
+    tree.items_ = reinterpret_cast<const std::pair<const Key, Value>*>(bytes + header.itemsOffset);
+    tree.size_ = header.count;
+    tree.storage_ = mapping;
+    return tree;
+}
+
+/**
+* A header with everything but the counts, offsets and checksum filled in
+* for this Key and Value.
+*/
+template<typename Key, typename Value, typename Compare>
+SnapshotHeader FrozenTree<Key, Value, Compare>::expectedHeader()
+{
+    SnapshotHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.byteOrder = SNAPSHOT_BYTE_ORDER;
+    header.keySize = sizeof(Key);
+    header.valueSize = sizeof(Value);
+    header.itemSize = sizeof(std::pair<const Key, Value>);
+    header.itemAlign = alignof(std::pair<const Key, Value>);
+    return header;
+}
+
+/**
+* Writes n objects and folds them into checksum. They are copied into a
+* zeroed buffer first so that padding bytes go out as zeros.
+*/
+template<typename Key, typename Value, typename Compare>
+template<typename T>
+void FrozenTree<Key, Value, Compare>::writeArray(int fd, const T* data, std::size_t n, std::uint64_t& checksum)
+{
+    const std::size_t CHUNK = 4096;
+    std::vector<char> buffer(std::min(n, CHUNK) * sizeof(T));
+
+    for (std::size_t done = 0; done < n; ) {
+        std::size_t count = std::min(n - done, CHUNK);
+        std::size_t bytes = count * sizeof(T);
+        std::memset(buffer.data(), 0, bytes);
+        for (std::size_t i = 0; i < count; ++i) {
+            new (buffer.data() + i * sizeof(T)) T(data[done + i]);
+        }
+        checksum = snapshotChecksum(buffer.data(), bytes, checksum);
+        writeBytes(fd, buffer.data(), bytes);
+        done += count;
+    }
+}
+
+template<typename Key, typename Value, typename Compare>
+void FrozenTree<Key, Value, Compare>::writeBytes(int fd, const void* data, std::size_t bytes)
+{
+    const char* p = static_cast<const char*>(data);
+    while (bytes > 0) {
+        ssize_t written = ::write(fd, p, bytes);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            throw std::runtime_error(std::string("snapshot write failed: ") + std::strerror(errno));
+        }
+        p += written;
+        bytes -= static_cast<std::size_t>(written);
+    }
+}
+
+/**
+* Syncs the directory holding path, which makes a rename into it durable.
+*/
+template<typename Key, typename Value, typename Compare>
+void FrozenTree<Key, Value, Compare>::syncDirectory(const std::string& path)
+{
+    std::string::size_type slash = path.rfind('/');
+    std::string dir = slash == std::string::npos ? "." : (slash == 0 ? "/" : path.substr(0, slash));
+
+    int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+    if (fd < 0) {
+        throw std::runtime_error("cannot open " + dir + ": " + std::strerror(errno));
+    }
+    if (::fsync(fd) != 0) {
+        std::string reason = std::strerror(errno);
+        ::close(fd);
+        throw std::runtime_error("cannot sync " + dir + ": " + reason);
+    }
+    ::close(fd);
+}
+
+template<typename Key, typename Value, typename Compare>
+std::size_t FrozenTree<Key, Value, Compare>::alignUp(std::size_t offset)
+{
+    return (offset + SNAPSHOT_ALIGN - 1) / SNAPSHOT_ALIGN * SNAPSHOT_ALIGN;
+}
+
+/*
+  --------------------------------------------
+  End implementations for the FrozenTree class.
+  --------------------------------------------
+*/
+
+#endif
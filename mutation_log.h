@@ -0,0 +1,530 @@
+#ifndef MUTATION_LOG_H
+#define MUTATION_LOG_H
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "avlbst.h"
+#include "frozen_tree.h"
+
+/**
+ * An append-only write-ahead log of inserts and removes, for trivially
+ * copyable keys and values.
+ *
+ * The file starts with a small header naming the key and value sizes.
+ * Each record after it is a 32-bit body length and a 64-bit checksum of
+ * the body, followed by the body itself: one operation byte, the key and,
+ * for inserts, the value. Records collect in memory and are written and
+ * synced to disk together, once every syncEvery records or when commit()
+ * is called, so one fdatasync covers a whole group. A record is durable
+ * only once a commit has covered it.
+ *
+ * A crash can leave a torn record at the end of the file. replay() stops
+ * at the first record that is short or fails its checksum and cuts the
+ * file back to the last good one, so appending can carry on from there.
+ * A commit that fails part-way can leave one too; records are written at
+ * the end of the last successful commit, so retrying the commit writes
+ * over the torn bytes instead of after them.
+ */
+template <class Key, class Value>
+class MutationLog
+{
+public:
+    explicit MutationLog(const std::string& path, std::size_t syncEvery = 64);
+    ~MutationLog();
+
+    template<typename Apply>
+    std::size_t replay(Apply apply);
+
+    void logInsert(const Key& key, const Value& value);
+    void logRemove(const Key& key);
+    void commit();
+    void reset();
+
+    std::size_t pending() const;
+
+protected:
+    MutationLog(const MutationLog&) = delete;
+    MutationLog& operator=(const MutationLog&) = delete;
+
+    enum Operation : std::uint8_t { INSERT = 1, REMOVE = 2 };
+
+    struct LogHeader
+    {
+        char magic[8];
+        std::uint32_t version;
+        std::uint32_t byteOrder;
+        std::uint32_t keySize;
+        std::uint32_t valueSize;
+    };
+
+    static LogHeader expectedHeader();
+    void append(Operation op, const Key& key, const Value* value);
+    void writeHeader();
+    void writeAt(const void* data, std::size_t bytes, std::size_t offset);
+    std::size_t readAt(char* data, std::size_t bytes, std::size_t offset) const;
+    void fail(const char* what, int error) const;
+
+    // Record framing: body length, then body checksum.
+    static const std::size_t FRAME_BYTES = sizeof(std::uint32_t) + sizeof(std::uint64_t);
+    // Longest record body, an insert.
+    static const std::size_t MAX_BODY = 1 + sizeof(Key) + sizeof(Value);
+    // replay reads the log this many bytes at a time.
+    static const std::size_t READ_CHUNK = 1 << 16;
+
+    std::string path_;
+    int fd_;
+    std::size_t syncEvery_;
+    std::size_t pending_;
+    std::vector<char> buffer_;
+    // End of the last successful commit, where the next one is written.
+    std::size_t end_;
+};
+
+/*
+  -------------------------------------------------
+  Begin implementations for the MutationLog class.
+  -------------------------------------------------
+*/
+
+/**
+* Opens path for appending, creating it with a fresh header if it does
+* not exist yet. Call replay() before logging anything to a file that may
+* already hold records.
+*/
+template<class Key, class Value>
+MutationLog<Key, Value>::MutationLog(const std::string& path, std::size_t syncEvery) :
+    path_(path),
+    fd_(-1),
+    syncEvery_(syncEvery == 0 ? 1 : syncEvery),
+    pending_(0),
+    end_(0)
+{
+    static_assert(std::is_trivially_copyable<Key>::value &&
+                  std::is_trivially_copyable<Value>::value,
+                  "the mutation log needs trivially copyable keys and values");
+
+    fd_ = ::open(path_.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd_ < 0) fail("cannot open", errno);
+
+    struct stat info;
+    if (::fstat(fd_, &info) != 0) {
+        int error = errno;
+        ::close(fd_);
+        fail("cannot stat", error);
+    }
+    if (info.st_size == 0) {
+        try {
+            writeHeader();
+        }
+        catch (...) {
+            ::close(fd_);
+            throw;
+        }
+    }
+    else {
+        end_ = static_cast<std::size_t>(info.st_size);
+    }
+}
+
+/**
+* Commits whatever is still pending. Errors cannot be reported from here;
+* call commit() first to see them.
+*/
+template<class Key, class Value>
+MutationLog<Key, Value>::~MutationLog()
+{
+    try {
+        commit();
+    }
+    catch (...) {
+    }
+    ::close(fd_);
+}
+
+/**
+* Calls apply(true, key, value) for every logged insert and
+* apply(false, key, value) for every remove (value is then
+* value-initialized), in log order. Returns the number of records
+* replayed. Throws std::runtime_error if the file belongs to other types.
+*
+* The file is read READ_CHUNK bytes at a time, so replaying a long log
+* needs no more memory than a short one.
+*/
+template<class Key, class Value>
+template<typename Apply>
+std::size_t MutationLog<Key, Value>::replay(Apply apply)
+{
+    commit();
+
+    struct stat info;
+    if (::fstat(fd_, &info) != 0) fail("cannot stat", errno);
+    std::size_t fileSize = static_cast<std::size_t>(info.st_size);
+
+    LogHeader header;
+    LogHeader expected = expectedHeader();
+    if (fileSize < sizeof(header)) {
+        // Only a crash while starting the file leaves less than a header.
+        reset();
+        return 0;
+    }
+    if (readAt(reinterpret_cast<char*>(&header), sizeof(header), 0) != sizeof(header)) {
+        throw std::runtime_error(path_ + " shrank while it was being read");
+    }
+    if (std::memcmp(&header, &expected, sizeof(header)) != 0) {
+        throw std::runtime_error(path_ + " was written for other key or value types");
+    }
+
+    // buffer[begin, end) holds the file from offset on.
+    std::vector<char> buffer(READ_CHUNK);
+    std::size_t begin = 0;
+    std::size_t end = 0;
+    std::size_t offset = sizeof(header);
+    std::size_t records = 0;
+    bool atEnd = false;
+    for (;;) {
+        if (end - begin < FRAME_BYTES + MAX_BODY && !atEnd) {
+            std::memmove(buffer.data(), buffer.data() + begin, end - begin);
+            end -= begin;
+            begin = 0;
+            std::size_t got = readAt(buffer.data() + end, buffer.size() - end, offset + end);
+            atEnd = end + got < buffer.size();
+            end += got;
+        }
+        if (end - begin < FRAME_BYTES) break;
+
+        std::uint32_t length;
+        std::uint64_t checksum;
+        std::memcpy(&length, &buffer[begin], sizeof(length));
+        std::memcpy(&checksum, &buffer[begin + sizeof(length)], sizeof(checksum));
+
+        const char* body = &buffer[begin + FRAME_BYTES];
+        std::size_t available = end - begin - FRAME_BYTES;
+        if (length > available || length < 1 + sizeof(Key) ||
+            snapshotChecksum(body, length) != checksum) {
+            break;
+        }
+
+        Key key;
+        Value value = Value();
+        std::memcpy(&key, body + 1, sizeof(Key));
+        if (body[0] == INSERT && length == 1 + sizeof(Key) + sizeof(Value)) {
+            std::memcpy(&value, body + 1 + sizeof(Key), sizeof(Value));
+            apply(true, key, value);
+        }
+        else if (body[0] == REMOVE && length == 1 + sizeof(Key)) {
+            apply(false, key, value);
+        }
+        else {
+            break;
+        }
+
+        begin += FRAME_BYTES + length;
+        offset += FRAME_BYTES + length;
+        ++records;
+    }
+
+    // Drop a torn tail so that new records follow the last good one.
+    if (offset != fileSize) {
+        if (::ftruncate(fd_, static_cast<off_t>(offset)) != 0 || ::fdatasync(fd_) != 0) {
+            fail("cannot truncate", errno);
+        }
+    }
+    end_ = offset;
+    return records;
+}
+
+template<class Key, class Value>
+void MutationLog<Key, Value>::logInsert(const Key& key, const Value& value)
+{
+    append(INSERT, key, &value);
+}
+
+template<class Key, class Value>
+void MutationLog<Key, Value>::logRemove(const Key& key)
+{
+    append(REMOVE, key, nullptr);
+}
+
+/**
+* Writes the pending records and waits for them to reach the disk. If
+* that fails the records stay pending and the end of the log is not
+* moved, so the next commit writes them again from the same place.
+*/
+template<class Key, class Value>
+void MutationLog<Key, Value>::commit()
+{
+    if (buffer_.empty()) return;
+
+    writeAt(buffer_.data(), buffer_.size(), end_);
+    if (::fdatasync(fd_) != 0) fail("cannot sync", errno);
+    end_ += buffer_.size();
+    buffer_.clear();
+    pending_ = 0;
+}
+
+/**
+* Empties the log, pending records included. Used once a snapshot has
+* made the logged mutations redundant.
+*/
+template<class Key, class Value>
+void MutationLog<Key, Value>::reset()
+{
+    buffer_.clear();
+    pending_ = 0;
+    end_ = 0;
+    if (::ftruncate(fd_, 0) != 0) fail("cannot truncate", errno);
+    writeHeader();
+}
+
+/**
+* Records logged but not yet covered by a commit.
+*/
+template<class Key, class Value>
+std::size_t MutationLog<Key, Value>::pending() const
+{
+    return pending_;
+}
+
+template<class Key, class Value>
+typename MutationLog<Key, Value>::LogHeader MutationLog<Key, Value>::expectedHeader()
+{
+    LogHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, "TREELOG", 8);
+    header.version = 1;
+    header.byteOrder = SNAPSHOT_BYTE_ORDER;
+    header.keySize = sizeof(Key);
+    header.valueSize = sizeof(Value);
+    return header;
+}
+
+/**
+* Frames one record into the buffer and commits once enough have piled
+* up. The body is assembled in place after a gap for the frame, which is
+* filled in once the checksum is known.
+*/
+template<class Key, class Value>
+void MutationLog<Key, Value>::append(Operation op, const Key& key, const Value* value)
+{
+    std::uint32_t length = static_cast<std::uint32_t>(1 + sizeof(Key) + (value ? sizeof(Value) : 0));
+    std::size_t start = buffer_.size();
+    buffer_.resize(start + FRAME_BYTES + length);
+
+    char* body = &buffer_[start + FRAME_BYTES];
+    body[0] = static_cast<char>(op);
+    std::memcpy(body + 1, &key, sizeof(Key));
+    if (value) {
+        std::memcpy(body + 1 + sizeof(Key), value, sizeof(Value));
+    }
+
+    std::uint64_t checksum = snapshotChecksum(body, length);
+    std::memcpy(&buffer_[start], &length, sizeof(length));
+    std::memcpy(&buffer_[start + sizeof(length)], &checksum, sizeof(checksum));
+
+    if (++pending_ >= syncEvery_) {
+        commit();
+    }
+}
+
+template<class Key, class Value>
+void MutationLog<Key, Value>::writeHeader()
+{
+    LogHeader header = expectedHeader();
+    writeAt(&header, sizeof(header), 0);
+    if (::fdatasync(fd_) != 0) fail("cannot sync", errno);
+    end_ = sizeof(header);
+}
+
+template<class Key, class Value>
+void MutationLog<Key, Value>::writeAt(const void* data, std::size_t bytes, std::size_t offset)
+{
+    const char* p = static_cast<const char*>(data);
+    while (bytes > 0) {
+        ssize_t written = ::pwrite(fd_, p, bytes, static_cast<off_t>(offset));
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            fail("cannot write", errno);
+        }
+        p += written;
+        offset += static_cast<std::size_t>(written);
+        bytes -= static_cast<std::size_t>(written);
+    }
+}
+
+/**
+* Reads up to bytes bytes at offset, stopping early only at the end of
+* the file. Returns how many were read.
+*/
+template<class Key, class Value>
+std::size_t MutationLog<Key, Value>::readAt(char* data, std::size_t bytes, std::size_t offset) const
+{
+    std::size_t done = 0;
+    while (done < bytes) {
+        ssize_t got = ::pread(fd_, data + done, bytes - done, static_cast<off_t>(offset + done));
+        if (got < 0) {
+            if (errno == EINTR) continue;
+            fail("cannot read", errno);
+        }
+        if (got == 0) break;
+        done += static_cast<std::size_t>(got);
+    }
+    return done;
+}
+
+/**
+* Throws for a failed system call. error is the errno it left, saved by
+* the caller in case cleanup has changed errno since.
+*/
+template<class Key, class Value>
+void MutationLog<Key, Value>::fail(const char* what, int error) const
+{
+    throw std::runtime_error(std::string(what) + " " + path_ + ": " + std::strerror(error));
+}
+
+/*
+  -----------------------------------------------
+  End implementations for the MutationLog class.
+  -----------------------------------------------
+*/
+
+
+/**
+ * An AVLTree whose inserts and removes are logged before they are applied,
+ * so its contents survive a crash.
+ *
+ * Opening one recovers the latest state: the tree is loaded from the
+ * snapshot file, if there is one, and then every intact record of the log
+ * is replayed on top. checkpoint() writes a new snapshot and empties the
+ * log. A crash between those two steps only means the old log is replayed
+ * over the new snapshot on the next start. That is harmless because
+ * replaying inserts and removes in order gives the same final contents
+ * however many of them the snapshot already reflects.
+ *
+ * Mutations are durable once commit() returns or once the log has synced
+ * on its own, every syncEvery records.
+ */
+template <class Key, class Value, class Compare = std::less<Key> >
+class LoggedAVLTree
+{
+public:
+    LoggedAVLTree(const std::string& snapshotPath, const std::string& logPath,
+                  std::size_t syncEvery = 64, const Compare& comp = Compare());
+
+    bool insert(const std::pair<const Key, Value>& keyValuePair);
+    bool remove(const Key& key);
+    void commit();
+    void checkpoint();
+
+    const AVLTree<Key, Value, Compare>& tree() const;
+    std::size_t recoveredRecords() const;
+
+protected:
+    std::string snapshotPath_;
+    AVLTree<Key, Value, Compare> tree_;
+    MutationLog<Key, Value> log_;
+    std::size_t recovered_;
+};
+
+/*
+  ---------------------------------------------------
+  Begin implementations for the LoggedAVLTree class.
+  ---------------------------------------------------
+*/
+
+template<class Key, class Value, class Compare>
+LoggedAVLTree<Key, Value, Compare>::LoggedAVLTree(const std::string& snapshotPath, const std::string& logPath,
+                                                  std::size_t syncEvery, const Compare& comp) :
+    snapshotPath_(snapshotPath),
+    tree_(comp),
+    log_(logPath, syncEvery),
+    recovered_(0)
+{
+    if (::access(snapshotPath_.c_str(), F_OK) == 0) {
+        FrozenTree<Key, Value, Compare> snapshot = FrozenTree<Key, Value, Compare>::load_mmap(snapshotPath_, true, comp);
+        tree_.assign(snapshot.begin(), snapshot.end());
+    }
+
+    recovered_ = log_.replay([this](bool isInsert, const Key& key, const Value& value) {
+        if (isInsert) {
+            tree_.insert(std::make_pair(key, value));
+        }
+        else {
+            tree_.remove(key);
+        }
+    });
+}
+
+/**
+* Logs and then applies the insert. Returns true if the key is new.
+*/
+template<class Key, class Value, class Compare>
+bool LoggedAVLTree<Key, Value, Compare>::insert(const std::pair<const Key, Value>& keyValuePair)
+{
+    log_.logInsert(keyValuePair.first, keyValuePair.second);
+    return tree_.insert(keyValuePair).second;
+}
+
+/**
+* Logs and then applies the remove. Returns true if the key was there.
+*/
+template<class Key, class Value, class Compare>
+bool LoggedAVLTree<Key, Value, Compare>::remove(const Key& key)
+{
+    log_.logRemove(key);
+    std::size_t before = tree_.size();
+    tree_.remove(key);
+    return tree_.size() != before;
+}
+
+template<class Key, class Value, class Compare>
+void LoggedAVLTree<Key, Value, Compare>::commit()
+{
+    log_.commit();
+}
+
+/**
+* Saves the whole tree as the new snapshot and starts an empty log. The
+* log is only emptied once save has made the new snapshot durable,
+* directory entry included; otherwise a crash could leave the old
+* snapshot next to an empty log.
+*/
+template<class Key, class Value, class Compare>
+void LoggedAVLTree<Key, Value, Compare>::checkpoint()
+{
+    FrozenTree<Key, Value, Compare>(tree_).save(snapshotPath_);
+    log_.reset();
+}
+
+template<class Key, class Value, class Compare>
+const AVLTree<Key, Value, Compare>& LoggedAVLTree<Key, Value, Compare>::tree() const
+{
+    return tree_;
+}
+
+/**
+* How many log records were replayed when the tree was opened.
+*/
+template<class Key, class Value, class Compare>
+std::size_t LoggedAVLTree<Key, Value, Compare>::recoveredRecords() const
+{
+    return recovered_;
+}
+
+/*
+  -------------------------------------------------
+  End implementations for the LoggedAVLTree class.
+  -------------------------------------------------
+*/
+
+#endif
@@ -0,0 +1,205 @@
+#ifndef NODE_POOL_H
+#define NODE_POOL_H
+
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <vector>
+
+/**
+ * A fixed-size block allocator used by the search trees for their nodes.
+ *
+ * Blocks are carved out of contiguous slabs that grow geometrically, so
+ * nodes inserted together end up next to each other in memory. Freed
+ * blocks go onto an intrusive free list and are handed out again before
+ * any new slab space is used. release() gives every slab back at once,
+ * which is how the trees implement clear().
+ *
+ * The pool only manages raw storage; constructing and destroying the
+ * objects that live in it is up to the caller.
+ *
+ * Slabs are kept in reference counted groups so that blocks can move to
+ * another pool without being copied: after a.shareWith(b), b keeps a's
+ * slabs alive, and b may hold and free blocks that a handed out. A slab
+ * goes back to the system once every pool sharing it has been released.
+ */
+class NodePool
+{
+public:
+    explicit NodePool(std::size_t blockSize);
+    ~NodePool();
+
+    void* allocate();
+    void deallocate(void* block);
+    void release();
+    void shareWith(NodePool& other);
+
+    std::size_t blockSize() const;
+
+private:
+    NodePool(const NodePool&) = delete;
+    NodePool& operator=(const NodePool&) = delete;
+
+    void grow();
+
+    // A freed block reuses its own storage as the free list link.
+    struct FreeBlock
+    {
+        FreeBlock* next;
+    };
+
+    // Slabs that are freed together when the last pool holding them lets go.
+    struct SlabGroup
+    {
+        std::vector<void*> slabs;
+        ~SlabGroup();
+    };
+
+    static const std::size_t FIRST_SLAB_BLOCKS = 32;
+    static const std::size_t MAX_SLAB_BLOCKS = 4096;
+
+    std::size_t blockSize_;
+    std::size_t nextSlabBlocks_;
+    // New slabs go into the last group, which no other pool has seen.
+    std::vector<std::shared_ptr<SlabGroup> > groups_;
+    bool lastGroupShared_;
+    char* cursor_;
+    char* limit_;
+    FreeBlock* free_;
+};
+
+/*
+  -----------------------------------------------
+  Begin implementations for the NodePool class.
+  -----------------------------------------------
+*/
+
+/**
+* Rounds the block size up so that every block in a slab stays suitably
+* aligned for any node type (and is big enough to hold a free list link).
+*/
+inline NodePool::NodePool(std::size_t blockSize) :
+    blockSize_(0),
+    nextSlabBlocks_(FIRST_SLAB_BLOCKS),
+    lastGroupShared_(false),
+    cursor_(nullptr),
+    limit_(nullptr),
+    free_(nullptr)
+{
+    const std::size_t align = alignof(std::max_align_t);
+    if (blockSize < sizeof(FreeBlock)) {
+        blockSize = sizeof(FreeBlock);
+    }
+    blockSize_ = (blockSize + align - 1) / align * align;
+}
+
+inline NodePool::~NodePool()
+{
+    release();
+}
+
+inline std::size_t NodePool::blockSize() const
+{
+    return blockSize_;
+}
+
+/**
+* Hands out a recycled block if one is available, otherwise bumps the
+* cursor in the current slab, growing a new slab when it runs out.
+*/
+inline void* NodePool::allocate()
+{
+    if (free_) {
+        FreeBlock* block = free_;
+        free_ = block->next;
+        return block;
+    }
+
+    if (cursor_ == limit_) {
+        grow();
+    }
+
+    void* block = cursor_;
+    cursor_ += blockSize_;
+    return block;
+}
+
+inline void NodePool::deallocate(void* block)
+{
+    if (!block) return;
+
+    FreeBlock* freed = static_cast<FreeBlock*>(block);
+    freed->next = free_;
+    free_ = freed;
+}
+
+inline NodePool::SlabGroup::~SlabGroup()
+{
+    for (std::size_t i = 0; i < slabs.size(); ++i) {
+        ::operator delete(slabs[i]);
+    }
+}
+
+/**
+* Frees every slab in one pass. Any objects still living in the pool must
+* already have been destroyed by the caller. Slabs shared with another
+* pool stay alive until that pool is released too.
+*/
+inline void NodePool::release()
+{
+    groups_.clear();
+    lastGroupShared_ = false;
+    nextSlabBlocks_ = FIRST_SLAB_BLOCKS;
+    cursor_ = nullptr;
+    limit_ = nullptr;
+    free_ = nullptr;
+}
+
+/**
+* Makes other a co-owner of every slab of this pool, so blocks handed out
+* here can be moved into other's care. Costs one step per slab group;
+* groups other already holds are not added twice. The free lists stay
+* separate.
+*/
+inline void NodePool::shareWith(NodePool& other)
+{
+    if (&other == this || groups_.empty()) return;
+
+    other.groups_.insert(other.groups_.end(), groups_.begin(), groups_.end());
+    std::sort(other.groups_.begin(), other.groups_.end());
+    other.groups_.erase(std::unique(other.groups_.begin(), other.groups_.end()), other.groups_.end());
+
+    // Either pool's next slab starts a group of its own.
+    other.lastGroupShared_ = true;
+    lastGroupShared_ = true;
+}
+
+inline void NodePool::grow()
+{
+    if (groups_.empty() || lastGroupShared_) {
+        groups_.push_back(std::make_shared<SlabGroup>());
+        lastGroupShared_ = false;
+    }
+    std::vector<void*>& slabs = groups_.back()->slabs;
+    slabs.reserve(slabs.size() + 1);
+
+    std::size_t bytes = blockSize_ * nextSlabBlocks_;
+    char* slab = static_cast<char*>(::operator new(bytes));
+    slabs.push_back(slab);
+
+    cursor_ = slab;
+    limit_ = slab + bytes;
+
+    if (nextSlabBlocks_ < MAX_SLAB_BLOCKS) {
+        nextSlabBlocks_ *= 2;
+    }
+}
+
+/*
+  ---------------------------------------------
+  End implementations for the NodePool class.
+  ---------------------------------------------
+*/
+
+#endif
@@ -0,0 +1,346 @@
+#ifndef PARALLEL_BST_H
+#define PARALLEL_BST_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <exception>
+#include <limits>
+#include <mutex>
+#include <system_error>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "bst.h"
+
+/**
+ * Multi-threaded full scans of a BinarySearchTree (or AVLTree).
+ *
+ * The tree is cut, in key order, into pieces that are either a whole
+ * subtree of at most a grain's worth of nodes or a single node above such
+ * subtrees. With SubtreeSizes, cutting only looks at the sizes the nodes
+ * keep; without them it cuts at the depth where the subtrees of a
+ * balanced tree get that small, which evens out for AVL trees but not
+ * for a lopsided plain BST. Either way it touches O(pieces * height)
+ * nodes and copies nothing. Each piece is
+ * then walked in order with a small stack of its own, never following
+ * parent links out of it.
+ *
+ * Threads claim pieces one at a time from a shared counter. There are
+ * several pieces per thread, so a thread that finishes early just takes
+ * more of them, which keeps the threads busy as a work-stealing pool
+ * would without any per-thread queues.
+ *
+ * The tree must not be modified during a scan. The callbacks run on
+ * several threads at once; if one throws, no new pieces are started and
+ * the first exception is rethrown once every thread has stopped.
+ */
+class ParallelTraversal
+{
+public:
+    // Smallest piece worth handing to a thread.
+    static const std::size_t MIN_GRAIN = 1024;
+    // Pieces cut per thread, so uneven pieces still even out.
+    static const std::size_t PIECES_PER_THREAD = 8;
+
+    template<typename Key, typename Value, typename Sizes, typename Function>
+    static void forEach(Node<Key, Value, Sizes>* root, std::size_t size, Function& fn,
+                        unsigned threads);
+
+    template<typename Key, typename Value, typename Sizes, typename T, typename Reduce, typename Combine>
+    static T reduce(Node<Key, Value, Sizes>* root, std::size_t size, const T& identity,
+                    Reduce& fold, Combine& combine, unsigned threads);
+
+    template<typename Key, typename Value, typename Compare, typename Sizes>
+    static Node<Key, Value, Sizes>* rootOf(const BinarySearchTree<Key, Value, Compare, Sizes>& tree);
+
+private:
+    // A whole subtree, or only its root node when whole is false.
+    template<typename Key, typename Value, typename Sizes>
+    struct Piece
+    {
+        Node<Key, Value, Sizes>* node;
+        bool whole;
+    };
+
+    static unsigned threadCount(unsigned threads);
+    static std::size_t grainFor(std::size_t size, unsigned threads);
+
+    template<typename Key, typename Value, typename Sizes>
+    static void cut(Node<Key, Value, Sizes>* root, std::size_t size, std::size_t grain,
+                    std::vector<Piece<Key, Value, Sizes> >& pieces);
+    static int cutDepth(std::size_t size, std::size_t grain, SubtreeSizes);
+    static int cutDepth(std::size_t size, std::size_t grain, NoSubtreeSizes);
+    template<typename Key, typename Value>
+    static bool largerThan(const Node<Key, Value, SubtreeSizes>* node, std::size_t grain);
+    template<typename Key, typename Value>
+    static bool largerThan(const Node<Key, Value, NoSubtreeSizes>* node, std::size_t grain);
+
+    template<typename Key, typename Value, typename Sizes, typename Function>
+    static void walk(const Piece<Key, Value, Sizes>& piece, Function& fn);
+
+    template<typename Task>
+    static void run(std::size_t count, unsigned threads, Task task);
+};
+
+/*
+  -------------------------------------------------------
+  Begin implementations for the ParallelTraversal class.
+  -------------------------------------------------------
+*/
+
+/**
+* Treats 0 as "one per hardware thread".
+*/
+inline unsigned ParallelTraversal::threadCount(unsigned threads)
+{
+    if (threads == 0) {
+        threads = std::thread::hardware_concurrency();
+    }
+    return threads == 0 ? 1 : threads;
+}
+
+inline std::size_t ParallelTraversal::grainFor(std::size_t size, unsigned threads)
+{
+    std::size_t grain = size / (threads * PIECES_PER_THREAD);
+    return grain < MIN_GRAIN ? MIN_GRAIN : grain;
+}
+
+template<typename Key, typename Value, typename Compare, typename Sizes>
+Node<Key, Value, Sizes>* ParallelTraversal::rootOf(const BinarySearchTree<Key, Value, Compare, Sizes>& tree)
+{
+    return tree.root_;
+}
+
+/**
+* Calls fn on every pair, spread over the given number of threads. Pairs
+* within a piece are visited in key order, but pieces run concurrently.
+*/
+template<typename Key, typename Value, typename Sizes, typename Function>
+void ParallelTraversal::forEach(Node<Key, Value, Sizes>* root, std::size_t size, Function& fn,
+                                unsigned threads)
+{
+    threads = threadCount(threads);
+    std::size_t grain = grainFor(size, threads);
+
+    std::vector<Piece<Key, Value, Sizes> > pieces;
+    cut(root, size, grain, pieces);
+    run(pieces.size(), threads, [&](std::size_t i) { walk(pieces[i], fn); });
+}
+
+/**
+* Folds every piece separately, starting from identity, then combines the
+* per-piece results from left to right. combine only has to be
+* associative, not commutative, and the result is the same for any
+* number of threads.
+*/
+template<typename Key, typename Value, typename Sizes, typename T, typename Reduce, typename Combine>
+T ParallelTraversal::reduce(Node<Key, Value, Sizes>* root, std::size_t size, const T& identity,
+                            Reduce& fold, Combine& combine, unsigned threads)
+{
+    threads = threadCount(threads);
+    std::size_t grain = grainFor(size, threads);
+
+    std::vector<Piece<Key, Value, Sizes> > pieces;
+    cut(root, size, grain, pieces);
+
+    std::vector<T> results(pieces.size(), identity);
+    run(pieces.size(), threads, [&](std::size_t i) {
+        T& acc = results[i];
+        auto step = [&](const std::pair<const Key, Value>& item) { acc = fold(std::move(acc), item); };
+        walk(pieces[i], step);
+    });
+
+    T total = identity;
+    for (std::size_t i = 0; i < results.size(); ++i) {
+        total = combine(std::move(total), std::move(results[i]));
+    }
+    return total;
+}
+
+/**
+* Cuts the tree of size nodes into pieces in key order. This is an
+* in-order walk that stops descending at subtrees of at most grain nodes
+* (or, without subtree sizes, at cutDepth); the nodes above them become
+* single-node pieces.
+*/
+template<typename Key, typename Value, typename Sizes>
+void ParallelTraversal::cut(Node<Key, Value, Sizes>* root, std::size_t size, std::size_t grain,
+                            std::vector<Piece<Key, Value, Sizes> >& pieces)
+{
+    const int maxDepth = cutDepth(size, grain, Sizes());
+    std::vector<std::pair<Node<Key, Value, Sizes>*, int> > above;
+    Node<Key, Value, Sizes>* node = root;
+    int depth = 0;
+
+    for (;;) {
+        while (node != nullptr && depth < maxDepth && largerThan(node, grain)) {
+            above.push_back(std::make_pair(node, depth));
+            node = node->getLeft();
+            ++depth;
+        }
+        if (node != nullptr) {
+            Piece<Key, Value, Sizes> piece = { node, true };
+            pieces.push_back(piece);
+        }
+        if (above.empty()) break;
+
+        node = above.back().first;
+        depth = above.back().second + 1;
+        above.pop_back();
+        Piece<Key, Value, Sizes> piece = { node, false };
+        pieces.push_back(piece);
+        node = node->getRight();
+    }
+}
+
+/**
+* Subtree sizes tell cut where to stop, so depth does not limit it.
+*/
+inline int ParallelTraversal::cutDepth(std::size_t, std::size_t, SubtreeSizes)
+{
+    return std::numeric_limits<int>::max();
+}
+
+/**
+* The depth at which the subtrees of a balanced tree of size nodes hold
+* at most grain nodes each.
+*/
+inline int ParallelTraversal::cutDepth(std::size_t size, std::size_t grain, NoSubtreeSizes)
+{
+    int depth = 0;
+    while (size > grain) {
+        size /= 2;
+        ++depth;
+    }
+    return depth;
+}
+
+template<typename Key, typename Value>
+bool ParallelTraversal::largerThan(const Node<Key, Value, SubtreeSizes>* node, std::size_t grain)
+{
+    return node->getSize() > grain;
+}
+
+template<typename Key, typename Value>
+bool ParallelTraversal::largerThan(const Node<Key, Value, NoSubtreeSizes>*, std::size_t)
+{
+    return true;
+}
+
+/**
+* Visits a piece in key order.
+*/
+template<typename Key, typename Value, typename Sizes, typename Function>
+void ParallelTraversal::walk(const Piece<Key, Value, Sizes>& piece, Function& fn)
+{
+    if (!piece.whole) {
+        fn(piece.node->getItem());
+        return;
+    }
+
+    std::vector<Node<Key, Value, Sizes>*> pending;
+    Node<Key, Value, Sizes>* node = piece.node;
+    while (node != nullptr || !pending.empty()) {
+        while (node != nullptr) {
+            pending.push_back(node);
+            node = node->getLeft();
+        }
+        node = pending.back();
+        pending.pop_back();
+        fn(node->getItem());
+        node = node->getRight();
+    }
+}
+
+/**
+* Runs task(i) for every i below count on up to threads threads,
+* including the calling one.
+*/
+template<typename Task>
+void ParallelTraversal::run(std::size_t count, unsigned threads, Task task)
+{
+    std::atomic<std::size_t> next(0);
+    std::atomic<bool> failed(false);
+    std::exception_ptr error;
+    std::mutex errorLock;
+
+    auto worker = [&]() {
+        for (;;) {
+            std::size_t i = next++;
+            if (i >= count || failed) return;
+            try {
+                task(i);
+            }
+            catch (...) {
+                std::lock_guard<std::mutex> guard(errorLock);
+                if (!error) error = std::current_exception();
+                failed = true;
+            }
+        }
+    };
+
+    std::size_t helpers = std::min<std::size_t>(threads, count);
+    std::vector<std::thread> pool;
+    for (std::size_t t = 1; t < helpers; ++t) {
+        try {
+            pool.push_back(std::thread(worker));
+        }
+        catch (const std::system_error&) {
+            // Out of threads: the ones we have share the work.
+            break;
+        }
+    }
+    worker();
+    for (std::size_t t = 0; t < pool.size(); ++t) {
+        pool[t].join();
+    }
+
+    if (error) std::rethrow_exception(error);
+}
+
+/*
+  -----------------------------------------------------
+  End implementations for the ParallelTraversal class.
+  -----------------------------------------------------
+*/
+
+/**
+* Calls fn(std::pair<const Key, Value>&) on every pair of tree using the
+* given number of threads (0 means one per hardware thread). fn may
+* update values but is called concurrently and in no overall order.
+*/
+template<typename Key, typename Value, typename Compare, typename Sizes, typename Function>
+void parallel_for_each(BinarySearchTree<Key, Value, Compare, Sizes>& tree, Function fn, unsigned threads = 0)
+{
+    ParallelTraversal::forEach(ParallelTraversal::rootOf(tree), tree.size(), fn, threads);
+}
+
+/**
+* The read-only version: fn gets a const pair.
+*/
+template<typename Key, typename Value, typename Compare, typename Sizes, typename Function>
+void parallel_for_each(const BinarySearchTree<Key, Value, Compare, Sizes>& tree, Function fn, unsigned threads = 0)
+{
+    auto readOnly = [&fn](const std::pair<const Key, Value>& item) { fn(item); };
+    ParallelTraversal::forEach(ParallelTraversal::rootOf(tree), tree.size(), readOnly, threads);
+}
+
+/**
+* Folds the pairs of tree into a T using the given number of threads.
+* Each piece is folded in key order from identity with fold(T, const
+* std::pair<const Key, Value>&), which returns the new accumulator, and
+* the pieces' results are merged left to right with combine(T, T).
+* identity must be an identity of combine, since every piece starts
+* from it.
+*/
+template<typename Key, typename Value, typename Compare, typename Sizes, typename T, typename Reduce,
+         typename Combine>
+T parallel_reduce(const BinarySearchTree<Key, Value, Compare, Sizes>& tree, const T& identity,
+                  Reduce fold, Combine combine, unsigned threads = 0)
+{
+    return ParallelTraversal::reduce(ParallelTraversal::rootOf(tree), tree.size(), identity,
+                                     fold, combine, threads);
+}
+
+#endif
@@ -0,0 +1,468 @@
+#ifndef PERSISTENT_AVL_H
+#define PERSISTENT_AVL_H
+
+#include <algorithm>
+#include <cstddef>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+/**
+ * An immutable node of PersistentAVLTree. Once built, a node is never
+ * changed, so any number of tree versions (and threads) can share it.
+ * Children are held by shared_ptr, which frees a subtree when the last
+ * version referring to it goes away.
+ */
+template<typename Key, typename Value>
+class PersistentAVLNode
+{
+public:
+    typedef std::shared_ptr<const PersistentAVLNode<Key, Value> > Ptr;
+
+    PersistentAVLNode(const std::pair<const Key, Value>& item, const Ptr& left, const Ptr& right);
+
+    static int heightOf(const Ptr& node);
+
+    const std::pair<const Key, Value> item_;
+    const Ptr left_;
+    const Ptr right_;
+    const int height_;
+};
+
+template<typename Key, typename Value>
+PersistentAVLNode<Key, Value>::PersistentAVLNode(const std::pair<const Key, Value>& item, const Ptr& left, const Ptr& right) :
+    item_(item),
+    left_(left),
+    right_(right),
+    height_(1 + std::max(heightOf(left), heightOf(right)))
+{
+
+}
+
+template<typename Key, typename Value>
+int PersistentAVLNode<Key, Value>::heightOf(const Ptr& node)
+{
+    return node ? node->height_ : 0;
+}
+
+
+/**
+ * An AVL tree whose updates never modify existing nodes. insert and
+ * remove build new copies of the nodes on the root-to-leaf path they
+ * touch (O(log n) of them) and share every other subtree with the
+ * previous version.
+ *
+ * That makes copying a tree, or calling snapshot(), O(1): it just shares
+ * the root. A snapshot stays valid and unchanged however the original is
+ * modified afterwards, and since nodes are immutable and their reference
+ * counts atomic, it can be read from other threads while the original
+ * keeps taking writes. The one rule is the usual one for a single
+ * object: one tree object must not be written while another thread uses
+ * that same object.
+ *
+ * Each path copy copies the key/value pairs on the path, so this suits
+ * small values; store large ones behind a pointer.
+ */
+template<typename Key, typename Value, typename Compare = std::less<Key> >
+class PersistentAVLTree
+{
+public:
+    typedef PersistentAVLNode<Key, Value> NodeType;
+    typedef typename NodeType::Ptr NodePtr;
+
+    /**
+     * Forward iterator in key order. It keeps the ancestors still to be
+     * visited on a stack, since nodes have no parent links. Like any other
+     * tree's iterators, it is invalidated by modifying the tree object it
+     * came from; iterate a snapshot() to read while writing.
+     */
+    class const_iterator
+    {
+    public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef std::pair<const Key, Value> value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef const std::pair<const Key, Value>* pointer;
+        typedef const std::pair<const Key, Value>& reference;
+
+        const_iterator();
+
+        const std::pair<const Key, Value>& operator*() const;
+        const std::pair<const Key, Value>* operator->() const;
+
+        bool operator==(const const_iterator& rhs) const;
+        bool operator!=(const const_iterator& rhs) const;
+
+        const_iterator& operator++();
+        const_iterator operator++(int);
+
+    protected:
+        friend class PersistentAVLTree<Key, Value, Compare>;
+        void pushLeftSpine(const NodeType* node);
+
+        std::vector<const NodeType*> stack_;
+    };
+
+    typedef Compare key_compare;
+
+    PersistentAVLTree();
+    explicit PersistentAVLTree(const Compare& comp);
+
+    bool insert(const std::pair<const Key, Value>& keyValuePair);
+    bool remove(const Key& key);
+    void clear();
+    PersistentAVLTree<Key, Value, Compare> snapshot() const;
+
+    const_iterator begin() const;
+    const_iterator end() const;
+    const_iterator find(const Key& key) const;
+    Value const & operator[](const Key& key) const;
+
+    bool empty() const;
+    std::size_t size() const;
+    int height() const;
+    Compare key_comp() const;
+
+protected:
+    bool keyLess(const Key& a, const Key& b) const;
+    static NodePtr makeNode(const std::pair<const Key, Value>& item, const NodePtr& left, const NodePtr& right);
+    static NodePtr rebalance(const std::pair<const Key, Value>& item, const NodePtr& left, const NodePtr& right);
+    NodePtr insertAt(const NodePtr& node, const std::pair<const Key, Value>& keyValuePair, bool& added) const;
+    NodePtr removeAt(const NodePtr& node, const Key& key, bool& removed) const;
+    static NodePtr removeMin(const NodePtr& node, NodePtr& min);
+
+    NodePtr root_;
+    std::size_t size_;
+    Compare comp_;
+};
+
+/*
+  -----------------------------------------------------------------------
+  Begin implementations for the PersistentAVLTree::const_iterator class.
+  -----------------------------------------------------------------------
+*/
+
+template<typename Key, typename Value, typename Compare>
+PersistentAVLTree<Key, Value, Compare>::const_iterator::const_iterator()
+{
+
+}
+
+template<typename Key, typename Value, typename Compare>
+void PersistentAVLTree<Key, Value, Compare>::const_iterator::pushLeftSpine(const NodeType* node)
+{
+    while (node != nullptr) {
+        stack_.push_back(node);
+        node = node->left_.get();
+    }
+}
+
+template<typename Key, typename Value, typename Compare>
+const std::pair<const Key, Value>&
+PersistentAVLTree<Key, Value, Compare>::const_iterator::operator*() const
+{
+    return stack_.back()->item_;
+}
+
+template<typename Key, typename Value, typename Compare>
+const std::pair<const Key, Value>*
+PersistentAVLTree<Key, Value, Compare>::const_iterator::operator->() const
+{
+    return &(stack_.back()->item_);
+}
+
+template<typename Key, typename Value, typename Compare>
+bool PersistentAVLTree<Key, Value, Compare>::const_iterator::operator==(const const_iterator& rhs) const
+{
+    if (stack_.empty() || rhs.stack_.empty()) {
+        return stack_.empty() == rhs.stack_.empty();
+    }
+    return stack_.back() == rhs.stack_.back();
+}
+
+template<typename Key, typename Value, typename Compare>
+bool PersistentAVLTree<Key, Value, Compare>::const_iterator::operator!=(const const_iterator& rhs) const
+{
+    return !(*this == rhs);
+}
+
+template<typename Key, typename Value, typename Compare>
+typename PersistentAVLTree<Key, Value, Compare>::const_iterator&
+PersistentAVLTree<Key, Value, Compare>::const_iterator::operator++()
+{
+    const NodeType* current = stack_.back();
+    stack_.pop_back();
+    pushLeftSpine(current->right_.get());
+    return *this;
+}
+
+template<typename Key, typename Value, typename Compare>
+typename PersistentAVLTree<Key, Value, Compare>::const_iterator
+PersistentAVLTree<Key, Value, Compare>::const_iterator::operator++(int)
+{
+    const_iterator old = *this;
+    ++(*this);
+    return old;
+}
+
+/*
+  ---------------------------------------------------------------------
+  End implementations for the PersistentAVLTree::const_iterator class.
+  ---------------------------------------------------------------------
+*/
+
+/*
+  ----------------------------------------------------------
+  Begin implementations for the PersistentAVLTree class.
+  ----------------------------------------------------------
+*/
+
+template<typename Key, typename Value, typename Compare>
+PersistentAVLTree<Key, Value, Compare>::PersistentAVLTree() :
+    size_(0),
+    comp_()
+{
+
+}
+
+template<typename Key, typename Value, typename Compare>
+PersistentAVLTree<Key, Value, Compare>::PersistentAVLTree(const Compare& comp) :
+    size_(0),
+    comp_(comp)
+{
+
+}
+
+/**
+* Inserts the pair, or overwrites the value if the key is already present
+* (like AVLTree::insert). Returns true if the key is new. Versions taken
+* before the call do not see the change.
+*/
+template<typename Key, typename Value, typename Compare>
+bool PersistentAVLTree<Key, Value, Compare>::insert(const std::pair<const Key, Value>& keyValuePair)
+{
+    bool added = false;
+    root_ = insertAt(root_, keyValuePair, added);
+    if (added) ++size_;
+    return added;
+}
+
+/**
+* Returns true if the key was there to remove. When it is not, the tree
+* is left exactly as it was and nothing is copied.
+*/
+template<typename Key, typename Value, typename Compare>
+bool PersistentAVLTree<Key, Value, Compare>::remove(const Key& key)
+{
+    bool removed = false;
+    root_ = removeAt(root_, key, removed);
+    if (removed) --size_;
+    return removed;
+}
+
+/**
+* Drops this version's reference to its nodes; they are freed once no
+* snapshot shares them any more.
+*/
+template<typename Key, typename Value, typename Compare>
+void PersistentAVLTree<Key, Value, Compare>::clear()
+{
+    root_.reset();
+    size_ = 0;
+}
+
+/**
+* O(1): the snapshot shares every node with this tree.
+*/
+template<typename Key, typename Value, typename Compare>
+PersistentAVLTree<Key, Value, Compare> PersistentAVLTree<Key, Value, Compare>::snapshot() const
+{
+    return *this;
+}
+
+template<typename Key, typename Value, typename Compare>
+typename PersistentAVLTree<Key, Value, Compare>::const_iterator
+PersistentAVLTree<Key, Value, Compare>::begin() const
+{
+    const_iterator it;
+    it.pushLeftSpine(root_.get());
+    return it;
+}
+
+template<typename Key, typename Value, typename Compare>
+typename PersistentAVLTree<Key, Value, Compare>::const_iterator
+PersistentAVLTree<Key, Value, Compare>::end() const
+{
+    return const_iterator();
+}
+
+/**
+* The ancestors we went left from are the nodes the iterator still has to
+* visit, so they are collected on the way down.
+*/
+template<typename Key, typename Value, typename Compare>
+typename PersistentAVLTree<Key, Value, Compare>::const_iterator
+PersistentAVLTree<Key, Value, Compare>::find(const Key& key) const
+{
+    const_iterator it;
+    const NodeType* node = root_.get();
+    while (node != nullptr) {
+        if (keyLess(key, node->item_.first)) {
+            it.stack_.push_back(node);
+            node = node->left_.get();
+        }
+        else if (keyLess(node->item_.first, key)) {
+            node = node->right_.get();
+        }
+        else {
+            it.stack_.push_back(node);
+            return it;
+        }
+    }
+    return end();
+}
+
+template<typename Key, typename Value, typename Compare>
+Value const & PersistentAVLTree<Key, Value, Compare>::operator[](const Key& key) const
+{
+    const_iterator it = find(key);
+    if(it == end()) throw std::out_of_range("Invalid key");
+    return it->second;
+}
+
+template<typename Key, typename Value, typename Compare>
+bool PersistentAVLTree<Key, Value, Compare>::empty() const
+{
+    return !root_;
+}
+
+template<typename Key, typename Value, typename Compare>
+std::size_t PersistentAVLTree<Key, Value, Compare>::size() const
+{
+    return size_;
+}
+
+template<typename Key, typename Value, typename Compare>
+int PersistentAVLTree<Key, Value, Compare>::height() const
+{
+    return NodeType::heightOf(root_);
+}
+
+template<typename Key, typename Value, typename Compare>
+Compare PersistentAVLTree<Key, Value, Compare>::key_comp() const
+{
+    return comp_;
+}
+
+template<typename Key, typename Value, typename Compare>
+inline bool PersistentAVLTree<Key, Value, Compare>::keyLess(const Key& a, const Key& b) const
+{
+    return comp_(a, b);
+}
+
+template<typename Key, typename Value, typename Compare>
+typename PersistentAVLTree<Key, Value, Compare>::NodePtr
+PersistentAVLTree<Key, Value, Compare>::makeNode(const std::pair<const Key, Value>& item, const NodePtr& left, const NodePtr& right)
+{
+    return std::make_shared<NodeType>(item, left, right);
+}
+
+/**
+* Builds a node for item over left and right, which may differ in height
+* by two after an insert or remove below. In that case the node comes
+* out of a single or double rotation made of fresh nodes; the subtrees
+* underneath are reused as they are.
+*/
+template<typename Key, typename Value, typename Compare>
+typename PersistentAVLTree<Key, Value, Compare>::NodePtr
+PersistentAVLTree<Key, Value, Compare>::rebalance(const std::pair<const Key, Value>& item, const NodePtr& left, const NodePtr& right)
+{
+    int leftHeight = NodeType::heightOf(left);
+    int rightHeight = NodeType::heightOf(right);
+
+    if (leftHeight > rightHeight + 1) {
+        if (NodeType::heightOf(left->left_) >= NodeType::heightOf(left->right_)) {
+            return makeNode(left->item_, left->left_, makeNode(item, left->right_, right));
+        }
+        const NodePtr& inner = left->right_;
+        return makeNode(inner->item_,
+                        makeNode(left->item_, left->left_, inner->left_),
+                        makeNode(item, inner->right_, right));
+    }
+    if (rightHeight > leftHeight + 1) {
+        if (NodeType::heightOf(right->right_) >= NodeType::heightOf(right->left_)) {
+            return makeNode(right->item_, makeNode(item, left, right->left_), right->right_);
+        }
+        const NodePtr& inner = right->left_;
+        return makeNode(inner->item_,
+                        makeNode(item, left, inner->left_),
+                        makeNode(right->item_, inner->right_, right->right_));
+    }
+    return makeNode(item, left, right);
+}
+
+template<typename Key, typename Value, typename Compare>
+typename PersistentAVLTree<Key, Value, Compare>::NodePtr
+PersistentAVLTree<Key, Value, Compare>::insertAt(const NodePtr& node, const std::pair<const Key, Value>& keyValuePair, bool& added) const
+{
+    if (!node) {
+        added = true;
+        return makeNode(keyValuePair, NodePtr(), NodePtr());
+    }
+    if (keyLess(keyValuePair.first, node->item_.first)) {
+        return rebalance(node->item_, insertAt(node->left_, keyValuePair, added), node->right_);
+    }
+    if (keyLess(node->item_.first, keyValuePair.first)) {
+        return rebalance(node->item_, node->left_, insertAt(node->right_, keyValuePair, added));
+    }
+    return makeNode(keyValuePair, node->left_, node->right_);
+}
+
+template<typename Key, typename Value, typename Compare>
+typename PersistentAVLTree<Key, Value, Compare>::NodePtr
+PersistentAVLTree<Key, Value, Compare>::removeAt(const NodePtr& node, const Key& key, bool& removed) const
+{
+    if (!node) return node;
+
+    if (keyLess(key, node->item_.first)) {
+        NodePtr left = removeAt(node->left_, key, removed);
+        if (!removed) return node;
+        return rebalance(node->item_, left, node->right_);
+    }
+    if (keyLess(node->item_.first, key)) {
+        NodePtr right = removeAt(node->right_, key, removed);
+        if (!removed) return node;
+        return rebalance(node->item_, node->left_, right);
+    }
+
+    removed = true;
+    if (!node->left_) return node->right_;
+    if (!node->right_) return node->left_;
+
+    // Two children: the successor takes this node's place.
+    NodePtr min;
+    NodePtr right = removeMin(node->right_, min);
+    return rebalance(min->item_, node->left_, right);
+}
+
+template<typename Key, typename Value, typename Compare>
+typename PersistentAVLTree<Key, Value, Compare>::NodePtr
+PersistentAVLTree<Key, Value, Compare>::removeMin(const NodePtr& node, NodePtr& min)
+{
+    if (!node->left_) {
+        min = node;
+        return node->right_;
+    }
+    return rebalance(node->item_, removeMin(node->left_, min), node->right_);
+}
+
+/*
+  --------------------------------------------------------
+  End implementations for the PersistentAVLTree class.
+  --------------------------------------------------------
+*/
+
+#endif
@@ -0,0 +1,75 @@
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <string>
+#include "mutation_log.h"
+
+using namespace std;
+
+// Each configuration runs for about this long, or until MAX_INSERTS.
+const double SECONDS_PER_RUN = 1.0;
+const long MAX_INSERTS = 2000000;
+
+double elapsed(chrono::steady_clock::time_point start)
+{
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+// Inserts random keys until the time is up and returns inserts per second.
+// syncEvery == 0 means no log at all, as a baseline.
+double run(const string& dir, size_t syncEvery)
+{
+    string snapshot = dir + "/wal-bench.snapshot";
+    string log = dir + "/wal-bench.log";
+    remove(snapshot.c_str());
+    remove(log.c_str());
+
+    mt19937 rng(42);
+    long inserts = 0;
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    double seconds = 0;
+
+    if (syncEvery == 0) {
+        AVLTree<int,long> tree;
+        while (inserts < MAX_INSERTS && (inserts % 256 != 0 || elapsed(start) < SECONDS_PER_RUN)) {
+            tree.insert(std::make_pair((int)rng(), (long)inserts));
+            ++inserts;
+        }
+        seconds = elapsed(start);
+    }
+    else {
+        LoggedAVLTree<int,long> tree(snapshot, log, syncEvery);
+        while (inserts < MAX_INSERTS && (inserts % 16 != 0 || elapsed(start) < SECONDS_PER_RUN)) {
+            tree.insert(std::make_pair((int)rng(), (long)inserts));
+            ++inserts;
+        }
+        tree.commit();
+        seconds = elapsed(start);
+    }
+
+    remove(snapshot.c_str());
+    remove(log.c_str());
+    return inserts / seconds;
+}
+
+int main(int argc, char *argv[])
+{
+    string dir = argc > 1 ? argv[1] : ".";
+    size_t batches[] = { 0, 1, 16, 256, 4096 };
+
+    cout << "Logged insert throughput into " << dir << endl;
+    cout << setw(12) << "sync every" << setw(16) << "inserts/s" << endl;
+    for (size_t i = 0; i < sizeof(batches) / sizeof(batches[0]); ++i) {
+        double rate = run(dir, batches[i]);
+        if (batches[i] == 0) {
+            cout << setw(12) << "no log";
+        }
+        else {
+            cout << setw(12) << batches[i];
+        }
+        cout << setw(16) << fixed << setprecision(0) << rate << endl;
+    }
+    return 0;
+}